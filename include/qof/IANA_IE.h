@@ -19,6 +19,8 @@
 static fbInfoElement_t yaf_iana_extra_info_elements[] = {
     FB_IE_INIT("transportOctetDeltaCount", 0, 401, 8, FB_IE_F_ENDIAN | FB_IE_F_REVERSIBLE),
     FB_IE_INIT("transportPacketDeltaCount", 0, 402, 8, FB_IE_F_ENDIAN | FB_IE_F_REVERSIBLE),
+    FB_IE_INIT("dot1qVlanId", 0, 243, 2, FB_IE_F_ENDIAN),
+    FB_IE_INIT("dot1qCustomerVlanId", 0, 245, 2, FB_IE_F_ENDIAN),
     FB_IE_NULL
 };
 
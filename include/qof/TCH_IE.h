@@ -45,6 +45,37 @@ static fbInfoElement_t yaf_tch_info_elements[] = {
      FB_IE_INIT("minTcpIOTMilliseconds", TCH_PEN, 1050, 2, FB_IE_F_ENDIAN | FB_IE_F_REVERSIBLE),
      FB_IE_INIT("maxTcpIOTMilliseconds", TCH_PEN, 1051, 2, FB_IE_F_ENDIAN | FB_IE_F_REVERSIBLE),
      FB_IE_INIT("meanTcpChirpMilliseconds", TCH_PEN, 1052, 4, FB_IE_F_ENDIAN | FB_IE_F_REVERSIBLE),
+     FB_IE_INIT("flowTableAnalyticsShedCount", TCH_PEN, 1053, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableShortIdleCount", TCH_PEN, 1054, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableMemoryEvictionCount", TCH_PEN, 1055, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTablePeakMemory", TCH_PEN, 1056, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableCreatedFlowCount", TCH_PEN, 1057, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableFlowCreationRate", TCH_PEN, 1058, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableIdleTimeoutCount", TCH_PEN, 1059, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableActiveTimeoutCount", TCH_PEN, 1060, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableEndOfFlowCount", TCH_PEN, 1061, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableResourceEvictionCount", TCH_PEN, 1062, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableProbe1Count", TCH_PEN, 1063, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableProbe2Count", TCH_PEN, 1064, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableProbe4Count", TCH_PEN, 1065, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableProbeLongCount", TCH_PEN, 1066, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableOccupancy", TCH_PEN, 1067, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableCapacity", TCH_PEN, 1068, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableLoadPermille", TCH_PEN, 1069, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableMaxProbeLength", TCH_PEN, 1070, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableTcpStateCount", TCH_PEN, 1071, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableCloseQueuePeak", TCH_PEN, 1072, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("captureRingStallCount", TCH_PEN, 1073, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("captureRingOccupancy", TCH_PEN, 1074, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("captureRingPeak", TCH_PEN, 1075, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("reorderedPacketCount", TCH_PEN, 1076, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("reorderLatePacketCount", TCH_PEN, 1077, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("minTcpRttMicroseconds", TCH_PEN, 1078, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("lastTcpRttMicroseconds", TCH_PEN, 1079, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("tunnelIdentifier", TCH_PEN, 1080, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("inputMergeLatePacketCount", TCH_PEN, 1081, 8, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableFlushTimeMaxMicroseconds", TCH_PEN, 1082, 4, FB_IE_F_ENDIAN),
+     FB_IE_INIT("flowTableFlushTimeP99Microseconds", TCH_PEN, 1083, 4, FB_IE_F_ENDIAN),
      FB_IE_NULL
 };
 
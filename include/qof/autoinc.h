@@ -234,6 +234,14 @@ silk_config.h */
 #define UNUSED(var) /*@unused@*/ var
 #endif
 
+/** prefetch a cache line for reading (rw 0) or writing (rw 1), where the
+    compiler supports it */
+#ifdef __GNUC__
+#define QF_PREFETCH(addr, rw) __builtin_prefetch((addr), (rw))
+#else
+#define QF_PREFETCH(addr, rw)
+#endif
+
 
 #ifdef __CYGWIN__
 const char * yfGetCygwinConfDir (void);
@@ -110,17 +110,19 @@ typedef struct yfIPFragInfo_st {
 
 /** Datalink layer information structure */
 typedef struct yfL2Info_st {
-    /** Source MAC address */
+    /** Source MAC address; only if MAC fields are decoded */
     uint8_t         smac[6];
-    /** Destination MAC address */
+    /** Destination MAC address; only if MAC fields are decoded */
     uint8_t         dmac[6];
     /** Layer 2 Header Length */
     uint16_t        l2hlen;
-    /** VLAN tag */
+    /** VLAN tag; the innermost, if tags are stacked */
     uint16_t        vlan_tag;
-    /** MPLS label count */
+    /** Outermost VLAN tag of a stack (QinQ); 0 if one tag or none */
+    uint16_t        vlan_outer;
+    /** MPLS label count; labels are only collected when keyed on */
     uint32_t        mpls_count;
-    /** MPLS label stack */
+    /** MPLS label stack; only the first mpls_count labels are valid */
     uint32_t        mpls_label[YF_MPLS_LABEL_COUNT_MAX];
 } yfL2Info_t;
 
@@ -156,10 +158,16 @@ typedef struct yfTCPInfo_st {
 
 /** Full packet information structure. Used in the packet ring buffer. */
 typedef struct yfPBuf_st {
-    /** Packet timestamp in epoch milliseconds */
+    /** Packet timestamp in epoch milliseconds; the flow table clock */
     uint64_t        ptime;
+    /** Packet timestamp in epoch nanoseconds, for TCP analytics */
+    uint64_t        ptime_ns;
     /** Flow key containing decoded IP and transport headers. */
     yfFlowKey_t     key;
+    /** Canonical hash of the flow key, as returned by qfFlowKeyHash() */
+    uint32_t        hash;
+    /** Hash of the flow key without ports, shared by a packet's fragments */
+    uint32_t        pairhash;
     /** Length of all headers, L2, L3, L4 */
     size_t          allHeaderLen;
     /** pcap header */
@@ -251,6 +259,102 @@ yfDecodeCtx_t *yfDecodeCtxAlloc(
     gboolean        tomode,
     gboolean        gremode);
 
+/**
+ * Allocate a decode context with the same configuration as another, and
+ * empty statistics. Decode contexts are not thread-safe; use this to give
+ * each decoding thread its own.
+ *
+ * @param ctx A decode context to copy configuration from
+ * @return a new decode context
+ */
+
+yfDecodeCtx_t *yfDecodeCtxClone(
+    yfDecodeCtx_t           *ctx);
+
+/**
+ * Enable or disable the fast path decoder. A decode context decodes untagged
+ * Ethernet carrying IPv4 or IPv6 and TCP or UDP in a single pass by default,
+ * falling back to the full decoder for everything else; disabling the fast
+ * path sends every packet through the full decoder, for comparison.
+ *
+ * @param ctx      A decode context
+ * @param fastmode TRUE to use the fast path where possible (the default)
+ */
+
+void yfDecodeCtxSetFastPath(
+    yfDecodeCtx_t           *ctx,
+    gboolean                fastmode);
+
+/**
+ * Set the UDP destination ports on which to decapsulate VXLAN, Geneve and
+ * GTP-U tunnels. A tunnelled packet is decoded as the packet it carries,
+ * keyed by its inner addresses and ports, and by its tunnel's VNI or TEID
+ * in the tunnelId field of the flow key. Packets on a tunnel port that
+ * carry no inner packet, e.g. GTP-U signalling, are decoded as plain UDP.
+ * The tunnelId field exists only when QoF is built with
+ * --enable-tunnel-keys; otherwise this does nothing.
+ *
+ * @param ctx         A decode context
+ * @param vxlan_port  UDP port for VXLAN (usually 4789), or 0 for none
+ * @param geneve_port UDP port for Geneve (usually 6081), or 0 for none
+ * @param gtpu_port   UDP port for GTP-U (usually 2152), or 0 for none
+ */
+
+void yfDecodeCtxSetTunnelPorts(
+    yfDecodeCtx_t           *ctx,
+    uint16_t                vxlan_port,
+    uint16_t                geneve_port,
+    uint16_t                gtpu_port);
+
+/**
+ * Key flows on the outer VLAN tag of a QinQ stack, and/or on the top MPLS
+ * label, in addition to the (innermost) VLAN tag. Keys fill the outerVlanId
+ * and mplsLabel fields of the flow key, which exist only when QoF is built
+ * with --enable-l2-keys; otherwise this does nothing. Both are off by
+ * default.
+ *
+ * @param ctx       A decode context
+ * @param qinq_key  TRUE to key flows on the outer VLAN tag
+ * @param mpls_key  TRUE to key flows on the top MPLS label
+ */
+
+void yfDecodeCtxSetL2Keys(
+    yfDecodeCtx_t           *ctx,
+    gboolean                qinq_key,
+    gboolean                mpls_key);
+
+/**
+ * Select the decoded fields the consumer of the packet buffer needs beyond
+ * the flow key, lengths, IP information and TCP flags; fields not selected
+ * are not parsed, and are left with stale contents. Derive these from the
+ * flow table configuration, so each packet costs only the decode work the
+ * exported information elements need. Both are on by default. TCP option
+ * parsing (see yfDecodeCtxAlloc()) implies the TCP fields.
+ *
+ * @param ctx        A decode context
+ * @param mac_fields TRUE to copy source and destination MAC addresses
+ *                   into the yfL2Info_t
+ * @param tcp_fields TRUE to decode TCP sequence and acknowledgment numbers
+ *                   and window into the yfTCPInfo_t
+ */
+
+void yfDecodeCtxSetFields(
+    yfDecodeCtx_t           *ctx,
+    gboolean                mac_fields,
+    gboolean                tcp_fields);
+
+/**
+ * Add the statistics of one decode context to another's, and reset them in
+ * the first.
+ *
+ * @param ctx  decode context to add statistics to
+ * @param from decode context to move statistics from
+ */
+
+void yfDecodeCtxMergeStats(
+    yfDecodeCtx_t           *ctx,
+    yfDecodeCtx_t           *from);
+
 /** Free a decode context.
  *
  * @param ctx A decode context allocated with yfDecodeCtxAlloc()
@@ -262,15 +366,16 @@ void yfDecodeCtxFree(
 /**
  * Decode a packet into a durable packet buffer. It is assumed the packet
  * is encapsulated within a link layer frame described by the datalink
- * parameter. It fills in the pbuf structure, copying payload if necessary.
+ * parameter. It fills in the pbuf structure, copying payload if necessary,
+ * and hashes the flow key once, so the flow table, fragment table and shard
+ * dispatch need not hash it again.
  *
  * @param ctx      Decode context obtained from yfDecodeCtxAlloc()
  *                 containing decoder configuration and internal state.
  * @param linktype libtrace linktype of the packet.
- * @param ptime    Packet observation time in epoch milliseconds. Use
- *                 yfDecodeTimeval() or yfDecodeTimeNTP() to get epoch
- *                 milliseconds from a struct timeval or a 64-bit NTP
- *                 timestamp, respectively.
+ * @param ptime_ns Packet observation time in epoch nanoseconds. Use
+ *                 yfDecodeTimeERF() to get epoch nanoseconds from a 64-bit
+ *                 ERF timestamp.
  * @param caplen   Length of the packet to decode pkt.
  * @param pkt      Pointer to packet to decode. Is assumed to start with the
  *                 layer 2 header described by the datalink parameter.
@@ -290,15 +395,31 @@ void yfDecodeCtxFree(
 gboolean yfDecodeToPBuf(
      yfDecodeCtx_t           *ctx,
      libtrace_linktype_t     linktype,
-     uint64_t                ptime,
+     uint64_t                ptime_ns,
      size_t                  caplen,
      const uint8_t           *pkt,
      yfIPFragInfo_t          *fraginfo,
      yfPBuf_t                *pbuf);
 
+/**
+ * Restore a VLAN tag the capture interface stripped from a packet on
+ * receive, after decoding it with yfDecodeToPBuf(). The stripped tag is
+ * the outermost, so on a packet still carrying a tag it becomes the outer
+ * tag of a QinQ stack. The flow key is hashed again if the tag changes it.
+ *
+ * @param ctx      Decode context the packet was decoded with
+ * @param vlan     VLAN ID stripped by the interface, or 0 for none
+ * @param pbuf     Packet buffer holding the decoded packet
+ */
+
+void yfDecodeStrippedVlan(
+    yfDecodeCtx_t           *ctx,
+    uint16_t                vlan,
+    yfPBuf_t                *pbuf);
+
 /**
  * Utility call to convert a struct timeval (as returned from pcap) into a
- * 64-bit epoch millisecond timestamp suitable for use with yfDecodeToPBuf.
+ * 64-bit epoch millisecond timestamp.
  *
  * @param tv        Pointer to struct timeval to convert
  * @return the corresponding timestamp in epoch milliseconds
@@ -318,6 +439,19 @@ uint64_t yfDecodeTimeval(
 uint64_t yfDecodeTimeNTP(
     uint64_t                ntp);
 
+/**
+ * Utility call to convert an ERF timestamp (as returned from libtrace's
+ * trace_get_erf_timestamp(): 32.32 fixed-point seconds since the epoch)
+ * into a 64-bit epoch nanosecond timestamp suitable for use with
+ * yfDecodeToPBuf.
+ *
+ * @param erf       ERF timestamp to convert
+ * @return the corresponding timestamp in epoch nanoseconds
+ */
+
+uint64_t yfDecodeTimeERF(
+    uint64_t                erf);
+
 /**
  * Print decoder statistics to the log.
  *
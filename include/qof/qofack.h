@@ -23,7 +23,7 @@ typedef struct qfAck_st {
     /** Final acknowledgment number */
     uint32_t        fan;
     /** Time of lask acknowledgment advance */
-    uint32_t        fanlms;
+    uint32_t        fanlus;
     /** Duplicate acknowledgement count */
     uint32_t        dup_ct;
     /** Selective acklnowledgment count */
@@ -31,6 +31,6 @@ typedef struct qfAck_st {
 } qfAck_t;
 
 void qfAckSegment(qfAck_t *qa, uint32_t ack, uint32_t sack,
-                  uint32_t oct, uint32_t ms);
+                  uint32_t oct, uint32_t us);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,203 @@
+/**
+ ** @file qofflowidx.h
+ **
+ ** Flow key index, based on bucketized open addressing.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#ifndef _QOF_FLOWIDX_H_
+#define _QOF_FLOWIDX_H_
+
+#include <qof/autoinc.h>
+#include <qof/yafcore.h>
+
+/**
+ * A flow index maps flow keys to the flow nodes containing them. Entries are
+ * stored in cache-line sized buckets, each holding the full 32-bit hash of
+ * the key as a tag next to the node pointer, so a lookup normally touches
+ * one bucket and only dereferences nodes whose tag matches. Buckets which
+ * have overflowed into their neighbors count the overflow, so lookups stop
+ * at the first bucket without a match and without overflow, and removal
+ * needs no tombstones.
+ *
+ * The index does not own the nodes; it locates the flow key within a node
+ * at the key offset given at allocation time.
+ *
+ * Keys are matched in either direction with a single probe. qfFlowKeyHash()
+ * hashes keys in a canonical orientation (lower endpoint first), so a key
+ * and its reverse hash identically, and sets QF_FLOWIDX_REV in the hash if
+ * the key itself is not in canonical orientation. The index keeps this bit
+ * in the tag, and compares a lookup key against the node's key or its
+ * reverse depending on whether the bits differ.
+ *
+ * The hash is SipHash-1-3 keyed with a random seed chosen once per process,
+ * so colliding keys cannot be crafted in advance. The decoder hashes each
+ * packet's key as it fills in the packet buffer, and the index, the fragment
+ * table and shard dispatch all reuse that hash. The index counts the buckets
+ * visited per operation, to make hash quality visible.
+ */
+
+/** Hash bit set when a key is not in canonical orientation */
+#define QF_FLOWIDX_REV      0x80000000U
+
+/** Number of probe length histogram bins: 1, 2, 3-4 and 5 or more probes */
+#define QF_FLOWIDX_HIST     4
+
+struct qfFlowIdx_st;
+typedef struct qfFlowIdx_st qfFlowIdx_t;
+
+/**
+ * Allocate a flow index.
+ *
+ * @param key_offset offset of the yfFlowKey_t within each indexed node
+ * @param size_hint  expected number of entries, or 0 for a small default;
+ *                   the index grows as necessary.
+ * @return a new flow index
+ */
+
+qfFlowIdx_t *qfFlowIdxAlloc(size_t          key_offset,
+                            size_t          size_hint);
+
+/**
+ * Hash a flow key with the process-wide seed.
+ *
+ * @param key      flow key to hash
+ * @param pairhash if not NULL, set to a hash of the key without its ports,
+ *                 which all fragments of a packet share, and which is
+ *                 symmetric as well
+ * @return canonical hash of the key, with QF_FLOWIDX_REV set if the key is
+ *         not in canonical orientation
+ */
+
+uint32_t qfFlowKeyHash(yfFlowKey_t      *key,
+                       uint32_t         *pairhash);
+
+/**
+ * Free a flow index. Does not free the indexed nodes.
+ *
+ * @param idx flow index to free
+ */
+
+void qfFlowIdxFree(qfFlowIdx_t          *idx);
+
+/**
+ * Find the node with a given key or its reverse.
+ *
+ * @param idx     flow index to search
+ * @param key     flow key to find
+ * @param hash    canonical hash of the flow key, with QF_FLOWIDX_REV set
+ *                if the key is not in canonical orientation
+ * @param reverse set to TRUE if the node's key is the reverse of key,
+ *                FALSE if it is the same.
+ * @return the node containing the key, or NULL if not present.
+ */
+
+void *qfFlowIdxLookup(qfFlowIdx_t       *idx,
+                      yfFlowKey_t       *key,
+                      uint32_t          hash,
+                      gboolean          *reverse);
+
+/**
+ * Add a node to the index. The node's key must not already be present.
+ *
+ * @param idx  flow index to add to
+ * @param node node to add
+ * @param hash canonical hash of the node's flow key, with QF_FLOWIDX_REV
+ *             set if the key is not in canonical orientation
+ */
+
+void qfFlowIdxInsert(qfFlowIdx_t        *idx,
+                     void               *node,
+                     uint32_t           hash);
+
+/**
+ * Remove a node from the index.
+ *
+ * @param idx  flow index to remove from
+ * @param node node to remove
+ * @param hash hash of the node's flow key, as given to qfFlowIdxInsert()
+ * @return TRUE if the node was present and removed
+ */
+
+gboolean qfFlowIdxRemove(qfFlowIdx_t    *idx,
+                         void           *node,
+                         uint32_t       hash);
+
+/**
+ * A function called by qfFlowIdxForEach() for each node in an index.
+ *
+ * @param node indexed node
+ * @param ctx  context pointer passed to qfFlowIdxForEach()
+ */
+
+typedef void (*qfFlowIdxIter_fn)(void           *node,
+                                 void           *ctx);
+
+/**
+ * Call a function for each node in an index. Nodes are visited in bucket
+ * order, which is the same on repeated calls as long as the index is not
+ * modified in between. The function must not modify the index.
+ *
+ * @param idx  flow index
+ * @param fn   function to call for each node
+ * @param ctx  context pointer to pass to fn
+ */
+
+void qfFlowIdxForEach(qfFlowIdx_t       *idx,
+                      qfFlowIdxIter_fn  fn,
+                      void              *ctx);
+
+/**
+ * Get the number of nodes in the index.
+ *
+ * @param idx flow index
+ * @return number of indexed nodes
+ */
+
+size_t qfFlowIdxCount(qfFlowIdx_t       *idx);
+
+/**
+ * Get probe statistics for an index. A probe visits one bucket; a lookup
+ * that finds its key in its home bucket takes one probe.
+ *
+ * @param idx       flow index
+ * @param lookups   returns number of lookups
+ * @param probes    returns total number of buckets visited by lookups
+ * @param max_probe returns longest probe sequence of any lookup or insert
+ */
+
+void qfFlowIdxStats(qfFlowIdx_t         *idx,
+                    uint64_t            *lookups,
+                    uint64_t            *probes,
+                    uint32_t            *max_probe);
+
+/**
+ * Get the probe length histogram for an index: the number of lookups which
+ * visited 1, 2, 3 to 4, and 5 or more buckets.
+ *
+ * @param idx  flow index
+ * @param hist returns lookup counts per bin
+ */
+
+void qfFlowIdxProbeHist(qfFlowIdx_t     *idx,
+                        uint64_t        hist[QF_FLOWIDX_HIST]);
+
+/**
+ * Get the number of slots in an index at its current size. The load factor
+ * of the index is qfFlowIdxCount() divided by its capacity.
+ *
+ * @param idx flow index
+ * @return number of slots
+ */
+
+size_t qfFlowIdxCapacity(qfFlowIdx_t    *idx);
+
+#endif /* idem */
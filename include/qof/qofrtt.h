@@ -21,16 +21,20 @@
 typedef struct qfRttDir_st {
     /** Next ack/tsecr expected in this direction */
     uint32_t    tsack;
-    /** Time seq/tsval seen ( + rttx = ctime) in this direction */
-    uint32_t    lms;
+    /** Time seq/tsval seen ( + rttx = ctime) in this direction, in the low
+        32 bits of epoch microseconds */
+    uint32_t    lus;
     /** True if waiting for ACK */
     uint32_t    ackwait : 1;
     /** True if waiting for ECR */
     uint32_t    ecrwait : 1;
-    /** Last observation (in milliseconds) */
-    uint32_t    obs_ms  : 30;
+    /** Last observation (in microseconds) */
+    uint32_t    obs_us  : 30;
 } qfRttDir_t;
 
+/** Longest observation that fits in a qfRttDir_t, in microseconds */
+#define QF_RTT_OBS_MAX  ((1U << 30) - 1)
+
 /** per-biflow RTT tracking structure */
 typedef struct qfRtt_st {
     /** smoothed RTT estimate */
@@ -46,7 +50,7 @@ void qfRttSegment(qfRtt_t           *rtt,
                   uint32_t          ack,
                   uint32_t          tsval,
                   uint32_t          tsecr,
-                  uint32_t          ms,
+                  uint32_t          us,
                   uint8_t           tcpflags,
                   unsigned          reverse);
 
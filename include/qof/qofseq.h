@@ -29,29 +29,19 @@ typedef struct qfSeqGap_st {
     uint32_t        b;
 } qfSeqGap_t;
 
+/* per-segment scalars first, then statistics; the gap stack, only touched
+   on reordering or loss, last */
 typedef struct qfSeq_st {
-    /** Gaps in seen sequence number space */
-    qfSeqGap_t      gaps[QF_SEQGAP_CT];
-    /* Non-empty segment interarrival time tracking */
-    sstMean_t       seg_iat;
-    /* Non-empty segment IAT/IDT variance tracking */
-    sstMean_t       seg_variat;
-    /** Initial advance time */
-    uint32_t        initlms;
-    /** Initial timestamp value */
-    uint32_t        initsval;
+    /** Next sequence number expected */
+    uint32_t        nsn;
     /** Time of last sequence number advance */
-    uint32_t        advlms;
+    uint32_t        advlus;
     /** Timestamp at last advance */
     uint32_t        advtsval;
-    /** Initial sequence number */
-    uint32_t        isn;
-    /** Next sequence number expected */
-    uint32_t        nsn;
     /** sequence wrap counter */
     uint32_t        wrapct;
-    /** low bits ms wrap counter */
-    uint32_t         lmswrap;
+    /** low bits microsecond wrap counter */
+    uint32_t         luswrap;
     /** Timestamp wrap counter */
     uint32_t         tsvalwrap;
     /** Retransmitted segment count */
@@ -65,7 +55,19 @@ typedef struct qfSeq_st {
     /** Burst loss count */
     uint32_t        lossct;
     /** Burst loss last start */
-    uint32_t        losslms;
+    uint32_t        losslus;
+    /** Initial sequence number */
+    uint32_t        isn;
+    /** Initial advance time */
+    uint32_t        initlus;
+    /** Initial timestamp value */
+    uint32_t        initsval;
+    /* Non-empty segment interarrival time tracking */
+    sstMean_t       seg_iat;
+    /* Non-empty segment IAT/IDT variance tracking */
+    sstMean_t       seg_variat;
+    /** Gaps in seen sequence number space */
+    qfSeqGap_t      gaps[QF_SEQGAP_CT];
 } qfSeq_t;
 
 #endif /* idem */
@@ -74,13 +76,13 @@ void qfSeqFirstSegment(qfSeq_t *qs,
                        uint8_t flags,
                        uint32_t seq,
                        uint32_t oct,
-                       uint32_t ms,
+                       uint32_t us,
                        uint32_t tsval,
                        gboolean do_ts);
 
 int qfSeqSegment(qfSeq_t *qs, qfRtt_t *rtt, uint16_t mss,
                  uint8_t flags, uint32_t seq, uint32_t oct,
-                 uint32_t ms, uint32_t tsval,
+                 uint32_t us, uint32_t tsval,
                  gboolean do_ts, gboolean do_iat);
 
 uint64_t qfSeqCount(qfSeq_t *qs, uint8_t flags);
@@ -0,0 +1,119 @@
+/**
+ ** @file qofslab.h
+ **
+ ** Fixed-size object slab allocator for flow table state.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#ifndef _QOF_SLAB_H_
+#define _QOF_SLAB_H_
+
+#include <qof/autoinc.h>
+
+/**
+ * A slab hands out objects of a single size from large regions, mapped
+ * directly from the operating system with hugepages where available.
+ * Returned objects go on a free list and are reused before any new region
+ * is mapped, so allocation and release are O(1) and, once the working set
+ * has been reached, never call into the system allocator. Regions are only
+ * returned to the system when the slab is freed.
+ *
+ * The flow table keeps one slab per object class (IPv4 flow nodes, IPv6
+ * flow nodes, and TCP analytics blocks).
+ */
+
+struct qfSlab_st;
+typedef struct qfSlab_st qfSlab_t;
+
+/** Size of each slab region; the common hugepage size */
+#define QF_SLAB_REGION_SZ   (2 * 1024 * 1024)
+
+/** Cache line size; the largest supported object alignment */
+#define QF_SLAB_LINE        64
+
+/**
+ * Allocate a slab.
+ *
+ * @param name    class name, for statistics
+ * @param objsize size of each object in bytes
+ * @param align   object alignment in bytes; a power of two no greater than
+ *                QF_SLAB_LINE. Use QF_SLAB_LINE to start each object on a
+ *                cache line.
+ * @return a new, empty slab
+ */
+
+qfSlab_t *qfSlabAlloc(const char        *name,
+                      size_t            objsize,
+                      size_t            align);
+
+/**
+ * Free a slab and unmap all its regions, including any objects still
+ * allocated from it.
+ *
+ * @param slab slab to free
+ */
+
+void qfSlabFree(qfSlab_t                *slab);
+
+/**
+ * Get a zeroed object from a slab.
+ *
+ * @param slab slab to allocate from
+ * @return a new object; never NULL (aborts if out of memory, as g_malloc)
+ */
+
+void *qfSlabGet(qfSlab_t                *slab);
+
+/**
+ * Return an object to its slab.
+ *
+ * @param slab slab the object was allocated from
+ * @param obj  object to return
+ */
+
+void qfSlabPut(qfSlab_t                 *slab,
+               void                     *obj);
+
+/**
+ * Get the size of each object in a slab, as rounded up for alignment; this is
+ * the memory each object actually occupies.
+ *
+ * @param slab slab to query
+ * @return object size in bytes
+ */
+
+size_t qfSlabObjSize(qfSlab_t           *slab);
+
+/**
+ * Get slab occupancy statistics.
+ *
+ * @param slab     slab to query
+ * @param live     returns the number of objects in use
+ * @param capacity returns the number of objects which fit in mapped regions
+ * @param mapped   returns the number of bytes mapped
+ * @param huge     returns TRUE if regions are backed by explicit hugepages
+ */
+
+void qfSlabStats(qfSlab_t               *slab,
+                 size_t                 *live,
+                 size_t                 *capacity,
+                 size_t                 *mapped,
+                 gboolean               *huge);
+
+/**
+ * Log slab occupancy at debug level.
+ *
+ * @param slab slab to report on
+ */
+
+void qfSlabDumpStats(qfSlab_t           *slab);
+
+#endif /* idem */
@@ -0,0 +1,135 @@
+/**
+ ** @file qofwheel.h
+ **
+ ** Hierarchical timing wheel for flow expiry.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#ifndef _QOF_WHEEL_H_
+#define _QOF_WHEEL_H_
+
+#include <qof/autoinc.h>
+
+/**
+ * A timing wheel holds nodes in slots by deadline. Level 0 has one slot per
+ * tick (QF_WHEEL_TICK_MS milliseconds); each higher level has slots
+ * QF_WHEEL_SLOTS times coarser. Nodes are pickable queue nodes (see picq.h),
+ * and must additionally contain a uint32_t slot number, at the slot offset
+ * given at allocation time, for the wheel's use.
+ *
+ * The wheel is lazy: it does not store deadlines, and a node is never moved
+ * when its deadline is extended. Instead, qfWheelNext() hands back every
+ * node whose slot has come due, and the caller either expires it or
+ * reschedules it at its actual deadline. As long as deadlines are only ever
+ * extended, a node is handed back at most one tick after its deadline. When
+ * a higher level slot comes due, its nodes are handed back in the same way,
+ * and rescheduling them places them in a finer level.
+ */
+
+struct qfWheel_st;
+typedef struct qfWheel_st qfWheel_t;
+
+/** Level 0 slot width in milliseconds, as a shift */
+#define QF_WHEEL_TICK_SHIFT     7
+#define QF_WHEEL_TICK_MS        (1 << QF_WHEEL_TICK_SHIFT)
+
+/** Slots per level, as a shift */
+#define QF_WHEEL_SLOT_SHIFT     6
+#define QF_WHEEL_SLOTS          (1 << QF_WHEEL_SLOT_SHIFT)
+
+/** Number of levels */
+#define QF_WHEEL_LEVELS         4
+
+/** Slot number of a node not on the wheel */
+#define QF_WHEEL_NONE           0xFFFFFFFFU
+
+/**
+ * Allocate a timing wheel.
+ *
+ * @param slot_offset offset of the uint32_t slot number within each node
+ * @return a new, empty timing wheel
+ */
+
+qfWheel_t *qfWheelAlloc(size_t          slot_offset);
+
+/**
+ * Free a timing wheel. Does not free nodes on the wheel.
+ *
+ * @param wheel timing wheel to free
+ */
+
+void qfWheelFree(qfWheel_t              *wheel);
+
+/**
+ * Schedule a node on the wheel. The node must not be on the wheel. Deadlines
+ * in the past are treated as due at the next call to qfWheelNext().
+ *
+ * @param wheel    timing wheel
+ * @param node     node to schedule
+ * @param deadline time in milliseconds after which the node is due
+ * @param now      current time in milliseconds; used to position an empty
+ *                 wheel.
+ */
+
+void qfWheelSchedule(qfWheel_t          *wheel,
+                     void               *node,
+                     uint64_t           deadline,
+                     uint64_t           now);
+
+/**
+ * Remove a node from the wheel. Does nothing if the node is not on the wheel.
+ *
+ * @param wheel timing wheel
+ * @param node  node to remove
+ */
+
+void qfWheelCancel(qfWheel_t            *wheel,
+                   void                 *node);
+
+/**
+ * Advance the wheel to a given time, removing and returning the next node
+ * which may be due. The caller must either expire the node or reschedule it.
+ *
+ * @param wheel timing wheel
+ * @param now   current time in milliseconds
+ * @return a node which may be due, or NULL if no more nodes are due.
+ */
+
+void *qfWheelNext(qfWheel_t             *wheel,
+                  uint64_t              now);
+
+/**
+ * Remove and return the node with the earliest scheduled slot, regardless of
+ * the current time. Used for eviction when the flow table is full.
+ *
+ * @param wheel    timing wheel
+ * @param slot_end returns the end of the node's slot, in milliseconds; if
+ *                 the node's actual deadline is later, its schedule was
+ *                 stale and the caller may wish to reschedule it. The
+ *                 last slot of the wheel, which holds deadlines beyond
+ *                 the wheel's span, has no end (UINT64_MAX), since
+ *                 rescheduling would only put its nodes back there.
+ * @return earliest node, or NULL if the wheel is empty.
+ */
+
+void *qfWheelPopEarliest(qfWheel_t      *wheel,
+                         uint64_t       *slot_end);
+
+/**
+ * Get the number of nodes on the wheel.
+ *
+ * @param wheel timing wheel
+ * @return number of scheduled nodes
+ */
+
+size_t qfWheelCount(qfWheel_t           *wheel);
+
+#endif /* idem */
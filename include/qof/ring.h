@@ -64,10 +64,35 @@
 struct rgaRing_st;
 typedef struct rgaRing_st rgaRing_t;
 
+/**
+ * Synchronization modes for rings shared between threads. Rings from
+ * rgaAlloc() are not synchronized, and use rgaNextHead() and rgaNextTail().
+ * Lock-free rings from rgaAllocSync() use the batch calls rgaNextHeadN(),
+ * rgaCommitHead(), rgaNextTailN() and rgaCommitTail() instead, and always
+ * have a single consumer.
+ */
+typedef enum rgaSync_en {
+    /** not synchronized */
+    RGA_SYNC_NONE = 0,
+    /** lock-free, one producer thread */
+    RGA_SYNC_SPSC,
+    /** lock-free, any number of producer threads */
+    RGA_SYNC_MPSC
+} rgaSync_t;
+
 rgaRing_t *rgaAlloc(
     size_t          elt_sz,
     size_t          cap);
 
+/**
+ * Allocate a lock-free ring. Capacity is rounded up to a power of two.
+ */
+
+rgaRing_t *rgaAllocSync(
+    size_t          elt_sz,
+    size_t          cap,
+    rgaSync_t       sync);
+
 void rgaFree(
     rgaRing_t       *ring);
 
@@ -77,9 +102,6 @@ uint8_t *rgaNextHead(
 uint8_t *rgaForceHead(
     rgaRing_t       *ring);
 
-void rgaRewindHead(
-    rgaRing_t       *ring);
-
 uint8_t *rgaPeekHead(
     rgaRing_t       *ring);
 
@@ -89,39 +111,52 @@ uint8_t *rgaNextTail(
 uint8_t *rgaPeekTail(
     rgaRing_t       *ring);
 
-size_t rgaCount(
-    rgaRing_t       *ring);
+/**
+ * Reserve up to *n contiguous free elements at the head of a lock-free ring,
+ * for the calling producer to fill. Sets *n to the number reserved, which
+ * may be fewer, and returns the first, or NULL if the ring is full. Never
+ * blocks.
+ */
 
-size_t rgaPeak(
-    rgaRing_t       *ring);
+uint8_t *rgaNextHeadN(
+    rgaRing_t       *ring,
+    size_t          *n);
 
-#if YAF_RING_THREAD
+/**
+ * Hand n elements reserved by rgaNextHeadN(), starting at head, to the
+ * consumer. On an SPSC ring, n may be fewer than were reserved. On an MPSC
+ * ring, n must be all that were reserved, and this waits for producers
+ * which reserved earlier elements to commit theirs first.
+ */
 
-rgaRing_t *rgaAllocThreaded(
-    size_t          elt_sz,
-    size_t          cap);
+void rgaCommitHead(
+    rgaRing_t       *ring,
+    uint8_t         *head,
+    size_t          n);
 
-uint8_t *rgaWaitHead(
-    rgaRing_t       *ring);
+/**
+ * Get up to *n contiguous committed elements at the tail of a lock-free
+ * ring. Sets *n to the number available, which may be fewer, and returns
+ * the first, or NULL if the ring is empty. Never blocks.
+ */
 
-void rgaReleaseHead(
+uint8_t *rgaNextTailN(
     rgaRing_t       *ring,
-    size_t          rsv);
+    size_t          *n);
 
-uint8_t *rgaWaitTail(
-    rgaRing_t       *ring);
+/**
+ * Release n elements got from rgaNextTailN() back to the producers.
+ */
 
-void rgaReleaseTail(
+void rgaCommitTail(
     rgaRing_t       *ring,
-    size_t          rsv);
+    size_t          n);
 
-void rgaSetInterrupt(
+size_t rgaCount(
     rgaRing_t       *ring);
 
-void rgaClearInterrupt(
+size_t rgaPeak(
     rgaRing_t       *ring);
 
-#endif
-
 /* end idem */
 #endif
@@ -178,6 +178,17 @@ typedef struct yfFlowKey_st {
     uint8_t             version;
     /** VLAN Tag - only fwd */
     uint16_t            vlanId;
+#if QOF_ENABLE_TUNNEL_KEYS
+    /** Tunnel identifier: VXLAN or Geneve VNI, or GTP-U TEID; 0 if none */
+    uint32_t            tunnelId;
+#endif
+#if QOF_ENABLE_L2_KEYS
+    /** Top MPLS label, if keying on MPLS; 0 if none */
+    uint32_t            mplsLabel;
+    /** Outer VLAN ID of a QinQ stack, if keying on it (vlanId is the
+        inner); 0 if none */
+    uint16_t            outerVlanId;
+#endif
     /** for DAG cards need to record the interface, may only be seeing
     unidirectional flows on each interface, and want to record what
     direction that is happening on */
@@ -211,16 +222,20 @@ typedef struct qfOpt_st {
     uint16_t    mss;
 } qfOpt_t;
 
-/** TCP structure collection */
+/**
+ * TCP structure collection. Acknowledgment, option and receiver window
+ * tracking share the first cache line, and the per-segment scalars at the
+ * start of qfSeq_t fill the second.
+ */
 typedef struct qfTcpVal_st {
-    /** TCP sequence number tracking */
-    qfSeq_t     seq;
     /** TCP acknowledgment tracking */
     qfAck_t     ack;
-    /** TCP receiver window tracking */
-    qfRwin_t    rwin;
     /** Option information tracking */
     qfOpt_t     opts;
+    /** TCP receiver window tracking */
+    qfRwin_t    rwin;
+    /** TCP sequence number tracking */
+    qfSeq_t     seq;
 } qfTcpVal_t;
 
 /**
@@ -228,8 +243,6 @@ typedef struct qfTcpVal_st {
  * two of these are used to build a biflow.
  */
 typedef struct yfFlowVal_st {
-    /** TCP value structure pointer */
-    qfTcpVal_t  *tcp;
     /** IP-layer octet count */
     uint64_t    oct;
     /** Application-layer octet count */
@@ -238,6 +251,8 @@ typedef struct yfFlowVal_st {
     uint64_t    pkt;
     /** Non-empty packet count */
     uint64_t    apppkt;
+    /** TCP value structure pointer */
+    qfTcpVal_t  *tcp;
     /** minimum ttl */
     uint8_t     minttl;
     /** maximum ttl */
@@ -254,33 +269,38 @@ typedef struct yfFlowVal_st {
 /**
  * A YAF flow. Joins a flow key with forward and reverse flow values in time.
  *
+ * The layout is arranged so that, in a cache-line aligned flow table node,
+ * a packet touches three lines: the times (with the node's state), its own
+ * direction's value, and the RTT state with the key. Fields set only at flow
+ * creation or close fill the space left over. See yfFlowTabLayoutCheck().
+ *
  * @note if you edit the layout of this structure, you must make a
  * corresponding edit of the yfFlowIPv4_t structure in yaftab.c
  */
 typedef struct yfFlow_st {
-    /** Flow identifier */
-    uint64_t        fid;
-    /** Flow start time in epoch milliseconds */
-    uint64_t        stime;
-    /** Flow end time in epoch milliseconds */
+    /** Flow end time in epoch microseconds */
     uint64_t        etime;
+    /** Flow start time in epoch microseconds */
+    uint64_t        stime;
+    /** src Mac Address */
+    uint8_t         sourceMacAddr[ETHERNET_MAC_ADDR_LENGTH];
+    /** destination Mac Address */
+    uint8_t         destinationMacAddr[ETHERNET_MAC_ADDR_LENGTH];
      /*
      * Reverse flow delta start time in milliseconds. Equivalent to initial
      * packet round-trip time; useful for decomposing biflows into uniflows.
      */
     int32_t         rdtime;
-    /** Flow termination reason (YAF_END_ macros, per IPFIX standard) */
-    uint8_t         reason;
-    /** src Mac Address */
-    uint8_t         sourceMacAddr[ETHERNET_MAC_ADDR_LENGTH];
-    /** destination Mac Address */
-    uint8_t         destinationMacAddr[ETHERNET_MAC_ADDR_LENGTH];
     /** Forward value */
     yfFlowVal_t     val;
+    /** Flow identifier */
+    uint64_t        fid;
+    /** Flow termination reason (YAF_END_ macros, per IPFIX standard) */
+    uint8_t         reason;
     /** Reverse value */
     yfFlowVal_t     rval;
-    /** RTT value */
-    qfRtt_t         rtt;
+    /** RTT value; starts a new line so it shares one with the key */
+    qfRtt_t         rtt __attribute__((aligned(32)));
     /** Flow key */
     yfFlowKey_t     key;
 } yfFlow_t;
@@ -387,6 +407,51 @@ gboolean yfWriteFlow(
     yfFlow_t            *flow,
     GError              **err);
 
+/**
+ * Get the size of the buffer needed to hold an export record built by
+ * yfFlowToRec().
+ *
+ * @return export record size in bytes
+ */
+
+size_t yfFlowRecSize(void);
+
+/**
+ * Build an export record from a flow without writing it. Together with
+ * yfWriteFlowRec(), this splits yfWriteFlow() so that records can be built
+ * on the thread owning the flow and written on the thread owning the
+ * message buffer.
+ *
+ * @param flow  pointer to yfFlow_t to build a record from.
+ * @param rec   buffer of at least yfFlowRecSize() bytes to build the
+ *              record in; must be aligned for a uint64_t.
+ * @param tid   returns the export template ID to write the record with.
+ * @param err   an error description; required.
+ * @return      TRUE on success, FALSE otherwise.
+ */
+
+gboolean yfFlowToRec(
+    yfFlow_t            *flow,
+    uint8_t             *rec,
+    uint16_t            *tid,
+    GError              **err);
+
+/**
+ * Write an export record built by yfFlowToRec() to an IPFIX message buffer.
+ *
+ * @param fbuf  buffer to write to, as for yfWriteFlow().
+ * @param rec   record built by yfFlowToRec().
+ * @param tid   template ID returned by yfFlowToRec().
+ * @param err   an error description; required.
+ * @return      TRUE on success, FALSE otherwise.
+ */
+
+gboolean yfWriteFlowRec(
+    fBuf_t              *fbuf,
+    uint8_t             *rec,
+    uint16_t            tid,
+    GError              **err);
+
 /**
  * Close the connection underlying an IPFIX message buffer created by
  * yfWriterForFP() or yfWriterForSpec(). If flush is TRUE, forces any message
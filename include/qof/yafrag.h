@@ -117,7 +117,8 @@ void yfFragTabFree(
  * @param fraginfo  fragment information structure filled in by yfDecodeToPBuf()
  * @param pbuf      packet buffer. On call, contains decoded fragmented packet
  *                  to add to the fragment table. If this call returns TRUE,
- *                  on return, contains assembled packet.
+ *                  on return, contains assembled packet, with the hashes
+ *                  of its now complete flow key recomputed.
  * @param pkt       pkt buffer from libpcap.  We need this to reassemble
  *                  (memcpy) TCP header fragments when payload is not enabled.
  * @param hdr_len   size of the packet buffer pkt
@@ -79,6 +79,7 @@
 #include <qof/autoinc.h>
 #include <qof/yafcore.h>
 #include <qof/decode.h>
+#include <qof/qofflowidx.h>
 
 
 struct yfFlowTab_st;
@@ -98,6 +99,16 @@ typedef struct yfFlowTab_st yfFlowTab_t;
  * @param active_ms active timeout in milliseconds. The maximum duration of a
  *                  flow is the active timeout; additional packets
  *                  for the same flow will be counted as part of a new flow.
+ * @param active_octets active timeout in octets. A flow which would exceed
+ *                  this many octets, in both directions, with its next packet
+ *                  times out as if on active timeout. 0 disables.
+ * @param active_packets active timeout in packets. A flow which has seen this
+ *                  many packets, in both directions, times out as if on
+ *                  active timeout at its next packet. 0 disables.
+ * @param active_rtts active timeout as a multiple of round-trip time. A TCP
+ *                  flow lasting longer than this many times its smoothed RTT
+ *                  times out as if on active timeout. Requires
+ *                  tcp_rtt_enable; 0 disables.
  * @param max_flows maximum number of active flows. Flows exceeding this limit
  *                  will be expired in least-recent order, as if they were idle.
  *                  Used to limit resource usage of a flow table. A value of 0
@@ -118,6 +129,9 @@ typedef struct yfFlowTab_st yfFlowTab_t;
  */
 yfFlowTab_t *yfFlowTabAlloc(uint64_t        idle_ms,
                             uint64_t        active_ms,
+                            uint64_t        active_octets,
+                            uint64_t        active_packets,
+                            uint32_t        active_rtts,
                             uint32_t        max_flows,
                             gboolean        uniflow,
                             gboolean        silkmode,
@@ -161,12 +175,71 @@ void yfGetFlowTabStats(
     uint32_t *peak,
     uint32_t *flush);
 
+/**
+ * yfGetFlowTabMemStats
+ * Get Flow Table Memory Pressure Stats for Export
+ *
+ * @param flowtab
+ * @param shed number of TCP flows created without TCP analytics state
+ * @param shortidle number of flows closed on the shortened idle timeout
+ * @param evicted number of flows closed to stay within the memory limit
+ * @param peakmem maximum flow and TCP state memory in use at any 1 time
+ */
+void yfGetFlowTabMemStats(
+    yfFlowTab_t *flowtab,
+    uint64_t *shed,
+    uint64_t *shortidle,
+    uint64_t *evicted,
+    uint64_t *peakmem);
+
+/**
+ * Flow table internals, for capacity planning. Counters are totals since
+ * the flow table was allocated; the rest are values at the time of the call.
+ */
+
+typedef struct yfFlowTabTelemetry_st {
+    /** Flows created */
+    uint64_t    created;
+    /** Flows closed by idle timeout */
+    uint64_t    end_idle;
+    /** Flows closed by active timeout */
+    uint64_t    end_active;
+    /** Flows closed by TCP teardown */
+    uint64_t    end_closed;
+    /** Flows closed early for lack of flow table space or memory */
+    uint64_t    end_resource;
+    /** Index lookups by buckets probed: 1, 2, 3 to 4, and 5 or more */
+    uint64_t    probe_hist[QF_FLOWIDX_HIST];
+    /** Flows in the table */
+    uint32_t    occupancy;
+    /** Slots in the index; occupancy / capacity is the load factor */
+    uint32_t    capacity;
+    /** Longest index probe sequence */
+    uint32_t    max_probe;
+    /** TCP analytics state blocks allocated */
+    uint32_t    tcp_blocks;
+    /** Maximum number of flows waiting in the close queue at any 1 time */
+    uint32_t    cq_peak;
+} yfFlowTabTelemetry_t;
+
+/**
+ * yfGetFlowTabTelemetry
+ * Get Flow Table Internals for Export
+ *
+ * @param flowtab
+ * @param tel returns flow table internals
+ */
+void yfGetFlowTabTelemetry(
+    yfFlowTab_t *flowtab,
+    yfFlowTabTelemetry_t *tel);
+
 /**
  * Add a decoded packet buffer to a given flow table. Adds the packet to
  * the flow to which it belongs, creating a new flow if necessary. Causes
  * the flow to which it belongs to time out if it is longer than the active
  * timeout.  Closes the flow if the flow closure conditions (TCP RST, TCP FIN
- * four-way teardown) are met.
+ * four-way teardown) are met. The flow is found by the hash the decoder
+ * left in the packet buffer; the key is not hashed again.
  *
  * @param flowtab   flow table to add the packet to
  * @param pbuf      packet buffer containing decoded packet to add.
@@ -195,6 +268,165 @@ gboolean yfFlowTabFlush(
     gboolean        close,
     GError          **err);
 
+/**
+ * A flow writer, called by yfFlowTabFlushTo() once for each closed flow (or
+ * twice for each biflow, in uniflow mode). The flow is only valid for the
+ * duration of the call.
+ *
+ * @param wctx  writer context, as passed to yfFlowTabFlushTo()
+ * @param flow  closed flow to write
+ * @param err   An error description pointer
+ * @return TRUE on success, FALSE otherwise.
+ */
+
+typedef gboolean (*yfFlowWriter_fn)(
+    void            *wctx,
+    yfFlow_t        *flow,
+    GError          **err);
+
+/**
+ * Flush closed flows in the given flow table to a flow writer. Times out
+ * and closes flows as yfFlowTabFlush(), but does not need a YAF context, so
+ * can be used with flow tables owned by worker threads.
+ *
+ * @param flowtab   flow table to flush
+ * @param close     close all active flows before flushing
+ * @param writer    function to write each closed flow with
+ * @param wctx      context pointer passed to writer
+ * @param err       An error description pointer
+ * @return TRUE on success, FALSE if the writer failed.
+ */
+
+gboolean yfFlowTabFlushTo(
+    yfFlowTab_t     *flowtab,
+    gboolean        close,
+    yfFlowWriter_fn writer,
+    void            *wctx,
+    GError          **err);
+
+/**
+ * Set the flow ID space for a flow table. Flows created in the table get IDs
+ * first, first + stride, first + 2 * stride, and so on; flow tables sharing
+ * a stride with distinct first IDs below it therefore never produce the same
+ * flow ID. New tables start at 1 with a stride of 1.
+ *
+ * @param flowtab   flow table to set flow ID space for
+ * @param first     first flow ID to assign; must be nonzero
+ * @param stride    increment between flow IDs; must be nonzero
+ */
+
+void yfFlowTabSetFlowIdSpace(
+    yfFlowTab_t     *flowtab,
+    uint64_t        first,
+    uint64_t        stride);
+
+/**
+ * Set incremental flush work quanta for a flow table. By default, a flush
+ * which is not closing all flows does nothing until five seconds of packet
+ * time have passed since the last one (or the close queue grows long), and
+ * then times out and writes every flow due at once. With a nonzero quantum,
+ * every flush does a bounded amount of work instead, so flushing after each
+ * batch of packets keeps per-batch latency flat; work not done is picked up
+ * by the next flush.
+ *
+ * @param flowtab           flow table to set quanta for
+ * @param expire_quantum    maximum flows to take off the timing wheel per
+ *                          flush (for timeout, rescheduling or eviction), or
+ *                          0 for no limit
+ * @param export_quantum    maximum closed flows to write per flush, or 0 for
+ *                          no limit
+ */
+
+void yfFlowTabSetFlushQuanta(
+    yfFlowTab_t     *flowtab,
+    uint32_t        expire_quantum,
+    uint32_t        export_quantum);
+
+/**
+ * Partition a flow table by VLAN ID. Each VLAN's flows are kept on their
+ * own timing wheel and may be held to their own limit, past which that
+ * VLAN's flows are evicted earliest deadline first; when the table as a
+ * whole is over its flow or memory limit, flows are evicted from the VLAN
+ * with the most. Without partitioning, eviction takes the earliest
+ * deadline flows of the whole table, whatever VLAN they are on. Must be
+ * called before any flows are added to the table.
+ *
+ * @param flowtab   flow table to partition
+ * @param max_flows maximum open flows per VLAN, or 0 for no limit
+ */
+
+void yfFlowTabSetVlanPartitions(
+    yfFlowTab_t     *flowtab,
+    uint32_t        max_flows);
+
+/**
+ * Limit the memory a flow table may use for flow nodes and TCP analytics
+ * state. As usage approaches the limit, the table degrades in stages: above
+ * three quarters of the limit, new TCP flows are metered without TCP
+ * analytics; above nine tenths, flushes close flows idle for longer than an
+ * eighth of the idle timeout; and beyond the limit, flushes evict flows,
+ * earliest deadline first, until usage is back within it.
+ *
+ * @param flowtab   flow table to limit
+ * @param bytes     memory limit in bytes, or 0 for no limit
+ */
+
+void yfFlowTabSetMemoryLimit(
+    yfFlowTab_t     *flowtab,
+    uint64_t        bytes);
+
+/**
+ * Advance the packet clock of a flow table without adding a packet, so
+ * that a flow table which sees no traffic still times out its flows on
+ * flush. Never moves the clock backward.
+ *
+ * @param flowtab a flow table
+ * @param ctime   new packet clock, in epoch milliseconds
+ */
+
+void yfFlowTabAdvanceTime(
+    yfFlowTab_t     *flowtab,
+    uint64_t        ctime);
+
+/**
+ * Write the open flows in a flow table, with their TCP and RTT state, to a
+ * snapshot file, for restoring with yfFlowTabRestore() in a later process.
+ * The snapshot is written to a temporary file and renamed into place.
+ * Flows in the close queue are not included; flush them separately.
+ *
+ * @param flowtab   flow table to checkpoint
+ * @param path      snapshot file to write
+ * @param detach    if TRUE, remove the open flows from the table after
+ *                  writing them, without closing or exporting them
+ * @param err       an error description
+ * @return TRUE on success, FALSE if the snapshot couldn't be written
+ */
+
+gboolean yfFlowTabCheckpoint(
+    yfFlowTab_t     *flowtab,
+    const char      *path,
+    gboolean        detach,
+    GError          **err);
+
+/**
+ * Load the open flows from a snapshot file written by yfFlowTabCheckpoint()
+ * into a flow table, before it sees its first packet. Flows keep their flow
+ * IDs and times; the packet clock and flow ID sequence resume from the
+ * snapshot, so flows idle across the restart time out as usual.
+ *
+ * @param flowtab   flow table to restore into
+ * @param path      snapshot file to read
+ * @param err       an error description
+ * @return TRUE on success, FALSE if the snapshot couldn't be read, was
+ *         written by an incompatible build, or is corrupt; the flow table
+ *         is then left as it was
+ */
+
+gboolean yfFlowTabRestore(
+    yfFlowTab_t     *flowtab,
+    const char      *path,
+    GError          **err);
+
 /**
  * Get the current packet clock from a flow table.
  *
@@ -218,6 +450,18 @@ uint64_t yfFlowDumpStats(
     yfFlowTab_t     *flowtab,
     GTimer          *timer);
 
+/**
+ * yfFlowTabLayoutCheck
+ *
+ * This is a purely internal diagnostic function, analogous to
+ * qfInternalTemplateCheck(). It logs the layout of the flow table's nodes
+ * at debug level, terminates if the compact IPv4 node does not mirror the
+ * full node, and warns if the fields touched on every packet no longer
+ * share a cache line.
+ */
+
+void yfFlowTabLayoutCheck(void);
+
 void yfFlowKeyReverse(
     yfFlowKey_t       *fwd,
     yfFlowKey_t       *rev);
@@ -61,6 +61,7 @@
 #define _YAF_SOURCE_
 #include <qof/autoinc.h>
 #include <qof/decode.h>
+#include <qof/qofflowidx.h>
 #include <airframe/airutil.h>
 
 /* Definitions of the various headers the decoder understands */
@@ -109,6 +110,10 @@ typedef struct yfHdrNull_st {
 
 /** Ethertype for 802.1q VLAN shim header */
 #define YF_TYPE_8021Q   0x8100
+/** Ethertype for 802.1ad service VLAN (QinQ outer) shim header */
+#define YF_TYPE_8021AD  0x88A8
+/** Ethertype for pre-standard QinQ outer shim header */
+#define YF_TYPE_QINQ    0x9100
 /** Ethertype for MPLS unicast shim header */
 #define YF_TYPE_MPLS    0x8847
 /** Ethertype for MPLE multicast shim header */
@@ -117,6 +122,8 @@ typedef struct yfHdrNull_st {
 #define YF_TYPE_PPPOE   0x8864
 /** Ethertype for ARP */
 #define YF_TYPE_ARP     0x0806
+/** Ethertype for Ethernet bridged over a tunnel */
+#define YF_TYPE_TEB     0x6558
 
 /** Ethernet encoding types:
 0x0800  IP v4
@@ -409,13 +416,38 @@ typedef struct yfHdrSre_st {
     uint8_t         gh_sre_len;
 } yfHdrSre_t;
 
+/* Fast path decoder results */
+#define YF_FAST_FAIL    0
+#define YF_FAST_OK      1
+#define YF_FAST_PUNT    2
+
+/* A fast path decoder; decodes the common case, and punts the rest */
+typedef int (*yfDecodeFast_fn)(
+    yfDecodeCtx_t           *ctx,
+    size_t                  caplen,
+    const uint8_t           *pkt,
+    yfIPFragInfo_t          *fraginfo,
+    yfPBuf_t                *pbuf);
+
 /* Decode context for configuration and statistics */
 struct yfDecodeCtx_st {
-    /* State (none) */
+    /* State: fast path chosen for the last linktype seen */
+    yfDecodeFast_fn     fast;
+    libtrace_linktype_t fastlink;
+    gboolean            fastsel;
     /* Configuration */
     uint16_t        reqtype;
     gboolean        gremode;
     gboolean        tomode;
+    gboolean        fastmode;
+    gboolean        tunnelmode;
+    uint16_t        vxlanport;
+    uint16_t        geneveport;
+    uint16_t        gtpuport;
+    gboolean        qinqkey;
+    gboolean        mplskey;
+    gboolean        macmode;
+    gboolean        tcpmode;
     /* Statistics */
     struct stats_tag {
         uint32_t        fail_l2hdr;
@@ -431,6 +463,7 @@ struct yfDecodeCtx_st {
         uint32_t        fail_l4hdr;
         uint32_t        fail_l4frag;
         uint32_t        fail_grevers;
+        uint32_t        fail_tunnel;
     } stats;
 };
 
@@ -527,6 +560,8 @@ static const uint8_t *yfDecodeL2Shim(
     while (1) {
         switch (*type) {
         case YF_TYPE_8021Q:
+        case YF_TYPE_8021AD:
+        case YF_TYPE_QINQ:
             /* Check for full 802.1q shim header */
             if (*caplen < 4) {
                 ++ctx->stats.fail_l2shim;
@@ -534,8 +569,12 @@ static const uint8_t *yfDecodeL2Shim(
             }
             /* Get type from 802.1q shim */
             *type = g_ntohs(((yfHdr1qShim_t *)pkt)->type);
-            /* Copy out vlan tag if necessary */
+            /* Copy out vlan tag if necessary; the first of a stack is
+               the outer tag, the last the inner */
             if (l2info) {
+                if (l2info->vlan_tag && !l2info->vlan_outer) {
+                    l2info->vlan_outer = l2info->vlan_tag;
+                }
                 l2info->vlan_tag =  YF_VLAN_TAG(pkt);
             }
             /* Advance packet pointer */
@@ -552,8 +591,10 @@ static const uint8_t *yfDecodeL2Shim(
             }
             /* Get label entry */
             mpls_entry = g_ntohl(*((uint32_t *)(pkt)));
-            /* Copy out label if necessary */
-            if (l2info && l2info->mpls_count < YF_MPLS_LABEL_COUNT_MAX) {
+            /* Copy out label if necessary; only flow keys use them */
+            if (l2info && ctx->mplskey &&
+                l2info->mpls_count < YF_MPLS_LABEL_COUNT_MAX)
+            {
                 l2info->mpls_label[l2info->mpls_count++] =
                     YF_MPLS_LABEL(mpls_entry);
             }
@@ -588,6 +629,21 @@ static const uint8_t *yfDecodeL2Shim(
     }
 }
 
+/* Clear everything but the label stack, which is only valid up to
+   mpls_count, and the MAC addresses, unless something downstream wants
+   them; this saves most of the structure's writes per packet */
+static inline void yfDecodeL2Clear(
+    yfDecodeCtx_t           *ctx,
+    yfL2Info_t              *l2info)
+{
+    if (ctx->macmode) {
+        memset(l2info, 0, offsetof(yfL2Info_t, mpls_label));
+    } else {
+        memset(&l2info->l2hlen, 0, offsetof(yfL2Info_t, mpls_label) -
+                                   offsetof(yfL2Info_t, l2hlen));
+    }
+}
+
 /**
  * yfDecodeL2
  *
@@ -604,7 +660,7 @@ static const uint8_t *yfDecodeL2(
     yfL2Info_t              *l2info)
 {
     if (l2info) {
-        memset(l2info, 0, sizeof(*l2info));
+        yfDecodeL2Clear(ctx, l2info);
     }
 
     switch (linktype) {
@@ -617,7 +673,7 @@ static const uint8_t *yfDecodeL2(
         /* Copy out ethertype */
         *type = g_ntohs(((yfHdrEn10Mb_t *)pkt)->type);
         /* Copy out MAC addresses if we care */
-        if (l2info) {
+        if (l2info && ctx->macmode) {
           memcpy(l2info->smac, ((yfHdrEn10Mb_t *)pkt)->smac, 6);
           memcpy(l2info->dmac, ((yfHdrEn10Mb_t *)pkt)->dmac, 6);
         }
@@ -894,81 +950,20 @@ static const uint8_t *yfDecodeIPv6(
 }
 
 /**
- * yfDecodeTCP
- *
+ * yfDecodeTCPOpts
  *
+ * Parse TCP options into tcpinfo. Returns FALSE on a malformed option.
  *
  */
-static const uint8_t *yfDecodeTCP(
+static gboolean yfDecodeTCPOpts(
     yfDecodeCtx_t           *ctx,
-    size_t                  *caplen,
     const uint8_t           *pkt,
-    yfFlowKey_t             *key,
-    yfIPFragInfo_t          *fraginfo,
+    ssize_t                 tcph_len,
     yfTCPInfo_t             *tcpinfo)
 {
-    const yfHdrTcp_t        *tcph = (const yfHdrTcp_t *)pkt;
     uint8_t to_kind, to_len;
     const yfHdrTcpOptTs_t   *tsopt;
-    ssize_t                 tcph_len;
-
-    /* zero stale TCP info */
-    memset(tcpinfo, 0, sizeof(yfTCPInfo_t));
-    
-    /* Verify we have a full TCP header without options */
-    if (*caplen < YF_TCP_HLEN) {
-        if (fraginfo && fraginfo->frag) {
-            /* will have to do TCP stuff later */
-            return pkt;
-        }
-        ++ctx->stats.fail_l4hdr;
-        return NULL;
-    }
-
-    /* get full header length */
-    tcph_len = tcph->th_off * 4;
-    
-    /* Decode source and destination port into key */
-    key->sp = g_ntohs(tcph->th_sport);
-    key->dp = g_ntohs(tcph->th_dport);
-
-    /* Copy header info */
-    if (tcpinfo) {
-        tcpinfo->seq = g_ntohl(tcph->th_seq);
-        tcpinfo->ack = g_ntohl(tcph->th_ack);
-        tcpinfo->rwin = g_ntohs(tcph->th_win);
-        tcpinfo->flags = tcph->th_flags;
-    }
-
-    if (fraginfo && fraginfo->frag) {
-        fraginfo->l4hlen = tcph_len;
-    }
-        
-    /* Now verify we have all options as well */
-    if (*caplen < tcph_len) {
-        if (fraginfo && fraginfo->frag) {
-            /* will do TCP stuff later */
-            return pkt;
-        }
-        ++ctx->stats.fail_l4hdr;
-        return NULL;
-    }
-    
-    /* Set caplen post-options (use tcp_hlen from here for pkt bounds) */
-    *caplen -= tcph_len;
 
-    if (!ctx->tomode) return pkt + tcph_len;
-    
-    /* Skip to start of options */
-    tcph_len -= YF_TCP_HLEN;
-    pkt += YF_TCP_HLEN;
-
-//    if (tcph_len) {
-//        fprintf(stderr, "tcp options (%u):", tcph_len);
-//    } else {
-//       goto OPT_NONE;
-//    }
-    
     /* Parse options while we still have them */
     while (tcpinfo && (tcph_len > 0)) {
 
@@ -977,7 +972,7 @@ static const uint8_t *yfDecodeTCP(
         /* handle single-byte options */
         if (to_kind == YF_TOK_EOL) {
 //            fprintf(stderr, " EOL");
-            goto OPT_EOL;
+            return TRUE;
         }
         if (to_kind == YF_TOK_NOP) {
             to_len = 1;
@@ -1030,19 +1025,89 @@ OPT_NEXT:
         tcph_len -= to_len;
         pkt += to_len;
     }
-OPT_EOL:
-    /* Advance beyond any skipped options */
-//    if (tcph_len) {
-//        fprintf(stderr, " SKP(%u)", tcph_len);
-//    }
-//    fprintf(stderr, "\n");
-//OPT_NONE:
-    return pkt + tcph_len;
+    return TRUE;
     
 OPT_ERR:
 //    fprintf(stderr, " ERR\n");
     ++ctx->stats.fail_l4hdr;
-    return NULL;
+    return FALSE;
+}
+
+/**
+ * yfDecodeTCP
+ *
+ *
+ *
+ */
+static const uint8_t *yfDecodeTCP(
+    yfDecodeCtx_t           *ctx,
+    size_t                  *caplen,
+    const uint8_t           *pkt,
+    yfFlowKey_t             *key,
+    yfIPFragInfo_t          *fraginfo,
+    yfTCPInfo_t             *tcpinfo)
+{
+    const yfHdrTcp_t        *tcph = (const yfHdrTcp_t *)pkt;
+    ssize_t                 tcph_len;
+
+    /* zero stale TCP info; without TCP analytics only flags are used */
+    if (ctx->tcpmode) {
+        memset(tcpinfo, 0, sizeof(yfTCPInfo_t));
+    } else {
+        tcpinfo->flags = 0;
+    }
+    
+    /* Verify we have a full TCP header without options */
+    if (*caplen < YF_TCP_HLEN) {
+        if (fraginfo && fraginfo->frag) {
+            /* will have to do TCP stuff later */
+            return pkt;
+        }
+        ++ctx->stats.fail_l4hdr;
+        return NULL;
+    }
+
+    /* get full header length */
+    tcph_len = tcph->th_off * 4;
+    
+    /* Decode source and destination port into key */
+    key->sp = g_ntohs(tcph->th_sport);
+    key->dp = g_ntohs(tcph->th_dport);
+
+    /* Copy header info */
+    tcpinfo->flags = tcph->th_flags;
+    if (ctx->tcpmode) {
+        tcpinfo->seq = g_ntohl(tcph->th_seq);
+        tcpinfo->ack = g_ntohl(tcph->th_ack);
+        tcpinfo->rwin = g_ntohs(tcph->th_win);
+    }
+
+    if (fraginfo && fraginfo->frag) {
+        fraginfo->l4hlen = tcph_len;
+    }
+        
+    /* Now verify we have all options as well */
+    if (*caplen < tcph_len) {
+        if (fraginfo && fraginfo->frag) {
+            /* will do TCP stuff later */
+            return pkt;
+        }
+        ++ctx->stats.fail_l4hdr;
+        return NULL;
+    }
+    
+    /* Set caplen post-options (use tcp_hlen from here for pkt bounds) */
+    *caplen -= tcph_len;
+
+    if (!ctx->tomode) return pkt + tcph_len;
+    
+    /* Parse options, then advance beyond them */
+    if (!yfDecodeTCPOpts(ctx, pkt + YF_TCP_HLEN, tcph_len - YF_TCP_HLEN,
+                         tcpinfo))
+    {
+        return NULL;
+    }
+    return pkt + tcph_len;
 }
 
 /**
@@ -1295,6 +1360,122 @@ static const uint8_t *yfDecodeGRE(
                       key, iplen, ipinfo, tcpinfo, fraginfo);
 }
 
+#if QOF_ENABLE_TUNNEL_KEYS
+/**
+ * yfDecodeTunnelPort
+ *
+ * TRUE if a UDP destination port is one we decapsulate tunnels on.
+ *
+ */
+static inline gboolean yfDecodeTunnelPort(
+    yfDecodeCtx_t           *ctx,
+    uint16_t                port)
+{
+    return port && (port == ctx->vxlanport || port == ctx->geneveport ||
+                    port == ctx->gtpuport);
+}
+
+/**
+ * yfDecodeUDPTunnel
+ *
+ * Decapsulate VXLAN, Geneve or GTP-U, chosen by UDP destination port, and
+ * decode the packet inside in place of the UDP payload, keyed by its VNI
+ * or TEID. Tunnel packets carrying nothing we decode are left as UDP.
+ *
+ */
+static const uint8_t *yfDecodeUDPTunnel(
+    yfDecodeCtx_t           *ctx,
+    size_t                  *caplen,
+    const uint8_t           *pkt,
+    yfFlowKey_t             *key,
+    uint16_t                *iplen,
+    yfIPInfo_t              *ipinfo,
+    yfTCPInfo_t             *tcpinfo,
+    yfIPFragInfo_t          *fraginfo)
+{
+    size_t                  hlen = 8;
+    size_t                  ext_len;
+    uint16_t                type;
+    uint32_t                tid;
+    uint8_t                 next;
+
+    /* All three have at least an eight byte header */
+    if (*caplen < hlen) goto TUNNEL_TRUNC;
+
+    if (key->dp == ctx->vxlanport) {
+        /* VXLAN: I flag set if the VNI is valid; then bridged Ethernet */
+        if (!(pkt[0] & 0x08)) return pkt;
+        type = YF_TYPE_TEB;
+        tid = (pkt[4] << 16) | (pkt[5] << 8) | pkt[6];
+    } else if (key->dp == ctx->geneveport) {
+        /* Geneve: version 0 data packets only; options follow the header */
+        if ((pkt[0] >> 6) || (pkt[1] & 0x80)) return pkt;
+        type = (pkt[2] << 8) | pkt[3];
+        if (type != YF_TYPE_TEB && type != YF_TYPE_IPv4 &&
+            type != YF_TYPE_IPv6)
+        {
+            return pkt;
+        }
+        hlen += (pkt[0] & 0x3F) * 4;
+        tid = (pkt[4] << 16) | (pkt[5] << 8) | pkt[6];
+    } else {
+        /* GTP-U: version 1 G-PDUs only */
+        if ((pkt[0] & 0xF0) != 0x30 || pkt[1] != 0xFF) return pkt;
+        tid = ((uint32_t)pkt[4] << 24) | (pkt[5] << 16) |
+              (pkt[6] << 8) | pkt[7];
+
+        /* E, S or PN add sequence, N-PDU and next extension type fields */
+        if (pkt[0] & 0x07) {
+            hlen += 4;
+            if (*caplen < hlen) goto TUNNEL_TRUNC;
+
+            /* Skip extension headers: length in words, next type last */
+            next = (pkt[0] & 0x04) ? pkt[hlen - 1] : 0;
+            while (next) {
+                if (*caplen <= hlen) goto TUNNEL_TRUNC;
+                ext_len = pkt[hlen] * 4;
+                if (!ext_len || *caplen < hlen + ext_len) goto TUNNEL_TRUNC;
+                hlen += ext_len;
+                next = pkt[hlen - 1];
+            }
+        }
+
+        /* The payload is IP, or something we don't decode */
+        if (*caplen <= hlen) goto TUNNEL_TRUNC;
+        switch (YF_IP_VERSION(pkt + hlen)) {
+          case 4:
+            type = YF_TYPE_IPv4;
+            break;
+          case 6:
+            type = YF_TYPE_IPv6;
+            break;
+          default:
+            return pkt;
+        }
+    }
+
+    /* Verify we have the full tunnel header, and skip it */
+    if (*caplen < hlen) goto TUNNEL_TRUNC;
+    pkt += hlen;
+    *caplen -= hlen;
+    key->tunnelId = tid;
+
+    /* Unwrap bridged Ethernet, keeping the outer layer 2 information */
+    if (type == YF_TYPE_TEB &&
+        !(pkt = yfDecodeL2(ctx, TRACE_TYPE_ETH, caplen, pkt, &type, NULL)))
+    {
+        return NULL;
+    }
+
+    return yfDecodeIP(ctx, type, caplen, pkt,
+                      key, iplen, ipinfo, tcpinfo, fraginfo);
+
+  TUNNEL_TRUNC:
+    ++ctx->stats.fail_tunnel;
+    return NULL;
+}
+#endif
+
 /**
  * yfDecodeIP
  *
@@ -1359,6 +1540,17 @@ static const uint8_t *yfDecodeIP(
         if (!(pkt = yfDecodeUDP(ctx, caplen, pkt, key, fraginfo))) {
             return NULL;
         }
+#if QOF_ENABLE_TUNNEL_KEYS
+        /* Decapsulate UDP tunnels, except from fragments */
+        if (ctx->tunnelmode && !(fraginfo && fraginfo->frag) &&
+            yfDecodeTunnelPort(ctx, key->dp))
+        {
+            if (!(pkt = yfDecodeUDPTunnel(ctx, caplen, pkt, key, iplen,
+                                          ipinfo, tcpinfo, fraginfo))) {
+                return NULL;
+            }
+        }
+#endif
         break;
       case YF_PROTO_ICMP:
       case YF_PROTO_ICMP6:
@@ -1388,6 +1580,191 @@ static const uint8_t *yfDecodeIP(
     return pkt;
 }
 
+/**
+ * yfDecodeFastEth
+ *
+ * Decode untagged Ethernet carrying unfragmented IPv4, or IPv6 without
+ * extension headers, carrying TCP or UDP, in one pass. Anything else,
+ * including truncated headers, is punted to the full decoder, which
+ * decodes or rejects it and counts the rejection; so this has no
+ * side effects on the decode statistics except through TCP options.
+ *
+ */
+static inline int yfDecodeFastEth(
+    yfDecodeCtx_t           *ctx,
+    size_t                  caplen,
+    const uint8_t           *pkt,
+    yfIPFragInfo_t          *fraginfo,
+    yfPBuf_t                *pbuf,
+    gboolean                tomode)
+{
+    yfFlowKey_t             *key = &(pbuf->key);
+    yfTCPInfo_t             *tcpinfo = &(pbuf->tcpinfo);
+    const uint8_t           *l4;
+    const yfHdrIPv4_t       *iph;
+    const yfHdrIPv6_t       *ip6h;
+    const yfHdrTcp_t        *tcph;
+    const yfHdrUdp_t        *udph;
+    uint16_t                type;
+    size_t                  hlen;
+
+    /* Ethernet, without shims */
+    if (caplen < 14) return YF_FAST_PUNT;
+    type = g_ntohs(((yfHdrEn10Mb_t *)pkt)->type);
+    if (ctx->reqtype && ctx->reqtype != type) return YF_FAST_PUNT;
+    caplen -= 14;
+
+    if (type == YF_TYPE_IPv4) {
+        iph = (const yfHdrIPv4_t *)(pkt + 14);
+        if (caplen < 20 || iph->ip_hl < 5 ||
+            (g_ntohs(iph->ip_off) & (YF_IP4_OFFMASK | YF_IP4_MF)) ||
+            (iph->ip_p != YF_PROTO_TCP && iph->ip_p != YF_PROTO_UDP))
+        {
+            return YF_FAST_PUNT;
+        }
+        hlen = iph->ip_hl * 4;
+        pbuf->iplen = g_ntohs(iph->ip_len);
+        if (caplen > pbuf->iplen) caplen = pbuf->iplen;
+        if (caplen < hlen) return YF_FAST_PUNT;
+
+        key->version = 4;
+        key->addr.v4.sip = g_ntohl(iph->ip_src);
+        key->addr.v4.dip = g_ntohl(iph->ip_dst);
+        key->proto = iph->ip_p;
+        pbuf->ipinfo.ttl = iph->ip_ttl;
+        pbuf->ipinfo.ecn = iph->ip_tos & 0x03;
+        if (fraginfo) {
+            fraginfo->offset = g_ntohs(iph->ip_off);
+            fraginfo->frag = 0;
+        }
+    } else if (type == YF_TYPE_IPv6) {
+        ip6h = (const yfHdrIPv6_t *)(pkt + 14);
+        hlen = 40;
+        if (caplen < hlen ||
+            (ip6h->ip6_nxt != YF_PROTO_TCP && ip6h->ip6_nxt != YF_PROTO_UDP))
+        {
+            return YF_FAST_PUNT;
+        }
+        pbuf->iplen = g_ntohs(ip6h->ip6_plen) + hlen;
+        if (caplen > pbuf->iplen) caplen = pbuf->iplen;
+        if (caplen < hlen) return YF_FAST_PUNT;
+
+        key->version = 6;
+        memcpy(key->addr.v6.sip, &(ip6h->ip6_src), 16);
+        memcpy(key->addr.v6.dip, &(ip6h->ip6_dst), 16);
+        key->proto = ip6h->ip6_nxt;
+        pbuf->ipinfo.ttl = ip6h->ip6_hlim;
+        pbuf->ipinfo.ecn = YF_VCF6_ECN(ip6h);
+        if (fraginfo) {
+            fraginfo->frag = 0;
+        }
+    } else {
+        return YF_FAST_PUNT;
+    }
+
+    l4 = pkt + 14 + hlen;
+    caplen -= hlen;
+
+    if (key->proto == YF_PROTO_TCP) {
+        tcph = (const yfHdrTcp_t *)l4;
+        if (caplen < YF_TCP_HLEN || tcph->th_off < 5) return YF_FAST_PUNT;
+        hlen = tcph->th_off * 4;
+        if (caplen < hlen) return YF_FAST_PUNT;
+
+        key->sp = g_ntohs(tcph->th_sport);
+        key->dp = g_ntohs(tcph->th_dport);
+        if (ctx->tcpmode) {
+            memset(tcpinfo, 0, sizeof(yfTCPInfo_t));
+            tcpinfo->seq = g_ntohl(tcph->th_seq);
+            tcpinfo->ack = g_ntohl(tcph->th_ack);
+            tcpinfo->rwin = g_ntohs(tcph->th_win);
+        }
+        tcpinfo->flags = tcph->th_flags;
+        if (tomode && hlen > YF_TCP_HLEN &&
+            !yfDecodeTCPOpts(ctx, l4 + YF_TCP_HLEN, hlen - YF_TCP_HLEN,
+                             tcpinfo))
+        {
+            return YF_FAST_FAIL;
+        }
+        l4 += hlen;
+    } else {
+        udph = (const yfHdrUdp_t *)l4;
+        if (caplen < 8) return YF_FAST_PUNT;
+        key->sp = g_ntohs(udph->uh_sport);
+        key->dp = g_ntohs(udph->uh_dport);
+#if QOF_ENABLE_TUNNEL_KEYS
+        if (ctx->tunnelmode && yfDecodeTunnelPort(ctx, key->dp)) {
+            return YF_FAST_PUNT;
+        }
+#endif
+        l4 += 8;
+    }
+
+    /* Layer 2 last; nothing above can fail after this */
+    yfDecodeL2Clear(ctx, &pbuf->l2info);
+    if (ctx->macmode) {
+        memcpy(pbuf->l2info.smac, ((yfHdrEn10Mb_t *)pkt)->smac, 6);
+        memcpy(pbuf->l2info.dmac, ((yfHdrEn10Mb_t *)pkt)->dmac, 6);
+    }
+    pbuf->l2info.l2hlen = 14;
+    key->vlanId = 0;
+#if QOF_ENABLE_TUNNEL_KEYS
+    key->tunnelId = 0;
+#endif
+#if QOF_ENABLE_L2_KEYS
+    key->mplsLabel = 0;
+    key->outerVlanId = 0;
+#endif
+
+    pbuf->allHeaderLen = l4 - pkt;
+    return YF_FAST_OK;
+}
+
+/* fast paths for Ethernet, specialized on TCP option parsing */
+
+static int yfDecodeFastEthOpt(
+    yfDecodeCtx_t           *ctx,
+    size_t                  caplen,
+    const uint8_t           *pkt,
+    yfIPFragInfo_t          *fraginfo,
+    yfPBuf_t                *pbuf)
+{
+    return yfDecodeFastEth(ctx, caplen, pkt, fraginfo, pbuf, TRUE);
+}
+
+static int yfDecodeFastEthNoOpt(
+    yfDecodeCtx_t           *ctx,
+    size_t                  caplen,
+    const uint8_t           *pkt,
+    yfIPFragInfo_t          *fraginfo,
+    yfPBuf_t                *pbuf)
+{
+    return yfDecodeFastEth(ctx, caplen, pkt, fraginfo, pbuf, FALSE);
+}
+
+/**
+ * yfDecodeFastSelect
+ *
+ * Choose a fast path for a linktype and the decoder configuration. GRE and
+ * UDP tunnels are always punted to the full decoder, so gremode and
+ * tunnelmode do not enter into it.
+ *
+ */
+static void yfDecodeFastSelect(
+    yfDecodeCtx_t           *ctx,
+    libtrace_linktype_t     linktype)
+{
+    ctx->fastlink = linktype;
+    ctx->fastsel = TRUE;
+    ctx->fast = NULL;
+
+    if (!ctx->fastmode) return;
+
+    if (linktype == TRACE_TYPE_ETH) {
+        ctx->fast = ctx->tomode ? yfDecodeFastEthOpt : yfDecodeFastEthNoOpt;
+    }
+}
+
 /**
  * yfDecodeToPBuf
  *
@@ -1397,7 +1774,7 @@ static const uint8_t *yfDecodeIP(
 gboolean yfDecodeToPBuf(
     yfDecodeCtx_t           *ctx,
     libtrace_linktype_t     linktype,
-    uint64_t                ptime,
+    uint64_t                ptime_ns,
     size_t                  caplen,
     const uint8_t           *pkt,
     yfIPFragInfo_t          *fraginfo,
@@ -1415,6 +1792,24 @@ gboolean yfDecodeToPBuf(
     /* Zero packet buffer time (mark it not yet valid) */
     pbuf->ptime = 0;
 
+    /* Try the fast path for this linktype first, if there is one */
+    if (!ctx->fastsel || linktype != ctx->fastlink) {
+        yfDecodeFastSelect(ctx, linktype);
+    }
+    if (ctx->fast) {
+        switch (ctx->fast(ctx, caplen, pkt, fraginfo, pbuf)) {
+          case YF_FAST_OK:
+            pbuf->hash = qfFlowKeyHash(key, &pbuf->pairhash);
+            pbuf->ptime = ptime_ns / 1000000;
+            pbuf->ptime_ns = ptime_ns;
+            return TRUE;
+          case YF_FAST_FAIL:
+            return FALSE;
+          default:
+            break;
+        }
+    }
+
     /* Keep the start of pcap for pcap output */
     ipTcpHeaderStart = pkt;
 
@@ -1429,6 +1824,14 @@ gboolean yfDecodeToPBuf(
     } else {
         key->vlanId = 0;
     }
+#if QOF_ENABLE_TUNNEL_KEYS
+    key->tunnelId = 0;
+#endif
+#if QOF_ENABLE_L2_KEYS
+    key->outerVlanId = ctx->qinqkey ? l2info->vlan_outer : 0;
+    key->mplsLabel = (ctx->mplskey && l2info->mpls_count) ?
+                     l2info->mpls_label[0] : 0;
+#endif
 
     /* Now we should have an IP packet. Decode it. */
     if (!(pkt = yfDecodeIP(ctx, type, &caplen, pkt, key, iplen,
@@ -1436,8 +1839,12 @@ gboolean yfDecodeToPBuf(
         return FALSE;
     }
 
+    /* Hash the finished key once, for everything downstream */
+    pbuf->hash = qfFlowKeyHash(key, &pbuf->pairhash);
+
     /* Copy ctime into packet buffer */
-    pbuf->ptime = ptime;
+    pbuf->ptime = ptime_ns / 1000000;
+    pbuf->ptime_ns = ptime_ns;
 
     /* Keep track of how far we progressed */
     pbuf->allHeaderLen = pkt - ipTcpHeaderStart;
@@ -1467,11 +1874,157 @@ yfDecodeCtx_t *yfDecodeCtxAlloc(
     ctx->reqtype = reqtype;
     ctx->tomode = tomode;
     ctx->gremode = gremode;
+    ctx->fastmode = TRUE;
+    ctx->macmode = TRUE;
+    ctx->tcpmode = TRUE;
 
     /* Done */
     return ctx;
 }
 
+/**
+ * yfDecodeStrippedVlan
+ *
+ *
+ *
+ */
+void yfDecodeStrippedVlan(
+    yfDecodeCtx_t           *ctx,
+    uint16_t                vlan,
+    yfPBuf_t                *pbuf)
+{
+    if (!vlan) return;
+
+    if (!pbuf->key.vlanId) {
+        /* the only tag */
+        pbuf->key.vlanId = vlan;
+        pbuf->l2info.vlan_tag = vlan;
+    } else if (!pbuf->l2info.vlan_outer) {
+        /* the outer tag of a QinQ stack */
+        pbuf->l2info.vlan_outer = vlan;
+#if QOF_ENABLE_L2_KEYS
+        if (ctx->qinqkey) pbuf->key.outerVlanId = vlan;
+#endif
+    } else {
+        return;
+    }
+
+    /* the key changed; hash it again */
+    pbuf->hash = qfFlowKeyHash(&pbuf->key, &pbuf->pairhash);
+}
+
+/**
+ * yfDecodeCtxClone
+ *
+ *
+ *
+ */
+yfDecodeCtx_t *yfDecodeCtxClone(
+    yfDecodeCtx_t           *ctx)
+{
+    yfDecodeCtx_t           *clone;
+
+    clone = yfDecodeCtxAlloc(ctx->reqtype, ctx->tomode, ctx->gremode);
+    clone->fastmode = ctx->fastmode;
+    yfDecodeCtxSetTunnelPorts(clone, ctx->vxlanport, ctx->geneveport,
+                              ctx->gtpuport);
+    yfDecodeCtxSetL2Keys(clone, ctx->qinqkey, ctx->mplskey);
+    yfDecodeCtxSetFields(clone, ctx->macmode, ctx->tcpmode);
+    return clone;
+}
+
+/**
+ * yfDecodeCtxSetFastPath
+ *
+ *
+ *
+ */
+void yfDecodeCtxSetFastPath(
+    yfDecodeCtx_t           *ctx,
+    gboolean                fastmode)
+{
+    ctx->fastmode = fastmode;
+    ctx->fastsel = FALSE;
+}
+
+/**
+ * yfDecodeCtxSetTunnelPorts
+ *
+ *
+ *
+ */
+void yfDecodeCtxSetTunnelPorts(
+    yfDecodeCtx_t           *ctx,
+    uint16_t                vxlan_port,
+    uint16_t                geneve_port,
+    uint16_t                gtpu_port)
+{
+    ctx->vxlanport = vxlan_port;
+    ctx->geneveport = geneve_port;
+    ctx->gtpuport = gtpu_port;
+#if QOF_ENABLE_TUNNEL_KEYS
+    ctx->tunnelmode = vxlan_port || geneve_port || gtpu_port;
+#endif
+}
+
+/**
+ * yfDecodeCtxSetL2Keys
+ *
+ *
+ *
+ */
+void yfDecodeCtxSetL2Keys(
+    yfDecodeCtx_t           *ctx,
+    gboolean                qinq_key,
+    gboolean                mpls_key)
+{
+    ctx->qinqkey = qinq_key;
+    ctx->mplskey = mpls_key;
+}
+
+/**
+ * yfDecodeCtxSetFields
+ *
+ *
+ *
+ */
+void yfDecodeCtxSetFields(
+    yfDecodeCtx_t           *ctx,
+    gboolean                mac_fields,
+    gboolean                tcp_fields)
+{
+    ctx->macmode = mac_fields;
+    /* options are parsed into the fields cleared with the rest */
+    ctx->tcpmode = tcp_fields || ctx->tomode;
+}
+
+/**
+ * yfDecodeCtxMergeStats
+ *
+ *
+ *
+ */
+void yfDecodeCtxMergeStats(
+    yfDecodeCtx_t           *ctx,
+    yfDecodeCtx_t           *from)
+{
+    ctx->stats.fail_l2hdr += from->stats.fail_l2hdr;
+    ctx->stats.fail_l2shim += from->stats.fail_l2shim;
+    ctx->stats.fail_l2loop += from->stats.fail_l2loop;
+    ctx->stats.fail_l3type += from->stats.fail_l3type;
+    ctx->stats.fail_arptype += from->stats.fail_arptype;
+    ctx->stats.fail_ip4hdr += from->stats.fail_ip4hdr;
+    ctx->stats.fail_ip4frag += from->stats.fail_ip4frag;
+    ctx->stats.fail_ip6hdr += from->stats.fail_ip6hdr;
+    ctx->stats.fail_ip6ext += from->stats.fail_ip6ext;
+    ctx->stats.fail_ip6frag += from->stats.fail_ip6frag;
+    ctx->stats.fail_l4hdr += from->stats.fail_l4hdr;
+    ctx->stats.fail_l4frag += from->stats.fail_l4frag;
+    ctx->stats.fail_grevers += from->stats.fail_grevers;
+    ctx->stats.fail_tunnel += from->stats.fail_tunnel;
+    memset(&from->stats, 0, sizeof(from->stats));
+}
+
 /**
  * yfDecodeCtxFree
  *
@@ -1516,6 +2069,19 @@ uint64_t yfDecodeTimeNTP(
     return (uint64_t)dntp;
 }
 
+/**
+ * yfDecodeTimeERF
+ *
+ *
+ *
+ */
+uint64_t yfDecodeTimeERF(
+    uint64_t                erf)
+{
+    return ((erf >> 32) * 1000000000) +
+           (((erf & 0x00000000FFFFFFFFLL) * 1000000000) >> 32);
+}
+
 /**
  * yfDecodeUndecodedCount
  *
@@ -1530,7 +2096,8 @@ uint32_t yfDecodeUndecodedCount(
     fail_snaptotal =
         ctx->stats.fail_l2hdr + ctx->stats.fail_l2shim +
         ctx->stats.fail_ip4hdr + ctx->stats.fail_ip6hdr +
-        ctx->stats.fail_ip6ext + ctx->stats.fail_l4hdr;
+        ctx->stats.fail_ip6ext + ctx->stats.fail_l4hdr +
+        ctx->stats.fail_tunnel;
 
     fail_suptotal =
         ctx->stats.fail_l2loop + ctx->stats.fail_l3type +
@@ -1560,7 +2127,8 @@ void yfDecodeDumpStats(
     fail_snaptotal =
         ctx->stats.fail_l2hdr + ctx->stats.fail_l2shim +
         ctx->stats.fail_ip4hdr + ctx->stats.fail_ip6hdr +
-        ctx->stats.fail_ip6ext + ctx->stats.fail_l4hdr;
+        ctx->stats.fail_ip6ext + ctx->stats.fail_l4hdr +
+        ctx->stats.fail_tunnel;
 
     fail_suptotal =
         ctx->stats.fail_l2loop + ctx->stats.fail_l3type +
@@ -1620,6 +2188,11 @@ void yfDecodeDumpStats(
                         ((double)(ctx->stats.fail_l4frag)/(double)(packetTotal) * 100) );
                 }
             }
+            if (ctx->stats.fail_tunnel) {
+                g_debug("    %u incomplete tunnel headers. (%3.2f%%)",
+                        ctx->stats.fail_tunnel,
+                        ((double)(ctx->stats.fail_tunnel)/(double)(packetTotal) * 100) );
+            }
             g_debug("    (Use a larger snaplen to reduce incomplete headers.)");
         }
 
@@ -58,6 +58,9 @@ static int          qof_detune_alpha = 4;
 /* global quit flag */
 int                 yaf_quit = 0;
 
+/* global checkpoint request flag */
+int                 yaf_checkpoint = 0;
+
 #define THE_LAME_80COL_FORMATTER_STRING "\n\t\t\t\t"
 
 // FIXME refactor all of this into YAML configuration for QoF
@@ -94,6 +97,11 @@ AirOptionEntry yaf_optent_core[] = {
               &qof_yaml_config,
               THE_LAME_80COL_FORMATTER_STRING"Read configuration "
               " from YAML file [./qof.yaml]","file"),
+    AF_OPTION( "checkpoint", (char)0, 0, AF_OPT_TYPE_STRING,
+              &(qfctx.checkpoint),
+              THE_LAME_80COL_FORMATTER_STRING"Save open flows to file on "
+              "SIGTERM/SIGUSR2,"THE_LAME_80COL_FORMATTER_STRING"resume from "
+              "it at startup","file"),
     AF_OPTION_END
 };
 
@@ -257,6 +265,17 @@ static void yfQuit() {
     yaf_quit++;
 }
 
+/**
+ *
+ *
+ *
+ *
+ *
+ */
+static void yfCheckpointRequest() {
+    yaf_checkpoint++;
+}
+
 /**
  *
  *
@@ -281,6 +300,14 @@ static void yfQuitInit() {
     if (sigaction(SIGTERM,&sa,&osa)) {
         g_error("sigaction(SIGTERM) failed: %s", strerror(errno));
     }
+
+    /* install checkpoint request handler */
+    sa.sa_handler = yfCheckpointRequest;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR2,&sa,&osa)) {
+        g_error("sigaction(SIGUSR2) failed: %s", strerror(errno));
+    }
 }
 
 /**
@@ -298,6 +325,7 @@ int main (
 
     /* check structure alignment */
     qfInternalTemplateCheck();
+    yfFlowTabLayoutCheck();
 
     /* zero out context */
     memset(&qfctx, 0, sizeof(qfContext_t));
@@ -24,11 +24,11 @@ void qfAckSegment(qfAck_t *qa,
                   uint32_t ack,
                   uint32_t sack,
                   uint32_t oct,
-                  uint32_t ms)
+                  uint32_t us)
 {
     if (!qa->fan || qfWrapCompare(ack, qa->fan) > 0) {
         qa->fan = ack;
-        qa->fanlms = ms;
+        qa->fanlus = us;
     } else if (!oct) {
         qa->dup_ct++;
     }
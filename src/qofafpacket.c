@@ -0,0 +1,382 @@
+/**
+ * @internal
+ *
+ ** qofafpacket.c
+ ** QoF native Linux AF_PACKET (TPACKET_V3) input support
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C)      2013 Brian Trammell.             All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Authors: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/autoinc.h>
+#include <qof/yafcore.h>
+
+#include "qofafpacket.h"
+
+#if HAVE_LINUX_IF_PACKET_H && HAVE_DECL_TPACKET_V3 && HAVE_DECL_PACKET_FANOUT
+
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <pcap.h>
+
+/* ring geometry: 128 blocks of 256 kB */
+#define QF_AFP_BLOCK_SIZE   (1 << 18)
+#define QF_AFP_BLOCK_COUNT  128
+/* nominal frame size; TPACKET_V3 packs variable-length frames into blocks */
+#define QF_AFP_FRAME_SIZE   2048
+/* how long the kernel holds a partly filled block, in milliseconds */
+#define QF_AFP_BLOCK_TMO    8
+/* how long a read waits for a block, in milliseconds */
+#define QF_AFP_POLL_TMO     100
+
+struct qfAfp_st {
+    int                     fd;
+    uint8_t                 *map;
+    size_t                  map_sz;
+    /* block being read, and how far into it we are */
+    unsigned int            block;
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr     *next;
+    unsigned int            left;
+    /* drops counted so far; the kernel resets its counters on each read */
+    uint64_t                dropped;
+};
+
+static gboolean qfAfpSetError(GError           **err,
+                              const char       *ifname,
+                              const char       *what)
+{
+    g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                "Could not %s on AF_PACKET interface %s: %s",
+                what, ifname, strerror(errno));
+    return FALSE;
+}
+
+/* compile a filter with libpcap and attach it to the socket. An empty
+   expression still truncates packets to the snaplen in the kernel, so
+   only the headers are copied into the ring. */
+static gboolean qfAfpAttachFilter(qfAfp_t       *afp,
+                                  const char    *ifname,
+                                  const char    *bpf,
+                                  int           snaplen,
+                                  GError        **err)
+{
+    pcap_t                  *pcap;
+    struct bpf_program      prog;
+    struct sock_fprog       fprog;
+    int                     rv;
+
+    if (!(pcap = pcap_open_dead(DLT_EN10MB, snaplen))) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Could not initialize BPF compiler");
+        return FALSE;
+    }
+
+    if (pcap_compile(pcap, &prog, (char *)(bpf ? bpf : ""), 1, 0) == -1) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_ARGUMENT,
+                    "Could not compile BPF %s: %s",
+                    bpf ? bpf : "", pcap_geterr(pcap));
+        pcap_close(pcap);
+        return FALSE;
+    }
+
+    /* classic BPF instructions are laid out as the kernel's */
+    fprog.len = prog.bf_len;
+    fprog.filter = (struct sock_filter *)prog.bf_insns;
+    rv = setsockopt(afp->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                    &fprog, sizeof(fprog));
+
+    pcap_freecode(&prog);
+    pcap_close(pcap);
+
+    if (rv == -1) return qfAfpSetError(err, ifname, "attach filter");
+    return TRUE;
+}
+
+qfAfp_t *qfAfpOpen(const char           *ifname,
+                   const char           *bpf,
+                   int                  snaplen,
+                   GError               **err)
+{
+    qfAfp_t                 *afp;
+    struct ifreq            ifr;
+    struct tpacket_req3     req;
+    struct sockaddr_ll      sll;
+    struct packet_mreq      mr;
+    int                     ver = TPACKET_V3;
+
+    if (strlen(ifname) >= IFNAMSIZ) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_ARGUMENT,
+                    "AF_PACKET interface name %s too long", ifname);
+        return NULL;
+    }
+
+    afp = g_new0(qfAfp_t, 1);
+    afp->map = MAP_FAILED;
+
+    /* open the socket without a protocol, so nothing arrives until the
+       filter and ring are in place and it is bound */
+    if ((afp->fd = socket(AF_PACKET, SOCK_RAW, 0)) == -1) {
+        qfAfpSetError(err, ifname, "open socket");
+        goto err;
+    }
+
+    /* find the interface, and make sure it frames packets as Ethernet */
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    if (ioctl(afp->fd, SIOCGIFINDEX, &ifr) == -1) {
+        qfAfpSetError(err, ifname, "find interface");
+        goto err;
+    }
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifr.ifr_ifindex;
+
+    if (ioctl(afp->fd, SIOCGIFHWADDR, &ifr) == -1) {
+        qfAfpSetError(err, ifname, "get link type");
+        goto err;
+    }
+    if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER &&
+        ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK)
+    {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_ARGUMENT,
+                    "AF_PACKET interface %s is not an Ethernet interface",
+                    ifname);
+        goto err;
+    }
+
+    if (setsockopt(afp->fd, SOL_PACKET, PACKET_VERSION,
+                   &ver, sizeof(ver)) == -1)
+    {
+        qfAfpSetError(err, ifname, "select TPACKET_V3");
+        goto err;
+    }
+
+    if (!qfAfpAttachFilter(afp, ifname, bpf, snaplen, err)) goto err;
+
+    /* set up and map the receive ring */
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = QF_AFP_BLOCK_SIZE;
+    req.tp_block_nr = QF_AFP_BLOCK_COUNT;
+    req.tp_frame_size = QF_AFP_FRAME_SIZE;
+    req.tp_frame_nr = (QF_AFP_BLOCK_SIZE / QF_AFP_FRAME_SIZE) *
+                      QF_AFP_BLOCK_COUNT;
+    req.tp_retire_blk_tov = QF_AFP_BLOCK_TMO;
+    if (setsockopt(afp->fd, SOL_PACKET, PACKET_RX_RING,
+                   &req, sizeof(req)) == -1)
+    {
+        qfAfpSetError(err, ifname, "set up receive ring");
+        goto err;
+    }
+
+    afp->map_sz = (size_t)QF_AFP_BLOCK_SIZE * QF_AFP_BLOCK_COUNT;
+    afp->map = mmap(NULL, afp->map_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, afp->fd, 0);
+    if (afp->map == MAP_FAILED) {
+        qfAfpSetError(err, ifname, "map receive ring");
+        goto err;
+    }
+
+    /* start capturing */
+    if (bind(afp->fd, (struct sockaddr *)&sll, sizeof(sll)) == -1) {
+        qfAfpSetError(err, ifname, "bind socket");
+        goto err;
+    }
+
+    memset(&mr, 0, sizeof(mr));
+    mr.mr_ifindex = sll.sll_ifindex;
+    mr.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(afp->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mr, sizeof(mr)) == -1)
+    {
+        qfAfpSetError(err, ifname, "enable promiscuous mode");
+        goto err;
+    }
+
+    g_debug("capturing on %s with a %u kB TPACKET_V3 ring", ifname,
+            (unsigned int)(afp->map_sz / 1024));
+    return afp;
+
+err:
+    qfAfpClose(afp);
+    return NULL;
+}
+
+gboolean qfAfpJoinFanout(qfAfp_t        *afp,
+                         uint16_t       group,
+                         GError         **err)
+{
+    int                     arg;
+
+    /* defragment before hashing, so fragments follow their flow */
+    arg = (int)(group | ((uint32_t)(PACKET_FANOUT_HASH |
+                                    PACKET_FANOUT_FLAG_DEFRAG) << 16));
+    if (setsockopt(afp->fd, SOL_PACKET, PACKET_FANOUT,
+                   &arg, sizeof(arg)) == -1)
+    {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Could not join AF_PACKET fanout group %u: %s",
+                    (unsigned int)group, strerror(errno));
+        return FALSE;
+    }
+
+    g_debug("joined AF_PACKET fanout group %u", (unsigned int)group);
+    return TRUE;
+}
+
+/* wait for the kernel to hand over the next block */
+static int qfAfpWait(qfAfp_t                   *afp,
+                     GError                    **err)
+{
+    struct pollfd           pfd;
+    int                     soerr;
+    socklen_t               len = sizeof(soerr);
+
+    pfd.fd = afp->fd;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, QF_AFP_POLL_TMO) == -1) {
+        if (errno == EINTR) return 0;
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "AF_PACKET poll failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pfd.revents & POLLERR) {
+        if (getsockopt(afp->fd, SOL_SOCKET, SO_ERROR, &soerr, &len) == -1) {
+            soerr = errno;
+        }
+        if (soerr) {
+            g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                        "AF_PACKET socket error: %s", strerror(soerr));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int qfAfpRead(qfAfp_t                   *afp,
+              qfAfpPkt_t                *pkts,
+              unsigned int              max,
+              GError                    **err)
+{
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr     *hdr;
+    unsigned int            count;
+
+    /* give a fully read block back to the kernel */
+    if (afp->bd && !afp->left) {
+        __sync_synchronize();
+        afp->bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        afp->bd = NULL;
+        afp->block = (afp->block + 1) % QF_AFP_BLOCK_COUNT;
+    }
+
+    /* take the next block, if the kernel has retired it */
+    if (!afp->bd) {
+        bd = (struct tpacket_block_desc *)
+             (afp->map + (size_t)afp->block * QF_AFP_BLOCK_SIZE);
+        if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+            if (qfAfpWait(afp, err) == -1) return -1;
+            if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) return 0;
+        }
+        __sync_synchronize();
+        afp->bd = bd;
+        afp->left = bd->hdr.bh1.num_pkts;
+        afp->next = (struct tpacket3_hdr *)
+                    ((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+    }
+
+    /* walk the block */
+    for (count = 0; count < max && afp->left; count++) {
+        hdr = afp->next;
+        pkts[count].pkt = (uint8_t *)hdr + hdr->tp_mac;
+        pkts[count].caplen = hdr->tp_snaplen;
+        pkts[count].ptime_ns = (uint64_t)hdr->tp_sec * 1000000000 +
+                               hdr->tp_nsec;
+        pkts[count].vlan = (hdr->tp_status & TP_STATUS_VLAN_VALID) ?
+                           (hdr->hv1.tp_vlan_tci & 0x0FFF) : 0;
+
+        afp->next = (struct tpacket3_hdr *)
+                    ((uint8_t *)hdr + hdr->tp_next_offset);
+        --afp->left;
+    }
+
+    return (int)count;
+}
+
+uint64_t qfAfpDropped(qfAfp_t           *afp)
+{
+    struct tpacket_stats_v3 st;
+    socklen_t               len = sizeof(st);
+
+    if (getsockopt(afp->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0) {
+        afp->dropped += st.tp_drops;
+    }
+
+    return afp->dropped;
+}
+
+void qfAfpClose(qfAfp_t                 *afp)
+{
+    if (!afp) return;
+    if (afp->map != MAP_FAILED) munmap(afp->map, afp->map_sz);
+    if (afp->fd != -1) close(afp->fd);
+    g_free(afp);
+}
+
+#else
+
+qfAfp_t *qfAfpOpen(const char           *ifname,
+                   const char           *bpf,
+                   int                  snaplen,
+                   GError               **err)
+{
+    g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IMPL,
+                "AF_PACKET capture is not supported on this platform");
+    return NULL;
+}
+
+gboolean qfAfpJoinFanout(qfAfp_t        *afp,
+                         uint16_t       group,
+                         GError         **err)
+{
+    g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IMPL,
+                "AF_PACKET capture is not supported on this platform");
+    return FALSE;
+}
+
+int qfAfpRead(qfAfp_t                   *afp,
+              qfAfpPkt_t                *pkts,
+              unsigned int              max,
+              GError                    **err)
+{
+    return -1;
+}
+
+uint64_t qfAfpDropped(qfAfp_t           *afp)
+{
+    return 0;
+}
+
+void qfAfpClose(qfAfp_t                 *afp) {}
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ * @internal
+ *
+ ** qofafpacket.h
+ ** QoF native Linux AF_PACKET (TPACKET_V3) input support
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C)      2013 Brian Trammell.             All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Authors: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#ifndef _QOF_AFPACKET_H_
+#define _QOF_AFPACKET_H_
+
+#include <qof/autoinc.h>
+
+/** URI prefix selecting native AF_PACKET capture on an interface */
+#define QF_AFP_URI "afpacket:"
+
+/**
+ * An AF_PACKET capture socket with a TPACKET_V3 receive ring mapped into
+ * this process. The kernel fills the ring a block at a time, and hands each
+ * block over when it is full or its timeout expires; packets are read
+ * straight out of the mapped block, without a system call per packet.
+ */
+
+struct qfAfp_st;
+typedef struct qfAfp_st qfAfp_t;
+
+/** A packet in a mapped ring block */
+typedef struct qfAfpPkt_st {
+    /** Start of the Ethernet header */
+    const uint8_t       *pkt;
+    /** Capture time in epoch nanoseconds */
+    uint64_t            ptime_ns;
+    /** Captured length */
+    size_t              caplen;
+    /** VLAN ID stripped from the frame by the interface, or 0 */
+    uint16_t            vlan;
+} qfAfpPkt_t;
+
+/**
+ * Open an AF_PACKET socket on an Ethernet or loopback interface in
+ * promiscuous mode, and map its receive ring.
+ *
+ * @param ifname  interface name
+ * @param bpf     BPF filter expression, or NULL
+ * @param snaplen capture length
+ * @param err     an error description
+ * @return a new capture socket, or NULL on error
+ */
+
+qfAfp_t *qfAfpOpen(const char           *ifname,
+                   const char           *bpf,
+                   int                  snaplen,
+                   GError               **err);
+
+/**
+ * Join a PACKET_FANOUT_HASH group, so that the kernel spreads the
+ * interface's packets among all the sockets in the group by flow hash. Both
+ * directions of a flow, and all fragments of a datagram, go to the same
+ * socket. Sockets in other processes may join the same group.
+ *
+ * @param afp     capture socket
+ * @param group   fanout group ID
+ * @param err     an error description
+ * @return TRUE on success, FALSE otherwise
+ */
+
+gboolean qfAfpJoinFanout(qfAfp_t        *afp,
+                         uint16_t       group,
+                         GError         **err);
+
+/**
+ * Read packets from the ring. Returns the packets of one block at a time,
+ * waiting briefly for the kernel to hand a block over if none is ready.
+ * Packets stay valid until the next call, which returns a block to the
+ * kernel once all its packets have been read.
+ *
+ * @param afp     capture socket
+ * @param pkts    array to fill with packets
+ * @param max     size of pkts
+ * @param err     an error description
+ * @return number of packets read, 0 if none arrived in time, or -1 on error
+ */
+
+int qfAfpRead(qfAfp_t                   *afp,
+              qfAfpPkt_t                *pkts,
+              unsigned int              max,
+              GError                    **err);
+
+/**
+ * Get the number of packets the kernel dropped because the ring was full
+ * since the socket was opened. May be called from any one thread while
+ * another reads.
+ *
+ * @param afp     capture socket
+ * @return total packets dropped
+ */
+
+uint64_t qfAfpDropped(qfAfp_t           *afp);
+
+/**
+ * Unmap a capture socket's ring, close it, and free it.
+ *
+ * @param afp     capture socket to close
+ */
+
+void qfAfpClose(qfAfp_t                 *afp);
+
+#endif
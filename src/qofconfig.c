@@ -19,6 +19,7 @@
 
 #include "qofconfig.h"
 #include "qofltrace.h"
+#include "qofshard.h"
 
 #include <arpa/inet.h>
 
@@ -51,11 +52,27 @@ static qfConfigKeyAction_t cfg_key_actions[] = {
     {"idle-timeout",           CFG_OFF(ito_s), QF_CONFIG_U32},
     {"max-flows",              CFG_OFF(max_flowtab), QF_CONFIG_U32},
     {"max-frags",              CFG_OFF(max_fragtab), QF_CONFIG_U32},
+    {"max-flow-memory",        CFG_OFF(max_flowmem), QF_CONFIG_U64},
+    {"flush-expire-quantum",   CFG_OFF(flush_expire), QF_CONFIG_U32},
+    {"flush-export-quantum",   CFG_OFF(flush_export), QF_CONFIG_U32},
     {"active-timeout-octets",  CFG_OFF(max_flow_oct), QF_CONFIG_U64},
     {"active-timeout-packets", CFG_OFF(max_flow_pkt), QF_CONFIG_U64},
     {"active-timeout-rtts",    CFG_OFF(ato_rtts), QF_CONFIG_U32},
+    {"worker-threads",         CFG_OFF(workers), QF_CONFIG_U32},
+    {"input-threads",          CFG_OFF(readers), QF_CONFIG_U32},
+    {"input-slack",            CFG_OFF(input_slack), QF_CONFIG_U32},
+    {"capture-ring",           CFG_OFF(capture_ring), QF_CONFIG_U32},
+    {"afpacket-fanout",        CFG_OFF(afp_fanout), QF_CONFIG_U32},
+    {"reorder-window",         CFG_OFF(reorder_ms), QF_CONFIG_U32},
     {"force-biflow",           CFG_OFF(enable_biforce), QF_CONFIG_BOOL},
     {"gre-decap",              CFG_OFF(enable_gre), QF_CONFIG_BOOL},
+    {"vxlan-decap",            CFG_OFF(vxlan_port), QF_CONFIG_U32},
+    {"geneve-decap",           CFG_OFF(geneve_port), QF_CONFIG_U32},
+    {"gtpu-decap",             CFG_OFF(gtpu_port), QF_CONFIG_U32},
+    {"qinq-key",               CFG_OFF(enable_qinq_key), QF_CONFIG_BOOL},
+    {"mpls-key",               CFG_OFF(enable_mpls_key), QF_CONFIG_BOOL},
+    {"vlan-partitions",        CFG_OFF(enable_vlan_part), QF_CONFIG_BOOL},
+    {"vlan-max-flows",         CFG_OFF(vlan_max_flows), QF_CONFIG_U32},
     {"silk-compatible",        CFG_OFF(enable_silk), QF_CONFIG_BOOL},
     {NULL, NULL, QF_CONFIG_NOTYPE}
 };
@@ -78,6 +95,8 @@ static qfConfigKeyAction_t cfg_ie_features[] = {
     {"tcpSelAckCount",          CFG_OFF(enable_ack), QF_CONFIG_BOOL},
     {"minTcpRttMilliseconds",   CFG_OFF(enable_rtt), QF_CONFIG_BOOL},
     {"tcpRttMilliseconds",      CFG_OFF(enable_rtt), QF_CONFIG_BOOL},
+    {"minTcpRttMicroseconds",   CFG_OFF(enable_rtt), QF_CONFIG_BOOL},
+    {"lastTcpRttMicroseconds",  CFG_OFF(enable_rtt), QF_CONFIG_BOOL},
     {"tcpLossEventCount",       CFG_OFF(enable_rtt), QF_CONFIG_BOOL},
     {"minTcpRwin",              CFG_OFF(enable_rwin), QF_CONFIG_BOOL},
     {"meanTcpRwin",             CFG_OFF(enable_rwin), QF_CONFIG_BOOL},
@@ -92,6 +111,8 @@ static qfConfigKeyAction_t cfg_ie_features[] = {
     {"meanTcpChirpMilliseconds", CFG_OFF(enable_iat), QF_CONFIG_BOOL},
     {"minTcpRttMilliseconds",   CFG_OFF(enable_tcpopt), QF_CONFIG_BOOL},
     {"tcpRttMilliseconds",      CFG_OFF(enable_tcpopt), QF_CONFIG_BOOL},
+    {"minTcpRttMicroseconds",   CFG_OFF(enable_tcpopt), QF_CONFIG_BOOL},
+    {"lastTcpRttMicroseconds",  CFG_OFF(enable_tcpopt), QF_CONFIG_BOOL},
     {"qofTcpCharacteristics",   CFG_OFF(enable_tcpopt), QF_CONFIG_BOOL},
     {"declaredTcpMss",          CFG_OFF(enable_tcpopt), QF_CONFIG_BOOL},
     {"minTcpRwin",              CFG_OFF(enable_tcpopt), QF_CONFIG_BOOL},
@@ -820,6 +841,11 @@ void qfConfigDefaults(qfConfig_t           *cfg,
     cfg->max_flow_pkt = 0;              /* no max packet */
     cfg->max_flow_oct = 0;              /* no max octet count */
     cfg->ato_rtts = 0;                  /* no RTT-based ATO */
+    cfg->readers = 0;                   /* read packets inline */
+    cfg->input_slack = 0;               /* the larger of default and reorder */
+    cfg->capture_ring = 0;              /* capture packets inline */
+    cfg->afp_fanout = 0;                /* capture the whole interface */
+    cfg->reorder_ms = 0;                /* no reordering */
     octx->rotate_period = 0;            /* no output rotation by default */
     octx->template_rtx_period = 0;      /* no template retransmit by default */
     octx->stats_period = 0;             /* no stats transmit by default */
@@ -944,9 +970,31 @@ static void qfContextSetupInput(qfContext_t *ctx) {
 
     /* open packet source or die */
     ctx->ictx.pktsrc = qfTraceOpen(ctx->ictx.inuri, ctx->ictx.bpf_expr,
-                                   kQfSnaplen, &ctx->err);
+                                   kQfSnaplen, ctx->cfg.readers, &ctx->err);
     if (!ctx->ictx.pktsrc) qfContextTerminate(ctx);
 
+    /* hold quiet readers back long enough for packets delivered late;
+       by default, at least as long as the reorder window */
+    if (ctx->cfg.input_slack) {
+        qfTraceSetReaderSlack(ctx->ictx.pktsrc, ctx->cfg.input_slack);
+    } else if (ctx->cfg.reorder_ms > QF_TRACE_READER_SLACK) {
+        qfTraceSetReaderSlack(ctx->ictx.pktsrc, ctx->cfg.reorder_ms);
+    }
+
+    /* share the interface with other processes if asked to */
+    if (ctx->cfg.afp_fanout) {
+        if (ctx->cfg.afp_fanout > UINT16_MAX) {
+            air_opterr("afpacket-fanout group must be between 1 and %u",
+                       UINT16_MAX);
+        }
+        if (!qfTraceJoinFanout(ctx->ictx.pktsrc,
+                               (uint16_t)ctx->cfg.afp_fanout, &ctx->err))
+        {
+            qfTraceClose(ctx->ictx.pktsrc);
+            qfContextTerminate(ctx);
+        }
+    }
+
 }
 
 void qfContextSetup(qfContext_t *ctx) {
@@ -970,9 +1018,6 @@ void qfContextSetup(qfContext_t *ctx) {
     qfContextSetupOutput(ctx);
     
     /* set up everything in the middle */
-    /* allocate ring buffer */
-    ctx->pbufring = rgaAlloc(sizeof(yfPBuf_t), 128);
-    
     /* Determine packet type to decode */
     if (!ctx->cfg.enable_ipv6) {
         reqtype = YF_TYPE_IPv4;
@@ -985,30 +1030,104 @@ void qfContextSetup(qfContext_t *ctx) {
                                   ctx->cfg.enable_tcpopt,
                                   ctx->cfg.enable_gre);
 
-    /* Allocate flow table */
-    ctx->flowtab = yfFlowTabAlloc(ctx->cfg.ito_s * 1000,
-                                  ctx->cfg.ato_s * 1000,
-                                  ctx->cfg.max_flowtab,
-                                  !ctx->cfg.enable_biflow,
-                                  ctx->cfg.enable_silk,
-                                  ctx->cfg.enable_mac,
-                                  ctx->cfg.enable_seq,
-                                  ctx->cfg.enable_ack,
-                                  ctx->cfg.enable_rtt,
-                                  ctx->cfg.enable_rwin,
-                                  ctx->cfg.enable_tcpopt,
-                                  ctx->cfg.enable_ts,
-                                  ctx->cfg.enable_iat);
-    
-    /* Allocate fragment table */
-    if (ctx->cfg.max_fragtab) {
-        ctx->fragtab = yfFragTabAlloc(30000, ctx->cfg.max_fragtab);
+    /* Decapsulate UDP tunnels if asked to */
+    if (ctx->cfg.vxlan_port > UINT16_MAX ||
+        ctx->cfg.geneve_port > UINT16_MAX ||
+        ctx->cfg.gtpu_port > UINT16_MAX)
+    {
+        air_opterr("tunnel decap ports must be 0 (disabled) to %u",
+                   UINT16_MAX);
+    }
+#if !QOF_ENABLE_TUNNEL_KEYS
+    if (ctx->cfg.vxlan_port || ctx->cfg.geneve_port || ctx->cfg.gtpu_port) {
+        air_opterr("vxlan-decap, geneve-decap and gtpu-decap require QoF "
+                   "built with --enable-tunnel-keys");
+    }
+#endif
+    yfDecodeCtxSetTunnelPorts(ctx->dectx, (uint16_t)ctx->cfg.vxlan_port,
+                              (uint16_t)ctx->cfg.geneve_port,
+                              (uint16_t)ctx->cfg.gtpu_port);
+
+    /* Key flows on stacked VLAN tags and MPLS labels if asked to */
+#if !QOF_ENABLE_L2_KEYS
+    if (ctx->cfg.enable_qinq_key || ctx->cfg.enable_mpls_key) {
+        air_opterr("qinq-key and mpls-key require QoF built with "
+                   "--enable-l2-keys");
+    }
+#endif
+    yfDecodeCtxSetL2Keys(ctx->dectx, ctx->cfg.enable_qinq_key,
+                         ctx->cfg.enable_mpls_key);
+
+    /* Decode only what the template's information elements need */
+    yfDecodeCtxSetFields(ctx->dectx, ctx->cfg.enable_mac,
+                         ctx->cfg.enable_seq || ctx->cfg.enable_ack ||
+                         ctx->cfg.enable_rtt || ctx->cfg.enable_rwin ||
+                         ctx->cfg.enable_ts || ctx->cfg.enable_iat);
+
+    /* Allocate reorder buffer */
+    if (ctx->cfg.reorder_ms) {
+        ctx->ictx.reorder = qfReorderAlloc(ctx->cfg.reorder_ms);
     }
 
-    /* FIXME need to re-add configuration of dynamics */
+    if (ctx->cfg.workers > 1) {
+        /* Hand flow metering to worker threads */
+        ctx->shards = qfShardSetAlloc(&ctx->cfg, ctx->cfg.workers);
+        if (ctx->checkpoint) {
+            g_warning("flow table checkpoint not supported "
+                      "with worker threads; ignoring");
+            ctx->checkpoint = NULL;
+        }
+    } else {
+        /* allocate ring buffer */
+        ctx->pbufring = rgaAlloc(sizeof(yfPBuf_t), 128);
+
+        /* Allocate flow table */
+        ctx->flowtab = yfFlowTabAlloc(ctx->cfg.ito_s * 1000,
+                                      ctx->cfg.ato_s * 1000,
+                                      ctx->cfg.max_flow_oct,
+                                      ctx->cfg.max_flow_pkt,
+                                      ctx->cfg.ato_rtts,
+                                      ctx->cfg.max_flowtab,
+                                      !ctx->cfg.enable_biflow,
+                                      ctx->cfg.enable_silk,
+                                      ctx->cfg.enable_mac,
+                                      ctx->cfg.enable_seq,
+                                      ctx->cfg.enable_ack,
+                                      ctx->cfg.enable_rtt,
+                                      ctx->cfg.enable_rwin,
+                                      ctx->cfg.enable_tcpopt,
+                                      ctx->cfg.enable_ts,
+                                      ctx->cfg.enable_iat);
+        yfFlowTabSetMemoryLimit(ctx->flowtab, ctx->cfg.max_flowmem);
+        yfFlowTabSetFlushQuanta(ctx->flowtab, ctx->cfg.flush_expire,
+                                ctx->cfg.flush_export);
+        if (ctx->cfg.enable_vlan_part || ctx->cfg.vlan_max_flows) {
+            yfFlowTabSetVlanPartitions(ctx->flowtab, ctx->cfg.vlan_max_flows);
+        }
+
+        /* Resume flows from a checkpoint if there is one */
+        if (ctx->checkpoint &&
+            g_file_test(ctx->checkpoint, G_FILE_TEST_EXISTS))
+        {
+            if (yfFlowTabRestore(ctx->flowtab, ctx->checkpoint, &ctx->err)) {
+                unlink(ctx->checkpoint);
+            } else {
+                g_warning("not restoring flows: %s", ctx->err->message);
+                g_clear_error(&ctx->err);
+            }
+        }
+
+        /* Allocate fragment table */
+        if (ctx->cfg.max_fragtab) {
+            ctx->fragtab = yfFragTabAlloc(30000, ctx->cfg.max_fragtab);
+        }
+    }
 }
 
 void qfContextTeardown(qfContext_t *ctx) {
+    if (ctx->shards) {
+        qfShardSetFree(ctx->shards);
+    }
     if (ctx->fragtab) {
         yfFragTabFree(ctx->fragtab);
     }
@@ -1021,9 +1140,20 @@ void qfContextTeardown(qfContext_t *ctx) {
     if (ctx->pbufring) {
         rgaFree(ctx->pbufring);
     }
+    if (ctx->ictx.reorder) {
+        qfReorderFree(ctx->ictx.reorder);
+    }
 
 }
 
+uint64_t qfContextCurrentTime(qfContext_t *ctx) {
+    if (ctx->shards) {
+        return qfShardCurrentTime(ctx->shards);
+    } else {
+        return yfFlowTabCurrentTime(ctx->flowtab);
+    }
+}
+
 void qfContextTerminate(qfContext_t *ctx) {
     g_warning("qof terminating on error: %s", ctx->err->message);
     exit(1);
@@ -13,6 +13,7 @@
 #include <airframe/airlock.h>
 
 #include "qofdetune.h"
+#include "qofreorder.h"
 
 typedef struct qfConfig_st {
     /* Features enabled by template selection */
@@ -33,14 +34,30 @@ typedef struct qfConfig_st {
     gboolean    enable_silk;    // SiLK compatibility mode
     gboolean    enable_gre;     // GRE decap mode
     gboolean    enable_biforce; // force biflow export
+    gboolean    enable_qinq_key; // key flows on outer VLAN tag
+    gboolean    enable_mpls_key; // key flows on top MPLS label
+    gboolean    enable_vlan_part; // partition flow table by VLAN
     /* Flow state configuration */
     uint32_t    ato_s;
     uint32_t    ito_s;
     uint32_t    max_flowtab;
     uint32_t    max_fragtab;
+    uint64_t    max_flowmem;      // flow table memory limit in bytes
+    uint32_t    flush_expire;     // flows expired per incremental flush
+    uint32_t    flush_export;     // flows exported per incremental flush
     uint64_t    max_flow_pkt;     // max packet count to force ATO (silk mode)
     uint64_t    max_flow_oct;     // max octet count to force ATO  (silk mode)
     uint32_t    ato_rtts;         // multiple of RTT to force ATO
+    uint32_t    workers;          // flow metering threads (0/1 = inline)
+    uint32_t    readers;          // libtrace reader threads (0/1 = inline)
+    uint32_t    input_slack;      // reader clock slack in ms (0 = default)
+    uint32_t    capture_ring;     // capture thread ring size (0 = inline)
+    uint32_t    afp_fanout;       // AF_PACKET fanout group (0 = none)
+    uint32_t    reorder_ms;       // reorder window in ms (0 = none)
+    uint32_t    vxlan_port;       // VXLAN decap UDP port (0 = none)
+    uint32_t    geneve_port;      // Geneve decap UDP port (0 = none)
+    uint32_t    gtpu_port;        // GTP-U decap UDP port (0 = none)
+    uint32_t    vlan_max_flows;   // flow limit per VLAN (0 = none)
     /* Interface map */
     qfIfMap_t           ifmap;
     /* Internal networks */
@@ -49,6 +66,7 @@ typedef struct qfConfig_st {
 } qfConfig_t;
 
 struct qfTraceSource_t;
+struct qfShardSet_st;
 
 typedef struct qfInputContext_st {
     /** Input specifier */
@@ -61,6 +79,8 @@ typedef struct qfInputContext_st {
     /** Packet detuner */
     qofDetune_t     *detune;
 #endif
+    /** Reorder buffer, if reordering packets */
+    qfReorder_t     *reorder;
 } qfInputContext_t;
 
 typedef struct qfOutputContext_st {
@@ -109,6 +129,10 @@ typedef struct qfContext_st {
     yfFlowTab_t         *flowtab;
     /** Fragment table */
     yfFragTab_t         *fragtab;
+    /** Flow metering shards (replace flowtab and fragtab if present) */
+    struct qfShardSet_st *shards;
+    /** Flow table checkpoint file, for warm restart */
+    char                *checkpoint;
     /** Error description */
     GError              *err;
 } qfContext_t;
@@ -129,4 +153,6 @@ void qfContextTeardown(qfContext_t        *ctx);
 
 void qfContextTerminate(qfContext_t *ctx);
 
+uint64_t qfContextCurrentTime(qfContext_t *ctx);
+
 #endif
@@ -0,0 +1,572 @@
+/**
+ ** @file qofflowidx.c
+ **
+ ** Flow key index, based on bucketized open addressing.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/qofflowidx.h>
+#include <qof/decode.h>
+
+/* fill buckets to a cache line: 4 + 4 * slots + ptr * slots <= 64 */
+#define QF_FLOWIDX_LINE     64
+#if GLIB_SIZEOF_VOID_P == 8
+#define QF_FLOWIDX_SLOTS    5
+#else
+#define QF_FLOWIDX_SLOTS    7
+#endif
+
+/* minimum bucket count, must be a power of two; the mask must stay clear
+   of QF_FLOWIDX_REV, which limits the index to 2^31 buckets */
+#define QF_FLOWIDX_MIN      64
+
+/* grow when more than 3/4 of all slots are full */
+#define QF_FLOWIDX_FULL(_b_) (((_b_) * QF_FLOWIDX_SLOTS * 3) / 4)
+
+typedef struct qfFlowIdxBucket_st {
+    /** canonical hash of the key in each slot, with orientation bit */
+    uint32_t    tag[QF_FLOWIDX_SLOTS];
+    /** number of entries whose home bucket precedes this one but probed
+        past it */
+    uint32_t    overflow;
+    /** node in each slot, NULL if slot empty */
+    void        *node[QF_FLOWIDX_SLOTS];
+} qfFlowIdxBucket_t;
+
+struct qfFlowIdx_st {
+    /* bucket array, aligned to cache line */
+    qfFlowIdxBucket_t   *buckets;
+    /* base of bucket array allocation */
+    uint8_t             *base;
+    size_t              base_sz;
+    /* bucket count - 1; bucket count is a power of two */
+    size_t              mask;
+    /* number of indexed nodes */
+    size_t              count;
+    /* number of nodes at which to grow */
+    size_t              grow_count;
+    /* offset of flow key within node */
+    size_t              key_offset;
+    /* probe statistics */
+    uint64_t            stat_lookups;
+    uint64_t            stat_probes;
+    uint32_t            stat_max_probe;
+    uint64_t            stat_hist[QF_FLOWIDX_HIST];
+};
+
+#define QF_SIP_ROTL(_x_, _b_) (((_x_) << (_b_)) | ((_x_) >> (64 - (_b_))))
+
+#define QF_SIP_ROUND(_v0_, _v1_, _v2_, _v3_) {                  \
+    _v0_ += _v1_; _v1_ = QF_SIP_ROTL(_v1_, 13); _v1_ ^= _v0_;   \
+    _v0_ = QF_SIP_ROTL(_v0_, 32);                               \
+    _v2_ += _v3_; _v3_ = QF_SIP_ROTL(_v3_, 16); _v3_ ^= _v2_;   \
+    _v0_ += _v3_; _v3_ = QF_SIP_ROTL(_v3_, 21); _v3_ ^= _v0_;   \
+    _v2_ += _v1_; _v1_ = QF_SIP_ROTL(_v1_, 17); _v1_ ^= _v2_;   \
+    _v2_ = QF_SIP_ROTL(_v2_, 32);                               \
+}
+
+/* SipHash-1-3 over whole 64-bit words, fed one word at a time so a
+   prefix of the message can be finalized on its own */
+typedef struct qfSipState_st {
+    uint64_t            v0, v1, v2, v3;
+} qfSipState_t;
+
+static inline void qfSipInit(qfSipState_t       *s,
+                             uint64_t           k0,
+                             uint64_t           k1)
+{
+    s->v0 = k0 ^ 0x736f6d6570736575ULL;
+    s->v1 = k1 ^ 0x646f72616e646f6dULL;
+    s->v2 = k0 ^ 0x6c7967656e657261ULL;
+    s->v3 = k1 ^ 0x7465646279746573ULL;
+}
+
+static inline void qfSipWord(qfSipState_t       *s,
+                             uint64_t           m)
+{
+    s->v3 ^= m;
+    QF_SIP_ROUND(s->v0, s->v1, s->v2, s->v3);
+    s->v0 ^= m;
+}
+
+static inline uint64_t qfSipFinal(qfSipState_t  s,
+                                  unsigned      mlen)
+{
+    uint64_t            b = ((uint64_t)(mlen * 8)) << 56;
+
+    s.v3 ^= b;
+    QF_SIP_ROUND(s.v0, s.v1, s.v2, s.v3);
+    s.v0 ^= b;
+
+    s.v2 ^= 0xff;
+    QF_SIP_ROUND(s.v0, s.v1, s.v2, s.v3);
+    QF_SIP_ROUND(s.v0, s.v1, s.v2, s.v3);
+    QF_SIP_ROUND(s.v0, s.v1, s.v2, s.v3);
+
+    return s.v0 ^ s.v1 ^ s.v2 ^ s.v3;
+}
+
+/* a single round finalizes a prefix well enough to spread packets over
+   shards and fragment table buckets, at a quarter the cost */
+static inline uint64_t qfSipFinalLight(qfSipState_t s)
+{
+    s.v2 ^= 0xff;
+    QF_SIP_ROUND(s.v0, s.v1, s.v2, s.v3);
+
+    return s.v0 ^ s.v1 ^ s.v2 ^ s.v3;
+}
+
+/* hash seed, shared by every index and decoder in the process */
+static gsize    qf_hash_seeded = 0;
+static uint64_t qf_hash_k0;
+static uint64_t qf_hash_k1;
+
+static inline void qfFlowKeyHashV6(qfSipState_t     *s,
+                                   const uint8_t    *addr)
+{
+    uint64_t            w[2];
+
+    memcpy(w, addr, sizeof(w));
+    qfSipWord(s, w[0]);
+    qfSipWord(s, w[1]);
+}
+
+static gboolean qfFlowKeyIsReverse(yfFlowKey_t      *key)
+{
+    int                 c;
+
+    /* order by address */
+    if (key->version == 4) {
+        if (key->addr.v4.sip != key->addr.v4.dip) {
+            return key->addr.v4.sip > key->addr.v4.dip;
+        }
+    } else {
+        if ((c = memcmp(key->addr.v6.sip, key->addr.v6.dip,
+                        sizeof(key->addr.v6.sip))))
+        {
+            return c > 0;
+        }
+    }
+
+    /* same address at both ends; order by port, except for ICMP */
+    if (key->proto == YF_PROTO_ICMP || key->proto == YF_PROTO_ICMP6) {
+        return FALSE;
+    }
+    return key->sp > key->dp;
+}
+
+#define QF_FLOWIDX_KEY(_idx_, _node_) \
+    ((yfFlowKey_t *)(((uint8_t *)(_node_)) + (_idx_)->key_offset))
+
+static inline gboolean qfFlowIdxKeyEqual(yfFlowKey_t       *a,
+                                         yfFlowKey_t       *b)
+{
+    /* compare header fields first; these lead the key */
+    if ((a->sp != b->sp) || (a->dp != b->dp) ||
+        (a->proto != b->proto) || (a->version != b->version) ||
+        ((a->vlanId ^ b->vlanId) & 0x0FFF))
+    {
+        return FALSE;
+    }
+
+#if QOF_ENABLE_TUNNEL_KEYS
+    if (a->tunnelId != b->tunnelId) {
+        return FALSE;
+    }
+#endif
+
+#if QOF_ENABLE_L2_KEYS
+    if ((a->mplsLabel != b->mplsLabel) || (a->outerVlanId != b->outerVlanId)) {
+        return FALSE;
+    }
+#endif
+
+#if YAF_ENABLE_DAG_SEPARATE_INTERFACES || YAF_ENABLE_NAPATECH_SEPARATE_INTERFACES
+    if (a->netIf != b->netIf) {
+        return FALSE;
+    }
+#endif
+
+    /* IPv4 keys compare two words; don't touch the rest of a compact key */
+    if (a->version == 4) {
+        return (a->addr.v4.sip == b->addr.v4.sip) &&
+               (a->addr.v4.dip == b->addr.v4.dip);
+    }
+
+    /* IPv6 source and destination are contiguous */
+    return memcmp(a->addr.v6.sip, b->addr.v6.sip,
+                  sizeof(a->addr.v6.sip) + sizeof(a->addr.v6.dip)) == 0;
+}
+
+static inline gboolean qfFlowIdxKeyEqualReverse(yfFlowKey_t       *a,
+                                                yfFlowKey_t       *b)
+{
+    if ((a->proto != b->proto) || (a->version != b->version) ||
+        ((a->vlanId ^ b->vlanId) & 0x0FFF))
+    {
+        return FALSE;
+    }
+
+#if QOF_ENABLE_TUNNEL_KEYS
+    if (a->tunnelId != b->tunnelId) {
+        return FALSE;
+    }
+#endif
+
+    /* ICMP type and code don't reverse; see yfFlowKeyReverse() */
+    if (a->proto == YF_PROTO_ICMP || a->proto == YF_PROTO_ICMP6) {
+        if ((a->sp != b->sp) || (a->dp != b->dp)) return FALSE;
+    } else {
+        if ((a->sp != b->dp) || (a->dp != b->sp)) return FALSE;
+    }
+
+#if QOF_ENABLE_L2_KEYS
+    if ((a->mplsLabel != b->mplsLabel) || (a->outerVlanId != b->outerVlanId)) {
+        return FALSE;
+    }
+#endif
+
+#if YAF_ENABLE_DAG_SEPARATE_INTERFACES || YAF_ENABLE_NAPATECH_SEPARATE_INTERFACES
+    if (a->netIf != b->netIf) {
+        return FALSE;
+    }
+#endif
+
+    if (a->version == 4) {
+        return (a->addr.v4.sip == b->addr.v4.dip) &&
+               (a->addr.v4.dip == b->addr.v4.sip);
+    }
+
+    return (memcmp(a->addr.v6.sip, b->addr.v6.dip,
+                   sizeof(a->addr.v6.sip)) == 0) &&
+           (memcmp(a->addr.v6.dip, b->addr.v6.sip,
+                   sizeof(a->addr.v6.dip)) == 0);
+}
+
+static qfFlowIdxBucket_t *qfFlowIdxBucketAlloc(size_t          bucket_count,
+                                               uint8_t         **base,
+                                               size_t          *base_sz)
+{
+    uintptr_t           aligned;
+
+    /* overallocate by a line so we can align the buckets to one */
+    *base_sz = bucket_count * sizeof(qfFlowIdxBucket_t) + QF_FLOWIDX_LINE;
+    *base = g_malloc0(*base_sz);
+
+    aligned = ((uintptr_t)*base + QF_FLOWIDX_LINE - 1) &
+              ~((uintptr_t)QF_FLOWIDX_LINE - 1);
+
+    return (qfFlowIdxBucket_t *)aligned;
+}
+
+static uint32_t qfFlowIdxPlace(qfFlowIdxBucket_t   *buckets,
+                               size_t              mask,
+                               void                *node,
+                               uint32_t            hash)
+{
+    qfFlowIdxBucket_t   *bucket;
+    size_t              b = hash & mask;
+    uint32_t            probes = 0;
+    unsigned            i;
+
+    for (;;) {
+        bucket = &buckets[b];
+        ++probes;
+        for (i = 0; i < QF_FLOWIDX_SLOTS; i++) {
+            if (!bucket->node[i]) {
+                bucket->tag[i] = hash;
+                bucket->node[i] = node;
+                return probes;
+            }
+        }
+
+        /* bucket full; note overflow and probe the next one */
+        bucket->overflow++;
+        b = (b + 1) & mask;
+    }
+}
+
+static void qfFlowIdxGrow(qfFlowIdx_t      *idx)
+{
+    qfFlowIdxBucket_t   *old_buckets = idx->buckets;
+    uint8_t             *old_base = idx->base;
+    size_t              old_count = idx->mask + 1;
+    size_t              new_count = old_count * 2;
+    size_t              b;
+    unsigned            i;
+
+    idx->buckets = qfFlowIdxBucketAlloc(new_count, &idx->base, &idx->base_sz);
+    idx->mask = new_count - 1;
+    idx->grow_count = QF_FLOWIDX_FULL(new_count);
+
+    /* tags are full hashes, so we can rehash without touching the nodes */
+    for (b = 0; b < old_count; b++) {
+        for (i = 0; i < QF_FLOWIDX_SLOTS; i++) {
+            if (old_buckets[b].node[i]) {
+                qfFlowIdxPlace(idx->buckets, idx->mask,
+                               old_buckets[b].node[i], old_buckets[b].tag[i]);
+            }
+        }
+    }
+
+    g_free(old_base);
+}
+
+qfFlowIdx_t *qfFlowIdxAlloc(size_t          key_offset,
+                            size_t          size_hint)
+{
+    qfFlowIdx_t         *idx = yg_slice_new0(qfFlowIdx_t);
+    size_t              bucket_count = QF_FLOWIDX_MIN;
+
+    /* size for the hint without growing */
+    while (QF_FLOWIDX_FULL(bucket_count) < size_hint) {
+        bucket_count *= 2;
+    }
+
+    idx->buckets = qfFlowIdxBucketAlloc(bucket_count, &idx->base, &idx->base_sz);
+    idx->mask = bucket_count - 1;
+    idx->grow_count = QF_FLOWIDX_FULL(bucket_count);
+    idx->key_offset = key_offset;
+
+    return idx;
+}
+
+uint32_t qfFlowKeyHash(yfFlowKey_t      *key,
+                       uint32_t         *pairhash)
+{
+    qfSipState_t        s;
+    uint64_t            w;
+    unsigned            mlen;
+    gboolean            rev = qfFlowKeyIsReverse(key);
+    uint16_t            lp = key->sp, hp = key->dp;
+    uint32_t            h;
+
+    /* pick a seed once per process; glib seeds its generator from
+       /dev/urandom */
+    if (g_once_init_enter(&qf_hash_seeded)) {
+        qf_hash_k0 = ((uint64_t)g_random_int() << 32) | g_random_int();
+        qf_hash_k1 = ((uint64_t)g_random_int() << 32) | g_random_int();
+        g_once_init_leave(&qf_hash_seeded, 1);
+    }
+    qfSipInit(&s, qf_hash_k0, qf_hash_k1);
+
+    /* addresses first, lower endpoint first */
+    if (key->version == 4) {
+        if (rev) {
+            qfSipWord(&s, ((uint64_t)key->addr.v4.dip << 32) |
+                          key->addr.v4.sip);
+        } else {
+            qfSipWord(&s, ((uint64_t)key->addr.v4.sip << 32) |
+                          key->addr.v4.dip);
+        }
+        mlen = 1;
+    } else {
+        qfFlowKeyHashV6(&s, rev ? key->addr.v6.dip : key->addr.v6.sip);
+        qfFlowKeyHashV6(&s, rev ? key->addr.v6.sip : key->addr.v6.dip);
+        mlen = 4;
+    }
+
+#if QOF_ENABLE_TUNNEL_KEYS
+    /* tunnelled flows hash one more word */
+    if (key->tunnelId) {
+        qfSipWord(&s, key->tunnelId);
+        mlen++;
+    }
+#endif
+#if QOF_ENABLE_L2_KEYS
+    /* as do flows keyed on an outer VLAN or an MPLS label */
+    if (key->mplsLabel || key->outerVlanId) {
+        qfSipWord(&s, ((uint64_t)key->mplsLabel << 16) | key->outerVlanId);
+        mlen++;
+    }
+#endif
+
+    /* every fragment of a packet shares the hash so far */
+    if (pairhash) *pairhash = (uint32_t)qfSipFinalLight(s);
+
+    /* last word holds ports, in canonical order, and everything else;
+       ICMP type/code never reverse */
+    if (rev && key->proto != YF_PROTO_ICMP && key->proto != YF_PROTO_ICMP6) {
+        lp = key->dp;
+        hp = key->sp;
+    }
+    w = ((uint64_t)lp << 48) | ((uint64_t)hp << 32) |
+        ((uint64_t)key->proto << 24) | ((uint64_t)key->version << 16) |
+        (0x0FFF & key->vlanId);
+#if YAF_ENABLE_DAG_SEPARATE_INTERFACES || YAF_ENABLE_NAPATECH_SEPARATE_INTERFACES
+    w |= (uint64_t)key->netIf << 12;
+#endif
+    qfSipWord(&s, w);
+    h = (uint32_t)qfSipFinal(s, mlen + 1);
+
+    return rev ? (h | QF_FLOWIDX_REV) : (h & ~QF_FLOWIDX_REV);
+}
+
+void qfFlowIdxFree(qfFlowIdx_t          *idx)
+{
+    g_free(idx->base);
+    yg_slice_free(qfFlowIdx_t, idx);
+}
+
+static inline void qfFlowIdxCountProbes(qfFlowIdx_t     *idx,
+                                        uint32_t        probes)
+{
+    idx->stat_probes += probes;
+    ++(idx->stat_hist[probes > 4 ? 3 : (probes > 2 ? 2 : probes - 1)]);
+    if (probes > idx->stat_max_probe) {
+        idx->stat_max_probe = probes;
+    }
+}
+
+void *qfFlowIdxLookup(qfFlowIdx_t       *idx,
+                      yfFlowKey_t       *key,
+                      uint32_t          hash,
+                      gboolean          *reverse)
+{
+    qfFlowIdxBucket_t   *bucket;
+    yfFlowKey_t         *nkey;
+    size_t              b = hash & idx->mask;
+    uint32_t            diff;
+    uint32_t            probes;
+    unsigned            i;
+
+    ++(idx->stat_lookups);
+
+    for (probes = 1;; probes++) {
+        bucket = &idx->buckets[b];
+        for (i = 0; i < QF_FLOWIDX_SLOTS; i++) {
+            diff = bucket->tag[i] ^ hash;
+            if ((diff & ~QF_FLOWIDX_REV) || !bucket->node[i]) {
+                continue;
+            }
+
+            /* orientation bits tell us which way round to compare */
+            nkey = QF_FLOWIDX_KEY(idx, bucket->node[i]);
+            if (diff & QF_FLOWIDX_REV) {
+                if (qfFlowIdxKeyEqualReverse(key, nkey)) {
+                    *reverse = TRUE;
+                    qfFlowIdxCountProbes(idx, probes);
+                    return bucket->node[i];
+                }
+            } else {
+                if (qfFlowIdxKeyEqual(key, nkey)) {
+                    *reverse = FALSE;
+                    qfFlowIdxCountProbes(idx, probes);
+                    return bucket->node[i];
+                }
+            }
+        }
+
+        /* nothing ever probed past this bucket, so we're done */
+        if (!bucket->overflow) {
+            qfFlowIdxCountProbes(idx, probes);
+            return NULL;
+        }
+        b = (b + 1) & idx->mask;
+    }
+}
+
+void qfFlowIdxInsert(qfFlowIdx_t        *idx,
+                     void               *node,
+                     uint32_t           hash)
+{
+    uint32_t            probes;
+
+    if (idx->count >= idx->grow_count) {
+        qfFlowIdxGrow(idx);
+    }
+
+    probes = qfFlowIdxPlace(idx->buckets, idx->mask, node, hash);
+    if (probes > idx->stat_max_probe) {
+        idx->stat_max_probe = probes;
+    }
+    ++(idx->count);
+}
+
+gboolean qfFlowIdxRemove(qfFlowIdx_t    *idx,
+                         void           *node,
+                         uint32_t       hash)
+{
+    qfFlowIdxBucket_t   *bucket;
+    size_t              home = hash & idx->mask;
+    size_t              b = home;
+    unsigned            i;
+
+    /* find the node */
+    for (;;) {
+        bucket = &idx->buckets[b];
+        for (i = 0; i < QF_FLOWIDX_SLOTS; i++) {
+            if (bucket->node[i] == node) {
+                goto found;
+            }
+        }
+        if (!bucket->overflow) {
+            return FALSE;
+        }
+        b = (b + 1) & idx->mask;
+    }
+
+found:
+    bucket->node[i] = NULL;
+    bucket->tag[i] = 0;
+    --(idx->count);
+
+    /* undo overflow counts along the probe path */
+    while (home != b) {
+        idx->buckets[home].overflow--;
+        home = (home + 1) & idx->mask;
+    }
+
+    return TRUE;
+}
+
+void qfFlowIdxForEach(qfFlowIdx_t       *idx,
+                      qfFlowIdxIter_fn  fn,
+                      void              *ctx)
+{
+    qfFlowIdxBucket_t   *b;
+    size_t              i;
+    unsigned            s;
+
+    for (i = 0; i <= idx->mask; i++) {
+        b = &idx->buckets[i];
+        for (s = 0; s < QF_FLOWIDX_SLOTS; s++) {
+            if (b->node[s]) fn(b->node[s], ctx);
+        }
+    }
+}
+
+size_t qfFlowIdxCount(qfFlowIdx_t       *idx)
+{
+    return idx->count;
+}
+
+void qfFlowIdxStats(qfFlowIdx_t         *idx,
+                    uint64_t            *lookups,
+                    uint64_t            *probes,
+                    uint32_t            *max_probe)
+{
+    *lookups = idx->stat_lookups;
+    *probes = idx->stat_probes;
+    *max_probe = idx->stat_max_probe;
+}
+
+void qfFlowIdxProbeHist(qfFlowIdx_t     *idx,
+                        uint64_t        hist[QF_FLOWIDX_HIST])
+{
+    memcpy(hist, idx->stat_hist, sizeof(idx->stat_hist));
+}
+
+size_t qfFlowIdxCapacity(qfFlowIdx_t    *idx)
+{
+    return (idx->mask + 1) * QF_FLOWIDX_SLOTS;
+}
@@ -25,36 +25,380 @@
 #include "yafstat.h"
 
 #include "qofltrace.h"
+#include "qofafpacket.h"
 #include "qofdetune.h"
+#include "qofreorder.h"
+#include "qofshard.h"
+
+#include <unistd.h>
 
 #define TRACE_PACKET_GROUP 32
+/* how many packets ahead of the decoder to prefetch headers */
+#define TRACE_PREFETCH_AHEAD 4
+/* how long the flow stage sleeps when the capture ring is empty, in us */
+#define TRACE_CAPTURE_IDLE 100
+/* how often the capture thread samples libtrace's drop count, in packet
+   time, in ns */
+#define TRACE_CAPTURE_STATS 1000000000ULL
+
+/* decoded packets per reader batch */
+#define TRACE_READER_BATCH 256
+/* batches per reader; bounds how far a reader runs ahead of the flow stage */
+#define TRACE_READER_DEPTH 64
+/* reader tick interval, which bounds how long a partial batch waits, and
+   how long the flow stage waits for a reader, in milliseconds */
+#define TRACE_READER_TICK  10
+/* batches per trace file read from a directory or glob */
+#define TRACE_FILE_DEPTH   16
+/* tells a trace file reader thread to stop */
+#define TRACE_FILE_STOP    G_MAXUINT
 
 /* Quit flag support */
 extern int yaf_quit;
 
-/* Statistics */
-static uint32_t            yaf_trace_drop = 0;
+struct qfTraceReader_st;
+struct qfTraceFile_st;
+
+/* a packet read but not yet decoded, still in libtrace's buffer */
+typedef struct qfTraceRaw_st {
+    const uint8_t       *pkt;
+    uint64_t            ptime_ns;
+    size_t              caplen;
+    libtrace_linktype_t linktype;
+    /* VLAN ID stripped from the frame before capture, or 0 */
+    uint16_t            vlan;
+} qfTraceRaw_t;
 
 struct qfTraceSource_st {
     libtrace_t          *trace;
-    libtrace_packet_t   *packet;
     libtrace_filter_t   *filter;
+    /* or native AF_PACKET capture, and its last read error */
+    qfAfp_t             *afp;
+    GError              *afp_err;
+    qfAfpPkt_t          afp_pkt[TRACE_PACKET_GROUP];
+    /* packets read as a group before decoding */
+    libtrace_packet_t   *group[TRACE_PACKET_GROUP];
+    qfTraceRaw_t        raw[TRACE_PACKET_GROUP];
+    /* parallel reader threads; 0 to read sequentially */
+    unsigned int        reader_count;
+    struct qfTraceReader_st *readers;
+    /* how far a quiet reader's clock trails the wall clock, in ms */
+    uint64_t            reader_slack;
+    /* packets merged behind a packet already merged from another reader */
+    uint64_t            merge_late;
+    /* or trace files from a directory or glob, each read on one of
+       file_threads threads, merged in time order */
+    unsigned int        file_count;
+    struct qfTraceFile_st *files;
+    struct qfTraceReader_st *streams;
+    unsigned int        file_threads;
+    GAsyncQueue         *workq;
+    char                *bpf;
+    int                 snaplen;
+    volatile gint       file_stop;
+    volatile gint       file_failed;
+    /* set while a capture thread reads this source */
+    gboolean            capturing;
+    /* drop count sampled by the capture thread, for the main thread */
+    volatile uint64_t   capture_dropped;
+    gboolean            defrag;
+};
+
+/* a packet decoded by a capture or reader thread */
+typedef struct qfTracePkt_st {
+    yfPBuf_t            pbuf;
+    yfIPFragInfo_t      fraginfo;
+} qfTracePkt_t;
+
+/* a capture thread feeding the flow stage through a ring */
+typedef struct qfTraceCapture_st {
+    qfContext_t         *ctx;
+    rgaRing_t           *ring;
+    /* set by the flow stage to stop capture */
+    volatile gint       stop;
+    /* set by the capture thread at end of input */
+    volatile gint       done;
+    /* times the capture thread had to wait for ring space */
+    volatile gint       stalls;
+    /* last trace_read_packet() result */
+    int                 trv;
+} qfTraceCapture_t;
+
+/* packets on their way from a reader thread to the flow stage */
+typedef struct qfTraceBatch_st {
+    /* decoder for this batch's packets, carrying its failure counts */
+    yfDecodeCtx_t       *dectx;
+    /* reader packet clock at handoff; no later packet is earlier */
+    uint64_t            clock;
+    /* last batch from this reader */
+    gboolean            last;
+    unsigned int        count;
+    /* next packet to merge, owned by the flow stage */
+    unsigned int        next;
+    qfTracePkt_t        pkt[TRACE_READER_BATCH];
+} qfTraceBatch_t;
+
+typedef struct qfTraceReader_st {
+    /* full and empty batches */
+    GAsyncQueue         *fullq;
+    GAsyncQueue         *freeq;
+    /* owned by the reader thread */
+    qfTraceBatch_t      *batch;
+    uint64_t            rclock;
+    /* owned by the flow stage */
+    qfTraceBatch_t      *cur;
+    uint64_t            clock;
+    gboolean            done;
+    /* batches allocated to a trace file reader */
+    unsigned int        depth;
+    /* set once a thread has started reading a trace file */
+    volatile gint       started;
+} qfTraceReader_t;
+
+/* a trace file read from a directory or glob */
+typedef struct qfTraceFile_st {
+    char                *uri;
+    char                *path;
+    /* timestamp of its first packet; no packet in it is earlier */
+    uint64_t            start;
+} qfTraceFile_t;
+
+/* formats read from files, which are always read sequentially */
+static const char *qf_trace_file_formats[] = {
+    "pcapfile:", "pcapng:", "erf:", "tsh:", "duck:", "atmhdr:",
+    "legacyatm:", "legacyeth:", "legacypos:", "legacyppp:", NULL
 };
 
+static gboolean qfTraceIsFile(const char *uri)
+{
+    const char          **fmt;
+
+    /* no format; libtrace guesses from the file */
+    if (!strchr(uri, ':')) return TRUE;
+
+    for (fmt = qf_trace_file_formats; *fmt; fmt++) {
+        if (!strncmp(uri, *fmt, strlen(*fmt))) return TRUE;
+    }
+
+    return FALSE;
+}
+
+static libtrace_t *qfTraceFileOpen(const char          *uri,
+                                   int                 snaplen,
+                                   const char          *bpf,
+                                   libtrace_filter_t   **filter,
+                                   GError              **err)
+{
+    libtrace_t          *trace;
+    libtrace_err_t      terr;
+
+    trace = trace_create(uri);
+    if (!trace_is_err(trace) &&
+        trace_config(trace, TRACE_OPTION_SNAPLEN, &snaplen) != -1 &&
+        (!bpf || ((*filter = trace_create_filter(bpf)) &&
+                  trace_config(trace, TRACE_OPTION_FILTER, *filter) != -1)) &&
+        trace_start(trace) != -1)
+    {
+        return trace;
+    }
+
+    terr = trace_get_err(trace);
+    g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                "Could not open trace file %s: %s", uri, terr.problem);
+    trace_destroy(trace);
+    return NULL;
+}
+
+/* find the timestamp of a trace file's first packet, or UINT64_MAX if it
+   has none */
+static gboolean qfTraceFileStart(struct qfTraceFile_st *tf,
+                                 GError                **err)
+{
+    libtrace_t          *trace;
+    libtrace_packet_t   *packet;
+    libtrace_err_t      terr;
+    struct timeval      tv;
+    int                 rv;
+
+    if (!(trace = qfTraceFileOpen(tf->uri, 0, NULL, NULL, err))) {
+        return FALSE;
+    }
+
+    packet = trace_create_packet();
+    if ((rv = trace_read_packet(trace, packet)) > 0) {
+        tv = trace_get_timeval(packet);
+        tf->start = yfDecodeTimeval(&tv);
+    } else {
+        tf->start = UINT64_MAX;
+        if (rv < 0) {
+            terr = trace_get_err(trace);
+            g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                        "Could not read trace file %s: %s",
+                        tf->uri, terr.problem);
+        }
+    }
+
+    trace_destroy_packet(packet);
+    trace_destroy(trace);
+    return rv >= 0;
+}
+
+static int qfTraceFileCompare(const void *a, const void *b)
+{
+    const qfTraceFile_t *fa = (const qfTraceFile_t *)a;
+    const qfTraceFile_t *fb = (const qfTraceFile_t *)b;
+
+    if (fa->start != fb->start) return fa->start < fb->start ? -1 : 1;
+    return strcmp(fa->path, fb->path);
+}
+
+/**
+ * If a URI names a directory or a glob of trace files, optionally with a
+ * file format prefix, find the files and sort them by the time of their
+ * first packet. Leaves the file count at zero for any other URI.
+ */
+static gboolean qfTraceFindFiles(qfTraceSource_t   *lts,
+                                 const char        *uri,
+                                 GError            **err)
+{
+    const char          **fmt;
+    const char          *path = uri, *name;
+    size_t              plen = 0;
+    GPtrArray           *paths;
+    GDir                *dir;
+    char                *file;
+    qfTraceFile_t       *tf;
+    gboolean            ok = TRUE;
+    unsigned int        i;
+#if HAVE_GLOB_H
+    glob_t              gl;
+#endif
+
+    /* keep the format prefix, if any, to add to each file */
+    for (fmt = qf_trace_file_formats; *fmt; fmt++) {
+        if (!strncmp(uri, *fmt, strlen(*fmt))) {
+            plen = strlen(*fmt);
+            path = uri + plen;
+            break;
+        }
+    }
+    if (!plen && strchr(uri, ':')) return TRUE;
+
+    paths = g_ptr_array_new();
+    if (strpbrk(path, "*?[")) {
+#if HAVE_GLOB_H
+        if (glob(path, 0, NULL, &gl) == 0) {
+            for (i = 0; i < gl.gl_pathc; i++) {
+                if (g_file_test(gl.gl_pathv[i], G_FILE_TEST_IS_REGULAR)) {
+                    g_ptr_array_add(paths, g_strdup(gl.gl_pathv[i]));
+                }
+            }
+        }
+        globfree(&gl);
+#endif
+    } else if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+        if (!(dir = g_dir_open(path, 0, err))) {
+            g_ptr_array_free(paths, TRUE);
+            return FALSE;
+        }
+        while ((name = g_dir_read_name(dir))) {
+            if (name[0] == '.') continue;
+            file = g_build_filename(path, name, NULL);
+            if (g_file_test(file, G_FILE_TEST_IS_REGULAR)) {
+                g_ptr_array_add(paths, file);
+            } else {
+                g_free(file);
+            }
+        }
+        g_dir_close(dir);
+    } else {
+        /* a single file */
+        g_ptr_array_free(paths, TRUE);
+        return TRUE;
+    }
+
+    if (!paths->len) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "No trace files match %s", uri);
+        g_ptr_array_free(paths, TRUE);
+        return FALSE;
+    }
+
+    /* note where each file starts, skipping empty ones */
+    lts->files = g_new0(qfTraceFile_t, paths->len);
+    for (i = 0; i < paths->len; i++) {
+        tf = &lts->files[lts->file_count];
+        tf->path = g_ptr_array_index(paths, i);
+        tf->uri = g_strdup_printf("%.*s%s", (int)plen, uri, tf->path);
+        ++lts->file_count;
+        if (!(ok = qfTraceFileStart(tf, err))) break;
+        if (tf->start == UINT64_MAX) {
+            g_debug("skipping empty trace file %s", tf->path);
+            g_free(tf->uri);
+            g_free(tf->path);
+            --lts->file_count;
+        }
+    }
+    for (++i; i < paths->len; i++) {
+        g_free(g_ptr_array_index(paths, i));
+    }
+    g_ptr_array_free(paths, TRUE);
+    if (!ok) return FALSE;
+
+    if (!lts->file_count) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "No packets in trace files matching %s", uri);
+        return FALSE;
+    }
+
+    qsort(lts->files, lts->file_count, sizeof(qfTraceFile_t),
+          qfTraceFileCompare);
+    g_debug("reading %u trace files from %s", lts->file_count, uri);
+    return TRUE;
+}
+
 qfTraceSource_t *qfTraceOpen(const char *uri,
                              const char *bpf,
                              int snaplen,
+                             unsigned int threads,
                              GError **err)
 {
     qfTraceSource_t *lts;
     libtrace_err_t  terr;
+    unsigned int    i;
     
     lts = g_new0(qfTraceSource_t, 1);
+    lts->reader_slack = QF_TRACE_READER_SLACK;
+
+    /* capture natively from AF_PACKET if asked to */
+    if (!strncmp(uri, QF_AFP_URI, strlen(QF_AFP_URI))) {
+        if (threads > 1) {
+            g_warning("input-threads does not apply to %s; "
+                      "use afpacket-fanout to spread capture", uri);
+        }
+        if (!(lts->afp = qfAfpOpen(uri + strlen(QF_AFP_URI), bpf,
+                                   snaplen, err)))
+        {
+            goto err;
+        }
+        return lts;
+    }
+
+    /* read a directory or glob of trace files in time order */
+    if (!qfTraceFindFiles(lts, uri, err)) goto err;
+    if (lts->file_count) {
+        lts->file_threads = threads > 1 ? threads : 1;
+        lts->bpf = bpf ? g_strdup(bpf) : NULL;
+        lts->snaplen = snaplen;
+        return lts;
+    }
     
-    if (!(lts->packet = trace_create_packet())) {
-        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
-                    "Could not initialize libtrace packet");
-        goto err;
+    for (i = 0; i < TRACE_PACKET_GROUP; i++) {
+        if (!(lts->group[i] = trace_create_packet())) {
+            g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                        "Could not initialize libtrace packet");
+            goto err;
+        }
     }
     
     lts->trace = trace_create(uri);
@@ -87,6 +431,33 @@ qfTraceSource_t *qfTraceOpen(const char *uri,
         }
     }
     
+    /* read live captures on multiple threads if asked to */
+    if (threads > 1) {
+#if HAVE_TRACE_PSTART
+        if (qfTraceIsFile(uri)) {
+            g_debug("reading %s sequentially", uri);
+        } else if (trace_set_perpkt_threads(lts->trace, threads) == -1 ||
+                   trace_set_hasher(lts->trace, HASHER_BIDIRECTIONAL,
+                                    NULL, NULL) == -1 ||
+                   trace_set_tick_interval(lts->trace,
+                                           TRACE_READER_TICK) == -1)
+        {
+            terr = trace_get_err(lts->trace);
+            g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                        "Could not set up parallel input on libtrace "
+                        "URI %s: %s", uri, terr.problem);
+            goto err;
+        } else {
+            /* qfTraceMain() starts the readers */
+            lts->reader_count = threads;
+            return lts;
+        }
+#else
+        g_warning("libtrace parallel input not available; "
+                  "reading sequentially");
+#endif
+    }
+
     /* start processing */
     if (trace_start(lts->trace) == -1) {
         terr = trace_get_err(lts->trace);
@@ -102,63 +473,239 @@ err:
     return NULL;
 }
 
+/* free a reader's batches and queues */
+static void qfTraceReaderFree(qfTraceReader_t       *r)
+{
+    qfTraceBatch_t      *b;
+
+    if (!r->fullq) return;
+
+    if (r->cur) g_async_queue_push(r->freeq, r->cur);
+    while ((b = g_async_queue_try_pop(r->fullq)) ||
+           (b = g_async_queue_try_pop(r->freeq)))
+    {
+        yfDecodeCtxFree(b->dectx);
+        g_free(b);
+    }
+    g_async_queue_unref(r->fullq);
+    g_async_queue_unref(r->freeq);
+    r->fullq = r->freeq = NULL;
+    r->cur = NULL;
+}
+
 void qfTraceClose(qfTraceSource_t *lts) {
+    unsigned int    i;
+
+    if (lts->readers) {
+        for (i = 0; i < lts->reader_count; i++) {
+            qfTraceReaderFree(&lts->readers[i]);
+        }
+        g_free(lts->readers);
+    }
+    for (i = 0; i < lts->file_count; i++) {
+        if (lts->streams) qfTraceReaderFree(&lts->streams[i]);
+        g_free(lts->files[i].uri);
+        g_free(lts->files[i].path);
+    }
+    g_free(lts->streams);
+    g_free(lts->files);
+    g_free(lts->bpf);
+    if (lts->workq) g_async_queue_unref(lts->workq);
+    if (lts->afp) qfAfpClose(lts->afp);
+    g_clear_error(&lts->afp_err);
     if (lts->filter) trace_destroy_filter(lts->filter);
-    if (lts->packet) trace_destroy_packet(lts->packet);
+    for (i = 0; i < TRACE_PACKET_GROUP; i++) {
+        if (lts->group[i]) trace_destroy_packet(lts->group[i]);
+    }
     if (lts->trace) trace_destroy(lts->trace);
     if (lts) g_free(lts);
 }
 
+void qfTraceSetReaderSlack(qfTraceSource_t *lts,
+                           uint32_t slack_ms)
+{
+    lts->reader_slack = slack_ms;
+}
+
+gboolean qfTraceJoinFanout(qfTraceSource_t *lts,
+                           uint16_t group,
+                           GError **err)
+{
+    if (!lts->afp) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_ARGUMENT,
+                    "Fanout requires an %s input", QF_AFP_URI);
+        return FALSE;
+    }
+
+    return qfAfpJoinFanout(lts->afp, group, err);
+}
+
+/* check for an input error, without reporting it */
+static gboolean qfTraceIsErr(qfTraceSource_t   *lts)
+{
+    if (lts->afp) return lts->afp_err ? TRUE : FALSE;
+    return trace_is_err(lts->trace);
+}
+
+/* check for an input error, and log it */
+static gboolean qfTraceCheckErr(qfTraceSource_t    *lts)
+{
+    libtrace_err_t      terr;
+
+    if (!qfTraceIsErr(lts)) return FALSE;
 
-static gboolean qfTraceHandlePacket(qfTraceSource_t    *lts,
+    if (lts->afp) {
+        g_warning("%s", lts->afp_err->message);
+    } else {
+        terr = trace_get_err(lts->trace);
+        g_warning("libtrace error: %s", terr.problem);
+    }
+    return TRUE;
+}
+
+/* read a group from an AF_PACKET ring; running out of packets is not EOF */
+static unsigned int qfTraceReadAfpGroup(qfTraceSource_t    *lts,
+                                        int                *trv)
+{
+    qfTraceRaw_t        *raw;
+    int                 count, i;
+
+    if ((count = qfAfpRead(lts->afp, lts->afp_pkt, TRACE_PACKET_GROUP,
+                           &lts->afp_err)) < 0)
+    {
+        *trv = -1;
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        raw = &lts->raw[i];
+        raw->pkt = lts->afp_pkt[i].pkt;
+        raw->ptime_ns = lts->afp_pkt[i].ptime_ns;
+        raw->caplen = lts->afp_pkt[i].caplen;
+        raw->linktype = TRACE_TYPE_ETH;
+        raw->vlan = lts->afp_pkt[i].vlan;
+    }
+
+    *trv = 1;
+    return (unsigned int)count;
+}
+
+
+static unsigned int qfTraceReadGroup(qfTraceSource_t   *lts,
+                                     int               *trv)
+{
+    qfTraceRaw_t        *raw;
+    uint32_t            rem;
+    unsigned int        count;
+
+    if (lts->afp) return qfTraceReadAfpGroup(lts, trv);
+
+    /* read a group of packets without touching their contents, so the
+       decoder gets them back to back */
+    for (count = 0; count < TRACE_PACKET_GROUP && !yaf_quit; count++) {
+        *trv = trace_read_packet(lts->trace, lts->group[count]);
+        if (*trv <= 0) break;
+
+        raw = &lts->raw[count];
+        raw->ptime_ns = yfDecodeTimeERF(
+                            trace_get_erf_timestamp(lts->group[count]));
+        raw->pkt = trace_get_packet_buffer(lts->group[count],
+                                           &raw->linktype, &rem);
+        raw->caplen = trace_get_capture_length(lts->group[count]);
+        raw->vlan = 0;
+    }
+
+    return count;
+}
+
+static gboolean qfTraceDecode(yfDecodeCtx_t          *dectx,
+                              qfTraceRaw_t           *raw,
+                              yfIPFragInfo_t         *fraginfo,
+                              yfPBuf_t               *pbuf)
+{
+    if (!yfDecodeToPBuf(dectx, raw->linktype, raw->ptime_ns,
+                        raw->caplen, raw->pkt, fraginfo, pbuf))
+    {
+        return FALSE;
+    }
+
+    /* restore a tag the interface stripped on receive */
+    yfDecodeStrippedVlan(dectx, raw->vlan, pbuf);
+
+    return TRUE;
+}
+
+#if QOF_ENABLE_DETUNE
+/* delay or drop a packet as detune says, keeping its timestamps in step */
+static gboolean qfTraceDetune(qofDetune_t           *detune,
+                              yfPBuf_t              *pbuf)
+{
+    uint64_t            ptime = pbuf->ptime;
+
+    if (!qfDetunePacket(detune, &pbuf->ptime, pbuf->iplen)) {
+        return FALSE;
+    }
+    pbuf->ptime_ns += (pbuf->ptime - ptime) * 1000000;
+    return TRUE;
+}
+#endif
+
+static gboolean qfTraceHandlePacket(qfTraceRaw_t       *raw,
                                     yfPBuf_t           *pbuf,
+                                    yfIPFragInfo_t     *fraginfo,
                                     qfContext_t        *ctx)
 {
-    yfIPFragInfo_t              fraginfo_buf,
-                                *fraginfo = ctx->fragtab ?
-                                &fraginfo_buf : NULL;
-    libtrace_linktype_t         linktype;
-    uint8_t                     *pkt;
-    uint32_t                    caplen;
-    
-    struct timeval tv;
-    
-    /* extract data from libtrace */
-    tv = trace_get_timeval(lts->packet);
-    pkt = trace_get_packet_buffer(lts->packet, &linktype, &caplen);
-
     /* Decode packet into packet buffer */
-    if (!yfDecodeToPBuf(ctx->dectx,
-                        linktype,
-                        yfDecodeTimeval(&tv),
-                        trace_get_capture_length(lts->packet),
-                        pkt, fraginfo, pbuf))
-    {
+    if (!qfTraceDecode(ctx->dectx, raw, fraginfo, pbuf)) {
         /* Couldn't decode packet; counted in dectx. Skip. */
         return FALSE;
     }
     
 #if QOF_ENABLE_DETUNE
-    /* Signal drop if detune says so */
+    /* Signal drop if detune says so; mark the buffer invalid, as a
+       decode failure does, since its ring slot may not be reused */
     if (ctx->ictx.detune) {
-        if (!qfDetunePacket(ctx->ictx.detune, &pbuf->ptime, pbuf->iplen)) {
+        if (!qfTraceDetune(ctx->ictx.detune, pbuf)) {
+            pbuf->ptime = 0;
             return FALSE;
         }
     }
 #endif
     
-    /* Handle fragmentation if necessary */
-    if (fraginfo && fraginfo->frag) {
-        yfDefragPBuf(ctx->fragtab, fraginfo, pbuf, pkt, caplen);
+    /* Handle fragmentation if necessary; shards do their own */
+    if (fraginfo && fraginfo->frag && ctx->fragtab) {
+        yfDefragPBuf(ctx->fragtab, fraginfo, pbuf, raw->pkt, raw->caplen);
     }
     
     /* signal packet processed */
     return TRUE;
 }
 
+/* sample libtrace's drop count; only on the thread reading the trace */
+static uint64_t qfTraceDropped(qfTraceSource_t *lts) {
+    uint64_t            dropped;
+
+    dropped = trace_get_dropped_packets(lts->trace);
+    return (dropped == UINT64_MAX) ? 0 : dropped;
+}
+
 static void qfTraceUpdateStats(qfTraceSource_t *lts) {
-    yaf_trace_drop = (uint32_t) trace_get_dropped_packets(lts->trace);
-    if (yaf_trace_drop == (uint32_t)-1) yaf_trace_drop = 0;
+    uint64_t            dropped;
+
+    yfStatReportMergeLate(lts->merge_late);
+
+    if (lts->afp) {
+        dropped = qfAfpDropped(lts->afp);
+    } else if (lts->trace && lts->capturing) {
+        /* as last published by the capture thread */
+        dropped = __sync_fetch_and_add(&lts->capture_dropped, 0);
+    } else if (lts->trace && !lts->reader_count) {
+        dropped = qfTraceDropped(lts);
+    } else {
+        return;
+    }
+
+    yfStatReportDropped(dropped);
 }
 
 static gboolean qfTracePeriodicExport(
@@ -170,6 +717,7 @@ static gboolean qfTracePeriodicExport(
         ctime - ctx->octx.stats_last >= ctx->octx.stats_period)
     {
         /* Stats timer, export */
+        qfTraceUpdateStats(ctx->ictx.pktsrc);
         if (!yfWriteStatsRec(ctx, &ctx->err)) {
             return FALSE;
         }
@@ -190,55 +738,911 @@ static gboolean qfTracePeriodicExport(
     return TRUE;
 }
 
+/* pass a packet on to its shard, or into the ring buffer, reassembling
+   fragments; FALSE if the ring buffer is full */
+static gboolean qfTraceFlowInsert(qfContext_t       *ctx,
+                                  yfPBuf_t          *src,
+                                  yfIPFragInfo_t    *fraginfo)
+{
+    yfPBuf_t            *pbuf;
+
+    if (ctx->shards) {
+        qfShardDispatch(ctx->shards, src, fraginfo);
+        return TRUE;
+    }
+
+    if (!(pbuf = (yfPBuf_t *)rgaNextHead(ctx->pbufring))) {
+        return FALSE;
+    }
+    memcpy(pbuf, src, sizeof(yfPBuf_t));
+    if (fraginfo && ctx->fragtab) {
+        yfDefragPBuf(ctx->fragtab, fraginfo, pbuf, NULL, 0);
+    }
+    return TRUE;
+}
+
+/* release packets held for reordering while there is room for them; on
+   flush, regardless of the reorder window */
+static void qfTraceReorderRelease(qfContext_t       *ctx,
+                                  gboolean          flush)
+{
+    qfReorderPkt_t      *rp;
+
+    while ((rp = qfReorderPeek(ctx->ictx.reorder, flush))) {
+        if (!qfTraceFlowInsert(ctx, &rp->pbuf,
+                               rp->fraginfo.frag ? &rp->fraginfo : NULL))
+        {
+            break;
+        }
+        qfReorderPop(ctx->ictx.reorder);
+    }
+}
+
+/* hand a packet decoded aside to the flow stage */
+static void qfTraceFlowPacket(qfContext_t           *ctx,
+                              qfTracePkt_t          *tp)
+{
+    yfIPFragInfo_t      *fraginfo = tp->fraginfo.frag ? &tp->fraginfo : NULL;
+    gboolean            ok;
+
+#if QOF_ENABLE_DETUNE
+    /* Drop if detune says so */
+    if (ctx->ictx.detune) {
+        if (!qfTraceDetune(ctx->ictx.detune, &tp->pbuf)) {
+            return;
+        }
+    }
+#endif
+
+    /* hold it back to put it in time order */
+    if (ctx->ictx.reorder) {
+        qfReorderPush(ctx->ictx.reorder, &tp->pbuf, fraginfo);
+        qfTraceReorderRelease(ctx, FALSE);
+        return;
+    }
+
+    /* the ring buffer is processed before it can fill */
+    ok = qfTraceFlowInsert(ctx, &tp->pbuf, fraginfo);
+    g_assert(ok);
+}
+
+/* release the packets still held for reordering, then flush */
+static gboolean qfTraceFinish(qfContext_t           *ctx,
+                              gboolean              ok)
+{
+    while (ok && ctx->ictx.reorder &&
+           qfReorderPeek(ctx->ictx.reorder, TRUE))
+    {
+        qfTraceReorderRelease(ctx, TRUE);
+        ok = yfProcessPBufRing(ctx, &(ctx->err));
+    }
+
+    return yfFinalFlush(ctx, ok, &(ctx->err));
+}
+
+/* read and decode packets into the capture ring until stopped or done */
+static gpointer qfTraceCaptureMain(gpointer         arg)
+{
+    qfTraceCapture_t    *cap = (qfTraceCapture_t *)arg;
+    qfContext_t         *ctx = cap->ctx;
+    qfTraceSource_t     *lts = ctx->ictx.pktsrc;
+    gboolean            defrag = ctx->cfg.max_fragtab ? TRUE : FALSE;
+    qfTracePkt_t        *res = NULL, *tp;
+    size_t              n = 0, used = 0;
+    uint64_t            sampled = 0;
+    unsigned int        count, i;
+    int                 trv = 1;
+
+    while (!yaf_quit && !g_atomic_int_get(&cap->stop)) {
+
+        /* read a group of packets */
+        count = qfTraceReadGroup(lts, &trv);
+
+        /* publish the drop count now and then, as only this thread may
+           ask libtrace for it */
+        if (count && !lts->afp &&
+            lts->raw[count - 1].ptime_ns - sampled >= TRACE_CAPTURE_STATS)
+        {
+            __sync_lock_test_and_set(&lts->capture_dropped,
+                                     qfTraceDropped(lts));
+            sampled = lts->raw[count - 1].ptime_ns;
+        }
+
+        /* decode them straight into the ring, prefetching headers */
+        for (i = 0; i < TRACE_PREFETCH_AHEAD && i < count; i++) {
+            QF_PREFETCH(lts->raw[i].pkt, 0);
+            QF_PREFETCH(lts->raw[i].pkt + 64, 0);
+        }
+        for (i = 0; i < count; i++) {
+            if (i + TRACE_PREFETCH_AHEAD < count) {
+                QF_PREFETCH(lts->raw[i + TRACE_PREFETCH_AHEAD].pkt, 0);
+                QF_PREFETCH(lts->raw[i + TRACE_PREFETCH_AHEAD].pkt + 64, 0);
+            }
+
+            /* reserve space for the rest of the group; if the flow stage
+               has fallen behind, wait for it here */
+            if (used == n) {
+                if (used) rgaCommitHead(cap->ring, (uint8_t *)res, used);
+                used = 0;
+                n = count - i;
+                if (!(res = (qfTracePkt_t *)rgaNextHeadN(cap->ring, &n))) {
+                    g_atomic_int_inc(&cap->stalls);
+                    do {
+                        if (yaf_quit || g_atomic_int_get(&cap->stop)) {
+                            goto end;
+                        }
+                        g_thread_yield();
+                        n = count - i;
+                    } while (!(res = (qfTracePkt_t *)
+                                     rgaNextHeadN(cap->ring, &n)));
+                }
+            }
+
+            /* a packet that fails to decode leaves its slot for the next */
+            tp = &res[used];
+            tp->fraginfo.frag = 0;
+            if (qfTraceDecode(ctx->dectx, &lts->raw[i],
+                              defrag ? &tp->fraginfo : NULL, &tp->pbuf))
+            {
+                ++used;
+            }
+        }
+
+        /* hand the group over */
+        if (used) rgaCommitHead(cap->ring, (uint8_t *)res, used);
+        used = n = 0;
+
+        if (trv <= 0 && (trv == 0 || qfTraceIsErr(lts))) break;
+    }
+
+end:
+    cap->trv = trv;
+    g_atomic_int_set(&cap->done, 1);
+    return NULL;
+}
+
+/**
+ * Read and decode packets on a capture thread into a ring, and run the flow
+ * stage and export on this thread, so that a slow flush or a blocked
+ * exporter fills the ring rather than the capture buffer.
+ */
+static gboolean qfTraceMainPipeline(qfContext_t     *ctx)
+{
+    qfTraceSource_t     *lts = ctx->ictx.pktsrc;
+    qfTraceCapture_t    cap;
+    GThread             *thread;
+    qfTracePkt_t        *tp;
+    gboolean            ok = TRUE, done;
+    size_t              n, i;
+
+#if !GLIB_CHECK_VERSION(2,32,0)
+    if (!g_thread_supported()) g_thread_init(NULL);
+#endif
+
+    memset(&cap, 0, sizeof(cap));
+    cap.ctx = ctx;
+    cap.ring = rgaAllocSync(sizeof(qfTracePkt_t), ctx->cfg.capture_ring,
+                            RGA_SYNC_SPSC);
+    lts->capturing = TRUE;
+
+#if GLIB_CHECK_VERSION(2,32,0)
+    thread = g_thread_new("qof-capture", qfTraceCaptureMain, &cap);
+#else
+    thread = g_thread_create(qfTraceCaptureMain, &cap, TRUE, NULL);
+    if (!thread) {
+        g_error("cannot start capture thread");
+    }
+#endif
+
+    g_debug("capturing packets on a separate thread into a ring of %u",
+            ctx->cfg.capture_ring);
+
+    while (!yaf_quit) {
+
+        /* note whether capture is done before looking for packets, so an
+           empty ring then means there are no more */
+        done = g_atomic_int_get(&cap.done);
+
+        n = TRACE_PACKET_GROUP;
+        if (!(tp = (qfTracePkt_t *)rgaNextTailN(cap.ring, &n))) {
+            if (done) break;
+            g_usleep(TRACE_CAPTURE_IDLE);
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            qfTraceFlowPacket(ctx, &tp[i]);
+        }
+        rgaCommitTail(cap.ring, n);
+
+        /* report how far behind capture we are */
+        yfStatReportRing(rgaCount(cap.ring), rgaPeak(cap.ring),
+                         (guint)g_atomic_int_get(&cap.stalls));
+
+        /* Process the packet buffer */
+        if (!yfProcessPBufRing(ctx, &(ctx->err))) {
+            ok = FALSE;
+            break;
+        }
+
+        /* Do periodic export as necessary */
+        qfTracePeriodicExport(ctx, qfContextCurrentTime(ctx));
+    }
+
+    /* stop capture, and wait for it */
+    g_atomic_int_set(&cap.stop, 1);
+    g_thread_join(thread);
+    rgaFree(cap.ring);
+    lts->capturing = FALSE;
+
+    /* Check for error */
+    if (ok && qfTraceCheckErr(lts)) ok = FALSE;
+
+    qfTraceUpdateStats(lts);
+    return qfTraceFinish(ctx, ok);
+}
+
+static qfTraceBatch_t *qfTraceReaderBatch(qfTraceReader_t   *r)
+{
+    if (!r->batch) {
+        r->batch = g_async_queue_pop(r->freeq);
+        r->batch->count = 0;
+        r->batch->next = 0;
+        r->batch->last = FALSE;
+    }
+
+    return r->batch;
+}
+
+static void qfTraceReaderHandoff(qfTraceReader_t    *r,
+                                 gboolean           last)
+{
+    qfTraceBatch_t      *b = qfTraceReaderBatch(r);
+
+    b->clock = r->rclock;
+    b->last = last;
+    g_async_queue_push(r->fullq, b);
+    r->batch = NULL;
+}
+
+/* decode a packet into a reader's batch; failures are counted in its
+   decoder */
+static void qfTraceReaderDecode(qfTraceReader_t     *r,
+                                gboolean            defrag,
+                                libtrace_linktype_t linktype,
+                                uint64_t            ptime_ns,
+                                size_t              caplen,
+                                const uint8_t       *pkt)
+{
+    qfTraceBatch_t      *b = qfTraceReaderBatch(r);
+    qfTracePkt_t        *tp = &b->pkt[b->count];
+
+    tp->fraginfo.frag = 0;
+    if (yfDecodeToPBuf(b->dectx, linktype, ptime_ns, caplen, pkt,
+                       defrag ? &tp->fraginfo : NULL, &tp->pbuf))
+    {
+        if (tp->pbuf.ptime > r->rclock) {
+            r->rclock = tp->pbuf.ptime;
+        }
+        if (++(b->count) == TRACE_READER_BATCH) {
+            qfTraceReaderHandoff(r, FALSE);
+        }
+    }
+}
+
+/* return a merged batch to its reader, keeping its statistics and clock */
+static void qfTraceReaderRecycle(qfContext_t        *ctx,
+                                 qfTraceReader_t    *r)
+{
+    yfDecodeCtxMergeStats(ctx->dectx, r->cur->dectx);
+    r->clock = r->cur->clock;
+    if (r->cur->last) r->done = TRUE;
+    g_async_queue_push(r->freeq, r->cur);
+    r->cur = NULL;
+}
+
+/* make sure a reader has packets to merge, without waiting */
+static gboolean qfTraceReaderReady(qfContext_t      *ctx,
+                                   qfTraceReader_t  *r)
+{
+    while (!r->cur || r->cur->next == r->cur->count) {
+        if (r->cur) qfTraceReaderRecycle(ctx, r);
+        if (r->done) return FALSE;
+        if (!(r->cur = g_async_queue_try_pop(r->fullq))) return FALSE;
+    }
+
+    return TRUE;
+}
+
+static qfTraceBatch_t *qfTraceReaderWait(qfTraceReader_t    *r)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+    return g_async_queue_timeout_pop(r->fullq, TRACE_READER_TICK * 1000);
+#else
+    GTimeVal            end;
+
+    g_get_current_time(&end);
+    g_time_val_add(&end, TRACE_READER_TICK * 1000);
+    return g_async_queue_timed_pop(r->fullq, &end);
+#endif
+}
+
+/* give a reader more batches, each with its own decoder */
+static void qfTraceReaderGrow(qfContext_t           *ctx,
+                              qfTraceReader_t       *r,
+                              unsigned int          count)
+{
+    qfTraceBatch_t      *b;
+    unsigned int        i;
+
+    for (i = 0; i < count; i++) {
+        b = g_new(qfTraceBatch_t, 1);
+        b->dectx = yfDecodeCtxClone(ctx->dectx);
+        g_async_queue_push(r->freeq, b);
+    }
+    r->depth += count;
+}
+
+/* ask the kernel to read a trace file ahead, or to drop it from cache */
+static void qfTraceFileAdvise(qfTraceFile_t         *tf,
+                              gboolean              willneed)
+{
+#if HAVE_POSIX_FADVISE
+    int                 fd;
+
+    if ((fd = open(tf->path, O_RDONLY)) == -1) return;
+    posix_fadvise(fd, 0, 0, willneed ? POSIX_FADV_WILLNEED :
+                                       POSIX_FADV_DONTNEED);
+    close(fd);
+#endif
+}
+
+/* read trace files handed over by the flow stage, each into its stream */
+static gpointer qfTraceFileMain(gpointer            arg)
+{
+    qfTraceSource_t     *lts = (qfTraceSource_t *)arg;
+    libtrace_packet_t   *packet = trace_create_packet();
+    libtrace_t          *trace;
+    libtrace_filter_t   *filter;
+    libtrace_linktype_t linktype;
+    libtrace_err_t      terr;
+    qfTraceFile_t       *tf;
+    qfTraceReader_t     *r;
+    GError              *err = NULL;
+    uint8_t             *pkt;
+    uint32_t            rem;
+    guint               i;
+    int                 rv = 0;
+
+    while ((i = GPOINTER_TO_UINT(g_async_queue_pop(lts->workq)))
+           != TRACE_FILE_STOP)
+    {
+        tf = &lts->files[i - 1];
+        r = &lts->streams[i - 1];
+        g_atomic_int_set(&r->started, 1);
+
+        filter = NULL;
+        rv = 0;
+        if ((trace = qfTraceFileOpen(tf->uri, lts->snaplen, lts->bpf,
+                                     &filter, &err)))
+        {
+            while (!g_atomic_int_get(&lts->file_stop) &&
+                   (rv = trace_read_packet(trace, packet)) > 0)
+            {
+                pkt = trace_get_packet_buffer(packet, &linktype, &rem);
+                qfTraceReaderDecode(r, lts->defrag, linktype,
+                                    yfDecodeTimeERF(
+                                        trace_get_erf_timestamp(packet)),
+                                    trace_get_capture_length(packet), pkt);
+            }
+            if (rv < 0) {
+                terr = trace_get_err(trace);
+                g_warning("libtrace error reading %s: %s",
+                          tf->uri, terr.problem);
+                g_atomic_int_set(&lts->file_failed, 1);
+            }
+            trace_destroy(trace);
+        } else {
+            g_warning("%s", err->message);
+            g_clear_error(&err);
+            g_atomic_int_set(&lts->file_failed, 1);
+        }
+        if (filter) trace_destroy_filter(filter);
+
+        /* that's the last of this file */
+        qfTraceReaderHandoff(r, TRUE);
+        qfTraceFileAdvise(tf, FALSE);
+    }
+
+    trace_destroy_packet(packet);
+    return NULL;
+}
+
+/* hand the next trace file to a reader thread, starting it as late as its
+   first packet */
+static void qfTraceFilePush(qfContext_t             *ctx,
+                            qfTraceSource_t         *lts,
+                            unsigned int            i)
+{
+    qfTraceReader_t     *r = &lts->streams[i];
+
+    r->fullq = g_async_queue_new();
+    r->freeq = g_async_queue_new();
+    r->clock = r->rclock = lts->files[i].start;
+    qfTraceReaderGrow(ctx, r, TRACE_FILE_DEPTH);
+    qfTraceFileAdvise(&lts->files[i], TRUE);
+    g_async_queue_push(lts->workq, GUINT_TO_POINTER(i + 1));
+}
+
+/**
+ * Read a set of trace files on reader threads, each of which decodes one
+ * file at a time into batches, and merge the batches in packet time order
+ * into the flow stage on this thread. Files are handed out in order of
+ * their first packet, with one more file in flight than there are threads,
+ * so a thread finishing a file moves straight on to the next. A file not
+ * yet finished holds back packets later than its clock, and a file not yet
+ * started, packets later than its first. If every thread is held up reading
+ * ahead in a file overlapping one no thread has started, those threads are
+ * given more batches until one of them finishes.
+ */
+static gboolean qfTraceMainFiles(qfContext_t        *ctx)
+{
+    qfTraceSource_t     *lts = ctx->ictx.pktsrc;
+    GThread             **threads;
+    qfTraceReader_t     *r, *next, *wait;
+    qfTraceBatch_t      *b;
+    qfTracePkt_t        *tp;
+    uint64_t            bound;
+    gboolean            ok = TRUE, stopping = FALSE, live;
+    unsigned int        i, lo = 0, pushed = 0, active, group = 0;
+
+#if !GLIB_CHECK_VERSION(2,32,0)
+    if (!g_thread_supported()) g_thread_init(NULL);
+#endif
+
+    lts->defrag = ctx->cfg.max_fragtab ? TRUE : FALSE;
+    lts->streams = g_new0(qfTraceReader_t, lts->file_count);
+    lts->workq = g_async_queue_new();
+
+    threads = g_new0(GThread *, lts->file_threads);
+    for (i = 0; i < lts->file_threads; i++) {
+#if GLIB_CHECK_VERSION(2,32,0)
+        threads[i] = g_thread_new("qof-file", qfTraceFileMain, lts);
+#else
+        threads[i] = g_thread_create(qfTraceFileMain, lts, TRUE, NULL);
+        if (!threads[i]) {
+            g_error("cannot start trace file reader thread");
+        }
+#endif
+    }
+    g_debug("reading %u trace files in %u threads",
+            lts->file_count, lts->file_threads);
+
+    /* merge until all files are done */
+    for (;;) {
+        /* stop reading on quit or error, then drain */
+        if ((yaf_quit || !ok || g_atomic_int_get(&lts->file_failed)) &&
+            !stopping)
+        {
+            g_atomic_int_set(&lts->file_stop, 1);
+            stopping = TRUE;
+        }
+
+        /* free finished files, and keep the threads busy */
+        while (lo < pushed && lts->streams[lo].done) {
+            qfTraceReaderFree(&lts->streams[lo++]);
+        }
+        if (!stopping) {
+            for (active = 0, i = lo; i < pushed; i++) {
+                if (!lts->streams[i].done) ++active;
+            }
+            for (; pushed < lts->file_count &&
+                   active <= lts->file_threads; active++)
+            {
+                qfTraceFilePush(ctx, lts, pushed++);
+            }
+        }
+
+        /* find the earliest packet waiting, and the earliest clock of any
+           file without packets waiting, started or not */
+        next = wait = NULL;
+        bound = (!stopping && pushed < lts->file_count) ?
+                lts->files[pushed].start : UINT64_MAX;
+        live = FALSE;
+        for (i = lo; i < pushed; i++) {
+            r = &lts->streams[i];
+            if (qfTraceReaderReady(ctx, r)) {
+                live = TRUE;
+                if (!next || r->cur->pkt[r->cur->next].pbuf.ptime_ns <
+                             next->cur->pkt[next->cur->next].pbuf.ptime_ns)
+                {
+                    next = r;
+                }
+            } else if (!r->done) {
+                live = TRUE;
+                if (r->clock < bound) {
+                    bound = r->clock;
+                    wait = r;
+                }
+            } else {
+                qfTraceReaderFree(r);
+            }
+        }
+        if (!live) {
+            if (stopping || pushed == lts->file_count) break;
+            continue;
+        }
+
+        if (next && next->cur->pkt[next->cur->next].pbuf.ptime <= bound) {
+            /* merge the earliest packet; after an error, just drain */
+            tp = &next->cur->pkt[(next->cur->next)++];
+            if (!ok) continue;
+            qfTraceFlowPacket(ctx, tp);
+            if (++group < TRACE_PACKET_GROUP) continue;
+        } else if (!group) {
+            /* held back by a file not yet handed out: hand it out */
+            if (!wait) {
+                if (pushed < lts->file_count) {
+                    qfTraceFilePush(ctx, lts, pushed++);
+                }
+                continue;
+            }
+
+            /* wait for the file holding us back */
+            if ((b = qfTraceReaderWait(wait))) {
+                wait->cur = b;
+                continue;
+            }
+
+            /* if no thread has started it, let the others read ahead */
+            if (!g_atomic_int_get(&wait->started)) {
+                for (i = lo; i < pushed; i++) {
+                    r = &lts->streams[i];
+                    if (!r->done && g_atomic_int_get(&r->started) &&
+                        !g_async_queue_length(r->freeq))
+                    {
+                        qfTraceReaderGrow(ctx, r, 1);
+                    }
+                }
+            }
+            continue;
+        }
+
+        /* Process the packet buffer */
+        group = 0;
+        if (!yfProcessPBufRing(ctx, &(ctx->err))) {
+            ok = FALSE;
+            continue;
+        }
+
+        /* Do periodic export as necessary */
+        qfTracePeriodicExport(ctx, qfContextCurrentTime(ctx));
+    }
+
+    /* process the last group */
+    if (group && ok && !yfProcessPBufRing(ctx, &(ctx->err))) {
+        ok = FALSE;
+    }
+
+    /* stop the reader threads */
+    for (i = 0; i < lts->file_threads; i++) {
+        g_async_queue_push(lts->workq, GUINT_TO_POINTER(TRACE_FILE_STOP));
+    }
+    for (i = 0; i < lts->file_threads; i++) {
+        g_thread_join(threads[i]);
+    }
+    g_free(threads);
+
+    if (g_atomic_int_get(&lts->file_failed)) ok = FALSE;
+
+    return qfTraceFinish(ctx, ok);
+}
+
+#if HAVE_TRACE_PSTART
+
+static void *qfTraceReaderStart(libtrace_t          *trace,
+                                libtrace_thread_t   *t,
+                                void                *global)
+{
+    qfTraceSource_t     *lts = (qfTraceSource_t *)global;
+    int                 id = trace_get_perpkt_thread_id(t);
+
+    g_assert(id >= 0 && (unsigned int)id < lts->reader_count);
+    return &lts->readers[id];
+}
+
+static libtrace_packet_t *qfTraceReaderPacket(libtrace_t        *trace,
+                                              libtrace_thread_t *t,
+                                              void              *global,
+                                              void              *tls,
+                                              libtrace_packet_t *packet)
+{
+    qfTraceSource_t     *lts = (qfTraceSource_t *)global;
+    libtrace_linktype_t linktype;
+    uint8_t             *pkt;
+    uint32_t            caplen;
+
+    /* extract data from libtrace, and decode into the batch */
+    pkt = trace_get_packet_buffer(packet, &linktype, &caplen);
+    qfTraceReaderDecode((qfTraceReader_t *)tls, lts->defrag, linktype,
+                        yfDecodeTimeERF(trace_get_erf_timestamp(packet)),
+                        trace_get_capture_length(packet), pkt);
+
+    /* hand the packet back to libtrace */
+    return packet;
+}
+
+static void qfTraceReaderTick(libtrace_t            *trace,
+                              libtrace_thread_t     *t,
+                              void                  *global,
+                              void                  *tls,
+                              uint64_t              order)
+{
+    qfTraceSource_t     *lts = (qfTraceSource_t *)global;
+    qfTraceReader_t     *r = (qfTraceReader_t *)tls;
+    uint64_t            wall;
+
+    /* tick order is the wall clock as an ERF timestamp; a quiet reader
+       vouches for it, less slack, so it doesn't hold the others back */
+    wall = ((order >> 32) * 1000) + (((order & 0xFFFFFFFF) * 1000) >> 32);
+    if (wall > r->rclock + lts->reader_slack) {
+        r->rclock = wall - lts->reader_slack;
+    }
+
+    /* and don't let a partial batch wait */
+    qfTraceReaderHandoff(r, FALSE);
+}
+
+static void qfTraceReaderStop(libtrace_t            *trace,
+                              libtrace_thread_t     *t,
+                              void                  *global,
+                              void                  *tls)
+{
+    qfTraceReaderHandoff((qfTraceReader_t *)tls, TRUE);
+}
+
+/**
+ * Read packets on the reader threads started by libtrace, which decode them
+ * into batches, and merge the batches in packet time order into the flow
+ * stage on this thread. Each reader's packets are in time order, so a packet
+ * may be merged once every reader without packets waiting has a clock at
+ * least as late. Quiet readers advance their clocks on each tick.
+ */
+static gboolean qfTraceMainParallel(qfContext_t     *ctx)
+{
+    qfTraceSource_t         *lts = ctx->ictx.pktsrc;
+    libtrace_callback_set_t *cbs;
+    libtrace_err_t          terr;
+    qfTraceReader_t         *r, *next, *wait;
+    qfTraceBatch_t          *b;
+    qfTracePkt_t            *tp;
+    uint64_t                bound, merged = 0;
+    gboolean                ok = TRUE, stopping = FALSE, live;
+    unsigned int            i, group = 0;
+
+#if !GLIB_CHECK_VERSION(2,32,0)
+    if (!g_thread_supported()) g_thread_init(NULL);
+#endif
+
+    /* set up readers, each with its own batches and decoders */
+    lts->defrag = ctx->cfg.max_fragtab ? TRUE : FALSE;
+    lts->readers = g_new0(qfTraceReader_t, lts->reader_count);
+    for (i = 0; i < lts->reader_count; i++) {
+        r = &lts->readers[i];
+        r->fullq = g_async_queue_new();
+        r->freeq = g_async_queue_new();
+        qfTraceReaderGrow(ctx, r, TRACE_READER_DEPTH);
+    }
+
+    /* start reading */
+    cbs = trace_create_callback_set();
+    trace_set_starting_cb(cbs, qfTraceReaderStart);
+    trace_set_packet_cb(cbs, qfTraceReaderPacket);
+    trace_set_tick_interval_cb(cbs, qfTraceReaderTick);
+    trace_set_stopping_cb(cbs, qfTraceReaderStop);
+    if (trace_pstart(lts->trace, lts, cbs, NULL) == -1) {
+        terr = trace_get_err(lts->trace);
+        g_warning("libtrace trace_pstart() error: %s", terr.problem);
+        trace_destroy_callback_set(cbs);
+        return qfTraceFinish(ctx, FALSE);
+    }
+
+    /* readers libtrace didn't start will never send anything */
+    for (i = trace_get_perpkt_threads(lts->trace);
+         i < lts->reader_count; i++)
+    {
+        lts->readers[i].done = TRUE;
+    }
+    g_debug("reading packets in %u threads",
+            (unsigned int)trace_get_perpkt_threads(lts->trace));
+
+    /* merge until all readers are done */
+    for (;;) {
+        /* stop readers on quit or error, then drain them */
+        if ((yaf_quit || !ok) && !stopping) {
+            trace_pstop(lts->trace);
+            stopping = TRUE;
+        }
+
+        /* find the earliest packet waiting, and the earliest clock of any
+           reader without packets waiting */
+        next = wait = NULL;
+        bound = UINT64_MAX;
+        live = FALSE;
+        for (i = 0; i < lts->reader_count; i++) {
+            r = &lts->readers[i];
+            if (qfTraceReaderReady(ctx, r)) {
+                live = TRUE;
+                if (!next || r->cur->pkt[r->cur->next].pbuf.ptime_ns <
+                             next->cur->pkt[next->cur->next].pbuf.ptime_ns)
+                {
+                    next = r;
+                }
+            } else if (!r->done) {
+                live = TRUE;
+                if (r->clock < bound) {
+                    bound = r->clock;
+                    wait = r;
+                }
+            }
+        }
+        if (!live) break;
+
+        if (next && next->cur->pkt[next->cur->next].pbuf.ptime <= bound) {
+            /* merge the earliest packet; after an error, just drain */
+            tp = &next->cur->pkt[(next->cur->next)++];
+            if (!ok) continue;
+
+            /* a packet that reached its reader more than the slack late
+               merges out of order; count it, as without a reorder window
+               the flow table will reject it */
+            if (tp->pbuf.ptime_ns < merged) {
+                ++lts->merge_late;
+            } else {
+                merged = tp->pbuf.ptime_ns;
+            }
+            qfTraceFlowPacket(ctx, tp);
+            if (++group < TRACE_PACKET_GROUP) continue;
+        } else if (!group) {
+            /* wait for the reader holding us back */
+            if ((b = qfTraceReaderWait(wait))) {
+                wait->cur = b;
+            }
+            continue;
+        }
+
+        /* Process the packet buffer */
+        group = 0;
+        if (!yfProcessPBufRing(ctx, &(ctx->err))) {
+            ok = FALSE;
+            continue;
+        }
+
+        /* Do periodic export as necessary */
+        qfTracePeriodicExport(ctx, qfContextCurrentTime(ctx));
+    }
+
+    /* process the last group */
+    if (group && ok && !yfProcessPBufRing(ctx, &(ctx->err))) {
+        ok = FALSE;
+    }
+
+    trace_join(lts->trace);
+    trace_destroy_callback_set(cbs);
+
+    /* Check for error */
+    if (trace_is_err(lts->trace)) {
+        terr = trace_get_err(lts->trace);
+        g_warning("libtrace error: %s", terr.problem);
+        ok = FALSE;
+    }
+
+    qfTraceUpdateStats(lts);
+    return qfTraceFinish(ctx, ok);
+}
+
+#endif
+
 gboolean qfTraceMain(qfContext_t             *ctx)
 {
     gboolean                ok = TRUE;
     qfTraceSource_t         *lts = ctx->ictx.pktsrc;
-    yfPBuf_t                    *pbuf;
-
-    libtrace_err_t          terr;
+    yfPBuf_t                *pbuf;
+    yfPBuf_t                spbuf;
+    qfTracePkt_t            tp;
+    yfIPFragInfo_t          fraginfo_buf,
+                            *fraginfo = ctx->cfg.max_fragtab ?
+                            &fraginfo_buf : NULL;
     
-    int i, trv;
+    unsigned int count, i;
+    int trv = 1;
     
+#if HAVE_TRACE_PSTART
+    if (lts->reader_count) {
+        return qfTraceMainParallel(ctx);
+    }
+#endif
+
+    if (lts->file_count) {
+        return qfTraceMainFiles(ctx);
+    }
+
+    if (ctx->cfg.capture_ring) {
+        return qfTraceMainPipeline(ctx);
+    }
+
     /* process input until we're done */
     while (!yaf_quit) {
         
-        i = 0;
-        while (i < TRACE_PACKET_GROUP && !yaf_quit) {
+        /* read a group of packets */
+        count = qfTraceReadGroup(lts, &trv);
+        
+        /* decode them, prefetching headers a few packets ahead */
+        for (i = 0; i < TRACE_PREFETCH_AHEAD && i < count; i++) {
+            QF_PREFETCH(lts->raw[i].pkt, 0);
+            QF_PREFETCH(lts->raw[i].pkt + 64, 0);
+        }
+        pbuf = NULL;
+        for (i = 0; i < count; i++) {
+            if (i + TRACE_PREFETCH_AHEAD < count) {
+                QF_PREFETCH(lts->raw[i + TRACE_PREFETCH_AHEAD].pkt, 0);
+                QF_PREFETCH(lts->raw[i + TRACE_PREFETCH_AHEAD].pkt + 64, 0);
+            }
+            
+            /* decode aside to hold for reordering */
+            if (ctx->ictx.reorder) {
+                tp.fraginfo.frag = 0;
+                if (qfTraceDecode(ctx->dectx, &lts->raw[i],
+                                  fraginfo ? &tp.fraginfo : NULL, &tp.pbuf))
+                {
+                    qfTraceFlowPacket(ctx, &tp);
+                }
+                continue;
+            }
+
+            /* get next spot in ring buffer, or decode in place for shards;
+               a spot a packet failed to decode into is reused */
+            if (ctx->shards) {
+                pbuf = &spbuf;
+            } else if (!pbuf) {
+                pbuf = (yfPBuf_t *)rgaNextHead(ctx->pbufring);
+                g_assert(pbuf);
+            }
             
-            /* get next spot in ring buffer */
-            pbuf = (yfPBuf_t *)rgaNextHead(ctx->pbufring);
-            g_assert(pbuf);
+            if (!qfTraceHandlePacket(&lts->raw[i], pbuf, fraginfo, ctx)) {
+                continue;
+            }
             
-            /* and try to parse packets into it until we get one */
-            do {
-                trv = trace_read_packet(lts->trace, lts->packet);
-                if (trv <= 0) goto TRACE_END;
-            } while (!qfTraceHandlePacket(lts, pbuf, ctx));
-            i++;
+            /* pass packet on to its shard, or keep it in the ring */
+            if (ctx->shards) {
+                qfShardDispatch(ctx->shards, pbuf, fraginfo);
+            } else {
+                pbuf = NULL;
+            }
         }
 
-TRACE_END:
         /* Check for error */
-        if (trace_is_err(lts->trace)) {
-            terr = trace_get_err(lts->trace);
-            g_warning("libtrace error: %s", terr.problem);
+        if (qfTraceCheckErr(lts)) {
             ok = FALSE;
             break;
         }
 
-        /* Check for quit or EOF */
-        if (yaf_quit || trv == 0) break;
+        /* Check for quit */
+        if (yaf_quit) break;
 
-        /* Process the packet buffer */
-        if (ok && !yfProcessPBufRing(ctx, &(ctx->err))) {
+        /* Process the packet buffer, including the last group at EOF */
+        if (!yfProcessPBufRing(ctx, &(ctx->err))) {
             ok = FALSE;
             break;
         }
         
+        /* Check for EOF */
+        if (trv == 0) break;
+        
         /* Do periodic export as necessary */
-        qfTracePeriodicExport(ctx, yfFlowTabCurrentTime(ctx->flowtab));
+        qfTracePeriodicExport(ctx, qfContextCurrentTime(ctx));
     }
 
-    return yfFinalFlush(ctx, ok,  &(ctx->err));
+    qfTraceUpdateStats(lts);
+    return qfTraceFinish(ctx, ok);
 }
@@ -21,16 +21,66 @@
 #include <libtrace.h>
 #include "qofconfig.h"
 
+/* default for how far behind the wall clock a quiet parallel reader's
+   packet clock is held, to allow for packets timestamped but not yet read,
+   in milliseconds */
+#define QF_TRACE_READER_SLACK 10
+
 struct qfTraceSource_st;
 typedef struct qfTraceSource_st qfTraceSource_t;
 
+/**
+ * Open a libtrace packet source. With more than one thread, live capture
+ * sources are read in parallel using libtrace's parallel API, if available;
+ * single files are always read sequentially. A directory or a glob of trace
+ * files is read as one input, one file per thread at a time, merged in
+ * packet time order. A URI of the form afpacket:IFNAME captures natively
+ * from a Linux AF_PACKET ring instead of using libtrace.
+ *
+ * @param uri     libtrace URI, directory or glob to read from, or
+ *                afpacket:IFNAME
+ * @param bpf     BPF filter expression, or NULL
+ * @param snaplen capture length
+ * @param threads number of reader threads; 0 or 1 to read sequentially,
+ *                or a directory or glob on one reader thread
+ * @param err     an error description
+ * @return a new packet source, or NULL on error
+ */
+
 qfTraceSource_t *qfTraceOpen(const char *uri,
                              const char *bpf,
                              int snaplen,
+                             unsigned int threads,
                              GError **err);
 
 void qfTraceClose(qfTraceSource_t *lts);
 
+/**
+ * Join an AF_PACKET packet source to a fanout group, sharing its interface
+ * by flow hash with every other source in the group.
+ *
+ * @param lts     packet source opened with an afpacket: URI
+ * @param group   fanout group ID
+ * @param err     an error description
+ * @return TRUE on success, FALSE otherwise
+ */
+
+gboolean qfTraceJoinFanout(qfTraceSource_t *lts,
+                           uint16_t group,
+                           GError **err);
+
+/**
+ * Set how far behind the wall clock a quiet parallel reader holds its
+ * packet clock. Packets reaching a reader more than this late are merged
+ * out of order, and counted as such in the statistics. Has no effect unless
+ * reading in several threads.
+ *
+ * @param lts      packet source
+ * @param slack_ms reader slack in milliseconds
+ */
+
+void qfTraceSetReaderSlack(qfTraceSource_t *lts,
+                           uint32_t slack_ms);
 
 gboolean qfTraceMain(qfContext_t *ctx);
 
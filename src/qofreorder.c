@@ -0,0 +1,199 @@
+/**
+ * @internal
+ *
+ ** qofreorder.c
+ ** QoF bounded packet reordering
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C)      2013 Brian Trammell.             All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Authors: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/autoinc.h>
+
+#include "qofreorder.h"
+
+/* initial packets held; the buffer doubles as needed */
+#define QF_REORDER_INITIAL  1024
+
+/* a heap entry; packets themselves stay put in the slab */
+typedef struct qfReorderNode_st {
+    uint64_t            ptime_ns;
+    /* arrival order, to keep packets with the same timestamp in order */
+    uint64_t            seq;
+    uint32_t            slot;
+} qfReorderNode_t;
+
+struct qfReorder_st {
+    /* in nanoseconds, like all times here */
+    uint64_t            window;
+    /* packet slab, and a stack of its free slots */
+    qfReorderPkt_t      *pkts;
+    uint32_t            *free;
+    uint32_t            free_count;
+    /* min-heap on (ptime_ns, seq) */
+    qfReorderNode_t     *heap;
+    uint32_t            count;
+    uint32_t            cap;
+    uint64_t            seq;
+    /* newest packet pushed and newest packet released */
+    uint64_t            newest;
+    uint64_t            released;
+    /* statistics */
+    uint64_t            stat_reordered;
+    uint64_t            stat_late;
+    uint32_t            stat_peak;
+};
+
+static gboolean qfReorderBefore(qfReorderNode_t     *a,
+                                qfReorderNode_t     *b)
+{
+    return a->ptime_ns < b->ptime_ns ||
+           (a->ptime_ns == b->ptime_ns && a->seq < b->seq);
+}
+
+static void qfReorderGrow(qfReorder_t           *ro,
+                          uint32_t              cap)
+{
+    uint32_t            i;
+
+    ro->pkts = g_renew(qfReorderPkt_t, ro->pkts, cap);
+    ro->free = g_renew(uint32_t, ro->free, cap);
+    ro->heap = g_renew(qfReorderNode_t, ro->heap, cap);
+
+    /* push new slots highest first, so they are used lowest first */
+    for (i = cap; i > ro->cap; i--) {
+        ro->free[ro->free_count++] = i - 1;
+    }
+    ro->cap = cap;
+}
+
+qfReorder_t *qfReorderAlloc(uint32_t            window_ms)
+{
+    qfReorder_t         *ro = yg_slice_new0(qfReorder_t);
+
+    ro->window = (uint64_t)window_ms * 1000000;
+    qfReorderGrow(ro, QF_REORDER_INITIAL);
+
+    return ro;
+}
+
+void qfReorderFree(qfReorder_t                  *ro)
+{
+    g_free(ro->pkts);
+    g_free(ro->free);
+    g_free(ro->heap);
+    yg_slice_free(qfReorder_t, ro);
+}
+
+void qfReorderPush(qfReorder_t                  *ro,
+                   yfPBuf_t                     *pbuf,
+                   yfIPFragInfo_t               *fraginfo)
+{
+    qfReorderNode_t     node;
+    qfReorderPkt_t      *rp;
+    uint32_t            i, parent;
+
+    /* count packets out of order, and whether we caught them in time */
+    if (pbuf->ptime_ns < ro->released) {
+        ++(ro->stat_late);
+    } else if (pbuf->ptime_ns < ro->newest) {
+        ++(ro->stat_reordered);
+    } else {
+        ro->newest = pbuf->ptime_ns;
+    }
+
+    /* copy the packet into a free slot */
+    if (!ro->free_count) qfReorderGrow(ro, ro->cap * 2);
+    node.ptime_ns = pbuf->ptime_ns;
+    node.seq = ro->seq++;
+    node.slot = ro->free[--(ro->free_count)];
+    rp = &ro->pkts[node.slot];
+    memcpy(&rp->pbuf, pbuf, sizeof(yfPBuf_t));
+    if (fraginfo) {
+        memcpy(&rp->fraginfo, fraginfo, sizeof(yfIPFragInfo_t));
+    } else {
+        rp->fraginfo.frag = 0;
+    }
+
+    /* and sift it up the heap */
+    for (i = ro->count++; i; i = parent) {
+        parent = (i - 1) / 2;
+        if (!qfReorderBefore(&node, &ro->heap[parent])) break;
+        ro->heap[i] = ro->heap[parent];
+    }
+    ro->heap[i] = node;
+
+    if (ro->count > ro->stat_peak) ro->stat_peak = ro->count;
+}
+
+qfReorderPkt_t *qfReorderPeek(qfReorder_t       *ro,
+                              gboolean          flush)
+{
+    if (!ro->count) return NULL;
+
+    /* hold packets until a full window has passed */
+    if (!flush && ro->heap[0].ptime_ns + ro->window > ro->newest) {
+        return NULL;
+    }
+
+    return &ro->pkts[ro->heap[0].slot];
+}
+
+void qfReorderPop(qfReorder_t                   *ro)
+{
+    qfReorderNode_t     last;
+    uint32_t            i, child;
+
+    if (!ro->count) return;
+
+    /* free the earliest packet's slot */
+    if (ro->heap[0].ptime_ns > ro->released) {
+        ro->released = ro->heap[0].ptime_ns;
+    }
+    ro->free[ro->free_count++] = ro->heap[0].slot;
+
+    /* and sift the last node down from the top */
+    last = ro->heap[--(ro->count)];
+    for (i = 0; (child = 2 * i + 1) < ro->count; i = child) {
+        if (child + 1 < ro->count &&
+            qfReorderBefore(&ro->heap[child + 1], &ro->heap[child]))
+        {
+            ++child;
+        }
+        if (!qfReorderBefore(&ro->heap[child], &last)) break;
+        ro->heap[i] = ro->heap[child];
+    }
+    ro->heap[i] = last;
+}
+
+void qfReorderGetStats(qfReorder_t              *ro,
+                       uint64_t                 *reordered,
+                       uint64_t                 *late)
+{
+    *reordered = ro->stat_reordered;
+    *late = ro->stat_late;
+}
+
+void qfReorderDumpStats(qfReorder_t             *ro,
+                        uint64_t                packetTotal)
+{
+    g_debug("Reordered %llu packets (%3.2f%%) within a %llu ms window; "
+            "peak %u packets held.",
+            (long long unsigned int)ro->stat_reordered,
+            packetTotal ?
+            ((double)ro->stat_reordered / (double)packetTotal * 100) : 0.0,
+            (long long unsigned int)(ro->window / 1000000), ro->stat_peak);
+    if (ro->stat_late) {
+        g_warning("%llu packets arrived too late to reorder. (%3.2f%%)",
+                  (long long unsigned int)ro->stat_late,
+                  packetTotal ?
+                  ((double)ro->stat_late / (double)packetTotal * 100) : 0.0);
+    }
+}
@@ -0,0 +1,119 @@
+/**
+ * @internal
+ *
+ ** qofreorder.h
+ ** QoF bounded packet reordering
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C)      2013 Brian Trammell.             All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Authors: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#ifndef _QOF_REORDER_H_
+#define _QOF_REORDER_H_
+
+#include <qof/autoinc.h>
+#include <qof/decode.h>
+
+/**
+ * A reorder buffer sits between the decoder and the flow and fragment
+ * tables, which reject any packet from an earlier millisecond than the
+ * last one they saw. It holds each decoded packet in a nanosecond
+ * timestamp min-heap until the newest packet seen is a full window later,
+ * then releases packets in timestamp order. Packets arriving up to a window
+ * out of order are thereby put back in order; packets earlier than one
+ * already released are too late, and are released immediately, to be
+ * rejected and counted as before if they fall in an earlier millisecond.
+ *
+ * Packets with the same timestamp are released in the order they arrived.
+ */
+
+struct qfReorder_st;
+typedef struct qfReorder_st qfReorder_t;
+
+/** A packet held in a reorder buffer */
+typedef struct qfReorderPkt_st {
+    yfPBuf_t            pbuf;
+    yfIPFragInfo_t      fraginfo;
+} qfReorderPkt_t;
+
+/**
+ * Allocate a reorder buffer.
+ *
+ * @param window_ms how long to hold packets, in milliseconds of packet time
+ * @return a new reorder buffer
+ */
+
+qfReorder_t *qfReorderAlloc(uint32_t            window_ms);
+
+/**
+ * Free a reorder buffer, discarding any packets it holds.
+ *
+ * @param ro        reorder buffer to free
+ */
+
+void qfReorderFree(qfReorder_t                  *ro);
+
+/**
+ * Copy a decoded packet into a reorder buffer.
+ *
+ * @param ro        reorder buffer
+ * @param pbuf      decoded packet
+ * @param fraginfo  its fragment information, or NULL if not a fragment
+ */
+
+void qfReorderPush(qfReorder_t                  *ro,
+                   yfPBuf_t                     *pbuf,
+                   yfIPFragInfo_t               *fraginfo);
+
+/**
+ * Get the earliest packet in a reorder buffer, if it is ready for release.
+ * The packet stays in the buffer until qfReorderPop(), and stays valid until
+ * the next qfReorderPush().
+ *
+ * @param ro        reorder buffer
+ * @param flush     TRUE to release packets regardless of the window, at
+ *                  end of input
+ * @return the earliest packet, or NULL if none is ready
+ */
+
+qfReorderPkt_t *qfReorderPeek(qfReorder_t       *ro,
+                              gboolean          flush);
+
+/**
+ * Release the packet last returned by qfReorderPeek().
+ *
+ * @param ro        reorder buffer
+ */
+
+void qfReorderPop(qfReorder_t                   *ro);
+
+/**
+ * Get a reorder buffer's counters.
+ *
+ * @param ro        reorder buffer
+ * @param reordered packets that arrived out of order but were put back
+ *                  in order
+ * @param late      packets that arrived too late to be put back in order
+ */
+
+void qfReorderGetStats(qfReorder_t              *ro,
+                       uint64_t                 *reordered,
+                       uint64_t                 *late);
+
+/**
+ * Log a reorder buffer's counters.
+ *
+ * @param ro        reorder buffer
+ * @param packetTotal total packets metered, for percentages
+ */
+
+void qfReorderDumpStats(qfReorder_t             *ro,
+                        uint64_t                packetTotal);
+
+#endif
@@ -25,34 +25,41 @@ static int qfWrapCompare(uint32_t a, uint32_t b) {
 
 static void qfRttSetAckWait(qfRttDir_t  *dir,
                             uint32_t    seq,
-                            uint32_t    ms)
+                            uint32_t    us)
 {
     dir->ackwait = 1;
     dir->ecrwait = 0;
-    dir->lms = ms;
+    dir->lus = us;
     dir->tsack = seq;
 }
 
 
 static void qfRttSetEcrWait(qfRttDir_t  *dir,
                             uint32_t    tsval,
-                            uint32_t    ms)
+                            uint32_t    us)
 {
     dir->ackwait = 0;
     dir->ecrwait = 1;
-    dir->lms = ms;
+    dir->lus = us;
     dir->tsack = tsval;
 }
 
+/* time since a direction started waiting, clamped to fit an observation */
+static uint32_t qfRttElapsed(qfRttDir_t *dir,
+                             uint32_t   us)
+{
+    return (us - dir->lus) > QF_RTT_OBS_MAX ? QF_RTT_OBS_MAX : us - dir->lus;
+}
+
 static int qfRttSample(qfRtt_t     *rtt)
 {
-    if (rtt->fwd.obs_ms && rtt->rev.obs_ms) {
-        sstLinSmoothAdd(&rtt->val, rtt->fwd.obs_ms + rtt->rev.obs_ms);
+    if (rtt->fwd.obs_us && rtt->rev.obs_us) {
+        sstLinSmoothAdd(&rtt->val, rtt->fwd.obs_us + rtt->rev.obs_us);
 #if QOF_RTT_DEBUG
         yfFlow_t *f = (yfFlow_t *)(((uint8_t*)rtt) - offsetof(yfFlow_t, rtt));
         fprintf(stderr,"%10llu fwd %4u rev %4u sample %4u last %4u min %4u n %4u\n",
-                f->fid, rtt->fwd.obs_ms, rtt->rev.obs_ms,
-                rtt->fwd.obs_ms + rtt->rev.obs_ms,
+                f->fid, rtt->fwd.obs_us, rtt->rev.obs_us,
+                rtt->fwd.obs_us + rtt->rev.obs_us,
                 rtt->val.val, rtt->val.min, rtt->val.n);
 #endif
         return 1;
@@ -67,7 +74,7 @@ void qfRttSegment(qfRtt_t           *rtt,
                   uint32_t          ack,
                   uint32_t          tsval,
                   uint32_t          tsecr,
-                  uint32_t          ms,
+                  uint32_t          us,
                   uint8_t           tcpflags,
                   unsigned          reverse)
 {
@@ -95,7 +102,7 @@ void qfRttSegment(qfRtt_t           *rtt,
         qfWrapCompare(ack, fdir->tsack) >= 0)
     {
         /* got an ACK we were waiting for */
-        fdir->obs_ms = ms - fdir->lms;
+        fdir->obs_us = qfRttElapsed(fdir, us);
         if (qfRttSample(rtt)) {
 #if QOF_RTT_DEBUG
             fprintf(stderr, "\ton %3s ack %u for seq %u (%u)\n", dirname,
@@ -104,14 +111,14 @@ void qfRttSegment(qfRtt_t           *rtt,
         }
         fdir->ackwait = 0;
         if (tsval) {
-            qfRttSetEcrWait(rdir, tsval, ms);
+            qfRttSetEcrWait(rdir, tsval, us);
         }
             
     } else if (fdir->ecrwait && qfWrapCompare(tsecr, fdir->tsack) >= 0) {
         /* got a TSECR we were waiting for */
-        if ((ms - fdir->lms) > fdir->obs_ms) {
+        if (qfRttElapsed(fdir, us) > fdir->obs_us) {
             /* Minimize measured RTT on TSECR samples */
-            fdir->obs_ms = ms - fdir->lms;
+            fdir->obs_us = qfRttElapsed(fdir, us);
             if (qfRttSample(rtt)) {
 #if QOF_RTT_DEBUG
                 fprintf(stderr, "\ton %s ecr %u for val %u (%u)\n", dirname,
@@ -120,8 +127,8 @@ void qfRttSegment(qfRtt_t           *rtt,
             }
         }
         fdir->ecrwait = 0;
-        qfRttSetAckWait(rdir, seq, ms);
+        qfRttSetAckWait(rdir, seq, us);
     } else if (!rdir->ackwait && !rdir->ecrwait) {
-        qfRttSetAckWait(rdir, seq, ms);
+        qfRttSetAckWait(rdir, seq, us);
     }
 }
\ No newline at end of file
@@ -173,32 +173,32 @@ static int qfSeqGapFill(qfSeq_t *qs, uint32_t a, uint32_t b) {
     
 }
 
-static void qfCountLoss(qfSeq_t *qs, qfRtt_t *rtt, uint32_t ms) {
+static void qfCountLoss(qfSeq_t *qs, qfRtt_t *rtt, uint32_t us) {
 
     /* only count one loss indication per RTT */
-    if (ms > (qs->losslms + rtt->val.val)) {
-        qs->losslms = ms;
+    if ((us - qs->losslus) > (uint32_t)rtt->val.val) {
+        qs->losslus = us;
         qs->lossct++;
     }
 }
 
 void qfSeqFirstSegment(qfSeq_t *qs, uint8_t flags, uint32_t seq, uint32_t oct,
-                       uint32_t ms, uint32_t tsval, gboolean do_ts) {
+                       uint32_t us, uint32_t tsval, gboolean do_ts) {
     qs->isn = seq;
     qs->nsn = seq + oct + ((flags & YF_TF_SYN) ? 1 : 0) ;
-    qs->advlms = ms;
+    qs->advlus = us;
     if (do_ts && tsval) {
-        qs->initlms = ms;
+        qs->initlus = us;
         qs->initsval = tsval;
     }
 }
 
 int qfSeqSegment(qfSeq_t *qs, qfRtt_t *rtt, uint16_t mss,
                  uint8_t flags, uint32_t seq, uint32_t oct,
-                 uint32_t ms, uint32_t tsval,
+                 uint32_t us, uint32_t tsval,
                  gboolean do_ts, gboolean do_iat) {
 
-    uint32_t lastms = 0;
+    uint32_t lastus = 0;
     
     /* Empty segments don't count */
     if (!oct) return 0;
@@ -209,7 +209,7 @@ int qfSeqSegment(qfSeq_t *qs, qfRtt_t *rtt, uint16_t mss,
             qs->maxooo = seq - qs->nsn;
         }
         if (qfSeqGapFill(qs, seq, seq + oct)) {
-            qfCountLoss(qs, rtt, ms);
+            qfCountLoss(qs, rtt, us);
         }
     } else {
         /* Sequence beyond NSN: push */
@@ -217,7 +217,7 @@ int qfSeqSegment(qfSeq_t *qs, qfRtt_t *rtt, uint16_t mss,
             qfSeqGapPush(qs, qs->nsn, seq, mss);
 
             /* signal loss for burst tracking */
-            qfCountLoss(qs, rtt, ms);
+            qfCountLoss(qs, rtt, us);
             
             /* track max out of order */
             if (seq - qs->nsn > qs->maxooo) {
@@ -239,8 +239,8 @@ int qfSeqSegment(qfSeq_t *qs, qfRtt_t *rtt, uint16_t mss,
             if (tsval < qs->advtsval) {
                 qs->tsvalwrap++;
             }
-            if (ms < qs->advlms) {
-                qs->lmswrap++;
+            if (us < qs->advlus) {
+                qs->luswrap++;
             }
 
             /* save current value */
@@ -248,17 +248,18 @@ int qfSeqSegment(qfSeq_t *qs, qfRtt_t *rtt, uint16_t mss,
         }
 
         /* and advance time */
-        lastms = qs->advlms;
-        qs->advlms = ms;
+        lastus = qs->advlus;
+        qs->advlus = us;
 
         /* calculate interarrival/interdeparture time of advancing segments */
         if (do_iat) {
             uint32_t iat = 0, idt = 0, hz = 0;
             
-            iat = ms - lastms;
+            iat = us - lastus;
             sstMeanAdd(&qs->seg_iat, iat);
             if (do_ts && tsval && (hz = qfTimestampHz(qs))) {
-                idt = (1000 * (tsval - qs->advtsval)) / hz;
+                idt = (uint32_t)((uint64_t)1000000 *
+                                 (tsval - qs->advtsval) / hz);
                 sstMeanAdd(&qs->seg_variat, iat - idt);
             }
         }
@@ -302,11 +303,11 @@ uint32_t qfTimestampHz(qfSeq_t *qs)
 {
     uint64_t val_interval =
     (((uint64_t)qs->tsvalwrap * k2e32) + qs->advtsval - qs->initsval);
-    uint64_t lms_interval =
-    (((uint64_t)qs->lmswrap * k2e32) + qs->advlms - qs->initlms);
+    uint64_t lus_interval =
+    (((uint64_t)qs->luswrap * k2e32) + qs->advlus - qs->initlus);
     
-    if (lms_interval && qs->initsval && qs->advtsval) {
-        return (uint32_t)(val_interval * 1000 / lms_interval);
+    if (lus_interval && qs->initsval && qs->advtsval) {
+        return (uint32_t)(val_interval * 1000000 / lus_interval);
     } else {
         return 0;
     }
@@ -0,0 +1,579 @@
+/**
+ * @internal
+ *
+ ** qofshard.c
+ ** QoF sharded multithreaded flow metering
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C)      2013 Brian Trammell.             All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Authors: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/autoinc.h>
+#include <qof/yafcore.h>
+#include <qof/yaftab.h>
+#include <qof/yafrag.h>
+
+#include "qofshard.h"
+
+/* packets per work batch */
+#define QF_SHARD_BATCH      256
+/* work batches per shard; bounds how far the input runs ahead of a worker */
+#define QF_SHARD_DEPTH      16
+/* export records per record batch */
+#define QF_SHARD_RECS       128
+/* longest a shard goes without a batch, in milliseconds of packet time */
+#define QF_SHARD_TICK       100
+
+typedef struct qfShardPkt_st {
+    yfPBuf_t            pbuf;
+    yfIPFragInfo_t      fraginfo;
+} qfShardPkt_t;
+
+/* packets on their way from the input thread to a worker */
+typedef struct qfShardBatch_st {
+    /* input packet clock at handoff */
+    uint64_t            ctime;
+    /* close all flows after this batch, and stop */
+    gboolean            close;
+    unsigned int        count;
+    qfShardPkt_t        pkt[QF_SHARD_BATCH];
+} qfShardBatch_t;
+
+typedef struct qfShardStats_st {
+    uint64_t            packets;
+    uint64_t            flows;
+    uint64_t            rej_pkts;
+    uint32_t            peak;
+    uint32_t            flush;
+    uint32_t            frag_dropped;
+    uint32_t            frag_assembled;
+    uint64_t            shed;
+    uint64_t            shortidle;
+    uint64_t            memevict;
+    uint64_t            peakmem;
+    yfFlowTabTelemetry_t tel;
+} qfShardStats_t;
+
+struct qfShard_st;
+
+/* export records on their way from a worker to the exporter, along with a
+   snapshot of the worker's statistics */
+typedef struct qfShardRecBatch_st {
+    struct qfShard_st   *shard;
+    /* last batch from this worker */
+    gboolean            done;
+    qfShardStats_t      stats;
+    unsigned int        count;
+    uint16_t            tid[QF_SHARD_RECS];
+    uint8_t             *recs;
+} qfShardRecBatch_t;
+
+typedef struct qfShard_st {
+    qfShardSet_t        *set;
+    GThread             *thread;
+    /* owned by the worker */
+    yfFlowTab_t         *flowtab;
+    yfFragTab_t         *fragtab;
+    qfShardRecBatch_t   *rb;
+    /* full and empty work batches */
+    GAsyncQueue         *workq;
+    GAsyncQueue         *freeq;
+    /* owned by the input thread */
+    qfShardBatch_t      *batch;
+    uint64_t            handoff;
+    qfShardStats_t      stats;
+} qfShard_t;
+
+struct qfShardSet_st {
+    unsigned int        count;
+    qfShard_t           *shards;
+    /* full and empty record batches */
+    GAsyncQueue         *exportq;
+    GAsyncQueue         *recfreeq;
+    size_t              recsz;
+    /* input packet clock */
+    uint64_t            ctime;
+    /* workers not yet done */
+    unsigned int        running;
+    gboolean            finished;
+    gboolean            defrag;
+};
+
+static qfShardRecBatch_t *qfShardRecBatch(qfShard_t      *shard)
+{
+    qfShardSet_t        *set = shard->set;
+    qfShardRecBatch_t   *rb;
+
+    if (shard->rb) return shard->rb;
+
+    if (!(rb = g_async_queue_try_pop(set->recfreeq))) {
+        rb = g_new0(qfShardRecBatch_t, 1);
+        rb->recs = g_malloc(set->recsz * QF_SHARD_RECS);
+    }
+    rb->shard = shard;
+    rb->done = FALSE;
+    rb->count = 0;
+
+    return (shard->rb = rb);
+}
+
+static void qfShardSendRecs(qfShard_t       *shard,
+                            gboolean        done)
+{
+    qfShardRecBatch_t   *rb = qfShardRecBatch(shard);
+
+    yfGetFlowTabStats(shard->flowtab, &rb->stats.packets, &rb->stats.flows,
+                      &rb->stats.rej_pkts, &rb->stats.peak, &rb->stats.flush);
+    yfGetFlowTabMemStats(shard->flowtab, &rb->stats.shed,
+                         &rb->stats.shortidle, &rb->stats.memevict,
+                         &rb->stats.peakmem);
+    yfGetFlowTabTelemetry(shard->flowtab, &rb->stats.tel);
+    if (shard->fragtab) {
+        yfGetFragTabStats(shard->fragtab, &rb->stats.frag_dropped,
+                          &rb->stats.frag_assembled);
+    }
+    rb->done = done;
+
+    g_async_queue_push(shard->set->exportq, rb);
+    shard->rb = NULL;
+}
+
+static gboolean qfShardWriteFlow(void       *wctx,
+                                 yfFlow_t   *flow,
+                                 GError     **err)
+{
+    qfShard_t           *shard = (qfShard_t *)wctx;
+    qfShardRecBatch_t   *rb = qfShardRecBatch(shard);
+
+    if (!yfFlowToRec(flow, rb->recs + rb->count * shard->set->recsz,
+                     &rb->tid[rb->count], err))
+    {
+        return FALSE;
+    }
+
+    if (++(rb->count) == QF_SHARD_RECS) {
+        qfShardSendRecs(shard, FALSE);
+    }
+
+    return TRUE;
+}
+
+static gpointer qfShardWorker(gpointer      data)
+{
+    qfShard_t           *shard = (qfShard_t *)data;
+    qfShardBatch_t      *batch;
+    qfShardPkt_t        *sp;
+    gboolean            close = FALSE;
+    unsigned int        i;
+
+    while (!close) {
+        batch = (qfShardBatch_t *)g_async_queue_pop(shard->workq);
+
+        for (i = 0; i < batch->count; i++) {
+            sp = &batch->pkt[i];
+
+            /* reassemble fragments; qof keeps no payload, so the fragment
+               table doesn't need the packet itself */
+            if (sp->fraginfo.frag) {
+                yfDefragPBuf(shard->fragtab, &sp->fraginfo, &sp->pbuf,
+                             NULL, 0);
+            }
+
+            /* Skip time zero packets (these are marked invalid) */
+            if (!sp->pbuf.ptime) {
+                continue;
+            }
+
+            yfFlowPBuf(shard->flowtab, &sp->pbuf);
+        }
+
+        /* keep time with the input, whether we've seen packets or not */
+        yfFlowTabAdvanceTime(shard->flowtab, batch->ctime);
+        close = batch->close;
+        g_async_queue_push(shard->freeq, batch);
+
+        /* flush into record batches; these writes can't fail */
+        yfFlowTabFlushTo(shard->flowtab, close, qfShardWriteFlow, shard, NULL);
+        qfShardSendRecs(shard, close);
+    }
+
+    return NULL;
+}
+
+static unsigned int qfShardIndex(qfShardSet_t    *set,
+                                 yfPBuf_t        *pbuf)
+{
+    /* the decoder's hash without ports is symmetric in source and
+       destination, and lands fragments with the rest of their flow */
+    return pbuf->pairhash % set->count;
+}
+
+static qfShardBatch_t *qfShardBatchGet(qfShard_t      *shard)
+{
+    qfShardBatch_t      *batch;
+
+    if (shard->batch) return shard->batch;
+
+    /* wait for the worker to return a batch if it's behind */
+    batch = (qfShardBatch_t *)g_async_queue_pop(shard->freeq);
+    batch->close = FALSE;
+    batch->count = 0;
+
+    return (shard->batch = batch);
+}
+
+static void qfShardHandoff(qfShard_t        *shard)
+{
+    shard->batch->ctime = shard->set->ctime;
+    g_async_queue_push(shard->workq, shard->batch);
+    shard->batch = NULL;
+    shard->handoff = shard->set->ctime;
+}
+
+qfShardSet_t *qfShardSetAlloc(qfConfig_t         *cfg,
+                              unsigned int       count)
+{
+    qfShardSet_t        *set;
+    qfShard_t           *shard;
+    unsigned int        i, j;
+
+#if !GLIB_CHECK_VERSION(2,32,0)
+    if (!g_thread_supported()) g_thread_init(NULL);
+#endif
+
+    set = g_new0(qfShardSet_t, 1);
+    set->count = count;
+    set->shards = g_new0(qfShard_t, count);
+    set->exportq = g_async_queue_new();
+    set->recfreeq = g_async_queue_new();
+    set->recsz = (yfFlowRecSize() + 7) & ~7;
+    set->running = count;
+    set->defrag = cfg->max_fragtab ? TRUE : FALSE;
+
+    for (i = 0; i < count; i++) {
+        shard = &set->shards[i];
+        shard->set = set;
+
+        /* split table limits evenly; flow IDs i+1, i+1+count, ... */
+        shard->flowtab = yfFlowTabAlloc(cfg->ito_s * 1000,
+                                        cfg->ato_s * 1000,
+                                        cfg->max_flow_oct,
+                                        cfg->max_flow_pkt,
+                                        cfg->ato_rtts,
+                                        (cfg->max_flowtab + count - 1) / count,
+                                        !cfg->enable_biflow,
+                                        cfg->enable_silk,
+                                        cfg->enable_mac,
+                                        cfg->enable_seq,
+                                        cfg->enable_ack,
+                                        cfg->enable_rtt,
+                                        cfg->enable_rwin,
+                                        cfg->enable_tcpopt,
+                                        cfg->enable_ts,
+                                        cfg->enable_iat);
+        yfFlowTabSetFlowIdSpace(shard->flowtab, i + 1, count);
+        yfFlowTabSetMemoryLimit(shard->flowtab, cfg->max_flowmem / count);
+        yfFlowTabSetFlushQuanta(shard->flowtab, cfg->flush_expire,
+                                cfg->flush_export);
+        if (cfg->enable_vlan_part || cfg->vlan_max_flows) {
+            yfFlowTabSetVlanPartitions(shard->flowtab,
+                                (cfg->vlan_max_flows + count - 1) / count);
+        }
+
+        if (cfg->max_fragtab) {
+            shard->fragtab = yfFragTabAlloc(30000,
+                                (cfg->max_fragtab + count - 1) / count);
+        }
+
+        shard->workq = g_async_queue_new();
+        shard->freeq = g_async_queue_new();
+        for (j = 0; j < QF_SHARD_DEPTH; j++) {
+            g_async_queue_push(shard->freeq, g_new(qfShardBatch_t, 1));
+        }
+
+#if GLIB_CHECK_VERSION(2,32,0)
+        shard->thread = g_thread_new("qof-shard", qfShardWorker, shard);
+#else
+        shard->thread = g_thread_create(qfShardWorker, shard, TRUE, NULL);
+        if (!shard->thread) {
+            g_error("cannot start flow metering thread %u", i);
+        }
+#endif
+    }
+
+    g_debug("metering flows in %u worker threads", count);
+
+    return set;
+}
+
+void qfShardSetFree(qfShardSet_t                 *set)
+{
+    qfShard_t           *shard;
+    qfShardBatch_t      *batch;
+    qfShardRecBatch_t   *rb;
+    unsigned int        i;
+
+    /* stop workers if still running */
+    qfShardFinish(set, NULL, NULL);
+
+    for (i = 0; i < set->count; i++) {
+        shard = &set->shards[i];
+        while ((batch = g_async_queue_try_pop(shard->freeq))) {
+            g_free(batch);
+        }
+        g_async_queue_unref(shard->freeq);
+        g_async_queue_unref(shard->workq);
+        if (shard->fragtab) yfFragTabFree(shard->fragtab);
+        yfFlowTabFree(shard->flowtab);
+    }
+
+    while ((rb = g_async_queue_try_pop(set->recfreeq))) {
+        g_free(rb->recs);
+        g_free(rb);
+    }
+    g_async_queue_unref(set->recfreeq);
+    g_async_queue_unref(set->exportq);
+
+    g_free(set->shards);
+    g_free(set);
+}
+
+void qfShardDispatch(qfShardSet_t                *set,
+                     yfPBuf_t                    *pbuf,
+                     yfIPFragInfo_t              *fraginfo)
+{
+    qfShard_t           *shard = &set->shards[qfShardIndex(set, pbuf)];
+    qfShardBatch_t      *batch = qfShardBatchGet(shard);
+    qfShardPkt_t        *sp = &batch->pkt[batch->count++];
+
+    memcpy(&sp->pbuf, pbuf, sizeof(yfPBuf_t));
+    if (set->defrag && fraginfo) {
+        memcpy(&sp->fraginfo, fraginfo, sizeof(yfIPFragInfo_t));
+    } else {
+        sp->fraginfo.frag = 0;
+    }
+
+    if (pbuf->ptime > set->ctime) {
+        set->ctime = pbuf->ptime;
+    }
+
+    if (batch->count == QF_SHARD_BATCH) {
+        qfShardHandoff(shard);
+    }
+}
+
+void qfShardTick(qfShardSet_t                    *set)
+{
+    qfShard_t           *shard;
+    unsigned int        i;
+
+    for (i = 0; i < set->count; i++) {
+        shard = &set->shards[i];
+        if (set->ctime - shard->handoff >= QF_SHARD_TICK) {
+            qfShardBatchGet(shard);
+            qfShardHandoff(shard);
+        }
+    }
+}
+
+static gboolean qfShardWriteRecs(qfShardSet_t           *set,
+                                 qfShardRecBatch_t      *rb,
+                                 fBuf_t                 *fbuf,
+                                 GError                 **err)
+{
+    qfShard_t           *shard = rb->shard;
+    gboolean            ok = TRUE;
+    unsigned int        i;
+
+    memcpy(&shard->stats, &rb->stats, sizeof(qfShardStats_t));
+    if (rb->done) {
+        --(set->running);
+    }
+
+    for (i = 0; fbuf && i < rb->count; i++) {
+        if (!yfWriteFlowRec(fbuf, rb->recs + i * set->recsz, rb->tid[i],
+                            err))
+        {
+            ok = FALSE;
+            break;
+        }
+    }
+
+    g_async_queue_push(set->recfreeq, rb);
+    return ok;
+}
+
+gboolean qfShardExport(qfShardSet_t              *set,
+                       fBuf_t                    *fbuf,
+                       GError                    **err)
+{
+    qfShardRecBatch_t   *rb;
+
+    while ((rb = g_async_queue_try_pop(set->exportq))) {
+        if (!qfShardWriteRecs(set, rb, fbuf, err)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+gboolean qfShardFinish(qfShardSet_t              *set,
+                       fBuf_t                    *fbuf,
+                       GError                    **err)
+{
+    qfShardRecBatch_t   *rb;
+    gboolean            ok = TRUE;
+    unsigned int        i;
+
+    if (set->finished) return TRUE;
+
+    /* hand over the last batches, telling workers to close and stop */
+    for (i = 0; i < set->count; i++) {
+        qfShardBatchGet(&set->shards[i])->close = TRUE;
+        qfShardHandoff(&set->shards[i]);
+    }
+
+    /* export until every worker is done; keep draining after an error */
+    while (set->running) {
+        rb = (qfShardRecBatch_t *)g_async_queue_pop(set->exportq);
+        if (!qfShardWriteRecs(set, rb, ok ? fbuf : NULL, err)) {
+            ok = FALSE;
+        }
+    }
+
+    for (i = 0; i < set->count; i++) {
+        g_thread_join(set->shards[i].thread);
+    }
+    set->finished = TRUE;
+
+    return ok;
+}
+
+uint64_t qfShardCurrentTime(qfShardSet_t         *set)
+{
+    return set->ctime;
+}
+
+void qfShardGetStats(qfShardSet_t                *set,
+                     uint64_t                    *packets,
+                     uint64_t                    *flows,
+                     uint64_t                    *rej_pkts,
+                     uint32_t                    *peak,
+                     uint32_t                    *flush,
+                     uint32_t                    *frag_dropped,
+                     uint32_t                    *frag_assembled)
+{
+    qfShardStats_t      *ss;
+    unsigned int        i;
+
+    *packets = *flows = *rej_pkts = 0;
+    *peak = *flush = *frag_dropped = *frag_assembled = 0;
+
+    for (i = 0; i < set->count; i++) {
+        ss = &set->shards[i].stats;
+        *packets += ss->packets;
+        *flows += ss->flows;
+        *rej_pkts += ss->rej_pkts;
+        /* peaks of different shards need not coincide, so don't sum */
+        if (ss->peak > *peak) *peak = ss->peak;
+        *flush += ss->flush;
+        *frag_dropped += ss->frag_dropped;
+        *frag_assembled += ss->frag_assembled;
+    }
+}
+
+void qfShardGetMemStats(qfShardSet_t             *set,
+                        uint64_t                 *shed,
+                        uint64_t                 *shortidle,
+                        uint64_t                 *evicted,
+                        uint64_t                 *peakmem)
+{
+    qfShardStats_t      *ss;
+    unsigned int        i;
+
+    *shed = *shortidle = *evicted = *peakmem = 0;
+
+    for (i = 0; i < set->count; i++) {
+        ss = &set->shards[i].stats;
+        *shed += ss->shed;
+        *shortidle += ss->shortidle;
+        *evicted += ss->memevict;
+        if (ss->peakmem > *peakmem) *peakmem = ss->peakmem;
+    }
+}
+
+void qfShardGetTelemetry(qfShardSet_t            *set,
+                         yfFlowTabTelemetry_t    *tel)
+{
+    yfFlowTabTelemetry_t *st;
+    unsigned int        i, j;
+
+    memset(tel, 0, sizeof(*tel));
+
+    for (i = 0; i < set->count; i++) {
+        st = &set->shards[i].stats.tel;
+        tel->created += st->created;
+        tel->end_idle += st->end_idle;
+        tel->end_active += st->end_active;
+        tel->end_closed += st->end_closed;
+        tel->end_resource += st->end_resource;
+        for (j = 0; j < QF_FLOWIDX_HIST; j++) {
+            tel->probe_hist[j] += st->probe_hist[j];
+        }
+        tel->occupancy += st->occupancy;
+        tel->capacity += st->capacity;
+        if (st->max_probe > tel->max_probe) {
+            tel->max_probe = st->max_probe;
+        }
+        tel->tcp_blocks += st->tcp_blocks;
+        if (st->cq_peak > tel->cq_peak) {
+            tel->cq_peak = st->cq_peak;
+        }
+    }
+}
+
+uint64_t qfShardDumpStats(qfShardSet_t           *set,
+                          GTimer                 *timer)
+{
+    qfShardStats_t      *ss;
+    uint64_t            packets = 0, flows = 0;
+    unsigned int        i;
+
+    for (i = 0; i < set->count; i++) {
+        if (set->finished) {
+            /* workers have stopped; the tables themselves are safe to read */
+            g_debug("Shard %u:", i);
+            yfFlowDumpStats(set->shards[i].flowtab, timer);
+            yfFragDumpStats(set->shards[i].fragtab,
+                            set->shards[i].stats.packets);
+        } else {
+            ss = &set->shards[i].stats;
+            g_debug("Shard %u: %llu packets into %llu flows, "
+                    "peak %u flows.", i,
+                    (long long unsigned int)ss->packets,
+                    (long long unsigned int)ss->flows, ss->peak);
+        }
+        packets += set->shards[i].stats.packets;
+        flows += set->shards[i].stats.flows;
+    }
+
+    g_debug("Processed %llu packets into %llu flows in %u shards.",
+            (long long unsigned int)packets,
+            (long long unsigned int)flows, set->count);
+    if (timer) {
+        g_debug("  Mean flow rate %.2f/s.",
+                ((double)flows / g_timer_elapsed(timer, NULL)));
+        g_debug("  Mean packet rate %.2f/s.",
+                ((double)packets / g_timer_elapsed(timer, NULL)));
+    }
+
+    return packets;
+}
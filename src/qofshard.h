@@ -0,0 +1,168 @@
+/**
+ * @internal
+ *
+ ** qofshard.h
+ ** QoF sharded multithreaded flow metering
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C)      2013 Brian Trammell.             All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Authors: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#ifndef _QOF_SHARD_H_
+#define _QOF_SHARD_H_
+
+#include <qof/autoinc.h>
+#include <qof/decode.h>
+#include "qofconfig.h"
+
+/**
+ * A shard set splits flow metering across worker threads. The input thread
+ * decodes each packet and dispatches it by a symmetric hash of its address
+ * pair to one of the shards; each shard's worker owns its own flow table and
+ * fragment table. Keying on addresses alone keeps both directions of a flow,
+ * and every fragment of a datagram, on the same shard. Workers build export
+ * records for the flows they close; the input thread, as the single exporter,
+ * writes these to the output message buffer.
+ *
+ * Flow IDs are assigned from disjoint arithmetic sequences per shard, so they
+ * remain unique across the whole process.
+ */
+
+struct qfShardSet_st;
+typedef struct qfShardSet_st qfShardSet_t;
+
+/**
+ * Allocate a shard set and start its worker threads.
+ *
+ * @param cfg       configuration to build each shard's tables from
+ * @param count     number of shards (worker threads)
+ * @return a new shard set
+ */
+
+qfShardSet_t *qfShardSetAlloc(qfConfig_t         *cfg,
+                              unsigned int       count);
+
+/**
+ * Stop a shard set's workers, discarding any flows still open, and free it.
+ * Use qfShardFinish() first to export open flows.
+ *
+ * @param shards    shard set to free
+ */
+
+void qfShardSetFree(qfShardSet_t                 *shards);
+
+/**
+ * Dispatch a decoded packet to its shard. The packet is copied; fragments
+ * are reassembled by the shard's own fragment table.
+ *
+ * @param shards    shard set to dispatch to
+ * @param pbuf      decoded packet
+ * @param fraginfo  fragment information from the decoder, or NULL
+ */
+
+void qfShardDispatch(qfShardSet_t                *shards,
+                     yfPBuf_t                    *pbuf,
+                     yfIPFragInfo_t              *fraginfo);
+
+/**
+ * Hand partially filled batches over to workers which have not been handed
+ * a batch for a while, so that quiet shards still see the packet clock
+ * advance and time out their flows. Call once per input group.
+ *
+ * @param shards    shard set to tick
+ */
+
+void qfShardTick(qfShardSet_t                    *shards);
+
+/**
+ * Write flows closed by the workers since the last call to a message
+ * buffer. Does not wait for workers.
+ *
+ * @param shards    shard set to export from
+ * @param fbuf      message buffer to write to
+ * @param err       an error description
+ * @return TRUE on success, FALSE if a write failed
+ */
+
+gboolean qfShardExport(qfShardSet_t              *shards,
+                       fBuf_t                    *fbuf,
+                       GError                    **err);
+
+/**
+ * Close all open flows at end of input, wait for the workers to finish, and
+ * write all remaining flows to a message buffer.
+ *
+ * @param shards    shard set to finish
+ * @param fbuf      message buffer to write to, or NULL to discard flows
+ * @param err       an error description
+ * @return TRUE on success, FALSE if a write failed
+ */
+
+gboolean qfShardFinish(qfShardSet_t              *shards,
+                       fBuf_t                    *fbuf,
+                       GError                    **err);
+
+/**
+ * Get the packet clock of the input thread.
+ *
+ * @param shards    shard set
+ * @return timestamp of the last packet dispatched
+ */
+
+uint64_t qfShardCurrentTime(qfShardSet_t         *shards);
+
+/**
+ * Get flow and fragment table statistics, summed across all shards, as of
+ * the last call to qfShardExport(). Arguments as yfGetFlowTabStats() and
+ * yfGetFragTabStats(); the peak flow count is the largest of any shard's.
+ */
+
+void qfShardGetStats(qfShardSet_t                *shards,
+                     uint64_t                    *packets,
+                     uint64_t                    *flows,
+                     uint64_t                    *rej_pkts,
+                     uint32_t                    *peak,
+                     uint32_t                    *flush,
+                     uint32_t                    *frag_dropped,
+                     uint32_t                    *frag_assembled);
+
+/**
+ * Get flow table memory pressure statistics, summed across all shards, as of
+ * the last call to qfShardExport(). Arguments as yfGetFlowTabMemStats();
+ * peak memory is the largest of any shard's peak.
+ */
+
+void qfShardGetMemStats(qfShardSet_t             *shards,
+                        uint64_t                 *shed,
+                        uint64_t                 *shortidle,
+                        uint64_t                 *evicted,
+                        uint64_t                 *peakmem);
+
+/**
+ * Get flow table internals, summed across all shards, as of the last call to
+ * qfShardExport(). Arguments as yfGetFlowTabTelemetry(); the close queue
+ * high-water mark is the highest, and the longest probe sequence the
+ * longest, of any shard's.
+ */
+
+void qfShardGetTelemetry(qfShardSet_t            *shards,
+                         yfFlowTabTelemetry_t    *tel);
+
+/**
+ * Log per-shard and total statistics.
+ *
+ * @param shards    shard set to dump stats for
+ * @param timer     a GTimer containing the runtime, or NULL
+ * @return total number of packets processed
+ */
+
+uint64_t qfShardDumpStats(qfShardSet_t           *shards,
+                          GTimer                 *timer);
+
+#endif
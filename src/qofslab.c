@@ -0,0 +1,211 @@
+/**
+ ** @file qofslab.c
+ **
+ ** Fixed-size object slab allocator for flow table state.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/qofslab.h>
+
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+/* minimum object alignment; regions start their objects one line in */
+#define QF_SLAB_ALIGN       16
+
+/* region header, at the start of each region */
+typedef struct qfSlabRegion_st {
+    struct qfSlabRegion_st  *next;
+} qfSlabRegion_t;
+
+/* free list link, overlaid on the start of each free object */
+typedef struct qfSlabFreeObj_st {
+    struct qfSlabFreeObj_st *next;
+} qfSlabFreeObj_t;
+
+struct qfSlab_st {
+    /* class name */
+    char                *name;
+    /* object size, rounded up to alignment */
+    size_t              objsize;
+    /* objects per region */
+    size_t              per_region;
+    /* mapped regions, most recent first */
+    qfSlabRegion_t      *regions;
+    size_t              region_count;
+    /* objects not yet carved from the most recent region */
+    uint8_t             *fresh;
+    size_t              fresh_count;
+    /* returned objects */
+    qfSlabFreeObj_t     *free;
+    /* objects in use */
+    size_t              live;
+    /* region backing: explicit hugepages, or give up on them */
+    gboolean            huge;
+    gboolean            nohuge;
+};
+
+static qfSlabRegion_t *qfSlabRegionMap(qfSlab_t        *slab)
+{
+    void                *region = NULL;
+
+#if HAVE_SYS_MMAN_H && defined(MAP_ANONYMOUS)
+#ifdef MAP_HUGETLB
+    /* explicit hugepages need a reserved pool; stop trying if there isn't
+       one, but stay with them once they've worked */
+    if (!slab->nohuge) {
+        region = mmap(NULL, QF_SLAB_REGION_SZ, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region == MAP_FAILED) {
+            region = NULL;
+            if (!slab->region_count) slab->nohuge = TRUE;
+        } else {
+            slab->huge = TRUE;
+        }
+    }
+#endif
+    if (!region) {
+        region = mmap(NULL, QF_SLAB_REGION_SZ, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            g_error("cannot map %u bytes for %s slab: %s",
+                    QF_SLAB_REGION_SZ, slab->name, strerror(errno));
+        }
+#ifdef MADV_HUGEPAGE
+        /* fall back to transparent hugepages, if the kernel has them */
+        madvise(region, QF_SLAB_REGION_SZ, MADV_HUGEPAGE);
+#endif
+    }
+#else
+    region = g_malloc0(QF_SLAB_REGION_SZ);
+#endif
+
+    return (qfSlabRegion_t *)region;
+}
+
+static void qfSlabRegionUnmap(qfSlabRegion_t    *region)
+{
+#if HAVE_SYS_MMAN_H && defined(MAP_ANONYMOUS)
+    munmap(region, QF_SLAB_REGION_SZ);
+#else
+    g_free(region);
+#endif
+}
+
+qfSlab_t *qfSlabAlloc(const char        *name,
+                      size_t            objsize,
+                      size_t            align)
+{
+    qfSlab_t            *slab = yg_slice_new0(qfSlab_t);
+
+    if (objsize < sizeof(qfSlabFreeObj_t)) {
+        objsize = sizeof(qfSlabFreeObj_t);
+    }
+    if (align < QF_SLAB_ALIGN) {
+        align = QF_SLAB_ALIGN;
+    }
+    g_assert(align <= QF_SLAB_LINE && !(align & (align - 1)));
+
+    slab->name = g_strdup(name);
+    slab->objsize = (objsize + align - 1) & ~(align - 1);
+    slab->per_region = (QF_SLAB_REGION_SZ - QF_SLAB_LINE) / slab->objsize;
+
+    return slab;
+}
+
+void qfSlabFree(qfSlab_t                *slab)
+{
+    qfSlabRegion_t      *region, *next;
+
+    for (region = slab->regions; region; region = next) {
+        next = region->next;
+        qfSlabRegionUnmap(region);
+    }
+
+    g_free(slab->name);
+    yg_slice_free(qfSlab_t, slab);
+}
+
+void *qfSlabGet(qfSlab_t                *slab)
+{
+    qfSlabRegion_t      *region;
+    void                *obj;
+
+    if (slab->free) {
+        /* recycle; zero since the previous user left state behind */
+        obj = slab->free;
+        slab->free = slab->free->next;
+        memset(obj, 0, slab->objsize);
+    } else {
+        if (!slab->fresh_count) {
+            region = qfSlabRegionMap(slab);
+            region->next = slab->regions;
+            slab->regions = region;
+            ++(slab->region_count);
+            slab->fresh = (uint8_t *)region + QF_SLAB_LINE;
+            slab->fresh_count = slab->per_region;
+        }
+        /* never used; fresh mappings are already zero */
+        obj = slab->fresh;
+        slab->fresh += slab->objsize;
+        --(slab->fresh_count);
+    }
+
+    ++(slab->live);
+    return obj;
+}
+
+void qfSlabPut(qfSlab_t                 *slab,
+               void                     *obj)
+{
+    qfSlabFreeObj_t     *fo = (qfSlabFreeObj_t *)obj;
+
+    fo->next = slab->free;
+    slab->free = fo;
+    --(slab->live);
+}
+
+size_t qfSlabObjSize(qfSlab_t           *slab)
+{
+    return slab->objsize;
+}
+
+void qfSlabStats(qfSlab_t               *slab,
+                 size_t                 *live,
+                 size_t                 *capacity,
+                 size_t                 *mapped,
+                 gboolean               *huge)
+{
+    *live = slab->live;
+    *capacity = slab->region_count * slab->per_region;
+    *mapped = slab->region_count * QF_SLAB_REGION_SZ;
+    *huge = slab->huge;
+}
+
+void qfSlabDumpStats(qfSlab_t           *slab)
+{
+    size_t              live, capacity, mapped;
+    gboolean            huge;
+
+    qfSlabStats(slab, &live, &capacity, &mapped, &huge);
+    if (!capacity) return;
+
+    g_debug("  %s slab: %lu of %lu objects in use (%.1f%%), "
+            "%.1f MB mapped%s.", slab->name,
+            (unsigned long)live, (unsigned long)capacity,
+            ((double)live / (double)capacity) * 100,
+            (double)mapped / (1024 * 1024), huge ? " in hugepages" : "");
+}
@@ -0,0 +1,219 @@
+/**
+ ** @file qofwheel.c
+ **
+ ** Hierarchical timing wheel for flow expiry.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/qofwheel.h>
+#include <qof/picq.h>
+
+#define QF_WHEEL_SLOT_MASK  (QF_WHEEL_SLOTS - 1)
+#define QF_WHEEL_SHIFT(_l_) ((_l_) * QF_WHEEL_SLOT_SHIFT)
+
+typedef struct qfWheelQueue_st {
+    void            *tail;
+    void            *head;
+} qfWheelQueue_t;
+
+struct qfWheel_st {
+    /* slots, level by level */
+    qfWheelQueue_t  slot[QF_WHEEL_LEVELS * QF_WHEEL_SLOTS];
+    /* higher level slots which have come due, to hand back */
+    uint32_t        cascade[QF_WHEEL_LEVELS];
+    unsigned        cascade_count;
+    /* first tick not yet elapsed */
+    uint64_t        clk;
+    /* number of scheduled nodes */
+    size_t          count;
+    /* offset of slot number in node */
+    size_t          slot_offset;
+};
+
+#define QF_WHEEL_NODE_SLOT(_w_, _n_) \
+    (*(uint32_t *)(((uint8_t *)(_n_)) + (_w_)->slot_offset))
+
+qfWheel_t *qfWheelAlloc(size_t          slot_offset)
+{
+    qfWheel_t       *wheel = yg_slice_new0(qfWheel_t);
+
+    wheel->slot_offset = slot_offset;
+
+    return wheel;
+}
+
+void qfWheelFree(qfWheel_t              *wheel)
+{
+    yg_slice_free(qfWheel_t, wheel);
+}
+
+void qfWheelSchedule(qfWheel_t          *wheel,
+                     void               *node,
+                     uint64_t           deadline,
+                     uint64_t           now)
+{
+    uint64_t        dt = deadline >> QF_WHEEL_TICK_SHIFT;
+    unsigned        level, shift = 0;
+
+    /* an empty wheel can skip ahead to the current time */
+    if (!wheel->count && !wheel->cascade_count &&
+        (wheel->clk < (now >> QF_WHEEL_TICK_SHIFT)))
+    {
+        wheel->clk = now >> QF_WHEEL_TICK_SHIFT;
+    }
+
+    /* past deadlines are due on the current tick */
+    if (dt < wheel->clk) {
+        dt = wheel->clk;
+    }
+
+    /* find the finest level whose slots cover the deadline without wrap */
+    for (level = 0; level < QF_WHEEL_LEVELS; level++) {
+        shift = QF_WHEEL_SHIFT(level);
+        if (((dt >> shift) - (wheel->clk >> shift)) < QF_WHEEL_SLOTS) break;
+    }
+
+    /* clamp far deadlines to the last slot; they'll be handed back early */
+    if (level == QF_WHEEL_LEVELS) {
+        level = QF_WHEEL_LEVELS - 1;
+        shift = QF_WHEEL_SHIFT(level);
+        dt = ((wheel->clk >> shift) + QF_WHEEL_SLOTS - 1) << shift;
+    }
+
+    QF_WHEEL_NODE_SLOT(wheel, node) =
+        (level * QF_WHEEL_SLOTS) + ((dt >> shift) & QF_WHEEL_SLOT_MASK);
+    piqEnQ(&wheel->slot[QF_WHEEL_NODE_SLOT(wheel, node)], node);
+    ++(wheel->count);
+}
+
+void qfWheelCancel(qfWheel_t            *wheel,
+                   void                 *node)
+{
+    if (QF_WHEEL_NODE_SLOT(wheel, node) == QF_WHEEL_NONE) {
+        return;
+    }
+
+    piqPick(&wheel->slot[QF_WHEEL_NODE_SLOT(wheel, node)], node);
+    QF_WHEEL_NODE_SLOT(wheel, node) = QF_WHEEL_NONE;
+    --(wheel->count);
+}
+
+static void *qfWheelTake(qfWheel_t      *wheel,
+                         uint32_t       slot)
+{
+    void            *node;
+
+    if ((node = piqDeQ(&wheel->slot[slot]))) {
+        QF_WHEEL_NODE_SLOT(wheel, node) = QF_WHEEL_NONE;
+        --(wheel->count);
+    }
+
+    return node;
+}
+
+void *qfWheelNext(qfWheel_t             *wheel,
+                  uint64_t              now)
+{
+    uint64_t        now_tick = now >> QF_WHEEL_TICK_SHIFT;
+    void            *node;
+    unsigned        level, shift;
+
+    for (;;) {
+        /* hand back nodes from higher level slots which have come due */
+        while (wheel->cascade_count) {
+            if ((node = qfWheelTake(wheel,
+                            wheel->cascade[wheel->cascade_count - 1])))
+            {
+                return node;
+            }
+            --(wheel->cascade_count);
+        }
+
+        /* stop at the current tick; it hasn't elapsed yet */
+        if (wheel->clk >= now_tick) {
+            return NULL;
+        }
+
+        /* skip ahead if there's nothing to do */
+        if (!wheel->count) {
+            wheel->clk = now_tick;
+            return NULL;
+        }
+
+        /* hand back nodes due on this tick */
+        if ((node = qfWheelTake(wheel, wheel->clk & QF_WHEEL_SLOT_MASK))) {
+            return node;
+        }
+
+        /* tick done; advance, noting higher level slots which come due */
+        ++(wheel->clk);
+        for (level = 1; level < QF_WHEEL_LEVELS; level++) {
+            shift = QF_WHEEL_SHIFT(level);
+            if (wheel->clk & ((1ULL << shift) - 1)) break;
+            wheel->cascade[wheel->cascade_count++] = (level * QF_WHEEL_SLOTS) +
+                ((wheel->clk >> shift) & QF_WHEEL_SLOT_MASK);
+        }
+    }
+}
+
+void *qfWheelPopEarliest(qfWheel_t      *wheel,
+                         uint64_t       *slot_end)
+{
+    void            *node;
+    uint64_t        k;
+    unsigned        i, level, shift, first;
+
+    if (!wheel->count) {
+        return NULL;
+    }
+
+    /* slots already due come first */
+    for (i = wheel->cascade_count; i > 0; i--) {
+        if ((node = qfWheelTake(wheel, wheel->cascade[i - 1]))) {
+            shift = QF_WHEEL_SHIFT(wheel->cascade[i - 1] / QF_WHEEL_SLOTS);
+            *slot_end = (((wheel->clk >> shift) + 1) << shift)
+                        << QF_WHEEL_TICK_SHIFT;
+            return node;
+        }
+    }
+
+    /* then level by level from the current position; the current slot of
+       each higher level has already been handed back */
+    for (level = 0; level < QF_WHEEL_LEVELS; level++) {
+        shift = QF_WHEEL_SHIFT(level);
+        first = level ? 1 : 0;
+        for (i = first; i < QF_WHEEL_SLOTS; i++) {
+            k = (wheel->clk >> shift) + i;
+            if ((node = qfWheelTake(wheel, (level * QF_WHEEL_SLOTS) +
+                                           (k & QF_WHEEL_SLOT_MASK))))
+            {
+                /* the last slot also holds deadlines clamped beyond the
+                   wheel's span; rescheduling can't move them, so report
+                   no end */
+                if (level == QF_WHEEL_LEVELS - 1 && i == QF_WHEEL_SLOTS - 1) {
+                    *slot_end = UINT64_MAX;
+                } else {
+                    *slot_end = ((k + 1) << shift) << QF_WHEEL_TICK_SHIFT;
+                }
+                return node;
+            }
+        }
+    }
+
+    /* not reached if count is right */
+    return NULL;
+}
+
+size_t qfWheelCount(qfWheel_t           *wheel)
+{
+    return wheel->count;
+}
@@ -59,23 +59,34 @@
 #define _YAF_SOURCE_
 #include <qof/ring.h>
 
+/* keep producer and consumer positions of lock-free rings apart */
+#define RGA_CACHE_LINE 64
+
 struct rgaRing_st {
     size_t          elt_sz;
     size_t          cap;
     size_t          count;
     size_t          peak;
-    size_t          hrsv;
-    size_t          trsv;
     uint8_t         *base;
     uint8_t         *end;
     uint8_t         *head;
     uint8_t         *tail;
-#if YAF_RING_THREAD
-    GMutex          *mtx;
-    GCond           *cnd_zero;
-    GCond           *cnd_full;
-    uint32_t        interrupt;
-#endif
+    /* lock-free mode and position mask; capacity is a power of two */
+    rgaSync_t       sync;
+    guint           mask;
+    uint8_t         pad_prod[RGA_CACHE_LINE];
+    /* written by producers: committed and (MPSC) reserved positions */
+    volatile gint   lf_head;
+    volatile gint   lf_rsv;
+    /* producer's last view of the tail (SPSC) */
+    guint           lf_tcache;
+    uint8_t         pad_cons[RGA_CACHE_LINE];
+    /* written by the consumer */
+    volatile gint   lf_tail;
+    guint           lf_peak;
+    /* consumer's last view of the head */
+    guint           lf_hcache;
+    uint8_t         pad_end[RGA_CACHE_LINE];
 };
 
 /**
@@ -114,27 +125,30 @@ rgaRing_t *rgaAlloc(
     return ring;
 }
 
-#if YAF_RING_THREAD
 /**
- * rgaAllocThreaded
+ * rgaAllocSync
  *
  *
  *
  */
-rgaRing_t *rgaAllocThreaded(
+rgaRing_t *rgaAllocSync(
     size_t          elt_sz,
-    size_t          cap)
+    size_t          cap,
+    rgaSync_t       sync)
 {
-    rgaRing_t        *ring = rgaAlloc(elt_sz, cap);
+    rgaRing_t       *ring;
+    size_t          pcap = 1;
 
-    /* allocate mutex and conditions */
-    ring->mtx = g_mutex_new();
-    ring->cnd_zero = g_cond_new();
-    ring->cnd_full = g_cond_new();
+    /* round capacity up to a power of two, so positions can run free */
+    while (pcap < cap) pcap <<= 1;
+    g_assert(pcap <= G_MAXINT / 2);
+
+    ring = rgaAlloc(elt_sz, pcap);
+    ring->sync = sync;
+    ring->mask = (guint)pcap - 1;
 
     return ring;
 }
-#endif
 
 /**
  * rgaFree
@@ -149,21 +163,6 @@ void rgaFree(
 
     base_sz = ring->elt_sz * ring->cap;
 
-#if YAF_RING_THREAD
-    /* free conditions and mutex if present */
-    if (ring->cnd_zero) {
-        g_cond_free(ring->cnd_zero);
-    }
-
-    if (ring->cnd_full) {
-        g_cond_free(ring->cnd_full);
-    }
-
-    if (ring->mtx) {
-        g_mutex_free(ring->mtx);
-    }
-#endif
-
     /* free buffer */
     yg_slice_free1(base_sz, ring->base);
 
@@ -183,7 +182,7 @@ uint8_t *rgaNextHead(
     uint8_t         *head;
 
     /* return null if buffer full */
-    if (ring->count >= (ring->cap - ring->trsv)) {
+    if (ring->count >= ring->cap) {
         return NULL;
     }
 
@@ -230,7 +229,7 @@ uint8_t *rgaForceHead(
     ++(ring->count);
     
     /* advance tail pointer if buffer full */
-    if (ring->count >= (ring->cap - ring->trsv)) {
+    if (ring->count >= ring->cap) {
         ring->tail += ring->elt_sz;
         if (ring->tail > ring->end) {
             ring->tail = ring->base;
@@ -264,59 +263,6 @@ uint8_t *rgaPeekHead(rgaRing_t       *ring)
     return ring->head;
 }
 
-
-
-#if YAF_RING_THREAD
-/**
- * rgaNextHead
- *
- *
- *
- */
-uint8_t *rgaNextHead(
-    rgaRing_t       *ring)
-{
-    uint8_t         *head = NULL;
-
-    g_mutex_lock(ring->mtx);
-    while (!ring->interrupt && ((head = rgaNextHead(ring)) == NULL)) {
-        g_cond_wait(ring->cnd_full, ring->mtx);
-    }
-    if (ring->interrupt) {
-        head = NULL;
-        goto end;
-    }
-    if (++(ring->hrsv) > ring->cap) {
-        ring->hrsv = ring->cap;
-    }
-    g_cond_signal(ring->cnd_zero);
-end:
-    g_mutex_unlock(ring->mtx);
-    return head;
-}
-#endif
-
-#if YAF_RING_THREAD
-/**
- * rgaReleaseHead
- *
- *
- *
- */
-void rgaReleaseHead(
-    rgaRing_t       *ring,
-    size_t          rsv)
-{
-    g_mutex_lock(ring->mtx);
-    if (rsv > ring->hrsv) {
-        rsv = ring->hrsv;
-    }
-    ring->hrsv -= rsv;
-    g_cond_signal(ring->cnd_full);
-    g_mutex_unlock(ring->mtx);
-}
-#endif
-
 /**
  * rgaNextTail
  *
@@ -329,7 +275,7 @@ uint8_t *rgaNextTail(
     uint8_t         *tail;
 
     /* return null if buffer empty */
-    if (ring->count <= ring->hrsv) {
+    if (ring->count <= 0) {
         return NULL;
     }
 
@@ -365,90 +311,129 @@ uint8_t *rgaPeekTail(
     return ring->tail;
 }
 
-#if YAF_RING_THREAD
+/* limit a batch to what is available, and to the end of the array */
+static guint rgaBatch(
+    rgaRing_t       *ring,
+    guint           pos,
+    guint           avail,
+    size_t          n)
+{
+    if (avail > n) avail = (guint)n;
+    if (avail > ring->cap - (pos & ring->mask)) {
+        avail = (guint)ring->cap - (pos & ring->mask);
+    }
+    return avail;
+}
+
 /**
- * rgaWaitTail
+ * rgaNextHeadN
  *
  *
  *
  */
-uint8_t *rgaWaitTail(
-    rgaRing_t       *ring)
+uint8_t *rgaNextHeadN(
+    rgaRing_t       *ring,
+    size_t          *n)
 {
-    uint8_t         *tail = NULL;
+    guint           pos, tail, avail;
 
-    g_mutex_lock(ring->mtx);
-    while (!ring->interrupt && ((tail = rgaNextTail(ring)) == NULL)) {
-        g_cond_wait(ring->cnd_zero, ring->mtx);
-    }
-    if (ring->interrupt) {
-        tail = NULL;
-        goto end;
-    }
-    if (++(ring->trsv) >= ring->cap) {
-        ring->trsv = ring->cap;
+    g_assert(ring->sync);
+
+    if (ring->sync == RGA_SYNC_SPSC) {
+        /* only we move the head; only look at the tail when we must */
+        pos = (guint)ring->lf_head;
+        avail = ring->cap - (pos - ring->lf_tcache);
+        if (avail < *n) {
+            ring->lf_tcache = (guint)g_atomic_int_get(&ring->lf_tail);
+            avail = ring->cap - (pos - ring->lf_tcache);
+        }
+        avail = rgaBatch(ring, pos, avail, *n);
+    } else {
+        /* claim positions against other producers */
+        do {
+            pos = (guint)g_atomic_int_get(&ring->lf_rsv);
+            tail = (guint)g_atomic_int_get(&ring->lf_tail);
+            avail = rgaBatch(ring, pos, ring->cap - (pos - tail), *n);
+            if (!avail) break;
+        } while (!g_atomic_int_compare_and_exchange(&ring->lf_rsv,
+                                                    (gint)pos,
+                                                    (gint)(pos + avail)));
     }
-    g_cond_signal(ring->cnd_full);
-end:
-    g_mutex_unlock(ring->mtx);
-    return tail;
+
+    *n = avail;
+    if (!avail) return NULL;
+    return ring->base + (pos & ring->mask) * ring->elt_sz;
 }
-#endif
 
-#if YAF_RING_THREAD
 /**
- * rgaReleaseTail
+ * rgaCommitHead
  *
  *
  *
  */
-void rgaReleaseTail(
+void rgaCommitHead(
     rgaRing_t       *ring,
-    size_t          rsv)
+    uint8_t         *head,
+    size_t          n)
 {
-    g_mutex_lock(ring->mtx);
-    if (rsv > ring->trsv) {
-        rsv = ring->trsv;
+    guint           idx = (guint)((head - ring->base) / ring->elt_sz);
+    guint           pos;
+
+    if (ring->sync == RGA_SYNC_SPSC) {
+        pos = (guint)ring->lf_head;
+    } else {
+        /* publish in reservation order: wait for earlier producers. Less
+           than a ring's worth is reserved, so the index finds our turn. */
+        while (((pos = (guint)g_atomic_int_get(&ring->lf_head)) &
+                ring->mask) != idx)
+        {
+            g_thread_yield();
+        }
     }
-    ring->trsv -= rsv;
-    g_cond_signal(ring->cnd_zero);
-    g_mutex_unlock(ring->mtx);
+
+    g_atomic_int_set(&ring->lf_head, (gint)(pos + n));
 }
-#endif
 
-#if YAF_RING_THREAD
 /**
- * rgaSetInterrupt
+ * rgaNextTailN
  *
  *
  *
  */
-void rgaSetInterrupt(
-    rgaRing_t       *ring)
+uint8_t *rgaNextTailN(
+    rgaRing_t       *ring,
+    size_t          *n)
 {
-    g_mutex_lock(ring->mtx);
-    ++(ring->interrupt);
-    g_cond_broadcast(ring->cnd_zero);
-    g_cond_broadcast(ring->cnd_full);
-    g_mutex_unlock(ring->mtx);
+    guint           pos = (guint)ring->lf_tail;
+    guint           avail;
+
+    g_assert(ring->sync);
+
+    /* only look at the head when what we last saw is used up */
+    avail = ring->lf_hcache - pos;
+    if (avail < *n) {
+        ring->lf_hcache = (guint)g_atomic_int_get(&ring->lf_head);
+        avail = ring->lf_hcache - pos;
+        if (avail > ring->lf_peak) ring->lf_peak = avail;
+    }
+
+    *n = avail = rgaBatch(ring, pos, avail, *n);
+    if (!avail) return NULL;
+    return ring->base + (pos & ring->mask) * ring->elt_sz;
 }
-#endif
 
-#if YAF_RING_THREAD
 /**
- * rgaClearInterrupt
+ * rgaCommitTail
  *
  *
  *
  */
-void rgaClearInterrupt(
-    rgaRing_t       *ring)
+void rgaCommitTail(
+    rgaRing_t       *ring,
+    size_t          n)
 {
-    g_mutex_lock(ring->mtx);
-    --(ring->interrupt);
-    g_mutex_unlock(ring->mtx);
+    g_atomic_int_set(&ring->lf_tail, (gint)((guint)ring->lf_tail + n));
 }
-#endif
 
 /**
  * rgaCount
@@ -459,6 +444,13 @@ void rgaClearInterrupt(
 size_t rgaCount(
     rgaRing_t       *ring)
 {
+    guint           tail;
+
+    /* read the tail first; the head can only be further along */
+    if (ring->sync) {
+        tail = (guint)g_atomic_int_get(&ring->lf_tail);
+        return (guint)g_atomic_int_get(&ring->lf_head) - tail;
+    }
     return ring->count;
 }
 
@@ -471,5 +463,8 @@ size_t rgaCount(
 size_t rgaPeak(
     rgaRing_t       *ring)
 {
+    if (ring->sync) {
+        return ring->lf_peak;
+    }
     return ring->peak;
 }
@@ -18,6 +18,7 @@
 #define _YAF_SOURCE_
 #include "qofconfig.h"
 #include "yafstat.h"
+#include "qofshard.h"
 
 #include <qof/yafcore.h>
 #include <qof/decode.h>
@@ -39,6 +40,7 @@
 #define YAF_FLOW_EXT_TID       0xB7FF /* everything except internal */
                                
 #define YAF_OPTIONS_TID        0xD000
+#define YAF_TABSTATS_TID       0xD001
 
 /* 49154 - 49160 */
 #define YAF_STATS_FLOW_TID     0xC005
@@ -88,6 +90,8 @@ static fbInfoElementSpec_t qof_internal_spec[] = {
     /* Timers and counters */
     { "flowStartMilliseconds",              8, 0 },
     { "flowEndMilliseconds",                8, 0 },
+    { "flowStartMicroseconds",              8, 0 },
+    { "flowEndMicroseconds",                8, 0 },
     { "octetDeltaCount",                    8, YTF_FLE },
     { "reverseOctetDeltaCount",             8, YTF_FLE | YTF_BIF },
     { "packetDeltaCount",                   8, YTF_FLE },
@@ -155,6 +159,8 @@ static fbInfoElementSpec_t qof_internal_spec[] = {
     { "tcpTimestampFrequency",              4, YTF_TCP | YTF_TSV },
     { "reverseTcpTimestampFrequency",       4, YTF_TCP | YTF_TSV | YTF_BIF},
     { "tcpRttSampleCount",                  4, YTF_RTT },
+    { "lastTcpRttMicroseconds",             4, YTF_RTT },
+    { "minTcpRttMicroseconds",              4, YTF_RTT },
     { "lastTcpRttMilliseconds",             2, YTF_RTT },
     { "minTcpRttMilliseconds",              2, YTF_RTT },
     { "declaredTcpMss",                     2, YTF_TCP },
@@ -173,6 +179,8 @@ static fbInfoElementSpec_t qof_internal_spec[] = {
     { "reverseMeanTcpChirpMilliseconds",    2, YTF_TCP | YTF_TSV | YTF_BIF},
     /* First-packet RTT (for all biflows) */
     { "reverseFlowDeltaMilliseconds",       4, YTF_BIF },
+    /* Tunnel VNI or TEID */
+    { "tunnelIdentifier",                   4, 0 },
     /* port, protocol, flow status, interfaces */
     { "sourceTransportPort",                2, 0 },
     { "destinationTransportPort",           2, 0 },
@@ -184,6 +192,9 @@ static fbInfoElementSpec_t qof_internal_spec[] = {
     { "sourceMacAddress",                   6, 0 },
     { "destinationMacAddress",              6, 0 },
     { "vlanId",                             2, 0 },
+    { "dot1qVlanId",                        2, 0 },
+    { "dot1qCustomerVlanId",                2, 0 },
+    { "mplsTopLabelStackSection",           3, 0 },
     /* Layer 3 information */
     { "minimumTTL",                         1, 0},
     { "maximumTTL",                         1, 0},
@@ -210,14 +221,48 @@ static fbInfoElementSpec_t yaf_stats_option_spec[] = {
     { "droppedPacketTotalCount",            0, 0 },
     { "ignoredPacketTotalCount",            0, 0 },
     { "notSentPacketTotalCount",            0, 0 },
+    { "flowTableAnalyticsShedCount",        0, 0 },
+    { "flowTableShortIdleCount",            0, 0 },
+    { "flowTableMemoryEvictionCount",       0, 0 },
+    { "flowTablePeakMemory",                0, 0 },
+    { "captureRingStallCount",              0, 0 },
+    { "reorderedPacketCount",               0, 0 },
+    { "reorderLatePacketCount",             0, 0 },
+    { "inputMergeLatePacketCount",          0, 0 },
     { "expiredFragmentCount",               0, 0 },
     { "assembledFragmentCount",             0, 0 },
     { "flowTableFlushEventCount",           0, 0 },
     { "flowTablePeakCount",                 0, 0 },
+    { "captureRingOccupancy",               0, 0 },
+    { "captureRingPeak",                    0, 0 },
     { "exporterIPv4Address",                0, 0 },
     { "exportingProcessId",                 0, 0 },
     FB_IESPEC_NULL
 };
+
+static fbInfoElementSpec_t yaf_tabstats_option_spec[] = {
+    { "exporterIPv4Address",                0, 0 },
+    { "exportingProcessId",                 0, 0 },
+    { "flowTableCreatedFlowCount",          0, 0 },
+    { "flowTableFlowCreationRate",          0, 0 },
+    { "flowTableIdleTimeoutCount",          0, 0 },
+    { "flowTableActiveTimeoutCount",        0, 0 },
+    { "flowTableEndOfFlowCount",            0, 0 },
+    { "flowTableResourceEvictionCount",     0, 0 },
+    { "flowTableProbe1Count",               0, 0 },
+    { "flowTableProbe2Count",               0, 0 },
+    { "flowTableProbe4Count",               0, 0 },
+    { "flowTableProbeLongCount",            0, 0 },
+    { "flowTableOccupancy",                 0, 0 },
+    { "flowTableCapacity",                  0, 0 },
+    { "flowTableLoadPermille",              0, 0 },
+    { "flowTableMaxProbeLength",            0, 0 },
+    { "flowTableTcpStateCount",             0, 0 },
+    { "flowTableCloseQueuePeak",            0, 0 },
+    { "flowTableFlushTimeMaxMicroseconds",  0, 0 },
+    { "flowTableFlushTimeP99Microseconds",  0, 0 },
+    FB_IESPEC_NULL
+};
 /* IPv6-mapped IPv4 address prefix */
 static uint8_t yaf_ip6map_pfx[12] =
     { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
@@ -229,6 +274,8 @@ typedef struct yfIpfixFlow_st {
     /* Timers and counters */
     uint64_t    flowStartMilliseconds;
     uint64_t    flowEndMilliseconds;
+    uint64_t    flowStartMicroseconds;
+    uint64_t    flowEndMicroseconds;
     uint64_t    octetCount;
     uint64_t    reverseOctetCount;
     uint64_t    packetCount;
@@ -274,6 +321,8 @@ typedef struct yfIpfixFlow_st {
     uint32_t    tcpTimestampFrequency;
     uint32_t    reverseTcpTimestampFrequency;
     uint32_t    tcpRttSampleCount;
+    uint32_t    lastTcpRttMicroseconds;
+    uint32_t    minTcpRttMicroseconds;
     uint16_t    lastTcpRttMilliseconds;
     uint16_t    minTcpRttMilliseconds;
     uint16_t    declaredTcpMss;
@@ -292,6 +341,8 @@ typedef struct yfIpfixFlow_st {
     int16_t     reverseMeanTcpChirpMilliseconds;
     /* First-packet RTT */
     int32_t     reverseFlowDeltaMilliseconds;
+    /* Tunnel VNI or TEID */
+    uint32_t    tunnelIdentifier;
     /* Flow key */
     uint16_t    sourceTransportPort;
     uint16_t    destinationTransportPort;
@@ -303,6 +354,9 @@ typedef struct yfIpfixFlow_st {
     uint8_t     sourceMacAddress[6];
     uint8_t     destinationMacAddress[6];
     uint16_t    vlanId;
+    uint16_t    dot1qVlanId;
+    uint16_t    dot1qCustomerVlanId;
+    uint8_t     mplsTopLabelStackSection[3];
     /* Layer 3 Information */
     uint8_t     minimumTTL;
     uint8_t     maximumTTL;
@@ -324,14 +378,47 @@ typedef struct yfIpfixStats_st {
     uint64_t    droppedPacketTotalCount;
     uint64_t    ignoredPacketTotalCount;
     uint64_t    notSentPacketTotalCount;
+    uint64_t    flowTableAnalyticsShedCount;
+    uint64_t    flowTableShortIdleCount;
+    uint64_t    flowTableMemoryEvictionCount;
+    uint64_t    flowTablePeakMemory;
+    uint64_t    captureRingStallCount;
+    uint64_t    reorderedPacketCount;
+    uint64_t    reorderLatePacketCount;
+    uint64_t    inputMergeLatePacketCount;
     uint32_t    expiredFragmentCount;
     uint32_t    assembledFragmentCount;
     uint32_t    flowTableFlushEvents;
     uint32_t    flowTablePeakCount;
+    uint32_t    captureRingOccupancy;
+    uint32_t    captureRingPeak;
     uint32_t    exporterIPv4Address;
     uint32_t    exportingProcessId;
 } yfIpfixStats_t;
 
+typedef struct yfIpfixTabStats_st {
+    uint32_t    exporterIPv4Address;
+    uint32_t    exportingProcessId;
+    uint64_t    flowTableCreatedFlowCount;
+    uint64_t    flowTableFlowCreationRate;
+    uint64_t    flowTableIdleTimeoutCount;
+    uint64_t    flowTableActiveTimeoutCount;
+    uint64_t    flowTableEndOfFlowCount;
+    uint64_t    flowTableResourceEvictionCount;
+    uint64_t    flowTableProbe1Count;
+    uint64_t    flowTableProbe2Count;
+    uint64_t    flowTableProbe4Count;
+    uint64_t    flowTableProbeLongCount;
+    uint32_t    flowTableOccupancy;
+    uint32_t    flowTableCapacity;
+    uint32_t    flowTableLoadPermille;
+    uint32_t    flowTableMaxProbeLength;
+    uint32_t    flowTableTcpStateCount;
+    uint32_t    flowTableCloseQueuePeak;
+    uint32_t    flowTableFlushTimeMaxMicroseconds;
+    uint32_t    flowTableFlushTimeP99Microseconds;
+} yfIpfixTabStats_t;
+
 /* Core library configuration variables */
 static gboolean yaf_core_map_ipv6 = FALSE;
 static gboolean yaf_core_force_biflow = FALSE;
@@ -376,6 +463,8 @@ void qfInternalTemplateCheck() {
     CHECK_OFFSET(yfIpfixFlow_t,flowId);
     CHECK_OFFSET(yfIpfixFlow_t,flowStartMilliseconds);
     CHECK_OFFSET(yfIpfixFlow_t,flowEndMilliseconds);
+    CHECK_OFFSET(yfIpfixFlow_t,flowStartMicroseconds);
+    CHECK_OFFSET(yfIpfixFlow_t,flowEndMicroseconds);
     CHECK_OFFSET(yfIpfixFlow_t,octetCount);
     CHECK_OFFSET(yfIpfixFlow_t,reverseOctetCount);
     CHECK_OFFSET(yfIpfixFlow_t,packetCount);
@@ -419,6 +508,8 @@ void qfInternalTemplateCheck() {
     CHECK_OFFSET(yfIpfixFlow_t,tcpTimestampFrequency);
     CHECK_OFFSET(yfIpfixFlow_t,reverseTcpTimestampFrequency);
     CHECK_OFFSET(yfIpfixFlow_t,tcpRttSampleCount);
+    CHECK_OFFSET(yfIpfixFlow_t,lastTcpRttMicroseconds);
+    CHECK_OFFSET(yfIpfixFlow_t,minTcpRttMicroseconds);
     CHECK_OFFSET(yfIpfixFlow_t,lastTcpRttMilliseconds);
     CHECK_OFFSET(yfIpfixFlow_t,minTcpRttMilliseconds);
     CHECK_OFFSET(yfIpfixFlow_t,declaredTcpMss);
@@ -436,6 +527,7 @@ void qfInternalTemplateCheck() {
     CHECK_OFFSET(yfIpfixFlow_t,meanTcpChirpMilliseconds);
     CHECK_OFFSET(yfIpfixFlow_t,reverseMeanTcpChirpMilliseconds);
     CHECK_OFFSET(yfIpfixFlow_t,reverseFlowDeltaMilliseconds);
+    CHECK_OFFSET(yfIpfixFlow_t,tunnelIdentifier);
     CHECK_OFFSET(yfIpfixFlow_t,sourceTransportPort);
     CHECK_OFFSET(yfIpfixFlow_t,destinationTransportPort);
     CHECK_OFFSET(yfIpfixFlow_t,protocolIdentifier);
@@ -445,6 +537,9 @@ void qfInternalTemplateCheck() {
     CHECK_OFFSET(yfIpfixFlow_t,sourceMacAddress);
     CHECK_OFFSET(yfIpfixFlow_t,destinationMacAddress);
     CHECK_OFFSET(yfIpfixFlow_t,vlanId);
+    CHECK_OFFSET(yfIpfixFlow_t,dot1qVlanId);
+    CHECK_OFFSET(yfIpfixFlow_t,dot1qCustomerVlanId);
+    CHECK_OFFSET(yfIpfixFlow_t,mplsTopLabelStackSection);
     CHECK_OFFSET(yfIpfixFlow_t,minimumTTL);
     CHECK_OFFSET(yfIpfixFlow_t,maximumTTL);
     CHECK_OFFSET(yfIpfixFlow_t,reverseMinimumTTL);
@@ -594,6 +689,38 @@ static fbTemplate_t *yfAllocExportTemplate(uint32_t flags, GError **err) {
     return tmpl;
 }
 
+/**
+ * yfAddOptionsTemplate
+ *
+ * Creates an options template from a spec array and adds it to a session
+ * as both internal and external template.
+ */
+
+static gboolean yfAddOptionsTemplate(
+    fbSession_t             *session,
+    uint16_t                tid,
+    fbInfoElementSpec_t     *spec,
+    GError                  **err)
+{
+    fbTemplate_t            *tmpl = fbTemplateAlloc(yfInfoModel());
+
+    /* FIXME check that the template looks like the structure */
+    if (!fbTemplateAppendSpecArray(tmpl, spec, 0, err)) {
+        return FALSE;
+    }
+
+    /* Scope is the first two fields */
+    fbTemplateSetOptionsScope(tmpl, 2);
+    if (!fbSessionAddTemplate(session, TRUE, tid, tmpl, err)) {
+        return FALSE;
+    }
+    if (!fbSessionAddTemplate(session, FALSE, tid, tmpl, err)) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 /**
  * yfInitExporterSession
  *
@@ -627,21 +754,11 @@ static fbSession_t *yfInitExporterSession(
     }
 
 
-    /* Create the Statistics Template */
-    /* FIXME check that the template looks like the structure */
-    tmpl = fbTemplateAlloc(model);
-    if (!fbTemplateAppendSpecArray(tmpl, yaf_stats_option_spec, 0, err))
-    {
-        return NULL;
-    }
-
-    /* Scope fields are exporterIPv4Address and exportingProcessID */
-    fbTemplateSetOptionsScope(tmpl, 2);
-    if (!fbSessionAddTemplate(session, TRUE, YAF_OPTIONS_TID, tmpl, err))
-    {
-        return NULL;
-    }
-    if (!fbSessionAddTemplate(session, FALSE, YAF_OPTIONS_TID, tmpl, err))
+    /* Create the Statistics and Flow Table Statistics Templates */
+    if (!yfAddOptionsTemplate(session, YAF_OPTIONS_TID,
+                              yaf_stats_option_spec, err) ||
+        !yfAddOptionsTemplate(session, YAF_TABSTATS_TID,
+                              yaf_tabstats_option_spec, err))
     {
         return NULL;
     }
@@ -804,47 +921,98 @@ static gboolean yfSetExportTemplate(
     return fBufSetExportTemplate(fbuf, tid, err);
 }
 
-static gboolean yfEnsureStatsTemplate(fBuf_t *fbuf, GError **err) {
-    fbInfoModel_t   *model = yfInfoModel();
-    fbSession_t     *session = fBufGetSession(fbuf);
-    fbTemplate_t    *tmpl = NULL;
-    
-    static gboolean stats_template_initialized = FALSE;
-    
-    /* Create the Statistics Template if we need to */
-    if (!stats_template_initialized) {
-        /* FIXME check that the template looks like the structure */
-        tmpl = fbTemplateAlloc(model);
-        if (!fbTemplateAppendSpecArray(tmpl, yaf_stats_option_spec, 0, err))
-        {
-            return FALSE;
-        }
-        
-        /* Scope fields are exporterIPv4Address and exportingProcessID */
-        fbTemplateSetOptionsScope(tmpl, 2);
-        if (!fbSessionAddTemplate(session, TRUE, YAF_OPTIONS_TID, tmpl, err))
-        {
-            return FALSE;
-        }
-        if (!fbSessionAddTemplate(session, FALSE, YAF_OPTIONS_TID, tmpl, err))
-        {
+static gboolean yfEnsureOptionsTemplate(
+    fBuf_t                  *fbuf,
+    uint16_t                tid,
+    fbInfoElementSpec_t     *spec,
+    GError                  **err)
+{
+    fbSession_t             *session = fBufGetSession(fbuf);
+
+    /* Create the template if the session doesn't have it yet */
+    if (!fbSessionGetTemplate(session, TRUE, tid, NULL)) {
+        if (!yfAddOptionsTemplate(session, tid, spec, err)) {
             return FALSE;
         }
-        stats_template_initialized = TRUE;
     }
-    
+
     /* Set Internal Template for Buffer to Options TID */
-    if (!fBufSetInternalTemplate(fbuf, YAF_OPTIONS_TID, err))
+    if (!fBufSetInternalTemplate(fbuf, tid, err))
         return FALSE;
-    
+
     /* Set Export Template for Buffer to Options TMPL */
-    if (!yfSetExportTemplate(fbuf, YAF_OPTIONS_TID, err)) {
+    if (!yfSetExportTemplate(fbuf, tid, err)) {
         return FALSE;
     }
-    
+
     return TRUE;
 }
 
+/**
+ *yfWriteTabStatsRec
+ *
+ * Appends a flow table statistics record; the internal template is left
+ * set to the options template.
+ */
+static gboolean yfWriteTabStatsRec(
+    qfContext_t         *ctx,
+    uint32_t            host_ip,
+    GError              **err)
+{
+    yfIpfixTabStats_t   rec;
+    yfFlowTabTelemetry_t tel;
+    uint64_t            ctime = qfContextCurrentTime(ctx);
+    static uint64_t     last_created = 0;
+    static uint64_t     last_time = 0;
+
+    if (ctx->shards) {
+        qfShardGetTelemetry(ctx->shards, &tel);
+    } else {
+        yfGetFlowTabTelemetry(ctx->flowtab, &tel);
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.exporterIPv4Address = host_ip;
+    rec.exportingProcessId = ctx->octx.odid;
+
+    rec.flowTableCreatedFlowCount = tel.created;
+    rec.flowTableIdleTimeoutCount = tel.end_idle;
+    rec.flowTableActiveTimeoutCount = tel.end_active;
+    rec.flowTableEndOfFlowCount = tel.end_closed;
+    rec.flowTableResourceEvictionCount = tel.end_resource;
+    rec.flowTableProbe1Count = tel.probe_hist[0];
+    rec.flowTableProbe2Count = tel.probe_hist[1];
+    rec.flowTableProbe4Count = tel.probe_hist[2];
+    rec.flowTableProbeLongCount = tel.probe_hist[3];
+    rec.flowTableOccupancy = tel.occupancy;
+    rec.flowTableCapacity = tel.capacity;
+    if (tel.capacity) {
+        rec.flowTableLoadPermille =
+            (uint32_t)(((uint64_t)tel.occupancy * 1000) / tel.capacity);
+    }
+    rec.flowTableMaxProbeLength = tel.max_probe;
+    rec.flowTableTcpStateCount = tel.tcp_blocks;
+    rec.flowTableCloseQueuePeak = tel.cq_peak;
+    yfStatGetFlushTime(&rec.flowTableFlushTimeMaxMicroseconds,
+                       &rec.flowTableFlushTimeP99Microseconds);
+
+    /* Creation rate over the packet clock since the last record */
+    if (last_time && ctime > last_time) {
+        rec.flowTableFlowCreationRate =
+            ((tel.created - last_created) * 1000) / (ctime - last_time);
+    }
+    last_created = tel.created;
+    last_time = ctime;
+
+    if (!yfEnsureOptionsTemplate(ctx->octx.fbuf, YAF_TABSTATS_TID,
+                                 yaf_tabstats_option_spec, err))
+    {
+        return FALSE;
+    }
+
+    return fBufAppend(ctx->octx.fbuf, (uint8_t *)&rec, sizeof(rec), err);
+}
+
 /**
  *yfWriteStatsRec
  *
@@ -862,18 +1030,36 @@ gboolean yfWriteStatsRec(
     static struct hostent *host;
     static uint32_t     host_ip = 0;
 
-    yfGetFlowTabStats(ctx->flowtab, &(rec.packetTotalCount),
-                      &(rec.exportedFlowTotalCount),
-                      &(rec.notSentPacketTotalCount),
-                      &(rec.flowTablePeakCount),
-                      &(rec.flowTableFlushEvents));
-    if (ctx->fragtab) {
-        yfGetFragTabStats(ctx->fragtab,
-                          &(rec.expiredFragmentCount),
-                          &(rec.assembledFragmentCount));
+    if (ctx->shards) {
+        qfShardGetStats(ctx->shards, &(rec.packetTotalCount),
+                        &(rec.exportedFlowTotalCount),
+                        &(rec.notSentPacketTotalCount),
+                        &(rec.flowTablePeakCount),
+                        &(rec.flowTableFlushEvents),
+                        &(rec.expiredFragmentCount),
+                        &(rec.assembledFragmentCount));
+        qfShardGetMemStats(ctx->shards, &(rec.flowTableAnalyticsShedCount),
+                           &(rec.flowTableShortIdleCount),
+                           &(rec.flowTableMemoryEvictionCount),
+                           &(rec.flowTablePeakMemory));
     } else {
-        rec.expiredFragmentCount = 0;
-        rec.assembledFragmentCount = 0;
+        yfGetFlowTabStats(ctx->flowtab, &(rec.packetTotalCount),
+                          &(rec.exportedFlowTotalCount),
+                          &(rec.notSentPacketTotalCount),
+                          &(rec.flowTablePeakCount),
+                          &(rec.flowTableFlushEvents));
+        yfGetFlowTabMemStats(ctx->flowtab, &(rec.flowTableAnalyticsShedCount),
+                             &(rec.flowTableShortIdleCount),
+                             &(rec.flowTableMemoryEvictionCount),
+                             &(rec.flowTablePeakMemory));
+        if (ctx->fragtab) {
+            yfGetFragTabStats(ctx->fragtab,
+                              &(rec.expiredFragmentCount),
+                              &(rec.assembledFragmentCount));
+        } else {
+            rec.expiredFragmentCount = 0;
+            rec.assembledFragmentCount = 0;
+        }
     }
 
     if (!fbuf) {
@@ -899,6 +1085,22 @@ gboolean yfWriteStatsRec(
 
     /* Dropped packets - from yafcap.c & libpcap */
     rec.droppedPacketTotalCount = yfStatGetDropped();
+
+    /* Capture ring back-pressure, if capturing on a separate thread */
+    yfStatGetRing(&(rec.captureRingOccupancy), &(rec.captureRingPeak),
+                  &(rec.captureRingStallCount));
+
+    /* Packets put back in order, and too late to be */
+    if (ctx->ictx.reorder) {
+        qfReorderGetStats(ctx->ictx.reorder, &(rec.reorderedPacketCount),
+                          &(rec.reorderLatePacketCount));
+    } else {
+        rec.reorderedPacketCount = 0;
+        rec.reorderLatePacketCount = 0;
+    }
+
+    /* Packets parallel input threads delivered too late to merge in order */
+    rec.inputMergeLatePacketCount = yfStatGetMergeLate();
     rec.exporterIPv4Address = host_ip;
 
     /* Use Observation ID as exporting Process ID */
@@ -907,7 +1109,9 @@ gboolean yfWriteStatsRec(
     rec.systemInitTimeMilliseconds = yaf_start_time;
     
     /* Initialize stats export templates if necessary */
-    if (!yfEnsureStatsTemplate(fbuf, err)) {
+    if (!yfEnsureOptionsTemplate(fbuf, YAF_OPTIONS_TID,
+                                 yaf_stats_option_spec, err))
+    {
         return FALSE;
     }
     
@@ -916,6 +1120,11 @@ gboolean yfWriteStatsRec(
         return FALSE;
     }
 
+    /* Append flow table internals on the same schedule */
+    if (!yfWriteTabStatsRec(ctx, host_ip, err)) {
+        return FALSE;
+    }
+
     /* Set Internal TID Back to Flow Record */
     if (!fBufSetInternalTemplate(fbuf, YAF_FLOW_FULL_TID, err)) {
         return FALSE;
@@ -925,17 +1134,62 @@ gboolean yfWriteStatsRec(
 }
  
 /**
- *yfWriteFlow
+ *yfFlowRecSize
  *
  *
  *
  */
-gboolean yfWriteFlow(
-    fBuf_t              *fbuf,
+size_t yfFlowRecSize(void)
+{
+    return sizeof(yfIpfixFlow_t);
+}
+
+/* seconds from the NTP epoch (1900) to the Unix epoch (1970) */
+#define YF_NTP_EPOCH_OFFSET 2208988800ULL
+
+/**
+ *yfMicrosToNTP
+ *
+ * encodes epoch microseconds as an NTP timestamp for a dateTimeMicroseconds
+ * IE; RFC 7011 requires the fraction bits below a microsecond be zero.
+ *
+ */
+static uint64_t yfMicrosToNTP(
+    uint64_t        us)
+{
+    uint64_t        frac = ((us % 1000000) << 32) / 1000000;
+
+    return (((us / 1000000 + YF_NTP_EPOCH_OFFSET) << 32) | frac) &
+           ~0x7FFULL;
+}
+
+/**
+ *yfNTPToMicros
+ *
+ * decodes a dateTimeMicroseconds NTP timestamp to epoch microseconds,
+ * rounding away the zeroed fraction bits.
+ *
+ */
+static uint64_t yfNTPToMicros(
+    uint64_t        ntp)
+{
+    return ((ntp >> 32) - YF_NTP_EPOCH_OFFSET) * 1000000 +
+           (((ntp & 0x00000000FFFFFFFFULL) * 1000000 + 0x80000000ULL) >> 32);
+}
+
+/**
+ *yfFlowToRec
+ *
+ *
+ *
+ */
+gboolean yfFlowToRec(
     yfFlow_t            *flow,
+    uint8_t             *recbuf,
+    uint16_t            *tid,
     GError              **err)
 {
-    yfIpfixFlow_t       rec;
+    yfIpfixFlow_t       *rec = (yfIpfixFlow_t *)recbuf;
     uint16_t            wtid;
     uint32_t            hz = 0, rhz = 0;
     
@@ -959,28 +1213,30 @@ gboolean yfWriteFlow(
     }
     
     /* copy time */
-    rec.flowStartMilliseconds = flow->stime;
-    rec.flowEndMilliseconds = flow->etime;
-    rec.reverseFlowDeltaMilliseconds = flow->rdtime;
+    rec->flowStartMilliseconds = flow->stime / 1000;
+    rec->flowEndMilliseconds = flow->etime / 1000;
+    rec->flowStartMicroseconds = yfMicrosToNTP(flow->stime);
+    rec->flowEndMicroseconds = yfMicrosToNTP(flow->etime);
+    rec->reverseFlowDeltaMilliseconds = flow->rdtime;
 
     /* choose options for basic template */
     wtid = YAF_FLOW_BASE_TID;
 
     /* fill in fields that are always present */
-    rec.flowId = flow->fid;
-    rec.flowEndReason = flow->reason;
-    rec.minimumTTL = val->minttl;
-    rec.reverseMinimumTTL = rval->minttl;
-    rec.maximumTTL = val->maxttl;
-    rec.reverseMaximumTTL = rval->maxttl;
-    rec.octetCount = val->oct;
-    rec.reverseOctetCount = rval->oct;
-    rec.packetCount = val->pkt;
-    rec.reversePacketCount = rval->pkt;
-    rec.transportOctetDeltaCount = val->appoct;
-    rec.reverseTransportOctetDeltaCount = rval->appoct;
-    rec.transportPacketDeltaCount = val->apppkt;
-    rec.reverseTransportPacketDeltaCount = rval->apppkt;
+    rec->flowId = flow->fid;
+    rec->flowEndReason = flow->reason;
+    rec->minimumTTL = val->minttl;
+    rec->reverseMinimumTTL = rval->minttl;
+    rec->maximumTTL = val->maxttl;
+    rec->reverseMaximumTTL = rval->maxttl;
+    rec->octetCount = val->oct;
+    rec->reverseOctetCount = rval->oct;
+    rec->packetCount = val->pkt;
+    rec->reversePacketCount = rval->pkt;
+    rec->transportOctetDeltaCount = val->appoct;
+    rec->reverseTransportOctetDeltaCount = rval->appoct;
+    rec->transportPacketDeltaCount = val->apppkt;
+    rec->reverseTransportPacketDeltaCount = rval->apppkt;
     
     /* set ingress and egress interface from map if not already set */
     if (yaf_core_ifmap) {
@@ -989,30 +1245,30 @@ gboolean yfWriteFlow(
     }
     
     /* copy ports and protocol */
-    rec.sourceTransportPort = key->sp;
-    rec.destinationTransportPort = key->dp;
-    rec.protocolIdentifier = key->proto;
+    rec->sourceTransportPort = key->sp;
+    rec->destinationTransportPort = key->dp;
+    rec->protocolIdentifier = key->proto;
         
     /* copy addresses */
     if (yaf_core_map_ipv6 && (key->version == 4)) {
-        memcpy(rec.sourceIPv6Address, yaf_ip6map_pfx,
+        memcpy(rec->sourceIPv6Address, yaf_ip6map_pfx,
                sizeof(yaf_ip6map_pfx));
-        *(uint32_t *)(&(rec.sourceIPv6Address[sizeof(yaf_ip6map_pfx)])) =
+        *(uint32_t *)(&(rec->sourceIPv6Address[sizeof(yaf_ip6map_pfx)])) =
             g_htonl(key->addr.v4.sip);
-        memcpy(rec.destinationIPv6Address, yaf_ip6map_pfx,
+        memcpy(rec->destinationIPv6Address, yaf_ip6map_pfx,
                sizeof(yaf_ip6map_pfx));
-        *(uint32_t *)(&(rec.destinationIPv6Address[sizeof(yaf_ip6map_pfx)])) =
+        *(uint32_t *)(&(rec->destinationIPv6Address[sizeof(yaf_ip6map_pfx)])) =
             g_htonl(key->addr.v4.dip);
         wtid |= YTF_IP6;
     } else if (key->version == 4) {
-        rec.sourceIPv4Address = key->addr.v4.sip;
-        rec.destinationIPv4Address = key->addr.v4.dip;
+        rec->sourceIPv4Address = key->addr.v4.sip;
+        rec->destinationIPv4Address = key->addr.v4.dip;
         wtid |= YTF_IP4;
     } else if (key->version == 6) {
-        memcpy(rec.sourceIPv6Address, key->addr.v6.sip,
-               sizeof(rec.sourceIPv6Address));
-        memcpy(rec.destinationIPv6Address, key->addr.v6.dip,
-               sizeof(rec.destinationIPv6Address));
+        memcpy(rec->sourceIPv6Address, key->addr.v6.sip,
+               sizeof(rec->sourceIPv6Address));
+        memcpy(rec->destinationIPv6Address, key->addr.v6.dip,
+               sizeof(rec->destinationIPv6Address));
         wtid |= YTF_IP6;
     } else {
         g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_ARGUMENT,
@@ -1023,130 +1279,199 @@ gboolean yfWriteFlow(
     if (key->proto == YF_PROTO_TCP) {
         wtid |= YTF_TCP;
 
-        rec.initialTCPFlags = val->iflags;
-        rec.reverseInitialTCPFlags = rval->iflags;
-        rec.unionTCPFlags = val->uflags;
-        rec.reverseUnionTCPFlags = rval->uflags;
-        rec.tcpControlBits = val->iflags | val->uflags;
-        rec.reverseTcpControlBits = rval->iflags | rval->uflags;
+        rec->initialTCPFlags = val->iflags;
+        rec->reverseInitialTCPFlags = rval->iflags;
+        rec->unionTCPFlags = val->uflags;
+        rec->reverseUnionTCPFlags = rval->uflags;
+        rec->tcpControlBits = val->iflags | val->uflags;
+        rec->reverseTcpControlBits = rval->iflags | rval->uflags;
         
         if (val->tcp) {
-            rec.tcpSequenceCount = qfSeqCount(&val->tcp->seq,
-                                              val->iflags | val->uflags);
-            rec.tcpSequenceLossCount = qfSeqCountLost(&val->tcp->seq);
-            rec.tcpRetransmitCount = val->tcp->seq.rtx;
-            rec.tcpSequenceJumpCount = val->tcp->seq.ooo;
-            rec.maxTcpSequenceJump = val->tcp->seq.maxooo;
-            rec.tcpLossEventCount = val->tcp->seq.lossct;
-            rec.tcpDupAckCount = val->tcp->ack.dup_ct;
-            rec.tcpSelAckCount = val->tcp->ack.sel_ct;
-            rec.qofTcpCharacteristics = val->tcp->opts.flags;
-            rec.tcpSequenceNumber = val->tcp->seq.isn;
-            rec.observedTcpMss = val->tcp->opts.mss;
-            rec.declaredTcpMss = val->tcp->opts.mss_opt;
-            rec.minTcpRwin = val->tcp->rwin.val.mm.min;
-            rec.meanTcpRwin = (uint32_t)val->tcp->rwin.val.mean;
-            rec.maxTcpRwin = val->tcp->rwin.val.mm.max;
-            rec.tcpReceiverStallCount = val->tcp->rwin.stall;
-            rec.minTcpIOTMilliseconds = val->tcp->seq.seg_iat.mm.min;
-            rec.maxTcpIOTMilliseconds = val->tcp->seq.seg_iat.mm.max;
+            rec->tcpSequenceCount = qfSeqCount(&val->tcp->seq,
+                                               val->iflags | val->uflags);
+            rec->tcpSequenceLossCount = qfSeqCountLost(&val->tcp->seq);
+            rec->tcpRetransmitCount = val->tcp->seq.rtx;
+            rec->tcpSequenceJumpCount = val->tcp->seq.ooo;
+            rec->maxTcpSequenceJump = val->tcp->seq.maxooo;
+            rec->tcpLossEventCount = val->tcp->seq.lossct;
+            rec->tcpDupAckCount = val->tcp->ack.dup_ct;
+            rec->tcpSelAckCount = val->tcp->ack.sel_ct;
+            rec->qofTcpCharacteristics = val->tcp->opts.flags;
+            rec->tcpSequenceNumber = val->tcp->seq.isn;
+            rec->observedTcpMss = val->tcp->opts.mss;
+            rec->declaredTcpMss = val->tcp->opts.mss_opt;
+            rec->minTcpRwin = val->tcp->rwin.val.mm.min;
+            rec->meanTcpRwin = (uint32_t)val->tcp->rwin.val.mean;
+            rec->maxTcpRwin = val->tcp->rwin.val.mm.max;
+            rec->tcpReceiverStallCount = val->tcp->rwin.stall;
+            rec->minTcpIOTMilliseconds =
+                val->tcp->seq.seg_iat.mm.min / 1000;
+            rec->maxTcpIOTMilliseconds =
+                val->tcp->seq.seg_iat.mm.max / 1000;
             
             if ((hz = qfTimestampHz(&val->tcp->seq))) {
                 wtid |= YTF_TSV;
 //                if (hz > 1000000) {
 //                    fprintf(stderr,"fast timestamp clock detected: %u\n", hz);
 //                }
-                rec.tcpTimestampFrequency = hz;
-                rec.minTcpChirpMilliseconds = (int16_t)val->tcp->seq.seg_variat.mm.min;
-                rec.maxTcpChirpMilliseconds = (int16_t)val->tcp->seq.seg_variat.mm.max;
-                rec.meanTcpChirpMilliseconds = (int16_t)val->tcp->seq.seg_variat.mean;
+                rec->tcpTimestampFrequency = hz;
+                rec->minTcpChirpMilliseconds =
+                    (int16_t)(val->tcp->seq.seg_variat.mm.min / 1000);
+                rec->maxTcpChirpMilliseconds =
+                    (int16_t)(val->tcp->seq.seg_variat.mm.max / 1000);
+                rec->meanTcpChirpMilliseconds =
+                    (int16_t)(val->tcp->seq.seg_variat.mean / 1000);
             }
         }
         
         if (rval->tcp) {
-            rec.reverseTcpSequenceCount = qfSeqCount(&rval->tcp->seq,
-                                          rval->iflags | rval->uflags);
-            rec.reverseTcpSequenceLossCount = qfSeqCountLost(&rval->tcp->seq);
-            rec.reverseTcpRetransmitCount = rval->tcp->seq.rtx;
-            rec.reverseTcpSequenceJumpCount = rval->tcp->seq.ooo;
-            rec.reverseMaxTcpSequenceJump = rval->tcp->seq.maxooo;
-            rec.reverseTcpLossEventCount = rval->tcp->seq.lossct;
-            rec.reverseTcpDupAckCount = rval->tcp->ack.dup_ct;
-            rec.reverseTcpSelAckCount = rval->tcp->ack.sel_ct;
-            rec.reverseQofTcpCharacteristics = rval->tcp->opts.flags;
-            rec.reverseTcpSequenceNumber = rval->tcp->seq.isn;
-            rec.reverseObservedTcpMss = rval->tcp->opts.mss;
-            rec.reverseDeclaredTcpMss = rval->tcp->opts.mss_opt;
-            rec.reverseMinTcpRwin = rval->tcp->rwin.val.mm.min;
-            rec.reverseMeanTcpRwin = (uint32_t)rval->tcp->rwin.val.mean;
-            rec.reverseMaxTcpRwin = rval->tcp->rwin.val.mm.max;
-            rec.reverseTcpReceiverStallCount = rval->tcp->rwin.stall;
-            rec.reverseMinTcpIOTMilliseconds = rval->tcp->seq.seg_iat.mm.min;
-            rec.reverseMaxTcpIOTMilliseconds = rval->tcp->seq.seg_iat.mm.max;
+            rec->reverseTcpSequenceCount = qfSeqCount(&rval->tcp->seq,
+                                           rval->iflags | rval->uflags);
+            rec->reverseTcpSequenceLossCount = qfSeqCountLost(&rval->tcp->seq);
+            rec->reverseTcpRetransmitCount = rval->tcp->seq.rtx;
+            rec->reverseTcpSequenceJumpCount = rval->tcp->seq.ooo;
+            rec->reverseMaxTcpSequenceJump = rval->tcp->seq.maxooo;
+            rec->reverseTcpLossEventCount = rval->tcp->seq.lossct;
+            rec->reverseTcpDupAckCount = rval->tcp->ack.dup_ct;
+            rec->reverseTcpSelAckCount = rval->tcp->ack.sel_ct;
+            rec->reverseQofTcpCharacteristics = rval->tcp->opts.flags;
+            rec->reverseTcpSequenceNumber = rval->tcp->seq.isn;
+            rec->reverseObservedTcpMss = rval->tcp->opts.mss;
+            rec->reverseDeclaredTcpMss = rval->tcp->opts.mss_opt;
+            rec->reverseMinTcpRwin = rval->tcp->rwin.val.mm.min;
+            rec->reverseMeanTcpRwin = (uint32_t)rval->tcp->rwin.val.mean;
+            rec->reverseMaxTcpRwin = rval->tcp->rwin.val.mm.max;
+            rec->reverseTcpReceiverStallCount = rval->tcp->rwin.stall;
+            rec->reverseMinTcpIOTMilliseconds =
+                rval->tcp->seq.seg_iat.mm.min / 1000;
+            rec->reverseMaxTcpIOTMilliseconds =
+                rval->tcp->seq.seg_iat.mm.max / 1000;
             
             if ((rhz = qfTimestampHz(&rval->tcp->seq))) {
                 wtid |= YTF_TSV;
 //                if (hz > 1000000) {
 //                    fprintf(stderr,"fast timestamp clock detected: %u\n", hz);
 //                }
-                rec.reverseTcpTimestampFrequency = rhz;
-                rec.reverseMinTcpChirpMilliseconds = (int16_t)rval->tcp->seq.seg_variat.mm.min;
-                rec.reverseMaxTcpChirpMilliseconds = (int16_t)rval->tcp->seq.seg_variat.mm.max;
-                rec.reverseMeanTcpChirpMilliseconds = (int16_t)rval->tcp->seq.seg_variat.mean;
+                rec->reverseTcpTimestampFrequency = rhz;
+                rec->reverseMinTcpChirpMilliseconds =
+                    (int16_t)(rval->tcp->seq.seg_variat.mm.min / 1000);
+                rec->reverseMaxTcpChirpMilliseconds =
+                    (int16_t)(rval->tcp->seq.seg_variat.mm.max / 1000);
+                rec->reverseMeanTcpChirpMilliseconds =
+                    (int16_t)(rval->tcp->seq.seg_variat.mean / 1000);
            }
         }
         
         /* Enable RTT export if we have enough samples */
         if (flow->rtt.val.n >= QOF_MIN_RTT_COUNT) {
             wtid |= YTF_RTT;
-            rec.lastTcpRttMilliseconds = flow->rtt.val.val;
-            rec.minTcpRttMilliseconds = flow->rtt.val.mm.min;
-            rec.tcpRttSampleCount = flow->rtt.val.n;
+            rec->lastTcpRttMilliseconds = flow->rtt.val.val / 1000;
+            rec->minTcpRttMilliseconds = flow->rtt.val.mm.min / 1000;
+            rec->lastTcpRttMicroseconds = flow->rtt.val.val;
+            rec->minTcpRttMicroseconds = flow->rtt.val.mm.min;
+            rec->tcpRttSampleCount = flow->rtt.val.n;
         }
     }
     
     /* MAC layer information */
-    memcpy(rec.sourceMacAddress, flow->sourceMacAddr,
+    memcpy(rec->sourceMacAddress, flow->sourceMacAddr,
            ETHERNET_MAC_ADDR_LENGTH);
-    memcpy(rec.destinationMacAddress, flow->destinationMacAddr,
+    memcpy(rec->destinationMacAddress, flow->destinationMacAddr,
            ETHERNET_MAC_ADDR_LENGTH);
-    rec.vlanId = key->vlanId;
+    rec->vlanId = key->vlanId;
+    rec->tunnelIdentifier = 0;
+#if QOF_ENABLE_TUNNEL_KEYS
+    rec->tunnelIdentifier = key->tunnelId;
+#endif
+
+    /* stacked tags: the outer VLAN and the customer VLAN inside it */
+    rec->dot1qVlanId = key->vlanId;
+    rec->dot1qCustomerVlanId = 0;
+    memset(rec->mplsTopLabelStackSection, 0,
+           sizeof(rec->mplsTopLabelStackSection));
+#if QOF_ENABLE_L2_KEYS
+    if (key->outerVlanId) {
+        rec->dot1qVlanId = key->outerVlanId;
+        rec->dot1qCustomerVlanId = key->vlanId;
+    }
+    rec->mplsTopLabelStackSection[0] = (key->mplsLabel >> 12) & 0xFF;
+    rec->mplsTopLabelStackSection[1] = (key->mplsLabel >> 4) & 0xFF;
+    rec->mplsTopLabelStackSection[2] = (key->mplsLabel << 4) & 0xF0;
+#endif
     
-    rec.ingressInterface = val->netIf;
-    rec.egressInterface = rval->netIf;
+    rec->ingressInterface = val->netIf;
+    rec->egressInterface = rval->netIf;
 
     /* Set flags based on exported record properties */
     
     /* Set biflow flag */
-    if (yaf_core_force_biflow || rec.reversePacketCount) {
+    if (yaf_core_force_biflow || rec->reversePacketCount) {
         wtid |= YTF_BIF;
     }
     
     /* Set RLE flag */
-    if (rec.octetCount < YAF_RLEMAX &&
-        rec.reverseOctetCount < YAF_RLEMAX &&
-        rec.packetCount < YAF_RLEMAX &&
-        rec.reversePacketCount < YAF_RLEMAX) {
+    if (rec->octetCount < YAF_RLEMAX &&
+        rec->reverseOctetCount < YAF_RLEMAX &&
+        rec->packetCount < YAF_RLEMAX &&
+        rec->reversePacketCount < YAF_RLEMAX) {
         wtid |= YTF_RLE;
     } else {
         wtid |= YTF_FLE;
     }
 
+    *tid = wtid;
+    
+    return TRUE;
+}
+
+/**
+ *yfWriteFlowRec
+ *
+ *
+ *
+ */
+gboolean yfWriteFlowRec(
+    fBuf_t              *fbuf,
+    uint8_t             *rec,
+    uint16_t            tid,
+    GError              **err)
+{
     /* Select template and export */
-    if (!yfSetExportTemplate(fbuf, wtid, err)) {
+    if (!yfSetExportTemplate(fbuf, tid, err)) {
         return FALSE;
     }
 
     /* FIXME where'd UDP template retransmit go? */
     
     /* Now append the record to the buffer */
-    if (!fBufAppend(fbuf, (uint8_t *)&rec, sizeof(rec), err)) {
+    if (!fBufAppend(fbuf, rec, sizeof(yfIpfixFlow_t), err)) {
         return FALSE;
     }
     
     return TRUE;
 }
 
+/**
+ *yfWriteFlow
+ *
+ *
+ *
+ */
+gboolean yfWriteFlow(
+    fBuf_t              *fbuf,
+    yfFlow_t            *flow,
+    GError              **err)
+{
+    yfIpfixFlow_t       rec;
+    uint16_t            wtid;
+
+    if (!yfFlowToRec(flow, (uint8_t *)&rec, &wtid, err)) {
+        return FALSE;
+    }
+
+    return yfWriteFlowRec(fbuf, (uint8_t *)&rec, wtid, err);
+}
+
 /**
  *yfWriterClose
  *
@@ -1328,8 +1653,13 @@ gboolean yfReadFlow(
         return FALSE;
 
     /* copy time */
-    flow->stime = rec.flowStartMilliseconds;
-    flow->etime = rec.flowEndMilliseconds;
+    if (rec.flowStartMicroseconds) {
+        flow->stime = yfNTPToMicros(rec.flowStartMicroseconds);
+        flow->etime = yfNTPToMicros(rec.flowEndMicroseconds);
+    } else {
+        flow->stime = rec.flowStartMilliseconds * 1000;
+        flow->etime = rec.flowEndMilliseconds * 1000;
+    }
     flow->rdtime = rec.reverseFlowDeltaMilliseconds;
     /* copy addresses */
     if (rec.sourceIPv4Address || rec.destinationIPv4Address) {
@@ -1360,6 +1690,17 @@ gboolean yfReadFlow(
         flow->val.pkt = rec.packetCount;
     }
     flow->key.vlanId = rec.vlanId;
+#if QOF_ENABLE_TUNNEL_KEYS
+    flow->key.tunnelId = rec.tunnelIdentifier;
+#endif
+#if QOF_ENABLE_L2_KEYS
+    if (rec.dot1qCustomerVlanId) {
+        flow->key.outerVlanId = rec.dot1qVlanId;
+    }
+    flow->key.mplsLabel = (rec.mplsTopLabelStackSection[0] << 12) |
+                          (rec.mplsTopLabelStackSection[1] << 4) |
+                          (rec.mplsTopLabelStackSection[2] >> 4);
+#endif
     flow->rval.oct = rec.reverseOctetCount;
     flow->rval.pkt = rec.reversePacketCount;
     flow->reason = rec.flowEndReason;
@@ -1432,14 +1773,15 @@ void yfPrintString(
                         dabuf[AIR_IP6ADDR_BUF_MINSZ];
 
     /* print start as date and time */
-    air_mstime_g_string_append(rstr, flow->stime, AIR_TIME_ISO8601);
+    air_mstime_g_string_append(rstr, flow->stime / 1000, AIR_TIME_ISO8601);
 
     /* print end as time and duration if not zero-duration */
     if (flow->stime != flow->etime) {
         g_string_append_printf(rstr, " - ");
-        air_mstime_g_string_append(rstr, flow->etime, AIR_TIME_ISO8601_HMS);
-        g_string_append_printf(rstr, " (%.3f sec)",
-            (flow->etime - flow->stime) / 1000.0);
+        air_mstime_g_string_append(rstr, flow->etime / 1000,
+                                   AIR_TIME_ISO8601_HMS);
+        g_string_append_printf(rstr, " (%.6f sec)",
+            (flow->etime - flow->stime) / 1000000.0);
     }
 
     /* print protocol and addresses */
@@ -1506,6 +1848,23 @@ void yfPrintString(
         }
     }
 
+#if QOF_ENABLE_L2_KEYS
+    /* print outer vlan tag and mpls label */
+    if (flow->key.outerVlanId) {
+        g_string_append_printf(rstr, " svlan %03hx", flow->key.outerVlanId);
+    }
+    if (flow->key.mplsLabel) {
+        g_string_append_printf(rstr, " mpls %u", flow->key.mplsLabel);
+    }
+#endif
+
+#if QOF_ENABLE_TUNNEL_KEYS
+    /* print tunnel identifier */
+    if (flow->key.tunnelId) {
+        g_string_append_printf(rstr, " tunnel %u", flow->key.tunnelId);
+    }
+#endif
+
     /* print flow counters and round-trip time */
     if (flow->rval.pkt) {
         g_string_append_printf(rstr, " (%llu/%llu <-> %llu/%llu) rtt %u ms",
@@ -60,8 +60,12 @@
 #include "yaflush.h"
 #include "yafout.h"
 #include "yafstat.h"
+#include "qofshard.h"
 #include <qof/yafcore.h>
 
+extern int yaf_quit;
+extern int yaf_checkpoint;
+
 gboolean yfProcessPBufRing(
     qfContext_t        *ctx,
     GError             **err)
@@ -87,27 +91,51 @@ gboolean yfProcessPBufRing(
     /* Dump statistics if requested */
     yfStatDumpLoop();
 
-    /* process packets from the ring buffer */
-    while ((pbuf = (yfPBuf_t *)rgaNextTail(ctx->pbufring))) {
+    /* Checkpoint flows if requested; a failed checkpoint isn't fatal */
+    if (yaf_checkpoint) {
+        yaf_checkpoint = 0;
+        if (ctx->checkpoint &&
+            !yfFlowTabCheckpoint(ctx->flowtab, ctx->checkpoint, FALSE, err))
+        {
+            g_warning("%s", (*err)->message);
+            g_clear_error(err);
+        }
+    }
 
-        /* Skip time zero packets (these are marked invalid) */
-        if (!pbuf->ptime) {
-            continue;
+    if (ctx->shards) {
+        /* keep quiet shards' clocks running, and export their flows */
+        qfShardTick(ctx->shards);
+        yfStatFlushBegin();
+        ok = qfShardExport(ctx->shards, ctx->octx.fbuf, err);
+        yfStatFlushEnd();
+        if (!ok) {
+            goto end;
         }
+    } else {
+        /* process packets from the ring buffer */
+        while ((pbuf = (yfPBuf_t *)rgaNextTail(ctx->pbufring))) {
 
-        /* Add the packet to the flow table */
-        yfFlowPBuf(ctx->flowtab, pbuf);
-    }
+            /* Skip time zero packets (these are marked invalid) */
+            if (!pbuf->ptime) {
+                continue;
+            }
 
-    /* Flush the flow table */
-    if (!yfFlowTabFlush(ctx, FALSE, err)) {
-        ok = FALSE;
-        goto end;
+            /* Add the packet to the flow table */
+            yfFlowPBuf(ctx->flowtab, pbuf);
+        }
+
+        /* Flush the flow table, timing the flush */
+        yfStatFlushBegin();
+        ok = yfFlowTabFlush(ctx, FALSE, err);
+        yfStatFlushEnd();
+        if (!ok) {
+            goto end;
+        }
     }
 
     /* Close output file for rotation if necessary */
     if (ctx->octx.rotate_period) {
-        cur_time = yfFlowTabCurrentTime(ctx->flowtab);
+        cur_time = qfContextCurrentTime(ctx);
         if (ctx->octx.rotate_last) {
             if (cur_time - ctx->octx.rotate_last > ctx->octx.rotate_period) {
                 yfOutputClose(ctx->octx.fbuf, lock, TRUE);
@@ -150,7 +178,12 @@ gboolean yfTimeOutFlush(
     yfStatDumpLoop();
 
     /* Flush the flow table */
-    if (!yfFlowTabFlush(ctx, FALSE, err)) {
+    if (ctx->shards) {
+        qfShardTick(ctx->shards);
+        if (!qfShardExport(ctx->shards, ctx->octx.fbuf, err)) {
+            return FALSE;
+        }
+    } else if (!yfFlowTabFlush(ctx, FALSE, err)) {
         return FALSE;
     }
     
@@ -160,7 +193,7 @@ gboolean yfTimeOutFlush(
 
     /* Close output file for rotation if necessary */
     if (ctx->octx.rotate_period) {
-        ctime = yfFlowTabCurrentTime(ctx->flowtab);
+        ctime = qfContextCurrentTime(ctx);
         if (ctx->octx.rotate_last) {
             if (ctime - ctx->octx.rotate_last > ctx->octx.rotate_period) {
                 yfOutputClose(ctx->octx.fbuf, lock, TRUE);
@@ -195,7 +228,20 @@ gboolean yfFinalFlush(
     if (ctx->octx.fbuf) {
         if (ok) {
             /* Flush flow buffer and close output file on successful exit */
-            frv = yfFlowTabFlush(ctx, TRUE, err);
+            if (ctx->shards) {
+                frv = qfShardFinish(ctx->shards, ctx->octx.fbuf, err);
+            } else {
+                /* On a signal, save open flows for the next process rather
+                   than closing them, if configured to; export the rest */
+                if (yaf_quit && ctx->checkpoint &&
+                    !yfFlowTabCheckpoint(ctx->flowtab, ctx->checkpoint,
+                                         TRUE, err))
+                {
+                    g_warning("%s; closing flows", (*err)->message);
+                    g_clear_error(err);
+                }
+                frv = yfFlowTabFlush(ctx, TRUE, err);
+            }
             if (ctx->octx.stats_period) {
                 srv = yfWriteStatsRec(ctx, err);
             }
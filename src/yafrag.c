@@ -61,6 +61,7 @@
 #include <qof/decode.h>
 #include <qof/picq.h>
 #include <qof/yafrag.h>
+#include <qof/qofflowidx.h>
 
 /* max ip is 60, max tcp is 60, 14 for l2 */
 #define YF_FRAG_L4H_MAX 134
@@ -74,6 +75,8 @@ typedef struct yfFragRec_st {
 
 typedef struct yfFragKey_st {
     uint32_t                ipid;
+    /* port-blind hash of the flow key, from the decoder */
+    uint32_t                hash;
     yfFlowKey_t             f;
 } yfFragKey_t;
 
@@ -142,20 +145,7 @@ struct yfFragTab_st {
 static uint32_t yfFragKeyHash(
     yfFragKey_t       *key)
 {
-    if (key->f.version == 4) {
-        return key->ipid ^ (key->f.proto << 12) ^ (key->f.version << 4) ^
-               key->f.addr.v4.sip ^ key->f.addr.v4.dip;
-    } else {
-        return key->ipid ^ (key->f.proto << 12) ^ (key->f.version << 4) ^
-               *((uint32_t *)&(key->f.addr.v6.sip[0])) ^
-               *((uint32_t *)&(key->f.addr.v6.sip[4])) ^
-               *((uint32_t *)&(key->f.addr.v6.sip[8])) ^
-               *((uint32_t *)&(key->f.addr.v6.sip[12])) ^
-               *((uint32_t *)&(key->f.addr.v6.dip[0])) ^
-               *((uint32_t *)&(key->f.addr.v6.dip[4])) ^
-               *((uint32_t *)&(key->f.addr.v6.dip[8])) ^
-               *((uint32_t *)&(key->f.addr.v6.dip[12]));
-    }
+    return key->hash ^ key->ipid;
 }
 
 static gboolean yfFragKeyEqual(
@@ -164,7 +154,15 @@ static gboolean yfFragKeyEqual(
 {
     if ((a->f.version == b->f.version) &&
         (a->ipid == b->ipid) &&
-        (a->f.proto == b->f.proto)) {
+        (a->f.proto == b->f.proto) &&
+#if QOF_ENABLE_TUNNEL_KEYS
+        (a->f.tunnelId == b->f.tunnelId) &&
+#endif
+#if QOF_ENABLE_L2_KEYS
+        (a->f.mplsLabel == b->f.mplsLabel) &&
+        (a->f.outerVlanId == b->f.outerVlanId) &&
+#endif
+        (a->f.vlanId == b->f.vlanId)) {
         if ((a->f.version     == 4) &&
             (a->f.addr.v4.sip == b->f.addr.v4.sip) &&
             (a->f.addr.v4.dip == b->f.addr.v4.dip))
@@ -233,15 +231,16 @@ static void yfFragAdd(
 
 static yfFragNode_t *yfFragGetNode(
     yfFragTab_t         *fragtab,
-    yfFlowKey_t         *flowkey,
+    yfPBuf_t            *pbuf,
     yfIPFragInfo_t      *fraginfo)
 {
     yfFragNode_t        *fn;
     yfFragKey_t         fragkey;
 
     /* construct a key to look up the frag node */
-    memcpy(&fragkey.f, flowkey, sizeof(*flowkey));
+    memcpy(&fragkey.f, &(pbuf->key), sizeof(pbuf->key));
     fragkey.ipid = fraginfo->ipid;
+    fragkey.hash = pbuf->pairhash;
 
     /* get it out of the fragment table */
     fn = g_hash_table_lookup(fragtab->table, &fragkey);
@@ -478,7 +477,7 @@ gboolean yfDefragPBuf(
     fragtab->ctime = pbuf->ptime;
 
     /* get a fragment node and place it at the head of the queue */
-    fn = yfFragGetNode(fragtab, &(pbuf->key), fraginfo);
+    fn = yfFragGetNode(fragtab, pbuf, fraginfo);
 
     /* stash information from first fragment */
     if (fraginfo->offset == 0) {
@@ -537,6 +536,7 @@ gboolean yfDefragPBuf(
 
     /* Copy other values from fragment node to packet buffer */
     memcpy(&(pbuf->key), &(fn->key.f), sizeof(yfFlowKey_t));
+    pbuf->hash = qfFlowKeyHash(&(pbuf->key), &(pbuf->pairhash));
     pbuf->iplen = fn->iplen;
     memcpy(tcpinfo, &(fn->tcpinfo), sizeof(yfTCPInfo_t));
     memcpy(l2info, &(fn->l2info), sizeof(yfL2Info_t));
@@ -62,11 +62,26 @@
 #include <qof/yafrag.h>
 #include <qof/decode.h>
 #include "qofdetune.h"
+#include "qofshard.h"
+#include <time.h>
+
+/* Flush time histogram; 8 buckets per power of two nanoseconds */
+#define YF_FLUSH_HIST_SUB   8
+#define YF_FLUSH_HIST_LEN   (64 * YF_FLUSH_HIST_SUB)
 
 static uint32_t yaf_do_stat = 0;
 static GTimer *yaf_fft = NULL;
 static qfContext_t *statctx = NULL;
 static uint64_t yaf_dropped = 0;
+static uint64_t yaf_merge_late = 0;
+static gboolean yaf_ring = FALSE;
+static size_t yaf_ring_occupancy = 0;
+static size_t yaf_ring_peak = 0;
+static uint64_t yaf_ring_stalls = 0;
+static uint64_t yaf_flush_start = 0;
+static uint64_t yaf_flush_count = 0;
+static uint64_t yaf_flush_max = 0;
+static uint64_t yaf_flush_hist[YF_FLUSH_HIST_LEN];
 
 static void yfSigUsr1()
 {
@@ -94,21 +109,90 @@ void yfStatInit(
     g_timer_start(yaf_fft);
 }
 
+static uint64_t yfStatClock(void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void yfStatFlushBegin(void)
+{
+    yaf_flush_start = yfStatClock();
+}
+
+void yfStatFlushEnd(void)
+{
+    uint64_t            ns = yfStatClock() - yaf_flush_start;
+    unsigned int        shift = 0;
+
+    if (ns > yaf_flush_max) yaf_flush_max = ns;
+    ++yaf_flush_count;
+
+    /* bucket by the top four significant bits */
+    while ((ns >> shift) >= 2 * YF_FLUSH_HIST_SUB) ++shift;
+    ++yaf_flush_hist[shift * YF_FLUSH_HIST_SUB + (ns >> shift)];
+}
+
+static uint64_t yfStatFlushPercentile(double pct)
+{
+    uint64_t            target = (uint64_t)(yaf_flush_count * pct / 100.0);
+    uint64_t            seen = 0;
+    unsigned int        i, shift;
+
+    for (i = 0; i < YF_FLUSH_HIST_LEN; i++) {
+        seen += yaf_flush_hist[i];
+        if (seen > target) break;
+    }
+
+    /* report the upper bound of the bucket */
+    shift = (i < 2 * YF_FLUSH_HIST_SUB) ? 0 : i / YF_FLUSH_HIST_SUB - 1;
+    return ((uint64_t)(i - shift * YF_FLUSH_HIST_SUB + 1) << shift) - 1;
+}
+
 static void yfStatDump()
 {
     uint64_t numPackets;
-    numPackets = yfFlowDumpStats(statctx->flowtab, yaf_fft);
-    yfFragDumpStats(statctx->fragtab, numPackets);
+    if (statctx->shards) {
+        numPackets = qfShardDumpStats(statctx->shards, yaf_fft);
+    } else {
+        numPackets = yfFlowDumpStats(statctx->flowtab, yaf_fft);
+        yfFragDumpStats(statctx->fragtab, numPackets);
+    }
 #if QOF_ENABLE_DETUNE
     if (statctx->ictx.detune) {
         numPackets = qfDetuneDumpStats(statctx->ictx.detune, numPackets);
     }
 #endif
+    if (statctx->ictx.reorder) {
+        qfReorderDumpStats(statctx->ictx.reorder, numPackets);
+    }
     yfDecodeDumpStats(statctx->dectx, numPackets);
+
+    if (yaf_flush_count) {
+        g_message("Flush time per packet batch over %llu batches: "
+                  "max %.1f us, p99 %.1f us.",
+                  (long long unsigned int)yaf_flush_count,
+                  (double)yaf_flush_max / 1000,
+                  (double)yfStatFlushPercentile(99) / 1000);
+    }
     
+    if (yaf_ring) {
+        g_debug("Capture ring: %zu packets queued, peak %zu; capture waited "
+                "for space %llu times.", yaf_ring_occupancy, yaf_ring_peak,
+                (long long unsigned int)yaf_ring_stalls);
+    }
+
     if (yaf_dropped) {
         g_warning("Capture dropped %llu packets.", yaf_dropped);
     }
+
+    if (yaf_merge_late) {
+        g_warning("%llu packets reached their input thread too late to be "
+                  "merged in order; consider raising input-slack.",
+                  (long long unsigned int)yaf_merge_late);
+    }
 }
 
 void yfStatDumpLoop()
@@ -137,3 +221,30 @@ void yfStatReportDropped(uint64_t dropped) {
 uint64_t yfStatGetDropped(void) {
     return yaf_dropped;
 }
+
+void yfStatReportMergeLate(uint64_t late) {
+    yaf_merge_late = late;
+}
+
+uint64_t yfStatGetMergeLate(void) {
+    return yaf_merge_late;
+}
+
+void yfStatReportRing(size_t occupancy, size_t peak, uint64_t stalls) {
+    yaf_ring = TRUE;
+    yaf_ring_occupancy = occupancy;
+    yaf_ring_peak = peak;
+    yaf_ring_stalls = stalls;
+}
+
+void yfStatGetRing(uint32_t *occupancy, uint32_t *peak, uint64_t *stalls) {
+    *occupancy = (uint32_t)yaf_ring_occupancy;
+    *peak = (uint32_t)yaf_ring_peak;
+    *stalls = yaf_ring_stalls;
+}
+
+void yfStatGetFlushTime(uint32_t *max_us, uint32_t *p99_us) {
+    *max_us = (uint32_t)MIN(yaf_flush_max / 1000, UINT32_MAX);
+    *p99_us = yaf_flush_count ?
+        (uint32_t)MIN(yfStatFlushPercentile(99) / 1000, UINT32_MAX) : 0;
+}
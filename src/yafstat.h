@@ -75,5 +75,19 @@ void yfStatReportDropped(uint64_t dropped);
 
 uint64_t yfStatGetDropped(void);
 
+void yfStatReportMergeLate(uint64_t late);
+
+uint64_t yfStatGetMergeLate(void);
+
+void yfStatReportRing(size_t occupancy, size_t peak, uint64_t stalls);
+
+void yfStatGetRing(uint32_t *occupancy, uint32_t *peak, uint64_t *stalls);
+
+void yfStatFlushBegin(void);
+
+void yfStatFlushEnd(void);
+
+void yfStatGetFlushTime(uint32_t *max_us, uint32_t *p99_us);
+
 
 #endif
@@ -25,6 +25,9 @@
 #include <qof/yaftab.h>
 #include <qof/yafrag.h>
 #include <qof/qofopt.h>
+#include <qof/qofflowidx.h>
+#include <qof/qofwheel.h>
+#include <qof/qofslab.h>
 
 #include "qofconfig.h"
 #include <qof/decode.h>
@@ -41,15 +44,27 @@
 #define YAF_STATE_RFINACK       0x00000080
 #define YAF_STATE_FIN           0x000000F0
 #define YAF_STATE_ATO           0x00000100
+#define YAF_STATE_LEAN          0x00000200
 
 #define YF_FLUSH_DELAY 5000
 #define YF_MAX_CQ      2500
 
+/* Memory pressure stages, as fractions of the memory limit */
+#define YF_MEM_SHED_NUM     3
+#define YF_MEM_SHED_DEN     4
+#define YF_MEM_SHORT_NUM    9
+#define YF_MEM_SHORT_DEN    10
+#define YF_MEM_SHORT_IDLE   8
+
+/* VLAN IDs, for partitioning */
+#define YF_VLAN_COUNT       4096
+
 typedef struct yfFlowNode_st {
     struct yfFlowNode_st        *p;
     struct yfFlowNode_st        *n;
-    struct yfFlowTab_t          *flowtab;
+    uint32_t                    wslot;
     uint32_t                    state;
+    uint32_t                    hash;
     yfFlow_t                    f;
 } yfFlowNode_t;
 
@@ -74,6 +89,13 @@ typedef struct yfFlowKeyIPv4_st {
     uint8_t             proto;
     uint8_t             version;
     uint16_t            vlanId;
+#if QOF_ENABLE_TUNNEL_KEYS
+    uint32_t            tunnelId;
+#endif
+#if QOF_ENABLE_L2_KEYS
+    uint32_t            mplsLabel;
+    uint16_t            outerVlanId;
+#endif
 #if YAF_ENABLE_DAG_SEPARATE_INTERFACES || YAF_ENABLE_NAPATECH_SEPARATE_INTERFACES || YAF_ENABLE_BIVIO
     uint8_t             netIf;
 #endif
@@ -86,29 +108,41 @@ typedef struct yfFlowKeyIPv4_st {
 } yfFlowKeyIPv4_t;
 
 typedef struct yfFlowIPv4_st {
-    uint64_t        fid;
-    uint64_t        stime;
     uint64_t        etime;
-    int32_t         rdtime;
-    uint8_t         reason;
+    uint64_t        stime;
     uint8_t         sourceMacAddr[6];
     uint8_t         destinationMacAddr[6];
+    int32_t         rdtime;
     yfFlowVal_t     val;
+    uint64_t        fid;
+    uint8_t         reason;
     yfFlowVal_t     rval;
-    qfRtt_t         rtt;
+    qfRtt_t         rtt __attribute__((aligned(32)));
     yfFlowKeyIPv4_t key;
 } yfFlowIPv4_t;
 
 typedef struct yfFlowNodeIPv4_st {
     struct yfFlowNodeIPv4_st    *p;
     struct yfFlowNodeIPv4_st    *n;
-    struct yfFlowTab_t          *flowtab;
+    uint32_t                    wslot;
     uint32_t                    state;
+    uint32_t                    hash;
     yfFlowIPv4_t                f;
 } yfFlowNodeIPv4_t;
 
 #endif
 
+/*
+ * A flow table partition: a set of flows on their own timing wheel, counted
+ * apart so they can be held to their own limit. A table has one partition,
+ * or one per VLAN if partitioned by yfFlowTabSetVlanPartitions(), so that
+ * eviction in one VLAN never closes another's flows.
+ */
+typedef struct yfFlowPart_st {
+    qfWheel_t       *wheel;
+    uint32_t        count;
+} yfFlowPart_t;
+
 struct yfFlowTabStats_st {
     uint64_t        stat_octets;
     uint64_t        stat_packets;
@@ -117,22 +151,56 @@ struct yfFlowTabStats_st {
     uint64_t        stat_uniflows;
     uint32_t        stat_peak;
     uint32_t        stat_flush;
+    uint64_t        stat_shed;
+    uint64_t        stat_shortidle;
+    uint64_t        stat_memevict;
+    uint64_t        stat_vlanevict;
+    uint64_t        stat_peakmem;
+    uint64_t        stat_created;
+    uint64_t        stat_end[YAF_END_RESOURCE + 1];
+    uint32_t        stat_cqpeak;
 };
 
 struct yfFlowTab_st {
     /* State */
     uint64_t        next_fid;
+    uint64_t        fid_stride;
     uint64_t        ctime;
+    uint64_t        cus;
     uint64_t        flushtime;
-    GHashTable      *table;
-    yfFlowQueue_t   aq;
+    qfFlowIdx_t     *table;
+    yfFlowPart_t    *part;
+    uint32_t        part_count;
+    uint32_t        part_next;
+    uint16_t        *vlan_part;
     yfFlowQueue_t   cq;
+    qfSlab_t        *node_slab;
+#if YAF_ENABLE_COMPACT_IP4
+    qfSlab_t        *node4_slab;
+#endif
+    qfSlab_t        *tcp_slab;
+    size_t          node_sz;
+#if YAF_ENABLE_COMPACT_IP4
+    size_t          node4_sz;
+#endif
+    size_t          tcp_sz;
+    uint64_t        mem;
+    uint64_t        cq_mem;
     uint32_t        count;
     uint32_t        cq_count;
     /* Configuration */
     uint64_t        idle_ms;
     uint64_t        active_ms;
+    uint64_t        active_oct;
+    uint64_t        active_pkt;
+    uint32_t        active_rtts;
     uint32_t        max_flows;
+    uint32_t        vlan_max_flows;
+    uint64_t        max_mem;
+    uint64_t        shed_mem;
+    uint64_t        short_mem;
+    uint32_t        expire_quantum;
+    uint32_t        export_quantum;
     gboolean        uniflow;
     gboolean        silkmode;
     gboolean        macmode;
@@ -143,6 +211,7 @@ struct yfFlowTab_st {
     gboolean        tcp_opt_enable;
     gboolean        tcp_ts_enable;
     gboolean        tcp_iat_enable;
+    gboolean        tcp_val_enable;
     /* Statistics */
     struct yfFlowTabStats_st stats;
 };
@@ -168,141 +237,52 @@ void yfGetFlowTabStats(
     *flush = flowtab->stats.stat_flush;
 }
 
-
 /**
- * yfFlowKeyHash
+ * yfGetFlowTabMemStats
  *
- * hash function that takes the 6-tuple for flow
- * identification and turns it into a single
- * 32-bit integer
  *
- * @param key pointer the the flow key which holds
- *        the set of values that uniquely identify
- *        a flow within yaf
- *
- * @return 32-bit hashed integer of the flow
  */
-static uint32_t yfFlowKeyHash(
-    yfFlowKey_t       *key)
+void yfGetFlowTabMemStats(
+    yfFlowTab_t *flowtab,
+    uint64_t *shed,
+    uint64_t *shortidle,
+    uint64_t *evicted,
+    uint64_t *peakmem)
 {
-
-    /* Mask out priority/CFI bits */
-    uint16_t vlan_mask = 0x0FFF & key->vlanId;
-
-#if YAF_ENABLE_DAG_SEPARATE_INTERFACES||YAF_ENABLE_NAPATECH_SEPARATE_INTERFACES
-    uint32_t netInterfaceHash;
-
-    switch (key->netIf) {
-        case 0:
-            netInterfaceHash = 0x33333333;
-            break;
-        case 1:
-            netInterfaceHash = 0x55555555;
-            break;
-        case 2:
-            netInterfaceHash = 0xaaaaaaaa;
-            break;
-        case 3:
-            netInterfaceHash = 0xbbbbbbbb;
-            break;
-        default:
-            /* this is impossible because of the
-               dag structure is a 2-bit field for
-               this */
-            g_warning("invalid DAG or Napatech interface code recorded: %d"
-                      " - continuing processing", key->netIf);
-            netInterfaceHash = 0xcccccccc;
-    }
-
-    if (key->version == 4) {
-        return (key->sp << 16) ^ key->dp ^
-            (key->proto << 12) ^ (key->version << 4) ^
-            (vlan_mask << 20) ^ key->addr.v4.sip ^
-            key->addr.v4.dip ^ netInterfaceHash;
-    } else {
-        return (key->sp << 16) ^ key->dp ^
-            (key->proto << 12) ^ (key->version << 4) ^
-            (vlan_mask << 20) ^
-            *((uint32_t *)&(key->addr.v6.sip[0])) ^
-            *((uint32_t *)&(key->addr.v6.sip[4])) ^
-            *((uint32_t *)&(key->addr.v6.sip[8])) ^
-            *((uint32_t *)&(key->addr.v6.sip[12])) ^
-            *((uint32_t *)&(key->addr.v6.dip[0])) ^
-            *((uint32_t *)&(key->addr.v6.dip[4])) ^
-            *((uint32_t *)&(key->addr.v6.dip[8])) ^
-            *((uint32_t *)&(key->addr.v6.dip[12])) ^
-            netInterfaceHash;
-    }
-#endif
-
-    if (key->version == 4) {
-        return (key->sp << 16) ^ key->dp ^
-               (key->proto << 12) ^ (key->version << 4) ^
-               (vlan_mask << 20) ^
-               key->addr.v4.sip ^ key->addr.v4.dip;
-    } else {
-        return (key->sp << 16) ^ key->dp ^
-            (key->proto << 12) ^ (key->version << 4) ^
-            (vlan_mask << 20) ^
-            *((uint32_t *)&(key->addr.v6.sip[0])) ^
-            *((uint32_t *)&(key->addr.v6.sip[4])) ^
-            *((uint32_t *)&(key->addr.v6.sip[8])) ^
-            *((uint32_t *)&(key->addr.v6.sip[12])) ^
-            *((uint32_t *)&(key->addr.v6.dip[0])) ^
-            *((uint32_t *)&(key->addr.v6.dip[4])) ^
-            *((uint32_t *)&(key->addr.v6.dip[8])) ^
-            *((uint32_t *)&(key->addr.v6.dip[12]));
-    }
+    *shed = flowtab->stats.stat_shed;
+    *shortidle = flowtab->stats.stat_shortidle;
+    *evicted = flowtab->stats.stat_memevict;
+    *peakmem = flowtab->stats.stat_peakmem;
 }
 
 /**
- * yfFlowKeyEqual
- *
- * compares two flows (a & b) based on their key value,
- * the hopefully unique 6-tuple of flow information to
- * see if the flows are the same
+ * yfGetFlowTabTelemetry
  *
- * @param
  *
  */
-static gboolean yfFlowKeyEqual(
-    yfFlowKey_t       *a,
-    yfFlowKey_t       *b)
+void yfGetFlowTabTelemetry(
+    yfFlowTab_t *flowtab,
+    yfFlowTabTelemetry_t *tel)
 {
-
-    uint16_t a_vlan_mask = 0x0FFF & a->vlanId;
-    uint16_t b_vlan_mask = 0x0FFF & b->vlanId;
-
-#if YAF_ENABLE_DAG_SEPARATE_INTERFACES || YAF_ENABLE_NAPATECH_SEPARATE_INTERFACES
-    if (a->netIf != b->netIf) {
-        return FALSE;
-    }
-#endif
-
-    if ((a->sp      == b->sp)    &&
-        (a->dp      == b->dp)    &&
-        (a->proto   == b->proto) &&
-        (a->version == b->version) &&
-        (a_vlan_mask == b_vlan_mask))
-    {
-        if ((a->version     == 4) &&
-            (a->addr.v4.sip == b->addr.v4.sip) &&
-            (a->addr.v4.dip == b->addr.v4.dip))
-        {
-            return TRUE;
-        } else if ((a->version == 6) &&
-                   (memcmp(a->addr.v6.sip, b->addr.v6.sip, 16) == 0) &&
-                   (memcmp(a->addr.v6.dip, b->addr.v6.dip, 16) == 0))
-        {
-            return TRUE;
-        } else {
-            return FALSE;
-        }
-    } else {
-        return FALSE;
-    }
+    uint64_t    lookups, probes;
+    size_t      live, capacity, mapped;
+    gboolean    huge;
+
+    tel->created = flowtab->stats.stat_created;
+    tel->end_idle = flowtab->stats.stat_end[YAF_END_IDLE];
+    tel->end_active = flowtab->stats.stat_end[YAF_END_ACTIVE];
+    tel->end_closed = flowtab->stats.stat_end[YAF_END_CLOSED];
+    tel->end_resource = flowtab->stats.stat_end[YAF_END_RESOURCE];
+    qfFlowIdxProbeHist(flowtab->table, tel->probe_hist);
+    tel->occupancy = flowtab->count;
+    tel->capacity = (uint32_t)qfFlowIdxCapacity(flowtab->table);
+    qfFlowIdxStats(flowtab->table, &lookups, &probes, &tel->max_probe);
+    qfSlabStats(flowtab->tcp_slab, &live, &capacity, &mapped, &huge);
+    tel->tcp_blocks = (uint32_t)live;
+    tel->cq_peak = flowtab->stats.stat_cqpeak;
 }
 
+
 /**
  * yfFlowKeyReverse
  *
@@ -328,6 +308,13 @@ void yfFlowKeyReverse(
     rev->proto = fwd->proto;
     rev->version = fwd->version;
     rev->vlanId = fwd->vlanId;
+#if QOF_ENABLE_TUNNEL_KEYS
+    rev->tunnelId = fwd->tunnelId;
+#endif
+#if QOF_ENABLE_L2_KEYS
+    rev->mplsLabel = fwd->mplsLabel;
+    rev->outerVlanId = fwd->outerVlanId;
+#endif
     if (fwd->version == 4) {
         rev->addr.v4.sip = fwd->addr.v4.dip;
         rev->addr.v4.dip = fwd->addr.v4.sip;
@@ -404,33 +391,71 @@ static void yfFlowDebug(
     g_debug("%s", str->str);
 }
 
+#endif
+
 /**
- * yfFlowTabVerifyIdleOrder
+ * yfFlowMem
  *
+ * returns the memory held by a flow: its node and
+ * the TCP state of either direction, as allocated
+ * from the flow table's slabs
  *
- * @param flowtab
+ * @param flowtab pointer to the flow table
+ * @param fn node in the table to size
  *
  */
-static void yfFlowTabVerifyIdleOrder(
-    yfFlowTab_t         *flowtab)
+static uint64_t yfFlowMem(
+    yfFlowTab_t         *flowtab,
+    yfFlowNode_t        *fn)
 {
-    yfFlowNode_t        *fn = NULL, *nfn = NULL;
-    uint64_t            end;
-    uint32_t            i;
+    uint64_t            mem;
 
-    /* rip through the active queue making sure end time strictly decreases */
-    for (fn = flowtab->aq.head, end = flowtab->aq.head->f.etime, i = 0;
-         fn; end = fn->f.etime, fn = nfn, ++i)
-    {
-        nfn = fn->p;
-        if (end < fn->f.etime) {
-            g_debug("Flow inversion in active table position %u; "
-                    "last end %llu, end %llu in flow:", i, end, fn->f.etime);
-            yfFlowDebug("iiv", &(fn->f));
-        }
+#if YAF_ENABLE_COMPACT_IP4
+    if (fn->f.key.version == 4) {
+        mem = flowtab->node4_sz;
+    } else {
+#endif
+        mem = flowtab->node_sz;
+#if YAF_ENABLE_COMPACT_IP4
     }
-}
 #endif
+    if (fn->f.val.tcp) mem += flowtab->tcp_sz;
+    if (fn->f.rval.tcp) mem += flowtab->tcp_sz;
+
+    return mem;
+}
+
+/**
+ * yfFlowMemAdd
+ *
+ * accounts for memory newly allocated to a flow
+ *
+ */
+static void yfFlowMemAdd(
+    yfFlowTab_t         *flowtab,
+    size_t              bytes)
+{
+    flowtab->mem += bytes;
+    if (flowtab->mem > flowtab->stats.stat_peakmem) {
+        flowtab->stats.stat_peakmem = flowtab->mem;
+    }
+}
+
+/**
+ * yfFlowMemOver
+ *
+ * returns TRUE if the flow table is limited in memory, and the memory held by
+ * open flows (i.e., not counting flows waiting in the close queue)
+ * exceeds the given threshold
+ *
+ */
+static gboolean yfFlowMemOver(
+    yfFlowTab_t         *flowtab,
+    uint64_t            threshold)
+{
+    return flowtab->max_mem &&
+           (flowtab->mem - flowtab->cq_mem > threshold);
+}
 
 /**
  * yfFlowFree
@@ -446,42 +471,100 @@ static void yfFlowFree(
     yfFlowTab_t         *flowtab,
     yfFlowNode_t        *fn)
 {
+    /* account for it */
+    flowtab->mem -= yfFlowMem(flowtab, fn);
+
     /* free flow */
-    if (fn->f.val.tcp) yg_slice_free(qfTcpVal_t, fn->f.val.tcp);
-    if (fn->f.rval.tcp) yg_slice_free(qfTcpVal_t, fn->f.rval.tcp);
+    if (fn->f.val.tcp) qfSlabPut(flowtab->tcp_slab, fn->f.val.tcp);
+    if (fn->f.rval.tcp) qfSlabPut(flowtab->tcp_slab, fn->f.rval.tcp);
     
 #if YAF_ENABLE_COMPACT_IP4
     if (fn->f.key.version == 4) {
-        yg_slice_free(yfFlowNodeIPv4_t, (yfFlowNodeIPv4_t *)fn);
+        qfSlabPut(flowtab->node4_slab, fn);
     } else {
 #endif
-        yg_slice_free(yfFlowNode_t, fn);
+        qfSlabPut(flowtab->node_slab, fn);
 #if YAF_ENABLE_COMPACT_IP4
     }
 #endif
 }
 
 /**
- * yfFlowTick
+ * yfFlowDeadline
  *
- * advances a flow to the head of the activity
- * queue so when flows get timed out, only the
- * bottom of the queue is examined
+ * returns the time after which a flow is due to be
+ * closed, for idle or active timeout, whichever
+ * comes first. As neither start time nor timeouts
+ * change, the deadline only ever moves forward, so
+ * the timing wheel can reschedule flows lazily.
  *
  * @param flowtable pointer to the flow table
  * @param fn pointer to the flow node entry in the
  *        table
  *
  */
-static void yfFlowTick(
+static uint64_t yfFlowDeadline(
     yfFlowTab_t                     *flowtab,
     yfFlowNode_t                    *fn)
 {
-    /* move flow node to head of queue */
-    if (flowtab->aq.head != fn) {
-        piqPick(&flowtab->aq, fn);
-        piqEnQ(&flowtab->aq, fn);
+    uint64_t                        idle = fn->f.etime / 1000 +
+                                           flowtab->idle_ms;
+    uint64_t                        active = fn->f.stime / 1000 +
+                                             flowtab->active_ms;
+
+    return (idle < active) ? idle : active;
+}
+
+/**
+ * yfFlowPartFor
+ *
+ * returns the partition a flow belongs to by its key, creating the
+ * partition for a VLAN on its first flow.
+ *
+ * @param flowtab pointer to the flow table
+ * @param key flow key to find the partition of
+ *
+ */
+static yfFlowPart_t *yfFlowPartFor(
+    yfFlowTab_t                     *flowtab,
+    yfFlowKey_t                     *key)
+{
+    uint16_t                        vid;
+
+    if (!flowtab->vlan_part) return flowtab->part;
+
+    vid = key->vlanId & (YF_VLAN_COUNT - 1);
+    if (!flowtab->vlan_part[vid]) {
+        flowtab->part[flowtab->part_count].wheel =
+            qfWheelAlloc(offsetof(yfFlowNode_t, wslot));
+        flowtab->vlan_part[vid] = ++(flowtab->part_count);
     }
+
+    return &flowtab->part[flowtab->vlan_part[vid] - 1];
+}
+
+/**
+ * yfFlowPartLargest
+ *
+ * returns the partition holding the most flows, to evict from when the
+ * table as a whole is over its limits, or NULL if there are none.
+ *
+ * @param flowtab pointer to the flow table
+ *
+ */
+static yfFlowPart_t *yfFlowPartLargest(
+    yfFlowTab_t                     *flowtab)
+{
+    yfFlowPart_t                    *part = NULL;
+    uint32_t                        i;
+
+    for (i = 0; i < flowtab->part_count; i++) {
+        if (!part || flowtab->part[i].count > part->count) {
+            part = &flowtab->part[i];
+        }
+    }
+
+    return part;
 }
 
 /**
@@ -501,24 +584,34 @@ static void yfFlowClose(
     yfFlowNode_t                    *fn,
     uint8_t                         reason)
 {
+    yfFlowPart_t                    *part = yfFlowPartFor(flowtab,
+                                                          &fn->f.key);
+
     /* remove flow from table */
-    g_hash_table_remove(flowtab->table, &(fn->f.key));
+    qfFlowIdxRemove(flowtab->table, fn, fn->hash);
 
     /* store closure reason */
     fn->f.reason &= ~YAF_END_MASK;
     fn->f.reason |= reason;
 
-    /* remove flow from active queue */
-    piqPick(&flowtab->aq, fn);
+    /* remove flow from timing wheel */
+    qfWheelCancel(part->wheel, fn);
 
     /* move flow node to close queue */
     piqEnQ(&flowtab->cq, fn);
 
-    /** count the flow in the close queue */
-    ++(flowtab->cq_count);
+    /** count the flow and its memory in the close queue */
+    if (++(flowtab->cq_count) > flowtab->stats.stat_cqpeak) {
+        flowtab->stats.stat_cqpeak = flowtab->cq_count;
+    }
+    if (reason <= YAF_END_RESOURCE) {
+        ++(flowtab->stats.stat_end[reason]);
+    }
+    flowtab->cq_mem += yfFlowMem(flowtab, fn);
 
     /* count the flow as inactive */
     --(flowtab->count);
+    --(part->count);
 }
 
 /**
@@ -533,6 +626,9 @@ static void yfFlowClose(
 yfFlowTab_t *yfFlowTabAlloc(
     uint64_t        idle_ms,
     uint64_t        active_ms,
+    uint64_t        active_octets,
+    uint64_t        active_packets,
+    uint32_t        active_rtts,
     uint32_t        max_flows,
     gboolean        uniflow,
     gboolean        silkmode,
@@ -552,12 +648,16 @@ yfFlowTab_t *yfFlowTabAlloc(
     
     /* Set state */
     flowtab->next_fid = 1;
+    flowtab->fid_stride = 1;
 
 /* FIXME consider a better mode selection interface */
 
     /* Fill in the configuration */
     flowtab->idle_ms = idle_ms;
     flowtab->active_ms = active_ms;
+    flowtab->active_oct = active_octets;
+    flowtab->active_pkt = active_packets;
+    flowtab->active_rtts = active_rtts;
     flowtab->max_flows = max_flows;
     flowtab->uniflow = uniflow;
     flowtab->silkmode = silkmode;
@@ -569,10 +669,36 @@ yfFlowTab_t *yfFlowTabAlloc(
     flowtab->tcp_opt_enable = tcp_opt_enable;
     flowtab->tcp_ts_enable = tcp_ts_enable,
     flowtab->tcp_iat_enable = tcp_iat_enable;
+    flowtab->tcp_val_enable = tcp_seq_enable || tcp_ack_enable ||
+                              tcp_rwin_enable || tcp_opt_enable ||
+                              tcp_ts_enable || tcp_iat_enable;
 
     /* Allocate key index table */
-    flowtab->table = g_hash_table_new((GHashFunc)yfFlowKeyHash,
-                                      (GEqualFunc)yfFlowKeyEqual);
+    flowtab->table = qfFlowIdxAlloc(offsetof(yfFlowNode_t, f.key), max_flows);
+
+    /* Allocate a single partition and its timing wheel */
+    flowtab->part = g_new0(yfFlowPart_t, 1);
+    flowtab->part->wheel = qfWheelAlloc(offsetof(yfFlowNode_t, wslot));
+    flowtab->part_count = 1;
+
+    /* Allocate slabs for flow nodes and TCP state; nodes and TCP state are
+       line aligned so their hot fields share a line (see
+       yfFlowTabLayoutCheck()) */
+    flowtab->node_slab = qfSlabAlloc("flow node", sizeof(yfFlowNode_t),
+                                     QF_SLAB_LINE);
+#if YAF_ENABLE_COMPACT_IP4
+    flowtab->node4_slab = qfSlabAlloc("IPv4 flow node",
+                                      sizeof(yfFlowNodeIPv4_t), QF_SLAB_LINE);
+#endif
+    flowtab->tcp_slab = qfSlabAlloc("TCP state", sizeof(qfTcpVal_t),
+                                    QF_SLAB_LINE);
+
+    /* Note the memory each object actually takes, for accounting */
+    flowtab->node_sz = qfSlabObjSize(flowtab->node_slab);
+#if YAF_ENABLE_COMPACT_IP4
+    flowtab->node4_sz = qfSlabObjSize(flowtab->node4_slab);
+#endif
+    flowtab->tcp_sz = qfSlabObjSize(flowtab->tcp_slab);
 
     /* Done */
     return flowtab;
@@ -588,6 +714,8 @@ void yfFlowTabFree(
     yfFlowTab_t             *flowtab)
 {
     yfFlowNode_t            *fn = NULL, *nfn = NULL;
+    uint64_t                slot_end;
+    uint32_t                i;
 
     /* zip through the close queue freeing flows */
     for (fn = flowtab->cq.head; fn; fn = nfn) {
@@ -595,14 +723,25 @@ void yfFlowTabFree(
         yfFlowFree(flowtab, fn);
     }
 
-    /* now do the same with the active queue */
-    for (fn = flowtab->aq.head; fn; fn = nfn) {
-        nfn = fn->p;
-        yfFlowFree(flowtab, fn);
+    /* now empty the timing wheels */
+    for (i = 0; i < flowtab->part_count; i++) {
+        while ((fn = qfWheelPopEarliest(flowtab->part[i].wheel, &slot_end))) {
+            yfFlowFree(flowtab, fn);
+        }
+        qfWheelFree(flowtab->part[i].wheel);
     }
+    g_free(flowtab->part);
+    g_free(flowtab->vlan_part);
 
-   /* free the key index table */
-    g_hash_table_destroy(flowtab->table);
+    /* free the key index table */
+    qfFlowIdxFree(flowtab->table);
+
+    /* and the slabs the flows lived in */
+    qfSlabFree(flowtab->node_slab);
+#if YAF_ENABLE_COMPACT_IP4
+    qfSlabFree(flowtab->node4_slab);
+#endif
+    qfSlabFree(flowtab->tcp_slab);
 
     /* now free the flow table */
     yg_slice_free(yfFlowTab_t, flowtab);
@@ -612,46 +751,56 @@ void yfFlowTabFree(
  * yfFlowGetNode
  *
  * finds a flow node entry in the flow table for
- * the appropriate key value given
+ * the appropriate key value given, by the key's
+ * hash as computed by the decoder
  *
  */
 static yfFlowNode_t *yfFlowGetNode(
     yfFlowTab_t             *flowtab,
     yfFlowKey_t             *key,
+    uint32_t                hash,
     yfFlowVal_t             **valp,
     yfFlowVal_t             **rvalp,
     uint64_t                cont_fid)
 {
-    yfFlowKey_t             rkey;
     yfFlowNode_t            *fn;
+    yfFlowPart_t            *part;
+    gboolean                rev;
 
-    /* Look for flow in table */
-    if ((fn = g_hash_table_lookup(flowtab->table, key))) {
-        /* Forward flow found. */
-        *valp = &(fn->f.val);
-        *rvalp = &(fn->f.rval);
-        return fn;
-    }
-
-    /* Okay. Check for reverse flow. */
-    yfFlowKeyReverse(key, &rkey);
-    if ((fn = g_hash_table_lookup(flowtab->table, &rkey))) {
-        /* Reverse flow found. */
-        *valp = &(fn->f.rval);
-        *rvalp = &(fn->f.val);
+    /* Look for flow in table, in either direction */
+    if ((fn = qfFlowIdxLookup(flowtab->table, key, hash, &rev))) {
+        if (rev) {
+            /* Reverse flow found. */
+            *valp = &(fn->f.rval);
+            *rvalp = &(fn->f.val);
+        } else {
+            /* Forward flow found. */
+            *valp = &(fn->f.val);
+            *rvalp = &(fn->f.rval);
+        }
         return fn;
     }
 
-    /* Neither exists. Create a new flow and put it in the table. */
+    /* Not found. Create a new flow and put it in the table. */
 #if YAF_ENABLE_COMPACT_IP4
     if (key->version == 4) {
-        fn = (yfFlowNode_t *)yg_slice_new0(yfFlowNodeIPv4_t);
+        fn = (yfFlowNode_t *)qfSlabGet(flowtab->node4_slab);
+        yfFlowMemAdd(flowtab, flowtab->node4_sz);
     } else {
 #endif
-        fn = yg_slice_new0(yfFlowNode_t);
+        fn = (yfFlowNode_t *)qfSlabGet(flowtab->node_slab);
+        yfFlowMemAdd(flowtab, flowtab->node_sz);
 #if YAF_ENABLE_COMPACT_IP4
     }
 #endif
+    /* Under memory pressure, meter new TCP flows without analytics */
+    if (yfFlowMemOver(flowtab, flowtab->shed_mem)) {
+        fn->state |= YAF_STATE_LEAN;
+        if (key->proto == YF_PROTO_TCP && flowtab->tcp_val_enable) {
+            ++(flowtab->stats.stat_shed);
+        }
+    }
+
     /* Copy key */
     yfFlowKeyCopy(key, &(fn->f.key));
 
@@ -659,17 +808,24 @@ static yfFlowNode_t *yfFlowGetNode(
     if (cont_fid) {
         fn->f.fid = cont_fid;
     } else {
-        fn->f.fid = flowtab->next_fid++;
+        fn->f.fid = flowtab->next_fid;
+        flowtab->next_fid += flowtab->fid_stride;
     }
     
     /* set flow start time */
-    fn->f.stime = flowtab->ctime;
+    fn->f.stime = flowtab->cus;
 
     /* set flow end time as start time */
-    fn->f.etime = flowtab->ctime;
+    fn->f.etime = flowtab->cus;
 
     /* stuff the flow in the table */
-    g_hash_table_insert(flowtab->table, &(fn->f.key), fn);
+    fn->hash = hash;
+    qfFlowIdxInsert(flowtab->table, fn, hash);
+
+    /* and schedule its timeout */
+    part = yfFlowPartFor(flowtab, key);
+    qfWheelSchedule(part->wheel, fn, yfFlowDeadline(flowtab, fn),
+                    flowtab->ctime);
 
     /* This is a forward flow */
     *valp = &(fn->f.val);
@@ -677,6 +833,8 @@ static yfFlowNode_t *yfFlowGetNode(
     
     /* Count it */
     ++(flowtab->count);
+    ++(part->count);
+    ++(flowtab->stats.stat_created);
     if (flowtab->count > flowtab->stats.stat_peak) {
         flowtab->stats.stat_peak = flowtab->count;
     }
@@ -736,63 +894,60 @@ static void yfFlowPktTCP(
     yfIPInfo_t                  *ipinfo,
     size_t                      datalen)
 {
-    uint32_t                    lms = (uint32_t)(UINT32_MAX & flowtab->ctime);
+    uint32_t                    lus = (uint32_t)(UINT32_MAX & flowtab->cus);
     int                         seqadv;
     
     /* handle flags */
     if (val->pkt) {
         /* Not the first packet. Union flags, track sequence number */
         val->uflags |= tcpinfo->flags;
-        if (flowtab->tcp_seq_enable) {
+        if (val->tcp && flowtab->tcp_seq_enable) {
             seqadv = qfSeqSegment(&val->tcp->seq, &fn->f.rtt,
                                   val->tcp->opts.mss, tcpinfo->flags,
                                   tcpinfo->seq, (uint32_t) datalen,
-                                  lms, tcpinfo->tsval,
+                                  lus, tcpinfo->tsval,
                                   flowtab->tcp_ts_enable,
                                   flowtab->tcp_iat_enable);
         }
     } else {
         /* First packet. Allocate a TCP structure for this direction,
-           if necessary */
-        if (flowtab->tcp_seq_enable ||
-            flowtab->tcp_ack_enable ||
-            flowtab->tcp_rwin_enable ||
-            flowtab->tcp_opt_enable ||
-            flowtab->tcp_ts_enable ||
-            flowtab->tcp_iat_enable) {
-            val->tcp = yg_slice_alloc0(sizeof(qfTcpVal_t));
+           if necessary, unless the flow was created under memory
+           pressure */
+        if (flowtab->tcp_val_enable && !(fn->state & YAF_STATE_LEAN)) {
+            val->tcp = qfSlabGet(flowtab->tcp_slab);
+            yfFlowMemAdd(flowtab, flowtab->tcp_sz);
         }
         
         /* Initial flags, start sequence number tracking */
         val->iflags = tcpinfo->flags;
-        if (flowtab->tcp_seq_enable) {
+        if (val->tcp && flowtab->tcp_seq_enable) {
             qfSeqFirstSegment(&val->tcp->seq, tcpinfo->flags,
                               tcpinfo->seq, (uint32_t) datalen,
-                              lms, tcpinfo->tsval, flowtab->tcp_ts_enable);
+                              lus, tcpinfo->tsval, flowtab->tcp_ts_enable);
         }
     }
     
     /* track ACK dynamics */
-    if (tcpinfo->flags & YF_TF_ACK && flowtab->tcp_ack_enable) {
+    if (val->tcp && tcpinfo->flags & YF_TF_ACK && flowtab->tcp_ack_enable) {
         qfAckSegment(&val->tcp->ack, tcpinfo->ack, tcpinfo->sack,
-                     (uint32_t) datalen, lms);
+                     (uint32_t) datalen, lus);
     }
         
     /* Track round trip time */
     if (flowtab->tcp_rtt_enable) {
         qfRttSegment(&fn->f.rtt, tcpinfo->seq, tcpinfo->ack,
-                     tcpinfo->tsval, tcpinfo->tsecr, lms,
+                     tcpinfo->tsval, tcpinfo->tsecr, lus,
                      tcpinfo->flags, (val == &fn->f.rval));
     }
     
     /* Track receiver window dynamics */
-    if (flowtab->tcp_rwin_enable) {
+    if (val->tcp && flowtab->tcp_rwin_enable) {
         if (tcpinfo->ws) qfRwinScale(&val->tcp->rwin, tcpinfo->ws);
         qfRwinSegment(&val->tcp->rwin, tcpinfo->rwin);
     }
     
     /* Store information from options */
-    if (flowtab->tcp_opt_enable) {
+    if (val->tcp && flowtab->tcp_opt_enable) {
         qfOptSegment(&val->tcp->opts, tcpinfo, ipinfo, (uint16_t)datalen);
     }
     
@@ -815,6 +970,54 @@ static void yfFlowPktTCP(
     }
 }
 
+/**
+ * yfFlowActiveDue
+ *
+ * returns TRUE if a flow is due for active timeout on arrival of a packet:
+ * by duration, by volume (octets or packets, counting both directions), by
+ * duration in multiples of its smoothed round-trip time, or, in SiLK mode,
+ * on 32-bit octet counter overflow in the packet's direction.
+ *
+ * @param flowtab pointer to the flow table
+ * @param fn pointer to the node for the flow
+ * @param val value for the packet's direction
+ * @param pbuf packet arriving
+ *
+ */
+static gboolean yfFlowActiveDue(
+    yfFlowTab_t                 *flowtab,
+    yfFlowNode_t                *fn,
+    yfFlowVal_t                 *val,
+    yfPBuf_t                    *pbuf)
+{
+    uint64_t                    dur = flowtab->cus - fn->f.stime;
+    uint64_t                    oct = fn->f.val.oct + fn->f.rval.oct;
+    uint64_t                    pkt = fn->f.val.pkt + fn->f.rval.pkt;
+
+    if (dur > flowtab->active_ms * 1000) return TRUE;
+
+    if (flowtab->silkmode && (val->oct + pbuf->iplen > UINT32_MAX)) {
+        return TRUE;
+    }
+
+    if (flowtab->active_oct && oct &&
+        (oct + pbuf->iplen > flowtab->active_oct))
+    {
+        return TRUE;
+    }
+
+    if (flowtab->active_pkt && (pkt >= flowtab->active_pkt)) return TRUE;
+
+    if (flowtab->active_rtts && (fn->f.rtt.val.n > 0) &&
+        (fn->f.rtt.val.val > 0) &&
+        (dur > (uint64_t)fn->f.rtt.val.val * flowtab->active_rtts))
+    {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
 /**
  * yfFlowPBuf
  *
@@ -842,6 +1045,7 @@ void yfFlowPBuf(
     uint16_t                    datalen = (pbuf->iplen - pbuf->allHeaderLen +
                                            l2info->l2hlen);
     uint64_t                    cont_fid = 0;
+    uint64_t                    us = pbuf->ptime_ns / 1000;
 
     /* skip and count out of sequence packets */
     if (pbuf->ptime < flowtab->ctime) {
@@ -849,39 +1053,41 @@ void yfFlowPBuf(
             return;
     }
 
-    /* update flow table current time */
+    /* update flow table current time; packets out of order within a
+       millisecond are accepted, so hold the microsecond clock steady
+       rather than let it run backward */
     flowtab->ctime = pbuf->ptime;
+    if (us > flowtab->cus) flowtab->cus = us;
 
     /* Count the packet and its octets */
     ++(flowtab->stats.stat_packets);
     flowtab->stats.stat_octets += pbuf->iplen;
 
     /* Get a flow node for this flow */
-    fn = yfFlowGetNode(flowtab, key, &val, &rval, 0);
+    fn = yfFlowGetNode(flowtab, key, pbuf->hash, &val, &rval, 0);
 
-    /* Check for active timeout or counter overflow */
-    if (((pbuf->ptime - fn->f.stime) > flowtab->active_ms) ||
-        (flowtab->silkmode && (val->oct + pbuf->iplen > UINT32_MAX)))
-    {
+    /* Check for active timeout, by time, volume or RTT,
+       or counter overflow */
+    if (yfFlowActiveDue(flowtab, fn, val, pbuf)) {
         cont_fid = fn->f.fid;
         yfFlowClose(flowtab, fn, YAF_END_ACTIVE);
         /* get a new flow node containing this packet */
-        fn = yfFlowGetNode(flowtab, key, &val, &rval, cont_fid);
+        fn = yfFlowGetNode(flowtab, key, pbuf->hash, &val, &rval, cont_fid);
         /* set continuation flag in silk mode */
         if (flowtab->silkmode) fn->f.reason = YAF_ENDF_ISCONT;
     }
 
     /* Check for inactive timeout - esp when reading from pcap */
-    if ((pbuf->ptime - fn->f.etime) > flowtab->idle_ms) {
+    if ((flowtab->cus - fn->f.etime) > flowtab->idle_ms * 1000) {
         cont_fid = fn->f.fid;
         yfFlowClose(flowtab, fn, YAF_END_IDLE);
         /* get a new flow node for the current packet */
-        fn = yfFlowGetNode(flowtab, key, &val, &rval, cont_fid);
+        fn = yfFlowGetNode(flowtab, key, pbuf->hash, &val, &rval, cont_fid);
     }
 
     /* Calculate reverse SYN/ACK RTT */
     if (val->pkt == 0 && val == &(fn->f.rval)) {
-        fn->f.rdtime = (uint32_t)(pbuf->ptime - fn->f.stime);
+        fn->f.rdtime = (uint32_t)((flowtab->cus - fn->f.stime) / 1000);
     }
 
     /* Do IP stuff */
@@ -926,7 +1132,7 @@ void yfFlowPBuf(
     if (datalen) val->apppkt += 1;
     
     /* update flow end time */
-    fn->f.etime = pbuf->ptime;
+    fn->f.etime = flowtab->cus;
 
     /* Update stats */
     // FIXME removed for now, moving all stats down into the values
@@ -935,13 +1141,12 @@ void yfFlowPBuf(
     //     yfFlowStatistics(fn, val, pbuf->ptime, datalen);
     // }
 
-    /* close flow, or move it to head of queue */
+    /* close flow if finished; the timing wheel picks up the new end time
+       when the flow's current slot comes due */
     if ((fn->state & YAF_STATE_FIN) == YAF_STATE_FIN ||
         fn->state & YAF_STATE_RST)
     {
         yfFlowClose(flowtab, fn, YAF_END_CLOSED);
-    } else {
-        yfFlowTick(flowtab, fn);
     }
 }
 
@@ -993,7 +1198,7 @@ static gboolean yfUniflowReverse(
     if (!(bf->rval.pkt)) return FALSE;
 
     /* calculate reverse time */
-    uf->stime = bf->stime + bf->rdtime;
+    uf->stime = bf->stime + (uint64_t)bf->rdtime * 1000;
     uf->etime = bf->etime;
     uf->rdtime = 0;
     
@@ -1023,58 +1228,184 @@ static gboolean yfUniflowReverse(
 }
 
 /**
- * yfFlowTabFlush
+ * yfFlowTabShortIdle
  *
+ * close flows idle for longer than a fraction of the idle timeout, for
+ * relief under memory pressure. Flows come off the wheel earliest deadline
+ * first; an idle-bound deadline orders flows by last activity, so once a
+ * flow is current on the wheel with a deadline beyond that of any flow
+ * idle past the shortened timeout, no flow after it can be either. Flows
+ * not closed whose deadline is still early (i.e., nearing active timeout)
+ * are held aside and rescheduled after the sweep.
  *
+ * @param flowtab pointer to the flow table
+ * @param part partition to close flows in
+ * @param budget maximum number of flows to take off the wheel
+ * @return budget remaining
  *
  */
-gboolean yfFlowTabFlush(
-    void            *yfContext,
+static uint64_t yfFlowTabShortIdle(
+    yfFlowTab_t     *flowtab,
+    yfFlowPart_t    *part,
+    uint64_t        budget)
+{
+    yfFlowQueue_t   held = { NULL, NULL };
+    yfFlowNode_t    *fn = NULL;
+    uint64_t        short_ms = flowtab->idle_ms / YF_MEM_SHORT_IDLE;
+    uint64_t        horizon = flowtab->ctime + flowtab->idle_ms - short_ms;
+    uint64_t        slot_end, deadline;
+
+    while (budget && (fn = qfWheelPopEarliest(part->wheel, &slot_end))) {
+        --budget;
+        deadline = yfFlowDeadline(flowtab, fn);
+        if (flowtab->ctime - fn->f.etime / 1000 > short_ms) {
+            yfFlowClose(flowtab, fn, YAF_END_IDLE);
+            ++(flowtab->stats.stat_shortidle);
+        } else if (deadline >= slot_end) {
+            /* flow has seen traffic since it was scheduled; move it on */
+            qfWheelSchedule(part->wheel, fn, deadline, flowtab->ctime);
+        } else {
+            piqEnQ(&held, fn);
+            if (deadline >= horizon) break;
+        }
+    }
+
+    while ((fn = piqDeQ(&held))) {
+        qfWheelSchedule(part->wheel, fn, yfFlowDeadline(flowtab, fn),
+                        flowtab->ctime);
+    }
+
+    return budget;
+}
+
+/**
+ * yfFlowTabFlushTo
+ *
+ *
+ *
+ */
+gboolean yfFlowTabFlushTo(
+    yfFlowTab_t     *flowtab,
     gboolean        close,
+    yfFlowWriter_fn writer,
+    void            *wctx,
     GError          **err)
 {
     gboolean        wok = TRUE;
     yfFlowNode_t    *fn = NULL;
+    yfFlowPart_t    *part = NULL;
     yfFlow_t        uf;
-    qfContext_t     *ctx = (qfContext_t *)yfContext;
-    yfFlowTab_t     *flowtab = ctx->flowtab;
-
-    if (!close && flowtab->flushtime &&
+    uint64_t        slot_end;
+    uint64_t        expire_left = UINT64_MAX;
+    uint64_t        export_left = UINT64_MAX;
+    uint32_t        i;
+
+    /* A flush is counted, and its time noted, whenever it does any work:
+       every call of an incremental flush, and every full flush not put
+       off by YF_FLUSH_DELAY */
+    if (!close && (flowtab->expire_quantum || flowtab->export_quantum)) {
+        /* Incremental flush: do a bounded amount of work on every call */
+        if (flowtab->expire_quantum) expire_left = flowtab->expire_quantum;
+        if (flowtab->export_quantum) export_left = flowtab->export_quantum;
+    } else if (!close && flowtab->flushtime &&
         (flowtab->ctime < flowtab->flushtime + YF_FLUSH_DELAY)
-        && (flowtab->cq_count < YF_MAX_CQ))
+        && (flowtab->cq_count < YF_MAX_CQ)
+        && !yfFlowMemOver(flowtab, flowtab->max_mem))
     {
         return TRUE;
     }
 
-    flowtab->flushtime = flowtab->ctime;
-
     /* Count the flush */
+    flowtab->flushtime = flowtab->ctime;
     ++flowtab->stats.stat_flush;
 
-    /* Verify flow table order */
-    /* yfFlowTabVerifyIdleOrder(flowtab);*/
-    /* close idle flows */
-    while (flowtab->aq.tail &&
-           (flowtab->ctime - flowtab->aq.tail->f.etime > flowtab->idle_ms))
+    /* close idle and active timed out flows, rescheduling the rest;
+       partitions take turns going first, so a bounded flush reaches all */
+    for (i = 0; expire_left && i < flowtab->part_count; i++) {
+        part = &flowtab->part[(flowtab->part_next + i) % flowtab->part_count];
+        while (expire_left && (fn = qfWheelNext(part->wheel, flowtab->ctime)))
+        {
+            --expire_left;
+            if (flowtab->ctime - fn->f.etime / 1000 > flowtab->idle_ms) {
+                yfFlowClose(flowtab, fn, YAF_END_IDLE);
+            } else if (flowtab->ctime - fn->f.stime / 1000 >
+                       flowtab->active_ms)
+            {
+                yfFlowClose(flowtab, fn, YAF_END_ACTIVE);
+            } else {
+                qfWheelSchedule(part->wheel, fn, yfFlowDeadline(flowtab, fn),
+                                flowtab->ctime);
+            }
+        }
+    }
+    if (flowtab->part_count) {
+        flowtab->part_next = (flowtab->part_next + 1) % flowtab->part_count;
+    }
+
+    /* under memory pressure, close flows on a shortened idle timeout */
+    for (i = 0; expire_left && i < flowtab->part_count &&
+                yfFlowMemOver(flowtab, flowtab->short_mem); i++)
     {
-        yfFlowClose(flowtab, flowtab->aq.tail, YAF_END_IDLE);
+        expire_left = yfFlowTabShortIdle(flowtab, &flowtab->part[i],
+                                         expire_left);
     }
 
-    /* close limited flows */
-    while (flowtab->max_flows &&
-           flowtab->aq.tail &&
-           flowtab->count >= flowtab->max_flows)
+    /* close flows over their VLAN's limit, earliest deadline first */
+    for (i = 0; flowtab->vlan_max_flows && i < flowtab->part_count; i++) {
+        part = &flowtab->part[i];
+        while (expire_left && part->count >= flowtab->vlan_max_flows &&
+               (fn = qfWheelPopEarliest(part->wheel, &slot_end)))
+        {
+            --expire_left;
+            if (yfFlowDeadline(flowtab, fn) >= slot_end) {
+                qfWheelSchedule(part->wheel, fn, yfFlowDeadline(flowtab, fn),
+                                flowtab->ctime);
+            } else {
+                ++(flowtab->stats.stat_vlanevict);
+                yfFlowClose(flowtab, fn, YAF_END_RESOURCE);
+            }
+        }
+    }
+
+    /* close limited flows, earliest deadline first, from the partition
+       holding the most; it is picked once per flush, and again only if it
+       runs dry, so eviction doesn't scan every partition every time */
+    part = NULL;
+    while (expire_left &&
+           ((flowtab->max_flows && flowtab->count >= flowtab->max_flows) ||
+            yfFlowMemOver(flowtab, flowtab->max_mem)))
     {
-        yfFlowClose(flowtab, flowtab->aq.tail, YAF_END_RESOURCE);
+        if (!part || !(fn = qfWheelPopEarliest(part->wheel, &slot_end))) {
+            if (!(part = yfFlowPartLargest(flowtab)) ||
+                !(fn = qfWheelPopEarliest(part->wheel, &slot_end)))
+            {
+                break;
+            }
+        }
+        --expire_left;
+        if (yfFlowDeadline(flowtab, fn) >= slot_end) {
+            /* flow has seen traffic since it was scheduled; move it on */
+            qfWheelSchedule(part->wheel, fn, yfFlowDeadline(flowtab, fn),
+                            flowtab->ctime);
+        } else {
+            if (!flowtab->max_flows || flowtab->count < flowtab->max_flows) {
+                ++(flowtab->stats.stat_memevict);
+            }
+            yfFlowClose(flowtab, fn, YAF_END_RESOURCE);
+        }
     }
 
     /* close all flows if flushing all */
-    while (close && flowtab->aq.tail) {
-        yfFlowClose(flowtab, flowtab->aq.tail, YAF_END_FORCED);
+    for (i = 0; close && i < flowtab->part_count; i++) {
+        part = &flowtab->part[i];
+        while ((fn = qfWheelPopEarliest(part->wheel, &slot_end))) {
+            yfFlowClose(flowtab, fn, YAF_END_FORCED);
+        }
     }
 
     /* flush flows from close queue */
-    while ((fn = piqDeQ(&flowtab->cq))) {
+    while (export_left && (fn = piqDeQ(&flowtab->cq))) {
+        --export_left;
         /* quick accounting of asymmetric/uniflow records present */
         if ((fn->f.rval.oct == 0) && (fn->f.rval.pkt == 0)) {
             ++(flowtab->stats.stat_uniflows);
@@ -1083,24 +1414,25 @@ gboolean yfFlowTabFlush(
         if (flowtab->uniflow) {
             /* Uniflow mode. Split flow in two and write. */
             yfUniflow(&(fn->f), &uf);
-            wok = yfWriteFlow(ctx->octx.fbuf, &uf, err);
+            wok = writer(wctx, &uf, err);
             if (wok) {
                 ++(flowtab->stats.stat_flows);
             }
             if (wok && yfUniflowReverse(&(fn->f), &uf)) {
-                wok = yfWriteFlow(ctx->octx.fbuf, &uf, err);
+                wok = writer(wctx, &uf, err);
                 if (wok) {
                     ++(flowtab->stats.stat_flows);
                 }
             }
         } else {
             /* Biflow mode. Write flow whole. */
-            wok = yfWriteFlow(ctx->octx.fbuf, &(fn->f), err);
+            wok = writer(wctx, &(fn->f), err);
             if (wok) {
                 ++(flowtab->stats.stat_flows);
             }
         }
         --(flowtab->cq_count);
+        flowtab->cq_mem -= yfFlowMem(flowtab, fn);
 
         /* free it */
         yfFlowFree(flowtab, fn);
@@ -1112,6 +1444,124 @@ gboolean yfFlowTabFlush(
     return TRUE;
 }
 
+/**
+ * yfFlowTabWriteFlow
+ *
+ * flow writer for yfFlowTabFlush(); writes to an IPFIX message buffer
+ *
+ */
+static gboolean yfFlowTabWriteFlow(
+    void            *wctx,
+    yfFlow_t        *flow,
+    GError          **err)
+{
+    return yfWriteFlow((fBuf_t *)wctx, flow, err);
+}
+
+/**
+ * yfFlowTabFlush
+ *
+ *
+ *
+ */
+gboolean yfFlowTabFlush(
+    void            *yfContext,
+    gboolean        close,
+    GError          **err)
+{
+    qfContext_t     *ctx = (qfContext_t *)yfContext;
+
+    return yfFlowTabFlushTo(ctx->flowtab, close, yfFlowTabWriteFlow,
+                            ctx->octx.fbuf, err);
+}
+
+/**
+ * yfFlowTabSetFlowIdSpace
+ *
+ *
+ *
+ */
+void yfFlowTabSetFlowIdSpace(
+    yfFlowTab_t     *flowtab,
+    uint64_t        first,
+    uint64_t        stride)
+{
+    g_assert(first && stride);
+
+    flowtab->next_fid = first;
+    flowtab->fid_stride = stride;
+}
+
+/**
+ * yfFlowTabSetMemoryLimit
+ *
+ *
+ *
+ */
+void yfFlowTabSetMemoryLimit(
+    yfFlowTab_t     *flowtab,
+    uint64_t        bytes)
+{
+    flowtab->max_mem = bytes;
+    flowtab->shed_mem = bytes / YF_MEM_SHED_DEN * YF_MEM_SHED_NUM;
+    flowtab->short_mem = bytes / YF_MEM_SHORT_DEN * YF_MEM_SHORT_NUM;
+}
+
+/**
+ * yfFlowTabSetFlushQuanta
+ *
+ *
+ *
+ */
+void yfFlowTabSetFlushQuanta(
+    yfFlowTab_t     *flowtab,
+    uint32_t        expire_quantum,
+    uint32_t        export_quantum)
+{
+    flowtab->expire_quantum = expire_quantum;
+    flowtab->export_quantum = export_quantum;
+}
+
+/**
+ * yfFlowTabSetVlanPartitions
+ *
+ *
+ *
+ */
+void yfFlowTabSetVlanPartitions(
+    yfFlowTab_t     *flowtab,
+    uint32_t        max_flows)
+{
+    g_assert(!flowtab->count && !flowtab->vlan_part);
+
+    /* trade the single partition for one per VLAN, made as VLANs appear */
+    qfWheelFree(flowtab->part->wheel);
+    g_free(flowtab->part);
+    flowtab->part = g_new0(yfFlowPart_t, YF_VLAN_COUNT);
+    flowtab->part_count = 0;
+    flowtab->part_next = 0;
+    flowtab->vlan_part = g_new0(uint16_t, YF_VLAN_COUNT);
+    flowtab->vlan_max_flows = max_flows;
+}
+
+/**
+ * yfFlowTabAdvanceTime
+ *
+ *
+ *
+ */
+void yfFlowTabAdvanceTime(
+    yfFlowTab_t     *flowtab,
+    uint64_t        ctime)
+{
+    if (ctime > flowtab->ctime) {
+        flowtab->ctime = ctime;
+    }
+    if (flowtab->ctime * 1000 > flowtab->cus) {
+        flowtab->cus = flowtab->ctime * 1000;
+    }
+}
+
 /**
  * yfFlowTabCurrentTime
  *
@@ -1125,6 +1575,376 @@ uint64_t yfFlowTabCurrentTime(
     return flowtab->ctime;
 }
 
+/*
+ * Flow table snapshots. A snapshot is a header, followed by a fixed-size
+ * record for each open flow, followed by the TCP state of each flow that
+ * has it, in flow order: forward then reverse. Both sections start on a
+ * cache line boundary, so a snapshot can be mapped and read in place.
+ * Records are raw structures; the header records their sizes, and
+ * snapshots from a build with a different layout are refused.
+ */
+
+#define YF_SNAP_MAGIC       0x514F4653   /* "QOFS" */
+#define YF_SNAP_VERSION     3
+#define YF_SNAP_ALIGN       64
+#define YF_SNAP_FWD_TCP     0x00000001
+#define YF_SNAP_REV_TCP     0x00000002
+
+typedef struct yfFlowSnapHdr_st {
+    uint32_t        magic;
+    uint32_t        version;
+    uint32_t        rec_size;
+    uint32_t        tcp_size;
+    uint64_t        flow_count;
+    uint64_t        tcp_count;
+    uint64_t        flow_off;
+    uint64_t        tcp_off;
+    uint64_t        next_fid;
+    uint64_t        fid_stride;
+    uint64_t        ctime;
+    uint64_t        cus;
+} yfFlowSnapHdr_t;
+
+typedef struct yfFlowSnapRec_st {
+    uint32_t        state;
+    uint32_t        tcp;
+    yfFlow_t        f;
+} yfFlowSnapRec_t;
+
+typedef struct yfFlowSnapWriter_st {
+    FILE            *fp;
+    uint64_t        flow_count;
+    uint64_t        tcp_count;
+    int             errnum;
+} yfFlowSnapWriter_t;
+
+#define YF_SNAP_ROUND(_x_) (((_x_) + YF_SNAP_ALIGN - 1) & \
+                            ~((uint64_t)YF_SNAP_ALIGN - 1))
+
+/**
+ * yfFlowSnapWrite
+ *
+ * write a chunk of a snapshot, noting the first error
+ *
+ */
+static void yfFlowSnapWrite(
+    yfFlowSnapWriter_t  *sw,
+    const void          *buf,
+    size_t              len)
+{
+    if (sw->errnum) return;
+    if (fwrite(buf, len, 1, sw->fp) != 1) {
+        sw->errnum = errno ? errno : EIO;
+    }
+}
+
+/**
+ * yfFlowSnapPad
+ *
+ * pad a snapshot with zeroes to a given offset
+ *
+ */
+static void yfFlowSnapPad(
+    yfFlowSnapWriter_t  *sw,
+    uint64_t            pos,
+    uint64_t            off)
+{
+    static const uint8_t zero[YF_SNAP_ALIGN] = { 0 };
+
+    g_assert(off - pos <= YF_SNAP_ALIGN);
+    if (off > pos) yfFlowSnapWrite(sw, zero, (size_t)(off - pos));
+}
+
+/**
+ * yfFlowSnapFlow
+ *
+ * write a snapshot record for a flow; flow index iterator
+ *
+ */
+static void yfFlowSnapFlow(
+    void                *node,
+    void                *ctx)
+{
+    yfFlowNode_t        *fn = (yfFlowNode_t *)node;
+    yfFlowSnapWriter_t  *sw = (yfFlowSnapWriter_t *)ctx;
+    yfFlowSnapRec_t     rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.state = fn->state;
+#if YAF_ENABLE_COMPACT_IP4
+    if (fn->f.key.version == 4) {
+        memcpy(&rec.f, &fn->f, sizeof(yfFlowIPv4_t));
+    } else {
+#endif
+        memcpy(&rec.f, &fn->f, sizeof(yfFlow_t));
+#if YAF_ENABLE_COMPACT_IP4
+    }
+#endif
+    if (fn->f.val.tcp) {
+        rec.tcp |= YF_SNAP_FWD_TCP;
+        ++(sw->tcp_count);
+    }
+    if (fn->f.rval.tcp) {
+        rec.tcp |= YF_SNAP_REV_TCP;
+        ++(sw->tcp_count);
+    }
+    rec.f.val.tcp = NULL;
+    rec.f.rval.tcp = NULL;
+
+    yfFlowSnapWrite(sw, &rec, sizeof(rec));
+    ++(sw->flow_count);
+}
+
+/**
+ * yfFlowSnapTcp
+ *
+ * write the TCP state of a flow to a snapshot; flow index iterator
+ *
+ */
+static void yfFlowSnapTcp(
+    void                *node,
+    void                *ctx)
+{
+    yfFlowNode_t        *fn = (yfFlowNode_t *)node;
+    yfFlowSnapWriter_t  *sw = (yfFlowSnapWriter_t *)ctx;
+
+    if (fn->f.val.tcp) {
+        yfFlowSnapWrite(sw, fn->f.val.tcp, sizeof(qfTcpVal_t));
+    }
+    if (fn->f.rval.tcp) {
+        yfFlowSnapWrite(sw, fn->f.rval.tcp, sizeof(qfTcpVal_t));
+    }
+}
+
+/**
+ * yfFlowTabCheckpoint
+ *
+ *
+ *
+ */
+gboolean yfFlowTabCheckpoint(
+    yfFlowTab_t         *flowtab,
+    const char          *path,
+    gboolean            detach,
+    GError              **err)
+{
+    yfFlowSnapHdr_t     hdr;
+    yfFlowSnapWriter_t  sw;
+    yfFlowNode_t        *fn = NULL;
+    yfFlowPart_t        *part = NULL;
+    GString             *tmppath = g_string_new(path);
+    GTimer              *timer = g_timer_new();
+    uint64_t            slot_end;
+    uint32_t            i;
+    gboolean            ok = FALSE;
+
+    memset(&sw, 0, sizeof(sw));
+    g_string_append(tmppath, ".tmp");
+    if (!(sw.fp = fopen(tmppath->str, "w"))) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't open checkpoint file %s: %s",
+                    tmppath->str, strerror(errno));
+        goto end;
+    }
+
+    /* lay out the header; TCP state count is filled in after the flows */
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = YF_SNAP_MAGIC;
+    hdr.version = YF_SNAP_VERSION;
+    hdr.rec_size = sizeof(yfFlowSnapRec_t);
+    hdr.tcp_size = sizeof(qfTcpVal_t);
+    hdr.flow_count = qfFlowIdxCount(flowtab->table);
+    hdr.flow_off = YF_SNAP_ROUND(sizeof(hdr));
+    hdr.tcp_off = YF_SNAP_ROUND(hdr.flow_off + hdr.flow_count * hdr.rec_size);
+    hdr.next_fid = flowtab->next_fid;
+    hdr.fid_stride = flowtab->fid_stride;
+    hdr.ctime = flowtab->ctime;
+    hdr.cus = flowtab->cus;
+
+    yfFlowSnapWrite(&sw, &hdr, sizeof(hdr));
+    yfFlowSnapPad(&sw, sizeof(hdr), hdr.flow_off);
+
+    /* write flows, then their TCP state in the same order */
+    qfFlowIdxForEach(flowtab->table, yfFlowSnapFlow, &sw);
+    yfFlowSnapPad(&sw, hdr.flow_off + hdr.flow_count * hdr.rec_size,
+                  hdr.tcp_off);
+    qfFlowIdxForEach(flowtab->table, yfFlowSnapTcp, &sw);
+
+    /* now go back and finish the header */
+    hdr.tcp_count = sw.tcp_count;
+    if (!sw.errnum && fseek(sw.fp, 0, SEEK_SET)) sw.errnum = errno;
+    yfFlowSnapWrite(&sw, &hdr, sizeof(hdr));
+
+    if (fclose(sw.fp) && !sw.errnum) sw.errnum = errno;
+    if (!sw.errnum && rename(tmppath->str, path)) sw.errnum = errno;
+    if (sw.errnum) {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_IO,
+                    "Couldn't write checkpoint file %s: %s",
+                    path, strerror(sw.errnum));
+        unlink(tmppath->str);
+        goto end;
+    }
+
+    g_message("Checkpointed %llu flows to %s in %.3f s",
+              (long long unsigned int)sw.flow_count, path,
+              g_timer_elapsed(timer, NULL));
+
+    /* hand the open flows over to the checkpoint if requested */
+    if (detach) {
+        for (i = 0; i < flowtab->part_count; i++) {
+            part = &flowtab->part[i];
+            while ((fn = qfWheelPopEarliest(part->wheel, &slot_end))) {
+                qfFlowIdxRemove(flowtab->table, fn, fn->hash);
+                --(flowtab->count);
+                --(part->count);
+                yfFlowFree(flowtab, fn);
+            }
+        }
+    }
+
+    ok = TRUE;
+
+end:
+    g_string_free(tmppath, TRUE);
+    g_timer_destroy(timer);
+    return ok;
+}
+
+/**
+ * yfFlowTabRestore
+ *
+ *
+ *
+ */
+gboolean yfFlowTabRestore(
+    yfFlowTab_t         *flowtab,
+    const char          *path,
+    GError              **err)
+{
+    GMappedFile         *mf = NULL;
+    const uint8_t       *base;
+    size_t              len;
+    yfFlowSnapHdr_t     hdr;
+    const yfFlowSnapRec_t *rec;
+    const qfTcpVal_t    *tcp;
+    yfFlowNode_t        *fn;
+    yfFlowPart_t        *part;
+    GTimer              *timer = NULL;
+    uint64_t            i, tcp_left;
+    unsigned int        tcp_need;
+    gboolean            ok = FALSE;
+
+    if (!(mf = g_mapped_file_new(path, FALSE, err))) {
+        return FALSE;
+    }
+    base = (const uint8_t *)g_mapped_file_get_contents(mf);
+    len = g_mapped_file_get_length(mf);
+    timer = g_timer_new();
+
+    /* check the header against this build */
+    if (len < sizeof(hdr)) goto bad;
+    memcpy(&hdr, base, sizeof(hdr));
+    if (hdr.magic != YF_SNAP_MAGIC) goto bad;
+    if (hdr.version != YF_SNAP_VERSION ||
+        hdr.rec_size != sizeof(yfFlowSnapRec_t) ||
+        hdr.tcp_size != sizeof(qfTcpVal_t))
+    {
+        g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_HEADER,
+                    "Checkpoint file %s is from an incompatible version "
+                    "(%u, record size %u)", path, hdr.version, hdr.rec_size);
+        goto end;
+    }
+    if (hdr.flow_off < sizeof(hdr) || hdr.tcp_off < hdr.flow_off ||
+        (hdr.tcp_off - hdr.flow_off) / hdr.rec_size < hdr.flow_count ||
+        hdr.tcp_off > len ||
+        (len - hdr.tcp_off) / hdr.tcp_size < hdr.tcp_count)
+    {
+        goto bad;
+    }
+
+    /* check every record before touching the table, so that a bad file
+       leaves it as it was */
+    rec = (const yfFlowSnapRec_t *)(base + hdr.flow_off);
+    tcp_left = hdr.tcp_count;
+    for (i = 0; i < hdr.flow_count; i++, rec++) {
+        if (rec->f.key.version != 4 && rec->f.key.version != 6) goto bad;
+        tcp_need = ((rec->tcp & YF_SNAP_FWD_TCP) ? 1 : 0) +
+                   ((rec->tcp & YF_SNAP_REV_TCP) ? 1 : 0);
+        if (tcp_need > tcp_left) goto bad;
+        tcp_left -= tcp_need;
+    }
+
+    /* resume the packet clock and flow ID sequence */
+    if (hdr.ctime > flowtab->ctime) flowtab->ctime = hdr.ctime;
+    if (hdr.cus > flowtab->cus) flowtab->cus = hdr.cus;
+    if (hdr.fid_stride == flowtab->fid_stride &&
+        hdr.next_fid > flowtab->next_fid)
+    {
+        flowtab->next_fid = hdr.next_fid;
+    }
+
+    /* recreate each flow */
+    rec = (const yfFlowSnapRec_t *)(base + hdr.flow_off);
+    tcp = (const qfTcpVal_t *)(base + hdr.tcp_off);
+    for (i = 0; i < hdr.flow_count; i++, rec++) {
+#if YAF_ENABLE_COMPACT_IP4
+        if (rec->f.key.version == 4) {
+            fn = (yfFlowNode_t *)qfSlabGet(flowtab->node4_slab);
+            yfFlowMemAdd(flowtab, flowtab->node4_sz);
+            memcpy(&fn->f, &rec->f, sizeof(yfFlowIPv4_t));
+        } else {
+#endif
+            fn = (yfFlowNode_t *)qfSlabGet(flowtab->node_slab);
+            yfFlowMemAdd(flowtab, flowtab->node_sz);
+            memcpy(&fn->f, &rec->f, sizeof(yfFlow_t));
+#if YAF_ENABLE_COMPACT_IP4
+        }
+#endif
+        fn->state = rec->state;
+
+        if (rec->tcp & YF_SNAP_FWD_TCP) {
+            fn->f.val.tcp = qfSlabGet(flowtab->tcp_slab);
+            yfFlowMemAdd(flowtab, flowtab->tcp_sz);
+            memcpy(fn->f.val.tcp, tcp++, sizeof(qfTcpVal_t));
+        }
+        if (rec->tcp & YF_SNAP_REV_TCP) {
+            fn->f.rval.tcp = qfSlabGet(flowtab->tcp_slab);
+            yfFlowMemAdd(flowtab, flowtab->tcp_sz);
+            memcpy(fn->f.rval.tcp, tcp++, sizeof(qfTcpVal_t));
+        }
+
+        /* index it with this process's hash, and schedule its timeout */
+        fn->hash = qfFlowKeyHash(&fn->f.key, NULL);
+        qfFlowIdxInsert(flowtab->table, fn, fn->hash);
+        part = yfFlowPartFor(flowtab, &fn->f.key);
+        qfWheelSchedule(part->wheel, fn, yfFlowDeadline(flowtab, fn),
+                        flowtab->ctime);
+
+        ++(flowtab->count);
+        ++(part->count);
+        if (flowtab->count > flowtab->stats.stat_peak) {
+            flowtab->stats.stat_peak = flowtab->count;
+        }
+    }
+
+    g_message("Restored %llu flows from %s in %.3f s",
+              (long long unsigned int)hdr.flow_count, path,
+              g_timer_elapsed(timer, NULL));
+    ok = TRUE;
+    goto end;
+
+bad:
+    g_set_error(err, YAF_ERROR_DOMAIN, YAF_ERROR_HEADER,
+                "%s is not a valid checkpoint file", path);
+end:
+    g_timer_destroy(timer);
+#if GLIB_CHECK_VERSION(2,22,0)
+    g_mapped_file_unref(mf);
+#else
+    g_mapped_file_free(mf);
+#endif
+    return ok;
+}
 
 /**
  * yfFlowDumpStats
@@ -1142,6 +1962,9 @@ uint64_t yfFlowDumpStats(
     yfFlowTab_t     *flowtab,
     GTimer          *timer)
 {
+    uint64_t        lookups, probes;
+    uint32_t        max_probe;
+
     g_debug("Processed %llu packets into %llu flows:",
             (long long unsigned int)flowtab->stats.stat_packets,
             (long long unsigned int)flowtab->stats.stat_flows);
@@ -1155,7 +1978,41 @@ uint64_t yfFlowDumpStats(
                  g_timer_elapsed(timer, NULL)));
     }
     g_debug("  Maximum flow table size %u.", flowtab->stats.stat_peak);
+    qfFlowIdxStats(flowtab->table, &lookups, &probes, &max_probe);
+    if (lookups) {
+        g_debug("  Flow index mean probes %.3f per lookup, longest probe %u.",
+                (double)probes / (double)lookups, max_probe);
+    }
+    qfSlabDumpStats(flowtab->node_slab);
+#if YAF_ENABLE_COMPACT_IP4
+    qfSlabDumpStats(flowtab->node4_slab);
+#endif
+    qfSlabDumpStats(flowtab->tcp_slab);
     g_debug("  %u flush events.", flowtab->stats.stat_flush);
+    if (flowtab->max_mem) {
+        g_debug("  Peak flow memory %.1f MB of %.1f MB limit.",
+                (double)flowtab->stats.stat_peakmem / (1024 * 1024),
+                (double)flowtab->max_mem / (1024 * 1024));
+    }
+    if (flowtab->stats.stat_shed) {
+        g_warning("Metered %"PRIu64" TCP flows without TCP analytics "
+                  "under memory pressure.", flowtab->stats.stat_shed);
+    }
+    if (flowtab->stats.stat_shortidle) {
+        g_warning("Closed %"PRIu64" flows on shortened idle timeout "
+                  "under memory pressure.", flowtab->stats.stat_shortidle);
+    }
+    if (flowtab->stats.stat_memevict) {
+        g_warning("Evicted %"PRIu64" flows to stay within memory limit.",
+                  flowtab->stats.stat_memevict);
+    }
+    if (flowtab->vlan_part) {
+        g_debug("  Flows partitioned across %u VLANs.", flowtab->part_count);
+    }
+    if (flowtab->stats.stat_vlanevict) {
+        g_warning("Evicted %"PRIu64" flows to stay within per-VLAN limit.",
+                  flowtab->stats.stat_vlanevict);
+    }
     if (flowtab->stats.stat_seqrej) {
         g_warning("Rejected %"PRIu64" out-of-sequence packets.",
                   flowtab->stats.stat_seqrej);
@@ -1167,6 +2024,118 @@ uint64_t yfFlowDumpStats(
     return flowtab->stats.stat_packets;
 }
 
+#define YF_LAYOUT_LINE 64
+
+#define YF_LAYOUT_FIELD(S_,F_) \
+    g_debug("  %-24s %4u %4u   line %u", #F_, (unsigned)offsetof(S_,F_), \
+            (unsigned)sizeof(((S_ *)0)->F_), \
+            (unsigned)(offsetof(S_,F_) / YF_LAYOUT_LINE));
+
+#define YF_LAYOUT_MIRROR(F_) \
+    if (offsetof(yfFlowNode_t,F_) != offsetof(yfFlowNodeIPv4_t,F_)) \
+        g_error("IPv4 flow node layout mismatch for " #F_ \
+                " (full %u compact %u)", \
+                (unsigned)offsetof(yfFlowNode_t,F_), \
+                (unsigned)offsetof(yfFlowNodeIPv4_t,F_));
+
+/**
+ * yfFlowLayoutLine
+ *
+ * warns if a range of offsets in a line aligned structure spans lines.
+ *
+ */
+static void yfFlowLayoutLine(
+    const char      *what,
+    size_t          start,
+    size_t          end)
+{
+    if (start / YF_LAYOUT_LINE != (end - 1) / YF_LAYOUT_LINE) {
+        g_warning("%s span cache lines (offsets %u-%u)", what,
+                  (unsigned)start, (unsigned)end);
+    }
+}
+
+/**
+ * yfFlowTabLayoutCheck
+ *
+ * logs flow node and TCP state layout, checks that the compact IPv4 node
+ * mirrors the full node, and checks that each group of fields touched
+ * together on the per-packet path shares a cache line.
+ *
+ */
+void yfFlowTabLayoutCheck(void)
+{
+    g_debug("Flow node layout (%u bytes):", (unsigned)sizeof(yfFlowNode_t));
+    g_debug("  %-24s %4s %4s", "field", "off", "size");
+    YF_LAYOUT_FIELD(yfFlowNode_t, wslot);
+    YF_LAYOUT_FIELD(yfFlowNode_t, state);
+    YF_LAYOUT_FIELD(yfFlowNode_t, hash);
+    YF_LAYOUT_FIELD(yfFlowNode_t, f.etime);
+    YF_LAYOUT_FIELD(yfFlowNode_t, f.stime);
+    YF_LAYOUT_FIELD(yfFlowNode_t, f.sourceMacAddr);
+    YF_LAYOUT_FIELD(yfFlowNode_t, f.destinationMacAddr);
+    YF_LAYOUT_FIELD(yfFlowNode_t, f.rdtime);
+    YF_LAYOUT_FIELD(yfFlowNode_t, f.val);
+    YF_LAYOUT_FIELD(yfFlowNode_t, f.fid);
+    YF_LAYOUT_FIELD(yfFlowNode_t, f.reason);
+    YF_LAYOUT_FIELD(yfFlowNode_t, f.rval);
+    YF_LAYOUT_FIELD(yfFlowNode_t, f.rtt);
+    YF_LAYOUT_FIELD(yfFlowNode_t, f.key);
+    g_debug("TCP state layout (%u bytes):", (unsigned)sizeof(qfTcpVal_t));
+    YF_LAYOUT_FIELD(qfTcpVal_t, ack);
+    YF_LAYOUT_FIELD(qfTcpVal_t, opts);
+    YF_LAYOUT_FIELD(qfTcpVal_t, rwin);
+    YF_LAYOUT_FIELD(qfTcpVal_t, seq.nsn);
+    YF_LAYOUT_FIELD(qfTcpVal_t, seq.seg_iat);
+    YF_LAYOUT_FIELD(qfTcpVal_t, seq.gaps);
+
+#if YAF_ENABLE_COMPACT_IP4
+    /* everything up to the key must line up exactly */
+    YF_LAYOUT_MIRROR(wslot);
+    YF_LAYOUT_MIRROR(state);
+    YF_LAYOUT_MIRROR(hash);
+    YF_LAYOUT_MIRROR(f.etime);
+    YF_LAYOUT_MIRROR(f.stime);
+    YF_LAYOUT_MIRROR(f.sourceMacAddr);
+    YF_LAYOUT_MIRROR(f.destinationMacAddr);
+    YF_LAYOUT_MIRROR(f.rdtime);
+    YF_LAYOUT_MIRROR(f.val);
+    YF_LAYOUT_MIRROR(f.fid);
+    YF_LAYOUT_MIRROR(f.reason);
+    YF_LAYOUT_MIRROR(f.rval);
+    YF_LAYOUT_MIRROR(f.rtt);
+    YF_LAYOUT_MIRROR(f.key);
+    YF_LAYOUT_MIRROR(f.key.addr);
+#endif
+
+    /* nodes and TCP state are line aligned by their slabs */
+    yfFlowLayoutLine("flow state and times",
+                     offsetof(yfFlowNode_t, state),
+                     offsetof(yfFlowNode_t, f.stime) + sizeof(uint64_t));
+    yfFlowLayoutLine("forward flow value",
+                     offsetof(yfFlowNode_t, f.val),
+                     offsetof(yfFlowNode_t, f.val) + sizeof(yfFlowVal_t));
+    yfFlowLayoutLine("reverse flow value",
+                     offsetof(yfFlowNode_t, f.rval),
+                     offsetof(yfFlowNode_t, f.rval) + sizeof(yfFlowVal_t));
+#if YAF_ENABLE_COMPACT_IP4
+    yfFlowLayoutLine("RTT state and IPv4 flow key",
+                     offsetof(yfFlowNodeIPv4_t, f.rtt),
+                     offsetof(yfFlowNodeIPv4_t, f.key) +
+                     sizeof(yfFlowKeyIPv4_t));
+#else
+    yfFlowLayoutLine("RTT state and flow key ports",
+                     offsetof(yfFlowNode_t, f.rtt),
+                     offsetof(yfFlowNode_t, f.key.addr));
+#endif
+    yfFlowLayoutLine("TCP acknowledgment, option and window state",
+                     offsetof(qfTcpVal_t, ack),
+                     offsetof(qfTcpVal_t, rwin) + sizeof(qfRwin_t));
+    yfFlowLayoutLine("TCP sequence scalars",
+                     offsetof(qfTcpVal_t, seq.nsn),
+                     offsetof(qfTcpVal_t, seq.initsval) + sizeof(uint32_t));
+}
+
 /*
  * Code Graveyard 
  */
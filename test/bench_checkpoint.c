@@ -0,0 +1,205 @@
+/**
+ ** @file bench_checkpoint.c
+ **
+ ** Flow table checkpoint benchmark: fills a flow table with synthetic
+ ** bidirectional TCP flows, with full TCP analytics enabled, writes a
+ ** checkpoint, restores it into a fresh flow table, and reports write and
+ ** load times. Checks that the restored table closes the same flows, with
+ ** the same flow IDs and packet counts, as the original.
+ **
+ ** Build against an installed libqof, e.g.:
+ **   cc -O2 -o bench_checkpoint bench_checkpoint.c \
+ **      `pkg-config --cflags --libs glib-2.0 libfixbuf` -lqof
+ **
+ ** usage: bench_checkpoint [-6] [-f flows] [-o file]
+ ** defaults are 2M flows and ./bench_checkpoint.qfs.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/autoinc.h>
+#include <qof/decode.h>
+#include <qof/yaftab.h>
+#include <qof/qofflowidx.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* what we know about the flows a table closes */
+typedef struct bench_sum_st {
+    uint64_t        flows;
+    uint64_t        packets;
+    uint64_t        fidsum;
+    uint64_t        tcp;
+} bench_sum_t;
+
+static gboolean bench_sum(void          *wctx,
+                          yfFlow_t      *flow,
+                          GError        **err)
+{
+    bench_sum_t     *sum = (bench_sum_t *)wctx;
+
+    ++sum->flows;
+    sum->packets += flow->val.pkt + flow->rval.pkt;
+    sum->fidsum += flow->fid;
+    if (flow->val.tcp) ++sum->tcp;
+    if (flow->rval.tcp) ++sum->tcp;
+    return TRUE;
+}
+
+static void bench_fill(yfPBuf_t        *pbuf,
+                       size_t          f,
+                       gboolean        reverse,
+                       gboolean        v6,
+                       uint64_t        now)
+{
+    yfFlowKey_t     *key = &pbuf->key;
+    uint32_t        sip = 0x0A000000 | (uint32_t)(f >> 16);
+    uint32_t        dip = 0xC0A80000 | (uint32_t)(f & 0xFFFF);
+
+    memset(key, 0, sizeof(*key));
+    key->proto = YF_PROTO_TCP;
+    key->sp = reverse ? 443 : 1024 + (f % 64512);
+    key->dp = reverse ? 1024 + (f % 64512) : 443;
+
+    if (reverse) {
+        uint32_t tmp = sip;
+        sip = dip;
+        dip = tmp;
+    }
+
+    if (v6) {
+        key->version = 6;
+        key->addr.v6.sip[0] = key->addr.v6.dip[0] = 0x20;
+        key->addr.v6.sip[1] = key->addr.v6.dip[1] = 0x01;
+        memcpy(&key->addr.v6.sip[12], &sip, sizeof(sip));
+        memcpy(&key->addr.v6.dip[12], &dip, sizeof(dip));
+    } else {
+        key->version = 4;
+        key->addr.v4.sip = sip;
+        key->addr.v4.dip = dip;
+    }
+
+    pbuf->ptime = now;
+    pbuf->ptime_ns = now * 1000000;
+    pbuf->l2info.l2hlen = 14;
+    pbuf->allHeaderLen = 14 + 20 + 32;
+    pbuf->iplen = reverse ? 52 : 1500;
+    pbuf->ipinfo.ttl = 64;
+    pbuf->tcpinfo.flags = YF_TF_ACK;
+    pbuf->tcpinfo.rwin = 512;
+    pbuf->tcpinfo.seq = (uint32_t)(f * 7919);
+    pbuf->tcpinfo.ack = (uint32_t)(f * 104729);
+    pbuf->tcpinfo.tsval = (uint32_t)now;
+    pbuf->tcpinfo.tsecr = (uint32_t)now - 10;
+
+    /* hash the key, as the decoder would */
+    pbuf->hash = qfFlowKeyHash(key, &pbuf->pairhash);
+}
+
+static yfFlowTab_t *bench_table(void)
+{
+    /* generous timeouts, so nothing closes until we say so */
+    return yfFlowTabAlloc(3600000, 3600000, 0, 0, 0, 0, FALSE, FALSE, FALSE,
+                          TRUE, TRUE, TRUE, TRUE, TRUE, TRUE, TRUE);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t          flow_count = 2 << 20;
+    const char      *path = "bench_checkpoint.qfs";
+    gboolean        v6 = FALSE;
+    yfFlowTab_t     *flowtab, *restab;
+    bench_sum_t     orig, rest;
+    yfPBuf_t        pbuf;
+    GTimer          *timer;
+    GError          *err = NULL;
+    struct stat     st;
+    double          wtime, ltime;
+    size_t          f;
+    int             c, i;
+
+    while ((c = getopt(argc, argv, "6f:o:")) != -1) {
+        switch (c) {
+            case '6':
+                v6 = TRUE;
+                break;
+            case 'f':
+                flow_count = strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                path = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-6] [-f flows] [-o file]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+
+    /* open every flow with a few packets in each direction */
+    flowtab = bench_table();
+    memset(&pbuf, 0, sizeof(pbuf));
+    for (i = 0; i < 3; i++) {
+        for (f = 0; f < flow_count; f++) {
+            bench_fill(&pbuf, f, FALSE, v6, 1000 + i * 10);
+            yfFlowPBuf(flowtab, &pbuf);
+            bench_fill(&pbuf, f, TRUE, v6, 1000 + i * 10 + 5);
+            yfFlowPBuf(flowtab, &pbuf);
+        }
+    }
+
+    /* checkpoint, keeping the flows to compare against */
+    timer = g_timer_new();
+    g_timer_start(timer);
+    if (!yfFlowTabCheckpoint(flowtab, path, FALSE, &err)) {
+        fprintf(stderr, "checkpoint failed: %s\n", err->message);
+        return 1;
+    }
+    wtime = g_timer_elapsed(timer, NULL);
+
+    /* restore into a fresh table */
+    restab = bench_table();
+    g_timer_start(timer);
+    if (!yfFlowTabRestore(restab, path, &err)) {
+        fprintf(stderr, "restore failed: %s\n", err->message);
+        return 1;
+    }
+    ltime = g_timer_elapsed(timer, NULL);
+
+    stat(path, &st);
+    fprintf(stdout, "%zu IPv%u TCP flows, %.1f MB: write %.3f s, "
+            "load %.3f s\n", flow_count, v6 ? 6 : 4,
+            (double)st.st_size / (1024 * 1024), wtime, ltime);
+
+    /* close both tables and compare */
+    memset(&orig, 0, sizeof(orig));
+    memset(&rest, 0, sizeof(rest));
+    yfFlowTabFlushTo(flowtab, TRUE, bench_sum, &orig, NULL);
+    yfFlowTabFlushTo(restab, TRUE, bench_sum, &rest, NULL);
+    if (memcmp(&orig, &rest, sizeof(orig))) {
+        fprintf(stderr, "restored table differs: %llu/%llu flows, "
+                "%llu/%llu packets, %llu/%llu TCP states\n",
+                (long long unsigned int)orig.flows,
+                (long long unsigned int)rest.flows,
+                (long long unsigned int)orig.packets,
+                (long long unsigned int)rest.packets,
+                (long long unsigned int)orig.tcp,
+                (long long unsigned int)rest.tcp);
+        return 1;
+    }
+
+    unlink(path);
+    yfFlowTabFree(flowtab);
+    yfFlowTabFree(restab);
+    g_timer_destroy(timer);
+    return 0;
+}
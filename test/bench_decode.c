@@ -0,0 +1,343 @@
+/**
+ ** @file bench_decode.c
+ **
+ ** Packet decoder benchmark: decodes synthetic packets of several common
+ ** encapsulations, including VXLAN and GTP-U tunnels, with yfDecodeToPBuf(),
+ ** with and without the fast path, checks that both paths decode each packet
+ ** identically, and reports nanoseconds per packet for each.
+ **
+ ** With -t, instead compares the decode work selected by two templates: the
+ ** minimal 5-tuple template in qof-5tuple.yaml, which needs neither TCP
+ ** options, TCP header fields nor MAC addresses, and the full qof-test.yaml,
+ ** which needs TCP options and fields but no MACs. Each is also run with
+ ** every field decoded, as before decode contexts were configured from the
+ ** template.
+ **
+ ** Build against an installed libqof, e.g.:
+ **   cc -O2 -o bench_decode bench_decode.c \
+ **      `pkg-config --cflags --libs glib-2.0 libfixbuf libtrace` -lqof
+ **
+ ** usage: bench_decode [-n] [-t] [-p packets]
+ ** -n disables TCP option parsing, except with -t; packets defaults to 16M
+ ** per packet type.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/autoinc.h>
+#include <qof/decode.h>
+
+#include <unistd.h>
+
+#define BENCH_PKTLEN 128
+#define BENCH_VXLAN  4789
+#define BENCH_GTPU   2152
+
+typedef struct bench_pkt_st {
+    const char      *name;
+    uint8_t         buf[BENCH_PKTLEN];
+    size_t          caplen;
+} bench_pkt_t;
+
+/* append an Ethernet header, with an optional 802.1q tag */
+static uint8_t *bench_eth(uint8_t *p, uint16_t type, gboolean vlan)
+{
+    static const uint8_t macs[12] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55,
+                                      0x00, 0x66, 0x77, 0x88, 0x99, 0xaa };
+
+    memcpy(p, macs, sizeof(macs));
+    p += sizeof(macs);
+    if (vlan) {
+        *p++ = 0x81; *p++ = 0x00;
+        *p++ = 0x00; *p++ = 0x2a;
+    }
+    *p++ = type >> 8; *p++ = type & 0xff;
+    return p;
+}
+
+static uint8_t *bench_ip4(uint8_t *p, uint8_t proto, uint16_t len)
+{
+    memset(p, 0, 20);
+    p[0] = 0x45; p[1] = 0x02;
+    p[2] = len >> 8; p[3] = len & 0xff;
+    p[6] = 0x40;                                /* DF */
+    p[8] = 64; p[9] = proto;
+    p[12] = 10; p[13] = 1; p[14] = 2; p[15] = 3;
+    p[16] = 192; p[17] = 168; p[18] = 4; p[19] = 5;
+    return p + 20;
+}
+
+static uint8_t *bench_ip6(uint8_t *p, uint8_t proto, uint16_t plen)
+{
+    memset(p, 0, 40);
+    p[0] = 0x60; p[1] = 0x10;
+    p[4] = plen >> 8; p[5] = plen & 0xff;
+    p[6] = proto; p[7] = 57;
+    p[8] = 0x20; p[9] = 0x01; p[23] = 0x01;
+    p[24] = 0x20; p[25] = 0x01; p[39] = 0x02;
+    return p + 40;
+}
+
+/* TCP header with NOP, NOP, timestamp options */
+static uint8_t *bench_tcp(uint8_t *p)
+{
+    memset(p, 0, 32);
+    p[0] = 0xc3; p[1] = 0x50; p[2] = 0x01; p[3] = 0xbb;
+    p[4] = 0x12; p[5] = 0x34; p[6] = 0x56; p[7] = 0x78;
+    p[8] = 0x9a; p[9] = 0xbc; p[10] = 0xde; p[11] = 0xf0;
+    p[12] = 0x80; p[13] = YF_TF_ACK | YF_TF_PSH;
+    p[14] = 0x01; p[15] = 0xf5;
+    p[20] = 1; p[21] = 1; p[22] = 8; p[23] = 10;
+    p[24] = 0x00; p[25] = 0x01; p[26] = 0x02; p[27] = 0x03;
+    p[28] = 0x00; p[29] = 0x01; p[30] = 0x01; p[31] = 0x00;
+    return p + 32;
+}
+
+static uint8_t *bench_udp(uint8_t *p, uint16_t len)
+{
+    p[0] = 0xd4; p[1] = 0x31; p[2] = 0x00; p[3] = 0x35;
+    p[4] = len >> 8; p[5] = len & 0xff; p[6] = 0; p[7] = 0;
+    return p + 8;
+}
+
+/* UDP header to a tunnel port, and VXLAN or GTP-U header */
+static uint8_t *bench_tunnel(uint8_t *p, uint16_t port, uint16_t len)
+{
+    p = bench_udp(p, len);
+    p[-6] = port >> 8; p[-5] = port & 0xff;
+    memset(p, 0, 8);
+    if (port == BENCH_VXLAN) {
+        p[0] = 0x08;
+        p[4] = 0x01; p[5] = 0x23; p[6] = 0x45;
+    } else {
+        p[0] = 0x30; p[1] = 0xff;
+        p[2] = (len - 16) >> 8; p[3] = (len - 16) & 0xff;
+        p[4] = 0x89; p[5] = 0xab; p[6] = 0xcd; p[7] = 0xef;
+    }
+    return p + 8;
+}
+
+/* build the packet types; payload is left out of the capture, as with
+   a short snaplen, since the decoder never touches it */
+static size_t bench_build(bench_pkt_t *pkts)
+{
+    uint8_t         *p;
+    size_t          n = 0;
+
+    pkts[n].name = "eth/ipv4/tcp";
+    p = bench_eth(pkts[n].buf, YF_TYPE_IPv4, FALSE);
+    p = bench_tcp(bench_ip4(p, YF_PROTO_TCP, 20 + 32 + 1448));
+    pkts[n].caplen = p - pkts[n].buf;
+    n++;
+
+    pkts[n].name = "eth/ipv4/udp";
+    p = bench_eth(pkts[n].buf, YF_TYPE_IPv4, FALSE);
+    p = bench_udp(bench_ip4(p, YF_PROTO_UDP, 20 + 8 + 512), 8 + 512);
+    pkts[n].caplen = p - pkts[n].buf;
+    n++;
+
+    pkts[n].name = "eth/ipv6/tcp";
+    p = bench_eth(pkts[n].buf, YF_TYPE_IPv6, FALSE);
+    p = bench_tcp(bench_ip6(p, YF_PROTO_TCP, 32 + 1428));
+    pkts[n].caplen = p - pkts[n].buf;
+    n++;
+
+    pkts[n].name = "eth/ipv6/udp";
+    p = bench_eth(pkts[n].buf, YF_TYPE_IPv6, FALSE);
+    p = bench_udp(bench_ip6(p, YF_PROTO_UDP, 8 + 512), 8 + 512);
+    pkts[n].caplen = p - pkts[n].buf;
+    n++;
+
+    pkts[n].name = "eth/vlan/ipv4/tcp";
+    p = bench_eth(pkts[n].buf, YF_TYPE_IPv4, TRUE);
+    p = bench_tcp(bench_ip4(p, YF_PROTO_TCP, 20 + 32 + 1448));
+    pkts[n].caplen = p - pkts[n].buf;
+    n++;
+
+    pkts[n].name = "vxlan/eth/ipv4/tcp";
+    p = bench_eth(pkts[n].buf, YF_TYPE_IPv4, FALSE);
+    p = bench_ip4(p, YF_PROTO_UDP, 20 + 8 + 8 + 14 + 20 + 32 + 1400);
+    p = bench_tunnel(p, BENCH_VXLAN, 8 + 8 + 14 + 20 + 32 + 1400);
+    p = bench_eth(p, YF_TYPE_IPv4, FALSE);
+    p = bench_tcp(bench_ip4(p, YF_PROTO_TCP, 20 + 32 + 1400));
+    pkts[n].caplen = p - pkts[n].buf;
+    n++;
+
+    pkts[n].name = "gtpu/ipv4/tcp";
+    p = bench_eth(pkts[n].buf, YF_TYPE_IPv4, FALSE);
+    p = bench_ip4(p, YF_PROTO_UDP, 20 + 8 + 8 + 20 + 32 + 1400);
+    p = bench_tunnel(p, BENCH_GTPU, 8 + 8 + 20 + 32 + 1400);
+    p = bench_tcp(bench_ip4(p, YF_PROTO_TCP, 20 + 32 + 1400));
+    pkts[n].caplen = p - pkts[n].buf;
+    n++;
+
+    return n;
+}
+
+/* compare everything the decoder fills in */
+static gboolean bench_same(yfPBuf_t *a, yfPBuf_t *b)
+{
+    return a->ptime == b->ptime && a->ptime_ns == b->ptime_ns &&
+           !memcmp(&a->key, &b->key, sizeof(yfFlowKey_t)) &&
+           a->hash == b->hash && a->pairhash == b->pairhash &&
+           a->allHeaderLen == b->allHeaderLen && a->iplen == b->iplen &&
+           !memcmp(&a->ipinfo, &b->ipinfo, sizeof(yfIPInfo_t)) &&
+           !memcmp(&a->tcpinfo, &b->tcpinfo, sizeof(yfTCPInfo_t)) &&
+           !memcmp(&a->l2info, &b->l2info,
+                   offsetof(yfL2Info_t, mpls_label));
+}
+
+static double bench_run(yfDecodeCtx_t  *ctx,
+                        bench_pkt_t    *pkt,
+                        size_t         packets,
+                        yfPBuf_t       *pbuf)
+{
+    yfIPFragInfo_t  fraginfo;
+    GTimer          *timer = g_timer_new();
+    double          elapsed;
+    size_t          i;
+
+    g_timer_start(timer);
+    for (i = 0; i < packets; i++) {
+        if (!yfDecodeToPBuf(ctx, TRACE_TYPE_ETH, 1380000000000000000ULL + i,
+                            pkt->caplen, pkt->buf, &fraginfo, pbuf))
+        {
+            fprintf(stderr, "%s: decode failed\n", pkt->name);
+            exit(1);
+        }
+    }
+    elapsed = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    return elapsed * 1e9 / packets;
+}
+
+/* a decode context as qof configures it for a template */
+static yfDecodeCtx_t *bench_ctx(gboolean       tomode,
+                                gboolean       tcp_fields,
+                                gboolean       mac_fields)
+{
+    yfDecodeCtx_t   *ctx = yfDecodeCtxAlloc(YF_TYPE_IPANY, tomode, FALSE);
+
+    yfDecodeCtxSetTunnelPorts(ctx, BENCH_VXLAN, 0, BENCH_GTPU);
+    yfDecodeCtxSetFields(ctx, mac_fields, tcp_fields);
+    return ctx;
+}
+
+/* compare what a 5-tuple template uses */
+static gboolean bench_same_key(yfPBuf_t *a, yfPBuf_t *b)
+{
+    return !memcmp(&a->key, &b->key, sizeof(yfFlowKey_t)) &&
+           a->hash == b->hash && a->allHeaderLen == b->allHeaderLen &&
+           a->iplen == b->iplen && a->tcpinfo.flags == b->tcpinfo.flags;
+}
+
+static int bench_templates(bench_pkt_t    *pkts,
+                           size_t         count,
+                           size_t         packets)
+{
+    yfDecodeCtx_t   *ctx[4];
+    yfPBuf_t        pbuf[4];
+    double          ns[4];
+    size_t          i, j;
+
+    /* 5-tuple and qof-test.yaml, pruned and not */
+    ctx[0] = bench_ctx(FALSE, FALSE, FALSE);
+    ctx[1] = bench_ctx(FALSE, TRUE, TRUE);
+    ctx[2] = bench_ctx(TRUE, TRUE, FALSE);
+    ctx[3] = bench_ctx(TRUE, TRUE, TRUE);
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < 4; j++) {
+            memset(&pbuf[j], 0, sizeof(yfPBuf_t));
+            ns[j] = bench_run(ctx[j], &pkts[i], packets, &pbuf[j]);
+        }
+        if (!bench_same_key(&pbuf[0], &pbuf[1]) ||
+            !bench_same_key(&pbuf[0], &pbuf[2]) ||
+            memcmp(&pbuf[2].tcpinfo, &pbuf[3].tcpinfo, sizeof(yfTCPInfo_t)))
+        {
+            fprintf(stderr, "%s: pruned decode differs\n", pkts[i].name);
+            return 1;
+        }
+        fprintf(stdout, "%-20s 5-tuple %6.1f ns/packet (%6.1f unpruned), "
+                "qof-test %6.1f ns/packet (%6.1f unpruned)\n", pkts[i].name,
+                ns[0], ns[1], ns[2], ns[3]);
+    }
+
+    for (j = 0; j < 4; j++) yfDecodeCtxFree(ctx[j]);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t          packets = 1 << 24;
+    gboolean        tomode = TRUE;
+    gboolean        templates = FALSE;
+    bench_pkt_t     pkts[8];
+    yfDecodeCtx_t   *fast, *full;
+    yfPBuf_t        fpbuf, gpbuf;
+    double          fns, gns;
+    size_t          count, i;
+    int             c;
+
+    while ((c = getopt(argc, argv, "ntp:")) != -1) {
+        switch (c) {
+            case 'n':
+                tomode = FALSE;
+                break;
+            case 't':
+                templates = TRUE;
+                break;
+            case 'p':
+                packets = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n] [-t] [-p packets]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+
+    if (!packets) {
+        fprintf(stderr, "packets must be nonzero\n");
+        return 2;
+    }
+
+    memset(pkts, 0, sizeof(pkts));
+    count = bench_build(pkts);
+
+    if (templates) return bench_templates(pkts, count, packets);
+
+    fast = yfDecodeCtxAlloc(YF_TYPE_IPANY, tomode, FALSE);
+    full = yfDecodeCtxAlloc(YF_TYPE_IPANY, tomode, FALSE);
+    yfDecodeCtxSetFastPath(full, FALSE);
+    yfDecodeCtxSetTunnelPorts(fast, BENCH_VXLAN, 0, BENCH_GTPU);
+    yfDecodeCtxSetTunnelPorts(full, BENCH_VXLAN, 0, BENCH_GTPU);
+
+    for (i = 0; i < count; i++) {
+        memset(&fpbuf, 0, sizeof(fpbuf));
+        memset(&gpbuf, 0, sizeof(gpbuf));
+        gns = bench_run(full, &pkts[i], packets, &gpbuf);
+        fns = bench_run(fast, &pkts[i], packets, &fpbuf);
+        if (!bench_same(&fpbuf, &gpbuf)) {
+            fprintf(stderr, "%s: fast path decode differs\n", pkts[i].name);
+            return 1;
+        }
+        fprintf(stdout, "%-20s full %6.1f ns/packet, fast %6.1f ns/packet "
+                "(%.2fx)\n", pkts[i].name, gns, fns, gns / fns);
+    }
+
+    yfDecodeCtxFree(fast);
+    yfDecodeCtxFree(full);
+
+    return 0;
+}
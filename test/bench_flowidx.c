@@ -0,0 +1,206 @@
+/**
+ ** @file bench_flowidx.c
+ **
+ ** Flow index lookup benchmark: compares qfFlowIdx against the GHashTable
+ ** index previously used by the flow table, at a range of table sizes.
+ **
+ ** Build against an installed libqof, e.g.:
+ **   cc -O2 -o bench_flowidx bench_flowidx.c \
+ **      `pkg-config --cflags --libs glib-2.0` -lqof
+ **
+ ** usage: bench_flowidx [-6] [-l lookups] [flows ...]
+ ** default flow counts are 1M, 4M and 16M.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/autoinc.h>
+#include <qof/qofflowidx.h>
+
+#include <unistd.h>
+
+static gboolean v6_mode = FALSE;
+
+/* stand-in for a flow node; key at offset zero */
+typedef struct bench_node_st {
+    yfFlowKey_t     key;
+} bench_node_t;
+
+/* the old flow table hash: xor fold of the key */
+static uint32_t bench_fold(yfFlowKey_t *key)
+{
+    uint32_t h = (key->sp << 16) ^ key->dp ^ (key->proto << 12) ^
+                 (key->version << 4) ^ ((0x0FFF & key->vlanId) << 20);
+    uint32_t w;
+    int i;
+
+    if (key->version == 4) {
+        return h ^ key->addr.v4.sip ^ key->addr.v4.dip;
+    }
+
+    for (i = 0; i < 16; i += 4) {
+        memcpy(&w, &key->addr.v6.sip[i], sizeof(w));
+        h ^= w;
+        memcpy(&w, &key->addr.v6.dip[i], sizeof(w));
+        h ^= w;
+    }
+    return h;
+}
+
+static guint bench_ghash(gconstpointer k)
+{
+    return bench_fold((yfFlowKey_t *)k);
+}
+
+static gboolean bench_gequal(gconstpointer ka, gconstpointer kb)
+{
+    const yfFlowKey_t *a = ka, *b = kb;
+
+    if (a->sp != b->sp || a->dp != b->dp || a->proto != b->proto ||
+        a->version != b->version || ((a->vlanId ^ b->vlanId) & 0x0FFF))
+    {
+        return FALSE;
+    }
+    if (a->version == 4) {
+        return a->addr.v4.sip == b->addr.v4.sip &&
+               a->addr.v4.dip == b->addr.v4.dip;
+    }
+    return memcmp(a->addr.v6.sip, b->addr.v6.sip, 32) == 0;
+}
+
+/* generate a plausible key: clients in a /12 talking to servers in a /16 */
+static void bench_key(GRand *rand, yfFlowKey_t *key)
+{
+    uint32_t sip = 0x0A000000 | (g_rand_int(rand) & 0x000FFFFF);
+    uint32_t dip = 0xC0A80000 | (g_rand_int(rand) & 0x0000FFFF);
+
+    memset(key, 0, sizeof(*key));
+    key->sp = 1024 + g_rand_int_range(rand, 0, 64512);
+    key->dp = (g_rand_int(rand) & 1) ? 443 : 80;
+    key->proto = 6;
+
+    if (v6_mode) {
+        key->version = 6;
+        key->addr.v6.sip[0] = 0x20;
+        key->addr.v6.sip[1] = 0x01;
+        key->addr.v6.dip[0] = 0x20;
+        key->addr.v6.dip[1] = 0x01;
+        memcpy(&key->addr.v6.sip[12], &sip, sizeof(sip));
+        memcpy(&key->addr.v6.dip[12], &dip, sizeof(dip));
+    } else {
+        key->version = 4;
+        key->addr.v4.sip = sip;
+        key->addr.v4.dip = dip;
+    }
+}
+
+static void bench_run(size_t flows, size_t lookups)
+{
+    bench_node_t    *nodes = g_new0(bench_node_t, flows);
+    size_t          *order = g_new(size_t, lookups);
+    GRand           *rand = g_rand_new_with_seed(4242);
+    GTimer          *timer = g_timer_new();
+    GHashTable      *ght;
+    qfFlowIdx_t     *idx;
+    size_t          i, found;
+    gboolean        rev;
+    uint64_t        idx_lookups, idx_probes;
+    uint32_t        max_probe;
+    double          ght_s, idx_s;
+
+    /* generate distinct keys */
+    ght = g_hash_table_new(bench_ghash, bench_gequal);
+    for (i = 0; i < flows; i++) {
+        do {
+            bench_key(rand, &nodes[i].key);
+        } while (g_hash_table_lookup(ght, &nodes[i].key));
+        g_hash_table_insert(ght, &nodes[i].key, &nodes[i]);
+    }
+
+    idx = qfFlowIdxAlloc(offsetof(bench_node_t, key), 0);
+    for (i = 0; i < flows; i++) {
+        qfFlowIdxInsert(idx, &nodes[i], qfFlowKeyHash(&nodes[i].key, NULL));
+    }
+
+    /* random access order, so both indexes miss cache as they would live */
+    for (i = 0; i < lookups; i++) {
+        order[i] = g_rand_int_range(rand, 0, (gint32)flows);
+    }
+
+    g_timer_start(timer);
+    for (i = 0, found = 0; i < lookups; i++) {
+        if (g_hash_table_lookup(ght, &nodes[order[i]].key)) found++;
+    }
+    ght_s = g_timer_elapsed(timer, NULL);
+    if (found != lookups) {
+        fprintf(stderr, "GHashTable lost %zu keys\n", lookups - found);
+    }
+
+    g_timer_start(timer);
+    for (i = 0, found = 0; i < lookups; i++) {
+        yfFlowKey_t *key = &nodes[order[i]].key;
+        if (qfFlowIdxLookup(idx, key, qfFlowKeyHash(key, NULL), &rev)) found++;
+    }
+    idx_s = g_timer_elapsed(timer, NULL);
+    if (found != lookups) {
+        fprintf(stderr, "qfFlowIdx lost %zu keys\n", lookups - found);
+    }
+
+    qfFlowIdxStats(idx, &idx_lookups, &idx_probes, &max_probe);
+
+    fprintf(stdout, "%10zu flows (IPv%u): GHashTable %8.2f Mlookup/s, "
+            "qfFlowIdx %8.2f Mlookup/s (%.2fx), "
+            "%.3f probes/lookup, longest %u\n",
+            flows, v6_mode ? 6 : 4,
+            lookups / ght_s / 1e6, lookups / idx_s / 1e6, ght_s / idx_s,
+            (double)idx_probes / idx_lookups, max_probe);
+
+    qfFlowIdxFree(idx);
+    g_hash_table_destroy(ght);
+    g_timer_destroy(timer);
+    g_rand_free(rand);
+    g_free(order);
+    g_free(nodes);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t      default_flows[] = { 1 << 20, 1 << 22, 1 << 24 };
+    size_t      lookups = 1 << 24;
+    int         c, i;
+
+    while ((c = getopt(argc, argv, "6l:")) != -1) {
+        switch (c) {
+            case '6':
+                v6_mode = TRUE;
+                break;
+            case 'l':
+                lookups = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [-6] [-l lookups] [flows ...]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind < argc) {
+        for (i = optind; i < argc; i++) {
+            bench_run(strtoul(argv[i], NULL, 0), lookups);
+        }
+    } else {
+        for (i = 0; i < 3; i++) {
+            bench_run(default_flows[i], lookups);
+        }
+    }
+
+    return 0;
+}
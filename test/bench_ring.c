@@ -0,0 +1,281 @@
+/**
+ ** @file bench_ring.c
+ **
+ ** Lock-free ring benchmark: passes fixed-size elements from one or more
+ ** producer threads to a consumer thread through an SPSC or MPSC ring, and
+ ** reports transfers per second at several batch sizes. A second pass sends
+ ** one element at a time, waiting for the ring to drain in between, and
+ ** reports one-way latency. Threads are pinned to CPUs where the platform
+ ** supports it; the consumer runs on the first CPU given, producers on the
+ ** following ones.
+ **
+ ** Build within the source tree after building libqof, e.g.:
+ **   cc -O2 -I../include -o bench_ring bench_ring.c \
+ **      `pkg-config --cflags --libs glib-2.0 gthread-2.0` \
+ **      ../src/.libs/libqof.a
+ **
+ ** usage: bench_ring [-p producers] [-n transfers] [-s size] [-c cpu]
+ ** defaults are 1 producer (SPSC), 16M transfers, 64-byte elements, CPU 0.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/autoinc.h>
+#include <qof/ring.h>
+
+#include <unistd.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#define RING_CAP        1024
+#define LATENCY_COUNT   100000
+
+typedef struct bench_ring_st {
+    rgaRing_t       *ring;
+    size_t          elt_sz;
+    size_t          count;
+    size_t          batch;
+    int             cpu;
+    /* latency pass: one element in flight at a time */
+    gboolean        latency;
+    uint64_t        *lat;
+    uint64_t        sum;
+} bench_ring_t;
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_pin(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t       set;
+    long            ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % (ncpu > 0 ? ncpu : 1), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+static gpointer bench_producer(gpointer arg)
+{
+    bench_ring_t    *br = (bench_ring_t *)arg;
+    uint8_t         *head;
+    size_t          sent = 0, n, i;
+
+    bench_pin(br->cpu);
+
+    while (sent < br->count) {
+        n = MIN(br->batch, br->count - sent);
+        if (!(head = rgaNextHeadN(br->ring, &n))) {
+            g_thread_yield();
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            *(uint64_t *)(head + i * br->elt_sz) =
+                br->latency ? bench_now() : sent + i;
+        }
+        rgaCommitHead(br->ring, head, n);
+        sent += n;
+
+        /* wait for the consumer to take it */
+        while (br->latency && rgaCount(br->ring)) {
+            g_thread_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static gpointer bench_consumer(gpointer arg)
+{
+    bench_ring_t    *br = (bench_ring_t *)arg;
+    uint8_t         *tail;
+    size_t          got = 0, n, i;
+
+    bench_pin(br->cpu);
+
+    while (got < br->count) {
+        n = br->batch;
+        if (!(tail = rgaNextTailN(br->ring, &n))) {
+            g_thread_yield();
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            if (br->latency) {
+                br->lat[got + i] = bench_now() - *(uint64_t *)tail;
+            } else {
+                br->sum += *(uint64_t *)(tail + i * br->elt_sz);
+            }
+        }
+        rgaCommitTail(br->ring, n);
+        got += n;
+    }
+
+    return NULL;
+}
+
+static GThread *bench_thread(GThreadFunc     func,
+                             bench_ring_t    *br)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+    return g_thread_new("bench-ring", func, br);
+#else
+    return g_thread_create(func, br, TRUE, NULL);
+#endif
+}
+
+static double bench_run(bench_ring_t    *cons,
+                        bench_ring_t    *prod,
+                        unsigned int    producers)
+{
+    GThread         *ct, *pt[64];
+    GTimer          *timer = g_timer_new();
+    double          elapsed;
+    unsigned int    p;
+
+    g_timer_start(timer);
+    ct = bench_thread(bench_consumer, cons);
+    for (p = 0; p < producers; p++) {
+        pt[p] = bench_thread(bench_producer, &prod[p]);
+    }
+    for (p = 0; p < producers; p++) {
+        g_thread_join(pt[p]);
+    }
+    g_thread_join(ct);
+    elapsed = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    return elapsed;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    uint64_t        x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t batches[] = { 1, 8, 32, 128 };
+    unsigned int    producers = 1;
+    size_t          count = 1 << 24;
+    size_t          elt_sz = 64;
+    int             cpu = 0;
+    rgaSync_t       sync;
+    bench_ring_t    cons, prod[64];
+    double          elapsed;
+    uint64_t        expect, mean;
+    unsigned int    b, p;
+    size_t          i;
+    int             c;
+
+    while ((c = getopt(argc, argv, "p:n:s:c:")) != -1) {
+        switch (c) {
+            case 'p':
+                producers = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                elt_sz = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                cpu = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p producers] [-n transfers] "
+                        "[-s size] [-c cpu]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (!producers || producers > 64 || !count ||
+        elt_sz < sizeof(uint64_t))
+    {
+        fprintf(stderr, "need 1-64 producers, nonzero transfers, and "
+                "elements of at least 8 bytes\n");
+        return 2;
+    }
+
+#if !GLIB_CHECK_VERSION(2,32,0)
+    if (!g_thread_supported()) g_thread_init(NULL);
+#endif
+
+    sync = producers > 1 ? RGA_SYNC_MPSC : RGA_SYNC_SPSC;
+    count -= count % producers;
+
+    /* throughput at each batch size */
+    for (b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        memset(&cons, 0, sizeof(cons));
+        cons.ring = rgaAllocSync(elt_sz, RING_CAP, sync);
+        cons.elt_sz = elt_sz;
+        cons.count = count;
+        cons.batch = batches[b];
+        cons.cpu = cpu;
+        for (p = 0; p < producers; p++) {
+            prod[p] = cons;
+            prod[p].count = count / producers;
+            prod[p].cpu = cpu + 1 + p;
+        }
+
+        elapsed = bench_run(&cons, prod, producers);
+
+        /* each producer sends 0 .. count/producers - 1 */
+        expect = (uint64_t)producers *
+                 ((count / producers) * (count / producers - 1) / 2);
+        fprintf(stdout, "%s, %u producer%s, %zu-byte elements, batch %3zu: "
+                "%.2f M transfers/s (%.1f ns/transfer, peak %zu)%s\n",
+                producers > 1 ? "MPSC" : "SPSC", producers,
+                producers > 1 ? "s" : "", elt_sz, batches[b],
+                count / elapsed / 1e6, elapsed * 1e9 / count,
+                rgaPeak(cons.ring), cons.sum == expect ? "" : " MISMATCH");
+        rgaFree(cons.ring);
+        if (cons.sum != expect) return 1;
+    }
+
+    /* one-way latency, one element at a time from a single producer */
+    memset(&cons, 0, sizeof(cons));
+    cons.ring = rgaAllocSync(elt_sz, RING_CAP, sync);
+    cons.elt_sz = elt_sz;
+    cons.count = LATENCY_COUNT;
+    cons.batch = 1;
+    cons.cpu = cpu;
+    cons.latency = TRUE;
+    cons.lat = g_new(uint64_t, LATENCY_COUNT);
+    prod[0] = cons;
+    prod[0].cpu = cpu + 1;
+
+    bench_run(&cons, prod, 1);
+
+    qsort(cons.lat, LATENCY_COUNT, sizeof(uint64_t), bench_cmp);
+    for (mean = 0, i = 0; i < LATENCY_COUNT; i++) mean += cons.lat[i];
+    mean /= LATENCY_COUNT;
+    fprintf(stdout, "latency: mean %llu ns, median %llu ns, 99%% %llu ns\n",
+            (long long unsigned int)mean,
+            (long long unsigned int)cons.lat[LATENCY_COUNT / 2],
+            (long long unsigned int)cons.lat[LATENCY_COUNT * 99 / 100]);
+
+    rgaFree(cons.ring);
+    g_free(cons.lat);
+    return 0;
+}
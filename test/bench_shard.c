@@ -0,0 +1,176 @@
+/**
+ ** @file bench_shard.c
+ **
+ ** Sharded flow metering benchmark: dispatches synthetic bidirectional TCP
+ ** traffic over a large number of concurrent flows to a shard set, with
+ ** full TCP analytics enabled, and reports packets per second including the
+ ** final close of all flows. Run with increasing worker counts to measure
+ ** scaling; exported records are built but discarded.
+ **
+ ** Build within the source tree after building libqof, e.g.:
+ **   cc -O2 -I../include -I../src -o bench_shard bench_shard.c \
+ **      `pkg-config --cflags --libs glib-2.0 gthread-2.0 libfixbuf` \
+ **      ../src/.libs/libqof.a
+ **
+ ** usage: bench_shard [-w workers] [-f flows] [-p packets]
+ ** defaults are 4 workers, 1M flows and 32M packets.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/autoinc.h>
+#include <qof/decode.h>
+#include <qof/qofflowidx.h>
+#include "qofshard.h"
+
+#include <unistd.h>
+
+#define MSS 1448
+
+typedef struct bench_flow_st {
+    uint32_t        sip;
+    uint32_t        dip;
+    uint16_t        sp;
+    uint32_t        seq;
+    uint32_t        rseq;
+} bench_flow_t;
+
+static void bench_fill(yfPBuf_t        *pbuf,
+                       bench_flow_t    *bf,
+                       gboolean        reverse,
+                       uint64_t        now)
+{
+    yfFlowKey_t     *key = &pbuf->key;
+
+    memset(key, 0, sizeof(*key));
+    key->version = 4;
+    key->proto = YF_PROTO_TCP;
+    key->addr.v4.sip = reverse ? bf->dip : bf->sip;
+    key->addr.v4.dip = reverse ? bf->sip : bf->dip;
+    key->sp = reverse ? 443 : bf->sp;
+    key->dp = reverse ? bf->sp : 443;
+
+    pbuf->ptime = now;
+    pbuf->ptime_ns = now * 1000000;
+    pbuf->l2info.l2hlen = 14;
+    pbuf->allHeaderLen = 14 + 20 + 32;
+    pbuf->ipinfo.ttl = 64;
+    pbuf->tcpinfo.flags = YF_TF_ACK;
+    pbuf->tcpinfo.rwin = 512;
+    pbuf->tcpinfo.tsval = (uint32_t)now;
+    pbuf->tcpinfo.tsecr = (uint32_t)now - 10;
+
+    /* hash the key, as the decoder would */
+    pbuf->hash = qfFlowKeyHash(key, &pbuf->pairhash);
+
+    if (reverse) {
+        pbuf->iplen = 52;
+        pbuf->tcpinfo.seq = bf->rseq;
+        pbuf->tcpinfo.ack = bf->seq;
+    } else {
+        pbuf->iplen = MSS + 52;
+        pbuf->tcpinfo.seq = bf->seq;
+        pbuf->tcpinfo.ack = bf->rseq;
+        bf->seq += MSS;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int    workers = 4;
+    size_t          flow_count = 1 << 20;
+    size_t          packets = 1 << 25;
+    bench_flow_t    *flows;
+    uint32_t        *trace;
+    qfConfig_t      cfg;
+    qfShardSet_t    *shards;
+    yfPBuf_t        pbuf;
+    GRand           *rand;
+    GTimer          *timer;
+    double          elapsed;
+    size_t          i, f;
+    int             c;
+
+    while ((c = getopt(argc, argv, "w:f:p:")) != -1) {
+        switch (c) {
+            case 'w':
+                workers = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                flow_count = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                packets = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-w workers] [-f flows] "
+                        "[-p packets]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (!workers || !flow_count) {
+        fprintf(stderr, "workers and flows must be nonzero\n");
+        return 2;
+    }
+
+    rand = g_rand_new_with_seed(4242);
+    flows = g_new0(bench_flow_t, flow_count);
+    for (f = 0; f < flow_count; f++) {
+        flows[f].sip = 0x0A000000 | (uint32_t)(f >> 8);
+        flows[f].dip = 0xC0A80000 | (g_rand_int(rand) & 0xFFFF);
+        flows[f].sp = 1024 + (f & 0xFFFF) % 64512;
+        flows[f].seq = g_rand_int(rand);
+        flows[f].rseq = g_rand_int(rand);
+    }
+
+    trace = g_new(uint32_t, packets);
+    for (i = 0; i < packets; i++) {
+        trace[i] = g_rand_int_range(rand, 0, (gint32)flow_count) << 1 |
+                   (g_rand_int(rand) & 1);
+    }
+
+    /* generous timeouts, so flows only close at the end */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.ito_s = 3600;
+    cfg.ato_s = 3600;
+    cfg.enable_biflow = TRUE;
+    cfg.enable_seq = cfg.enable_ack = cfg.enable_rtt = cfg.enable_rwin =
+        cfg.enable_tcpopt = cfg.enable_ts = cfg.enable_iat = TRUE;
+
+    shards = qfShardSetAlloc(&cfg, workers);
+    memset(&pbuf, 0, sizeof(pbuf));
+
+    timer = g_timer_new();
+    g_timer_start(timer);
+    for (i = 0; i < packets; i++) {
+        bench_fill(&pbuf, &flows[trace[i] >> 1], trace[i] & 1,
+                   1 + (i >> 10));
+        qfShardDispatch(shards, &pbuf, NULL);
+        if ((i & 31) == 31) {
+            qfShardTick(shards);
+            qfShardExport(shards, NULL, NULL);
+        }
+    }
+    qfShardFinish(shards, NULL, NULL);
+    elapsed = g_timer_elapsed(timer, NULL);
+
+    fprintf(stdout, "%u workers, %zu TCP flows, %zu packets: %.2f Mpps "
+            "(%.1f ns/packet)\n", workers, flow_count, packets,
+            packets / elapsed / 1e6, elapsed * 1e9 / packets);
+
+    qfShardSetFree(shards);
+    g_timer_destroy(timer);
+    g_rand_free(rand);
+    g_free(trace);
+    g_free(flows);
+    return 0;
+}
@@ -0,0 +1,242 @@
+/**
+ ** @file bench_wheel.c
+ **
+ ** Flow expiry benchmark: compares the per-packet cost of keeping flows in
+ ** an LRU pickable queue (relinked on every packet) against the lazy
+ ** timing wheel, including periodic expiry, on a large flow table.
+ **
+ ** Build against an installed libqof, e.g.:
+ **   cc -O2 -o bench_wheel bench_wheel.c \
+ **      `pkg-config --cflags --libs glib-2.0` -lqof
+ **
+ ** usage: bench_wheel [-u] [-f flows] [-p packets] [-r packets_per_ms]
+ ** defaults are 4M flows, 40M packets, 1000 packets per ms, with packets
+ ** skewed toward a minority of heavy flows (-u for uniform).
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/autoinc.h>
+#include <qof/picq.h>
+#include <qof/qofwheel.h>
+
+#include <unistd.h>
+
+#define IDLE_MS     30000
+#define ACTIVE_MS   300000
+#define FLUSH_MS    5000
+
+/* stand-in for a flow node: queue links first, as in yaftab.c */
+typedef struct bench_node_st {
+    struct bench_node_st    *p;
+    struct bench_node_st    *n;
+    uint32_t                wslot;
+    uint32_t                live;
+    uint64_t                stime;
+    uint64_t                etime;
+    uint64_t                pkt;
+    uint8_t                 cold[96];
+} bench_node_t;
+
+typedef struct bench_queue_st {
+    bench_node_t            *tail;
+    bench_node_t            *head;
+} bench_queue_t;
+
+static uint64_t bench_deadline(bench_node_t *fn)
+{
+    uint64_t idle = fn->etime + IDLE_MS;
+    uint64_t active = fn->stime + ACTIVE_MS;
+
+    return idle < active ? idle : active;
+}
+
+static uint32_t *bench_trace(size_t flows, size_t packets, gboolean uniform)
+{
+    uint32_t        *trace = g_new(uint32_t, packets);
+    GRand           *rand = g_rand_new_with_seed(4242);
+    double          u;
+    size_t          i;
+
+    for (i = 0; i < packets; i++) {
+        if (uniform) {
+            trace[i] = g_rand_int_range(rand, 0, (gint32)flows);
+        } else {
+            /* cubing a uniform variate puts most packets on few flows */
+            u = g_rand_int(rand) / 4294967296.0;
+            trace[i] = (uint32_t)(u * u * u * flows) * 2654435761U % flows;
+        }
+    }
+
+    g_rand_free(rand);
+    return trace;
+}
+
+static double bench_lru(bench_node_t *nodes, uint32_t *trace,
+                        size_t packets, unsigned rate, size_t *expired)
+{
+    bench_queue_t   aq = { NULL, NULL };
+    GTimer          *timer = g_timer_new();
+    bench_node_t    *fn;
+    uint64_t        now = 0, flushtime = 0;
+    size_t          i;
+    double          elapsed;
+
+    g_timer_start(timer);
+    for (i = 0; i < packets; i++) {
+        now = i / rate;
+        fn = &nodes[trace[i]];
+
+        if (!fn->live) {
+            /* new flow */
+            fn->live = 1;
+            fn->stime = now;
+            fn->pkt = 0;
+            piqEnQ(&aq, fn);
+        } else if (now - fn->stime > ACTIVE_MS) {
+            /* active timeout on packet, as in yfFlowPBuf() */
+            fn->stime = now;
+            fn->pkt = 0;
+            ++(*expired);
+        }
+        fn->etime = now;
+        fn->pkt++;
+
+        /* relink to head, as yfFlowTick() did */
+        if (aq.head != fn) {
+            piqPick(&aq, fn);
+            piqEnQ(&aq, fn);
+        }
+
+        /* idle expiry from the tail */
+        if (now >= flushtime + FLUSH_MS) {
+            flushtime = now;
+            while (aq.tail && (now - aq.tail->etime > IDLE_MS)) {
+                fn = piqDeQ(&aq);
+                fn->live = 0;
+                ++(*expired);
+            }
+        }
+    }
+    elapsed = g_timer_elapsed(timer, NULL);
+
+    g_timer_destroy(timer);
+    return elapsed;
+}
+
+static double bench_wheel(bench_node_t *nodes, uint32_t *trace,
+                          size_t packets, unsigned rate, size_t *expired)
+{
+    qfWheel_t       *wheel = qfWheelAlloc(offsetof(bench_node_t, wslot));
+    GTimer          *timer = g_timer_new();
+    bench_node_t    *fn;
+    uint64_t        now = 0, flushtime = 0;
+    size_t          i;
+    double          elapsed;
+
+    g_timer_start(timer);
+    for (i = 0; i < packets; i++) {
+        now = i / rate;
+        fn = &nodes[trace[i]];
+
+        if (!fn->live) {
+            /* new flow */
+            fn->live = 1;
+            fn->stime = fn->etime = now;
+            fn->pkt = 0;
+            qfWheelSchedule(wheel, fn, bench_deadline(fn), now);
+        } else if (now - fn->stime > ACTIVE_MS) {
+            /* active timeout on packet; the new deadline is later */
+            fn->stime = now;
+            fn->pkt = 0;
+            ++(*expired);
+        }
+        fn->etime = now;
+        fn->pkt++;
+
+        /* nothing to relink; expire or reschedule what comes due */
+        if (now >= flushtime + FLUSH_MS) {
+            flushtime = now;
+            while ((fn = qfWheelNext(wheel, now))) {
+                if (now - fn->etime > IDLE_MS ||
+                    now - fn->stime > ACTIVE_MS)
+                {
+                    fn->live = 0;
+                    ++(*expired);
+                } else {
+                    qfWheelSchedule(wheel, fn, bench_deadline(fn), now);
+                }
+            }
+        }
+    }
+    elapsed = g_timer_elapsed(timer, NULL);
+
+    g_timer_destroy(timer);
+    qfWheelFree(wheel);
+    return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t          flows = 1 << 22;
+    size_t          packets = 40000000;
+    unsigned        rate = 1000;
+    gboolean        uniform = FALSE;
+    bench_node_t    *nodes;
+    uint32_t        *trace;
+    size_t          lru_exp = 0, wheel_exp = 0;
+    double          lru_s, wheel_s;
+    int             c;
+
+    while ((c = getopt(argc, argv, "uf:p:r:")) != -1) {
+        switch (c) {
+            case 'u':
+                uniform = TRUE;
+                break;
+            case 'f':
+                flows = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                packets = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                rate = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-u] [-f flows] [-p packets] "
+                        "[-r packets_per_ms]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (!flows || !rate) {
+        fprintf(stderr, "flows and rate must be nonzero\n");
+        return 2;
+    }
+
+    trace = bench_trace(flows, packets, uniform);
+
+    nodes = g_new0(bench_node_t, flows);
+    lru_s = bench_lru(nodes, trace, packets, rate, &lru_exp);
+    g_free(nodes);
+
+    nodes = g_new0(bench_node_t, flows);
+    wheel_s = bench_wheel(nodes, trace, packets, rate, &wheel_exp);
+    g_free(nodes);
+
+    fprintf(stdout, "%zu flows, %zu packets: LRU queue %.1f ns/packet "
+            "(%zu expired), timing wheel %.1f ns/packet (%zu expired)\n",
+            flows, packets, lru_s * 1e9 / packets, lru_exp,
+            wheel_s * 1e9 / packets, wheel_exp);
+
+    g_free(trace);
+    return 0;
+}
@@ -0,0 +1,147 @@
+/**
+ ** @file test_longtimeout.c
+ **
+ ** Flow table resource limit test with timeouts beyond the timing wheel's
+ ** span (about 25 days): fills a flow table past its flow limit and checks
+ ** that each flush terminates and evicts flows down to the limit, rather
+ ** than rescheduling far-future flows into the wheel's last slot forever.
+ **
+ ** Build against an installed libqof, e.g.:
+ **   cc -O2 -o test_longtimeout test_longtimeout.c \
+ **      `pkg-config --cflags --libs glib-2.0 libfixbuf` -lqof
+ **
+ ** usage: test_longtimeout [-f flows] [-m max_flows] [-d timeout_days]
+ ** defaults are 100k flows, a limit of 10k flows and 30 day timeouts.
+ ** exits nonzero if the flow limit is not enforced, or if a flush hangs.
+ **
+ ** ------------------------------------------------------------------------
+ ** Copyright (C) 2013 Brian Trammell. All Rights Reserved.
+ ** ------------------------------------------------------------------------
+ ** Author: Brian Trammell <brian@trammell.ch>
+ ** ------------------------------------------------------------------------
+ ** QoF is made available under the terms of the
+ ** GNU General Public License (GPL) Version 2, June 1991
+ ** ------------------------------------------------------------------------
+ */
+
+#define _YAF_SOURCE_
+#include <qof/autoinc.h>
+#include <qof/decode.h>
+#include <qof/yaftab.h>
+#include <qof/qofflowidx.h>
+
+#include <unistd.h>
+
+#define DAY_MS      86400000ULL
+#define FLUSH_EVERY 1000
+/* packet spacing; puts flushes further apart than the flush delay */
+#define PKT_GAP_MS  10
+
+static gboolean test_writer(void        *wctx,
+                            yfFlow_t    *flow,
+                            GError      **err)
+{
+    ++*(size_t *)wctx;
+    return TRUE;
+}
+
+static void test_fill(yfPBuf_t *pbuf, size_t f, uint64_t now)
+{
+    yfFlowKey_t     *key = &pbuf->key;
+
+    memset(pbuf, 0, sizeof(*pbuf));
+    key->version = 4;
+    key->proto = YF_PROTO_UDP;
+    key->addr.v4.sip = 0x0A000000 | (uint32_t)(f >> 16);
+    key->addr.v4.dip = 0xC0A80001;
+    key->sp = 1024 + (uint16_t)(f & 0xFFFF) % 64512;
+    key->dp = 53;
+
+    pbuf->ptime = now;
+    pbuf->ptime_ns = now * 1000000;
+    pbuf->l2info.l2hlen = 14;
+    pbuf->allHeaderLen = 14 + 20 + 8;
+    pbuf->iplen = 64;
+    pbuf->ipinfo.ttl = 64;
+    pbuf->hash = qfFlowKeyHash(key, &pbuf->pairhash);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t          flow_count = 100000;
+    uint32_t        max_flows = 10000;
+    uint64_t        timeout_ms = 30 * DAY_MS;
+    yfFlowTab_t     *flowtab;
+    yfPBuf_t        pbuf;
+    yfFlowTabTelemetry_t tel;
+    GError          *err = NULL;
+    size_t          written = 0;
+    uint64_t        active = 0;
+    size_t          f;
+    int             c, rv = 0;
+
+    while ((c = getopt(argc, argv, "f:m:d:")) != -1) {
+        switch (c) {
+            case 'f':
+                flow_count = strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                max_flows = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                timeout_ms = strtoull(optarg, NULL, 0) * DAY_MS;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f flows] [-m max_flows] "
+                        "[-d timeout_days]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (!max_flows || flow_count <= max_flows) {
+        fprintf(stderr, "flows must exceed a nonzero flow limit\n");
+        return 2;
+    }
+
+    /* a flush that never returns is the failure we're looking for */
+    alarm(60);
+
+    flowtab = yfFlowTabAlloc(timeout_ms, timeout_ms, 0, 0, 0, max_flows,
+                             FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE,
+                             FALSE, FALSE, FALSE);
+
+    /* one packet per new flow, flushing as we go */
+    for (f = 0; f < flow_count; f++) {
+        test_fill(&pbuf, f, 1 + f * PKT_GAP_MS);
+        yfFlowPBuf(flowtab, &pbuf);
+        if ((f + 1) % FLUSH_EVERY == 0) {
+            if (!yfFlowTabFlushTo(flowtab, FALSE, test_writer, &written,
+                                  &err))
+            {
+                fprintf(stderr, "flush failed: %s\n", err->message);
+                return 1;
+            }
+            yfGetFlowTabTelemetry(flowtab, &tel);
+            active = tel.occupancy;
+            if (active > max_flows) {
+                fprintf(stderr, "%llu active flows after flush, limit %u\n",
+                        (unsigned long long)active, max_flows);
+                rv = 1;
+            }
+        }
+    }
+
+    fprintf(stdout, "%zu flows, limit %u, %llu day timeouts: "
+            "%zu evicted, %llu active\n", flow_count, max_flows,
+            (unsigned long long)(timeout_ms / DAY_MS), written,
+            (unsigned long long)active);
+
+    if (written + active != flow_count) {
+        fprintf(stderr, "%zu flows unaccounted for\n",
+                flow_count - written - (size_t)active);
+        rv = 1;
+    }
+
+    yfFlowTabFree(flowtab);
+    return rv;
+}